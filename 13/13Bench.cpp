@@ -0,0 +1,565 @@
+// a load generator: N connections over T threads, each keeping `depth`
+// requests in flight, with a mix of GET/SET/ZADD/ZQUERY over a uniform
+// or Zipfian keyspace. reports the throughput and the latency percentiles.
+//   bench --conns 50 --depth 16 --seconds 10 --mix get=90,set=10 --dist zipf
+// the latency is measured from queuing a request to reading its reply,
+// with a closed loop, so a stalled server also slows the senders down.
+// the requests are sent with client_send() of client.h, one Client per thread.
+// --mode sync sends one request at a time with client_call(), a thread per
+// connection, for the latency and the client CPU of a blocking caller.
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+// proj
+#include "common.h"
+#include "hist.h"
+#include "client.h"
+
+
+static void die(const char *msg) {
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+// the user and system time of the process, all threads
+static double cpu_secs() {
+    struct rusage ru = {};
+    getrusage(RUSAGE_SELF, &ru);
+    return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)
+        + (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+const size_t k_max_msg = 4096;
+
+enum {
+    OP_GET = 0,
+    OP_SET = 1,
+    OP_ZADD = 2,
+    OP_ZQUERY = 3,
+    OP_COUNT = 4,
+};
+
+static const char *const k_op_names[OP_COUNT] = {"get", "set", "zadd", "zquery"};
+
+static struct {
+    std::string host = "127.0.0.1";
+    uint16_t port = 1234;
+    uint32_t conns = 50;
+    uint32_t threads = 1;
+    uint32_t depth = 1;         // requests in flight per connection
+    bool sync = false;          // client_call() on a connection per thread
+    uint64_t requests = 0;      // stop after this many, or after `seconds`
+    double seconds = 10;
+    uint32_t mix[OP_COUNT] = {90, 10, 0, 0};    // weights
+    uint64_t keys = 100000;
+    double zipf = 0;            // the Zipf exponent, 0 is uniform
+    uint32_t value_min = 32;    // SET values are sized uniformly in the range
+    uint32_t value_max = 32;
+    uint64_t zsets = 16;        // ZADD and ZQUERY pick one of these
+    bool prefill = false;       // SET every key (and ZADD it) first
+    bool json = false;
+} g_opts;
+
+// random numbers, splitmix64
+static uint64_t rng_next(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+// in [0, 1)
+static double rng_unit(uint64_t &state) {
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipfian ranks in [0, n), rank 0 the most popular, by the method of
+// Gray et al. ("Quickly generating billion-record synthetic databases").
+// the setup is O(n), the draws are O(1). theta is in (0, 1).
+struct Zipf {
+    uint64_t n = 0;
+    double theta = 0;
+    double alpha = 0;
+    double zetan = 0;
+    double eta = 0;
+};
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; ++i) {
+        sum += 1 / pow((double)i, theta);
+    }
+    return sum;
+}
+
+static void zipf_init(Zipf &z, uint64_t n, double theta) {
+    z.n = n;
+    z.theta = theta;
+    z.alpha = 1 / (1 - theta);
+    z.zetan = zeta(n, theta);
+    double zeta2 = zeta(2, theta);
+    z.eta = (1 - pow(2.0 / (double)n, 1 - theta)) / (1 - zeta2 / z.zetan);
+}
+
+static uint64_t zipf_next(const Zipf &z, double u) {
+    double uz = u * z.zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, z.theta)) {
+        return 1;
+    }
+    uint64_t rank = (uint64_t)((double)z.n * pow(z.eta * u - z.eta + 1, z.alpha));
+    return rank < z.n ? rank : z.n - 1;
+}
+
+static Zipf g_zipf;
+
+struct Worker;
+
+// the context of a request in flight, kept in a pool of the worker
+struct Pending {
+    Worker *w;
+    uint64_t start_ns;
+    uint32_t op;
+};
+
+struct Worker {
+    Client client;
+    std::vector<Pending> slots;     // the most requests in flight
+    std::vector<uint32_t> free;     // the unused slots
+    uint64_t rng = 0;
+    Hist hist[OP_COUNT];
+    uint64_t errors = 0;
+    std::string first_error;
+    // scratch space for the request arguments
+    std::string value;
+    char key[32];
+    char zkey[32];
+    char score[32];
+};
+
+// shared by the workers
+static struct {
+    std::atomic<uint64_t> issued{0};
+    uint64_t deadline_ns = 0;
+} g_run;
+
+static void worker_open(Worker &w, uint32_t nconns, uint32_t inflight) {
+    if (client_open(&w.client, g_opts.host.c_str(), g_opts.port, nconns) < 0) {
+        die("connect");
+    }
+    w.slots.resize(inflight);
+    for (uint32_t i = 0; i < inflight; ++i) {
+        w.free.push_back(inflight - 1 - i);
+    }
+}
+
+static uint32_t pick_op(Worker &w) {
+    uint32_t total = 0;
+    for (uint32_t weight : g_opts.mix) {
+        total += weight;
+    }
+    uint32_t r = (uint32_t)(rng_next(w.rng) % total);
+    for (uint32_t op = 0; op < OP_COUNT; ++op) {
+        if (r < g_opts.mix[op]) {
+            return op;
+        }
+        r -= g_opts.mix[op];
+    }
+    return OP_GET;
+}
+
+static uint64_t pick_key(Worker &w) {
+    if (g_opts.zipf > 0) {
+        return zipf_next(g_zipf, rng_unit(w.rng));
+    }
+    return rng_next(w.rng) % g_opts.keys;
+}
+
+static void reply_done(Worker &w, uint32_t op, uint64_t start_ns, const ReplyView *reply) {
+    if (!reply) {
+        fprintf(stderr, "connection lost\n");
+        exit(1);
+    }
+    if (reply->type == SER_ERR) {
+        // the first one is shown, as the rest tend to repeat it
+        if (w.errors++ == 0) {
+            w.first_error.assign(reply->str, reply->len);
+        }
+    }
+    hist_add(&w.hist[op], get_monotonic_nsec() - start_ns);
+}
+
+static void on_reply(void *arg, const ReplyView *reply) {
+    Pending *p = (Pending *)arg;
+    reply_done(*p->w, p->op, p->start_ns, reply);
+    p->w->free.push_back((uint32_t)(p - p->w->slots.data()));
+}
+
+const size_t k_max_args = 6;
+
+// the arguments of a request for `op` on key number `k`, in the scratch space
+static size_t req_args(Worker &w, uint32_t op, uint64_t k, ClientArg *args) {
+    ClientArg key = {w.key, (size_t)snprintf(w.key, sizeof(w.key), "key:%lu", (unsigned long)k)};
+    ClientArg zkey = {w.zkey, (size_t)snprintf(w.zkey, sizeof(w.zkey), "zset:%lu",
+        (unsigned long)(k % g_opts.zsets))};
+    switch (op) {
+    case OP_GET:
+        args[0] = {"get", 3};
+        args[1] = key;
+        return 2;
+    case OP_SET: {
+        uint32_t span = g_opts.value_max - g_opts.value_min + 1;
+        size_t len = g_opts.value_min + (size_t)(rng_next(w.rng) % span);
+        args[0] = {"set", 3};
+        args[1] = key;
+        args[2] = {w.value.data(), len};
+        return 3;
+    }
+    case OP_ZADD:
+        args[0] = {"zadd", 4};
+        args[1] = zkey;
+        args[2] = {w.score, (size_t)snprintf(w.score, sizeof(w.score), "%lu", (unsigned long)k)};
+        args[3] = key;
+        return 4;
+    default: {
+        // the 10 members from a random score
+        uint64_t from = rng_next(w.rng) % g_opts.keys;
+        args[0] = {"zquery", 6};
+        args[1] = zkey;
+        args[2] = {w.score,
+            (size_t)snprintf(w.score, sizeof(w.score), "%lu", (unsigned long)from)};
+        args[3] = {"", 0};
+        args[4] = {"0", 1};
+        args[5] = {"10", 2};
+        return 6;
+    }
+    }
+}
+
+// queues a request for `op` on key number `k`, in a free slot
+static void add_request(Worker &w, uint32_t op, uint64_t k, uint64_t now_ns) {
+    ClientArg args[k_max_args];
+    size_t n = req_args(w, op, k, args);
+    Pending *p = &w.slots[w.free.back()];
+    w.free.pop_back();
+    *p = Pending{&w, now_ns, op};
+    if (client_send(&w.client, args, n, &on_reply, p) < 0) {
+        fprintf(stderr, "request too big, or connection lost\n");
+        exit(1);
+    }
+}
+
+// a request may be sent if the budget of requests or time allows
+static bool may_issue(uint64_t now_ns) {
+    if (g_opts.requests) {
+        return g_run.issued.fetch_add(1, std::memory_order_relaxed) < g_opts.requests;
+    }
+    return now_ns < g_run.deadline_ns;
+}
+
+static void worker_poll(Worker &w) {
+    if (client_poll(&w.client, 1000) < 0) {
+        die("poll");
+    }
+}
+
+// keeps every slot in flight, the client spreads them over the connections
+static void worker_run(Worker *w) {
+    bool issuing = true;
+    while (true) {
+        uint64_t now_ns = get_monotonic_nsec();
+        while (issuing && !w->free.empty()) {
+            if (!may_issue(now_ns)) {
+                issuing = false;
+                break;
+            }
+            add_request(*w, pick_op(*w), pick_key(*w), now_ns);
+        }
+        if (w->free.size() == w->slots.size()) {
+            return;     // drained
+        }
+        worker_poll(*w);
+    }
+}
+
+// one request at a time with client_call(), as 13Client sends them
+static void worker_run_sync(Worker *w) {
+    std::vector<std::string> cmd;
+    ClientFuture fut;
+    ReplyView reply;
+    while (true) {
+        uint64_t now_ns = get_monotonic_nsec();
+        if (!may_issue(now_ns)) {
+            return;
+        }
+        uint32_t op = pick_op(*w);
+        ClientArg args[k_max_args];
+        size_t n = req_args(*w, op, pick_key(*w), args);
+        cmd.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            cmd[i].assign(args[i].data, args[i].len);
+        }
+        bool ok = client_call(&w->client, cmd, &fut, &reply) == 0;
+        reply_done(*w, op, now_ns, ok ? &reply : NULL);
+    }
+}
+
+// SET every key, and ZADD it if the mix has sorted sets, on one connection
+static void prefill() {
+    Worker w;
+    w.value.assign(g_opts.value_max, 'x');
+    worker_open(w, 1, 256);
+    bool zsets = g_opts.mix[OP_ZADD] || g_opts.mix[OP_ZQUERY];
+    uint64_t next = 0;
+    uint64_t total = g_opts.keys * (zsets ? 2 : 1);
+    while (next < total || w.free.size() < w.slots.size()) {
+        while (next < total && !w.free.empty()) {
+            uint64_t k = next % g_opts.keys;
+            add_request(w, next < g_opts.keys ? OP_SET : OP_ZADD, k, 0);
+            next++;
+        }
+        worker_poll(w);
+    }
+    client_close(&w.client);
+    if (w.errors) {
+        fprintf(stderr, "prefill: %lu errors: %s\n", (unsigned long)w.errors, w.first_error.c_str());
+        exit(1);
+    }
+}
+
+static void report(
+    const Hist *hist, uint64_t errors, const std::string &first_error, double secs, double cpu)
+{
+    Hist all;
+    for (uint32_t op = 0; op < OP_COUNT; ++op) {
+        hist_merge(&all, &hist[op]);
+    }
+    if (g_opts.json) {
+        printf("{\"mode\":\"%s\",\"conns\":%u,\"threads\":%u,\"depth\":%u,\"keys\":%lu,"
+            "\"zipf\":%g,\"seconds\":%.3f,\"requests\":%lu,\"rps\":%.0f,\"errors\":%lu,"
+            "\"cpu_us_per_req\":%.3f,\"ops\":{", g_opts.sync ? "sync" : "async",
+            g_opts.conns, g_opts.threads, g_opts.depth, (unsigned long)g_opts.keys, g_opts.zipf,
+            secs, (unsigned long)all.count, (double)all.count / secs, (unsigned long)errors,
+            all.count ? cpu * 1e6 / (double)all.count : 0);
+        bool first = true;
+        for (uint32_t op = 0; op <= OP_COUNT; ++op) {
+            const Hist &h = op < OP_COUNT ? hist[op] : all;
+            if (!h.count) {
+                continue;
+            }
+            printf("%s\"%s\":{\"count\":%lu,\"rps\":%.0f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+                "\"p999_us\":%.3f,\"max_us\":%.3f}", first ? "" : ",",
+                op < OP_COUNT ? k_op_names[op] : "all", (unsigned long)h.count,
+                (double)h.count / secs, (double)hist_quantile(&h, 0.5) / 1000,
+                (double)hist_quantile(&h, 0.99) / 1000, (double)hist_quantile(&h, 0.999) / 1000,
+                (double)h.max / 1000);
+            first = false;
+        }
+        printf("}}\n");
+        return;
+    }
+    printf("%s, %u conns, %u threads, depth %u, %lu keys (%s), values %u-%u bytes\n",
+        g_opts.sync ? "sync" : "async", g_opts.conns, g_opts.threads, g_opts.depth,
+        (unsigned long)g_opts.keys, g_opts.zipf > 0 ? "zipf" : "uniform",
+        g_opts.value_min, g_opts.value_max);
+    printf("%lu requests in %.2f s: %.0f req/s, %lu errors, client cpu %.2f us/req\n",
+        (unsigned long)all.count, secs, (double)all.count / secs, (unsigned long)errors,
+        all.count ? cpu * 1e6 / (double)all.count : 0);
+    if (errors) {
+        printf("first error: %s\n", first_error.c_str());
+    }
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n",
+        "op", "count", "req/s", "p50 us", "p99 us", "p999 us", "max us");
+    for (uint32_t op = 0; op <= OP_COUNT; ++op) {
+        const Hist &h = op < OP_COUNT ? hist[op] : all;
+        if (!h.count) {
+            continue;
+        }
+        printf("%-8s %10lu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+            op < OP_COUNT ? k_op_names[op] : "all", (unsigned long)h.count,
+            (double)h.count / secs, (double)hist_quantile(&h, 0.5) / 1000,
+            (double)hist_quantile(&h, 0.99) / 1000, (double)hist_quantile(&h, 0.999) / 1000,
+            (double)h.max / 1000);
+    }
+}
+
+static bool str2num(const std::string &s, double &out) {
+    char *endp = NULL;
+    out = strtod(s.c_str(), &endp);
+    return !s.empty() && endp == s.c_str() + s.size() && !isnan(out);
+}
+
+// get=90,set=10
+static bool parse_mix(const std::string &val) {
+    uint32_t mix[OP_COUNT] = {};
+    size_t pos = 0;
+    while (pos < val.size()) {
+        size_t end = val.find(',', pos);
+        std::string item = val.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        size_t eq = item.find('=');
+        double weight = 0;
+        if (eq == std::string::npos || !str2num(item.substr(eq + 1), weight) || weight < 0) {
+            return false;
+        }
+        uint32_t op = 0;
+        while (op < OP_COUNT && item.compare(0, eq, k_op_names[op]) != 0) {
+            op++;
+        }
+        if (op == OP_COUNT) {
+            return false;
+        }
+        mix[op] = (uint32_t)weight;
+        pos = end == std::string::npos ? val.size() : end + 1;
+    }
+    uint32_t total = 0;
+    for (uint32_t op = 0; op < OP_COUNT; ++op) {
+        total += mix[op];
+        g_opts.mix[op] = mix[op];
+    }
+    return total > 0;
+}
+
+// n or min-max
+static bool parse_range(const std::string &val, uint32_t &lo, uint32_t &hi) {
+    size_t dash = val.find('-');
+    double a = 0, b = 0;
+    if (!str2num(val.substr(0, dash), a)) {
+        return false;
+    }
+    b = a;
+    if (dash != std::string::npos && !str2num(val.substr(dash + 1), b)) {
+        return false;
+    }
+    if (a < 0 || b < a || b > k_max_msg) {
+        return false;
+    }
+    lo = (uint32_t)a;
+    hi = (uint32_t)b;
+    return true;
+}
+
+// command line options, given as `--name value` pairs
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i += 2) {
+        std::string opt = argv[i];
+        std::string val = (i + 1 < argc) ? argv[i + 1] : "";
+        double num = 0;
+        bool is_num = str2num(val, num);
+        bool is_count = is_num && num >= 1 && num == floor(num);
+        struct in_addr addr = {};
+        if (opt == "--host" && inet_pton(AF_INET, val.c_str(), &addr) == 1) {
+            g_opts.host = val;
+        } else if (opt == "--port" && is_count && num <= 65535) {
+            g_opts.port = (uint16_t)num;
+        } else if (opt == "--conns" && is_count) {
+            g_opts.conns = (uint32_t)num;
+        } else if (opt == "--threads" && is_count) {
+            g_opts.threads = (uint32_t)num;
+        } else if (opt == "--depth" && is_count) {
+            g_opts.depth = (uint32_t)num;
+        } else if (opt == "--mode" && (val == "async" || val == "sync")) {
+            g_opts.sync = (val == "sync");
+        } else if (opt == "--requests" && is_count) {
+            g_opts.requests = (uint64_t)num;
+        } else if (opt == "--seconds" && is_num && num > 0) {
+            g_opts.seconds = num;
+        } else if (opt == "--mix" && parse_mix(val)) {
+            // parsed
+        } else if (opt == "--keys" && is_count) {
+            g_opts.keys = (uint64_t)num;
+        } else if (opt == "--dist" && (val == "uniform" || val == "zipf")) {
+            g_opts.zipf = (val == "zipf") ? 0.99 : 0;
+        } else if (opt == "--zipf" && is_num && num > 0 && num < 1) {
+            g_opts.zipf = num;
+        } else if (opt == "--value-size" && parse_range(val, g_opts.value_min, g_opts.value_max)) {
+            // parsed
+        } else if (opt == "--zsets" && is_count) {
+            g_opts.zsets = (uint64_t)num;
+        } else if (opt == "--prefill" && (val == "yes" || val == "no")) {
+            g_opts.prefill = (val == "yes");
+        } else if (opt == "--format" && (val == "text" || val == "json")) {
+            g_opts.json = (val == "json");
+        } else {
+            fprintf(stderr, "bad option: %s %s\n", opt.c_str(), val.c_str());
+            exit(1);
+        }
+    }
+    if (g_opts.threads > g_opts.conns) {
+        g_opts.threads = g_opts.conns;
+    }
+    if (g_opts.sync) {
+        g_opts.threads = g_opts.conns;
+        g_opts.depth = 1;
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    if (g_opts.zipf > 0) {
+        zipf_init(g_zipf, g_opts.keys, g_opts.zipf);
+    }
+    if (g_opts.prefill) {
+        prefill();
+    }
+
+    // the connections are spread over the threads
+    std::vector<Worker> workers(g_opts.threads);
+    for (uint32_t i = 0; i < g_opts.threads; ++i) {
+        uint32_t nconns = g_opts.conns / g_opts.threads + (i < g_opts.conns % g_opts.threads);
+        worker_open(workers[i], nconns, nconns * g_opts.depth);
+        workers[i].rng = get_monotonic_nsec() ^ ((uint64_t)i << 32);
+        workers[i].value.assign(g_opts.value_max, 'x');
+    }
+
+    uint64_t start_ns = get_monotonic_nsec();
+    double cpu = cpu_secs();
+    g_run.deadline_ns = start_ns + (uint64_t)(g_opts.seconds * 1e9);
+    void (*run)(Worker *) = g_opts.sync ? &worker_run_sync : &worker_run;
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < g_opts.threads; ++i) {
+        threads.emplace_back(run, &workers[i]);
+    }
+    run(&workers[0]);
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    double secs = (double)(get_monotonic_nsec() - start_ns) / 1e9;
+    cpu = cpu_secs() - cpu;
+
+    Hist *hist = new Hist[OP_COUNT];
+    uint64_t errors = 0;
+    std::string first_error;
+    for (Worker &w : workers) {
+        for (uint32_t op = 0; op < OP_COUNT; ++op) {
+            hist_merge(&hist[op], &w.hist[op]);
+        }
+        if (w.errors && first_error.empty()) {
+            first_error = w.first_error;
+        }
+        errors += w.errors;
+        client_close(&w.client);
+    }
+    report(hist, errors, first_error, secs, cpu);
+    delete[] hist;
+    return errors ? 2 : 0;
+}
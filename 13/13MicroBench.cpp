@@ -0,0 +1,708 @@
+// microbenchmarks of the data structures, run in-process at a range of sizes:
+//   microbench --sizes 1k,100k,10m --ops 1000000 --only hashtable,zset --format json
+// each result is the time per operation, the last-level cache misses per
+// operation (when perf_event_open() is permitted), and the peak RSS of the
+// group of benchmarks that produced it, measured from the RSS before it.
+// the dispatch group doesn't depend on the size, it runs once.
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <string>
+#include <vector>
+// proj
+#include "common.h"
+#include "hashtable.h"
+#include "avl.h"
+#include "heap.h"
+#include "zset.h"
+#include "cmdhash.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static struct {
+    // the sizes that don't fit in the memory are skipped, see group_run()
+    std::vector<uint64_t> sizes = {1000, 10000, 100000, 1000000, 10000000, 100000000};
+    uint64_t ops = 1000000;     // for the benchmarks that don't build a structure
+    std::string only;           // a comma separated list of groups, empty for all
+    uint64_t seed = 1;
+    bool json = false;
+} g_opts;
+
+// random numbers, splitmix64. it's a bijection of the state, so
+// `mix(i)` for distinct `i` are distinct keys.
+static uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+static uint64_t rng_next(uint64_t &state) {
+    return mix(state += 0x9e3779b97f4a7c15);
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// visits [0, n) in a scattered order without an array of n indexes:
+// i -> (i * step + start) mod n is a permutation if step is coprime to n.
+struct Perm {
+    uint64_t n = 0;
+    uint64_t step = 1;
+    uint64_t start = 0;
+};
+
+static Perm perm_init(uint64_t n, uint64_t &rng) {
+    Perm p;
+    p.n = n;
+    p.start = rng_next(rng) % n;
+    p.step = (n * 5 / 8) | 1;   // far apart, not a small stride
+    while (gcd(p.step, n) != 1) {
+        p.step += 2;
+    }
+    return p;
+}
+
+static uint64_t perm_at(const Perm &p, uint64_t i) {
+    return (uint64_t)(((unsigned __int128)i * p.step + p.start) % p.n);
+}
+
+// the random inputs of the timed loops are drawn in batches, outside of the timing
+const size_t k_batch = 1024;
+
+static size_t batch_size(uint64_t ops, uint64_t done) {
+    return (size_t)(ops - done < k_batch ? ops - done : k_batch);
+}
+
+// keeps the results alive so the loops are not optimized out
+static volatile uint64_t g_sink;
+
+// the last-level cache misses of this thread, user space only.
+// -1 when the kernel or the VM doesn't expose the counter.
+static int g_perf_fd = -1;
+
+static void perf_init() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    g_perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t perf_read() {
+    uint64_t val = 0;
+    if (g_perf_fd >= 0 && read(g_perf_fd, &val, sizeof(val)) != sizeof(val)) {
+        val = 0;
+    }
+    return val;
+}
+
+// a field in KB from /proc/self/status or /proc/meminfo, such as "VmRSS:"
+static uint64_t proc_kb(const char *path, const char *field) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    char line[256];
+    uint64_t kb = 0;
+    size_t flen = strlen(field);
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, field, flen) == 0) {
+            kb = strtoull(line + flen, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+// resets VmHWM, the peak RSS, to the current RSS (Linux 4.0+)
+static void peak_reset() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        ssize_t rv = write(fd, "5", 1);
+        (void)rv;
+        close(fd);
+    }
+}
+
+// the time and cache misses of a run of operations. start() and stop()
+// may be paired many times, as for the phases of hm_insert().
+struct Meter {
+    uint64_t ops = 0;
+    uint64_t ns = 0;
+    uint64_t misses = 0;
+    uint64_t t0 = 0;
+    uint64_t m0 = 0;
+};
+
+static void meter_start(Meter &m) {
+    m.m0 = perf_read();
+    m.t0 = get_monotonic_nsec();
+}
+
+static void meter_stop(Meter &m, uint64_t ops) {
+    m.ns += get_monotonic_nsec() - m.t0;
+    m.misses += perf_read() - m.m0;
+    m.ops += ops;
+}
+
+
+
+static Meter meter_sum(const Meter &a, const Meter &b) {
+    Meter m;
+    m.ops = a.ops + b.ops;
+    m.ns = a.ns + b.ns;
+    m.misses = a.misses + b.misses;
+    return m;
+}
+
+// the benchmarks on one structure of `n` items. the results are reported
+// together, with the peak RSS of the whole group.
+struct Result {
+    const char *name;
+    Meter meter;
+};
+
+struct Group {
+    uint64_t n = 0;
+    uint64_t rng = 0;
+    uint64_t ops = 0;   // for the benchmarks that don't build a structure
+    std::vector<Result> results;
+};
+
+static void group_add(Group &g, const char *name, const Meter &m) {
+    g.results.push_back(Result{name, m});
+}
+
+// hashtable: the keys are spread by the same hash as the server's keys
+struct HEntry {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool hentry_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, HEntry, node)->key == container_of(rhs, HEntry, node)->key;
+}
+
+static void hentry_init(HEntry *ent, uint64_t key) {
+    ent->key = key;
+    ent->node.next = NULL;
+    ent->node.hcode = str_hash((uint8_t *)&ent->key, sizeof(ent->key));
+}
+
+// runs `op(i)` for i in [0, count), timed separately while the map is
+// resizing (`phases[1]`) and while it isn't (`phases[0]`). the insert that
+// starts a resize counts as steady, and a small resize starts and ends
+// within that insert.
+template <class F>
+static void hm_phased(HMap *map, Meter phases[2], uint64_t count, F op) {
+    uint64_t i = 0;
+    while (i < count) {
+        bool resizing = map->ht2.tab != NULL;
+        uint64_t start = i;
+        meter_start(phases[resizing]);
+        while (i < count && (map->ht2.tab != NULL) == resizing) {
+            op(i++);
+        }
+        meter_stop(phases[resizing], i - start);
+    }
+}
+
+static void bench_hashtable(Group &g) {
+    uint64_t n = g.n;
+    uint64_t base = mix(g.rng);
+    HEntry *ents = new HEntry[n];
+    for (uint64_t i = 0; i < n; ++i) {
+        hentry_init(&ents[i], mix(base + i));
+    }
+
+    // from empty, with the progressive resizing
+    HMap map;
+    Meter phases[2];
+    hm_phased(&map, phases, n, [&](uint64_t i) {
+        hm_insert(&map, &ents[i].node);
+    });
+    group_add(g, "hm_insert", meter_sum(phases[0], phases[1]));
+    group_add(g, "hm_insert/steady", phases[0]);
+    group_add(g, "hm_insert/resizing", phases[1]);
+
+    // random hits, and misses. a lookup also moves nodes of a resize.
+    std::vector<HEntry> keys(k_batch);
+    Meter lookups[2];
+    uint64_t found = 0;
+    for (uint64_t done = 0; done < g.ops; ) {
+        size_t batch = batch_size(g.ops, done);
+        for (size_t j = 0; j < batch; ++j) {
+            HEntry *ent = &ents[rng_next(g.rng) % n];
+            keys[j].key = ent->key;
+            keys[j].node.hcode = ent->node.hcode;
+        }
+        hm_phased(&map, lookups, batch, [&](uint64_t j) {
+            found += hm_lookup(&map, &keys[j].node, &hentry_eq) != NULL;
+        });
+        done += batch;
+    }
+    group_add(g, "hm_lookup", meter_sum(lookups[0], lookups[1]));
+    group_add(g, "hm_lookup/resizing", lookups[1]);
+    Meter miss;
+    for (uint64_t done = 0; done < g.ops; ) {
+        size_t batch = batch_size(g.ops, done);
+        for (size_t j = 0; j < batch; ++j) {
+            hentry_init(&keys[j], mix(base + n + rng_next(g.rng) % n));
+        }
+        meter_start(miss);
+        for (size_t j = 0; j < batch; ++j) {
+            found += hm_lookup(&map, &keys[j].node, &hentry_eq) != NULL;
+        }
+        meter_stop(miss, batch);
+        done += batch;
+    }
+    group_add(g, "hm_lookup/miss", miss);
+    assert(found == g.ops);
+
+    // every key in a scattered order
+    Perm perm = perm_init(n, g.rng);
+    Meter pop;
+    meter_start(pop);
+    for (uint64_t i = 0; i < n; ++i) {
+        found += hm_pop(&map, &ents[perm_at(perm, i)].node, &hentry_eq) != NULL;
+    }
+    meter_stop(pop, n);
+    group_add(g, "hm_pop", pop);
+    assert(found == g.ops + n && hm_size(&map) == 0);
+    g_sink = found;
+
+    hm_destroy(&map);
+    delete[] ents;
+}
+
+// AVL tree: inserting is a descent by the key, then avl_fix()
+struct TNode {
+    AVLNode tree;
+    uint64_t key = 0;
+};
+
+static void bench_avl(Group &g) {
+    uint64_t n = g.n;
+    uint64_t base = mix(g.rng);
+    TNode *nodes = new TNode[n];
+    AVLNode *root = NULL;
+    Meter insert;
+    meter_start(insert);
+    for (uint64_t i = 0; i < n; ++i) {
+        TNode *node = &nodes[i];
+        avl_init(&node->tree);
+        node->key = mix(base + i);
+        AVLNode *parent = NULL;
+        AVLNode **from = &root;
+        while (*from) {
+            parent = *from;
+            from = node->key < container_of(parent, TNode, tree)->key
+                ? &parent->left : &parent->right;
+        }
+        *from = &node->tree;
+        node->tree.parent = parent;
+        root = avl_fix(&node->tree);
+    }
+    meter_stop(insert, n);
+    group_add(g, "avl_fix", insert);
+    assert(root->cnt == n);
+
+    // from a random node to a random rank, always in range.
+    // the rank of the starting node comes from its subtree counts.
+    std::vector<uint64_t> ranks(n < g.ops ? n : g.ops);
+    std::vector<uint64_t> starts(ranks.size());
+    for (size_t i = 0; i < ranks.size(); ++i) {
+        starts[i] = rng_next(g.rng) % n;
+        AVLNode *node = &nodes[starts[i]].tree;
+        uint64_t rank = node->left ? node->left->cnt : 0;
+        for (; node->parent; node = node->parent) {
+            if (node->parent->right == node) {
+                rank += 1 + (node->parent->left ? node->parent->left->cnt : 0);
+            }
+        }
+        ranks[i] = rank;
+    }
+    std::vector<int64_t> offsets(k_batch);
+    Meter offset;
+    uint64_t sum = 0;
+    for (uint64_t done = 0; done < g.ops; ) {
+        size_t batch = batch_size(g.ops, done);
+        for (size_t j = 0; j < batch; ++j) {
+            size_t k = (done + j) % ranks.size();
+            offsets[j] = (int64_t)(rng_next(g.rng) % n) - (int64_t)ranks[k];
+        }
+        meter_start(offset);
+        for (size_t j = 0; j < batch; ++j) {
+            AVLNode *start = &nodes[starts[(done + j) % ranks.size()]].tree;
+            AVLNode *node = avl_offset(start, offsets[j]);
+            sum += container_of(node, TNode, tree)->key;
+        }
+        meter_stop(offset, batch);
+        done += batch;
+    }
+    group_add(g, "avl_offset", offset);
+
+    Perm perm = perm_init(n, g.rng);
+    Meter del;
+    meter_start(del);
+    for (uint64_t i = 0; i < n; ++i) {
+        root = avl_del(&nodes[perm_at(perm, i)].tree);
+    }
+    meter_stop(del, n);
+    group_add(g, "avl_del", del);
+    assert(root == NULL);
+    g_sink = sum;
+    delete[] nodes;
+}
+
+// heap: the TTL timers, each item knows its position through `ref`
+static void bench_heap(Group &g) {
+    uint64_t n = g.n;
+    size_t *refs = new size_t[n];
+    Heap heap;
+    Meter push;
+    meter_start(push);
+    for (uint64_t i = 0; i < n; ++i) {
+        heap_push(&heap, rng_next(g.rng), &refs[i]);
+    }
+    meter_stop(push, n);
+    group_add(g, "heap_push", push);
+
+    // a random item to a random value, it moves up or down
+    std::vector<uint64_t> items(k_batch);
+    std::vector<uint64_t> vals(k_batch);
+    Meter update;
+    for (uint64_t done = 0; done < g.ops; ) {
+        size_t batch = batch_size(g.ops, done);
+        for (size_t j = 0; j < batch; ++j) {
+            items[j] = rng_next(g.rng) % n;
+            vals[j] = rng_next(g.rng);
+        }
+        meter_start(update);
+        for (size_t j = 0; j < batch; ++j) {
+            heap_update(&heap, refs[items[j]], vals[j]);
+        }
+        meter_stop(update, batch);
+        done += batch;
+    }
+    group_add(g, "heap_update", update);
+    g_sink = heap.a[0].val;
+
+    heap_dispose(&heap);
+    delete[] refs;
+}
+
+// zset: 8-byte names, integer scores in [0, n) with repeats
+static void bench_zset(Group &g) {
+    uint64_t n = g.n;
+    uint64_t base = mix(g.rng);
+    ZSet zset;
+    Meter add;
+    meter_start(add);
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t name = mix(base + i);
+        zset_add(&zset, (const char *)&name, sizeof(name), (double)(rng_next(g.rng) % n));
+    }
+    meter_stop(add, n);
+    group_add(g, "zset_add", add);
+    assert(zset_size(&zset) == n);
+
+    uint64_t sum = 0;   // past the greatest score, a query finds nothing
+    std::vector<double> scores(k_batch);
+    Meter query;
+    for (uint64_t done = 0; done < g.ops; ) {
+        size_t batch = batch_size(g.ops, done);
+        for (size_t j = 0; j < batch; ++j) {
+            scores[j] = (double)(rng_next(g.rng) % n);
+        }
+        meter_start(query);
+        for (size_t j = 0; j < batch; ++j) {
+            ZIter iter = zset_query(&zset, scores[j], "", 0);
+            sum += iter.name != NULL;
+        }
+        meter_stop(query, batch);
+        done += batch;
+    }
+    group_add(g, "zset_query", query);
+
+    // from a random rank to another, the iterators are positioned outside
+    // of the timing too
+    std::vector<ZIter> iters(k_batch);
+    std::vector<int64_t> offsets(k_batch);
+    ZIter first = zset_query(&zset, -1, "", 0);
+    uint64_t found = 0;
+    Meter offset;
+    for (uint64_t done = 0; done < g.ops; ) {
+        size_t batch = batch_size(g.ops, done);
+        for (size_t j = 0; j < batch; ++j) {
+            int64_t from = (int64_t)(rng_next(g.rng) % n);
+            iters[j] = first;
+            ziter_offset(&iters[j], from);
+            offsets[j] = (int64_t)(rng_next(g.rng) % n) - from;
+        }
+        meter_start(offset);
+        for (size_t j = 0; j < batch; ++j) {
+            ziter_offset(&iters[j], offsets[j]);
+            found += iters[j].name != NULL;
+        }
+        meter_stop(offset, batch);
+        done += batch;
+    }
+    group_add(g, "ziter_offset", offset);
+    assert(found == g.ops);
+    g_sink = sum + found;
+    zset_dispose(&zset);
+}
+
+// dispatch: the command names of the server, found as cmd_find() does
+struct CmdName {
+    const char *name;
+};
+
+static constexpr CmdName k_cmd_names[] = {
+#define CMD(name, ...) {name},
+#include "cmdtable.h"
+#undef CMD
+};
+
+static constexpr CmdHash<1024> k_cmd_names_hash = cmd_hash_build<1024>(k_cmd_names);
+
+// looks up `words` in an order drawn outside of the timing
+static Meter dispatch_run(Group &g, const std::vector<std::string> &words, uint64_t &found) {
+    std::vector<uint32_t> order(4096);
+    for (uint32_t &idx : order) {
+        idx = (uint32_t)(rng_next(g.rng) % words.size());
+    }
+    Meter m;
+    meter_start(m);
+    for (uint64_t i = 0; i < g.ops; ++i) {
+        const std::string &word = words[order[i % order.size()]];
+        found += cmd_hash_find(k_cmd_names_hash, k_cmd_names, word.c_str(), word.size()) >= 0;
+    }
+    meter_stop(m, g.ops);
+    return m;
+}
+
+static void bench_dispatch(Group &g) {
+    // every name, in lowercase and in uppercase. a miss is a name with
+    // a letter appended, it may land in the slot of a name.
+    std::vector<std::string> hits;
+    std::vector<std::string> misses;
+    for (const CmdName &cmd : k_cmd_names) {
+        std::string upper = cmd.name;
+        for (char &ch : upper) {
+            ch = (char)toupper((unsigned char)ch);
+        }
+        hits.push_back(cmd.name);
+        hits.push_back(upper);
+        misses.push_back(std::string(cmd.name) + "x");
+    }
+    g.n = sizeof(k_cmd_names) / sizeof(k_cmd_names[0]);
+
+    uint64_t found = 0;
+    group_add(g, "cmd_find", dispatch_run(g, hits, found));
+    assert(found == g.ops);
+    group_add(g, "cmd_find/miss", dispatch_run(g, misses, found));
+    assert(found == g.ops);
+    g_sink = found;
+}
+
+struct GroupSpec {
+    const char *name;
+    uint64_t bytes;     // roughly per item, to skip the sizes that don't fit.
+                        // 0 if it doesn't depend on the size.
+    void (*run)(Group &g);
+};
+
+static const GroupSpec k_groups[] = {
+    {"hashtable", 48, &bench_hashtable},
+    {"avl", 40, &bench_avl},
+    {"heap", 48, &bench_heap},
+    {"zset", 112, &bench_zset},
+    {"dispatch", 0, &bench_dispatch},
+};
+
+static bool g_header_done = false;
+
+static void group_report(const GroupSpec &spec, const Group &g, uint64_t rss_kb) {
+    uint64_t hwm_kb = proc_kb("/proc/self/status", "VmHWM:");
+    uint64_t peak_kb = hwm_kb > rss_kb ? hwm_kb - rss_kb : 0;
+    for (const Result &r : g.results) {
+        const Meter &m = r.meter;
+        if (!m.ops) {
+            continue;
+        }
+        double ns = (double)m.ns / (double)m.ops;
+        double misses = (double)m.misses / (double)m.ops;
+        if (g_opts.json) {
+            printf("{\"group\":\"%s\",\"bench\":\"%s\",\"n\":%lu,\"ops\":%lu,\"ns_per_op\":%.2f,",
+                spec.name, r.name, (unsigned long)g.n, (unsigned long)m.ops, ns);
+            if (g_perf_fd >= 0) {
+                printf("\"misses_per_op\":%.3f,", misses);
+            } else {
+                printf("\"misses_per_op\":null,");
+            }
+            printf("\"peak_kb\":%lu}\n", (unsigned long)peak_kb);
+            continue;
+        }
+        if (!g_header_done) {
+            printf("%-20s %10s %10s %10s %10s %10s\n",
+                "bench", "n", "ops", "ns/op", "miss/op", "peak MB");
+            g_header_done = true;
+        }
+        char mbuf[32] = "-";
+        if (g_perf_fd >= 0) {
+            snprintf(mbuf, sizeof(mbuf), "%.2f", misses);
+        }
+        printf("%-20s %10lu %10lu %10.1f %10s %10.1f\n", r.name, (unsigned long)g.n,
+            (unsigned long)m.ops, ns, mbuf, (double)peak_kb / 1024);
+    }
+    fflush(stdout);
+}
+
+static void group_run(const GroupSpec &spec, uint64_t n) {
+    uint64_t avail_kb = proc_kb("/proc/meminfo", "MemAvailable:");
+    if (avail_kb && n * spec.bytes / 1024 > avail_kb / 10 * 9) {
+        fprintf(stderr, "%s n=%lu: skipped, needs about %lu MB\n", spec.name,
+            (unsigned long)n, (unsigned long)(n * spec.bytes >> 20));
+        return;
+    }
+    Group g;
+    g.n = n;
+    g.rng = g_opts.seed ^ mix(n);
+    g.ops = g_opts.ops;
+    // return the memory freed by the previous group, so it's counted again
+    malloc_trim(0);
+    uint64_t rss_kb = proc_kb("/proc/self/status", "VmRSS:");
+    peak_reset();
+    spec.run(g);
+    group_report(spec, g, rss_kb);
+}
+
+static bool group_selected(const char *name) {
+    if (g_opts.only.empty()) {
+        return true;
+    }
+    std::string list = "," + g_opts.only + ",";
+    return list.find("," + std::string(name) + ",") != std::string::npos;
+}
+
+// 1000, 10k, 100M
+static bool parse_count(const std::string &val, uint64_t &out) {
+    char *endp = NULL;
+    unsigned long long num = strtoull(val.c_str(), &endp, 10);
+    uint64_t unit = 1;
+    switch (*endp | 0x20) {
+    case 'k': unit = 1000; endp++; break;
+    case 'm': unit = 1000000; endp++; break;
+    case 'g': unit = 1000000000; endp++; break;
+    }
+    out = num * unit;
+    return endp != val.c_str() && *endp == '\0' && val[0] != '-' && out > 0;
+}
+
+static bool parse_sizes(const std::string &val) {
+    std::vector<uint64_t> sizes;
+    size_t pos = 0;
+    while (pos <= val.size()) {
+        size_t end = val.find(',', pos);
+        end = end == std::string::npos ? val.size() : end;
+        uint64_t n = 0;
+        if (!parse_count(val.substr(pos, end - pos), n)) {
+            return false;
+        }
+        sizes.push_back(n);
+        pos = end + 1;
+    }
+    g_opts.sizes = sizes;
+    return true;
+}
+
+static bool groups_known(const std::string &val) {
+    size_t pos = 0;
+    while (pos <= val.size()) {
+        size_t end = val.find(',', pos);
+        end = end == std::string::npos ? val.size() : end;
+        std::string name = val.substr(pos, end - pos);
+        bool found = false;
+        for (const GroupSpec &spec : k_groups) {
+            found = found || name == spec.name;
+        }
+        if (!found) {
+            return false;
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+// command line options, given as `--name value` pairs
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i += 2) {
+        std::string opt = argv[i];
+        std::string val = (i + 1 < argc) ? argv[i + 1] : "";
+        uint64_t num = 0;
+        if (opt == "--sizes" && parse_sizes(val)) {
+            // parsed
+        } else if (opt == "--ops" && parse_count(val, num)) {
+            g_opts.ops = num;
+        } else if (opt == "--only" && groups_known(val)) {
+            g_opts.only = val;
+        } else if (opt == "--seed" && parse_count(val, num)) {
+            g_opts.seed = num;
+        } else if (opt == "--zset-large" && (val == "avl" || val == "btree")) {
+            g_zset_conf.large = (val == "btree") ? ZSET_BTREE : ZSET_AVL;
+        } else if (opt == "--format" && (val == "text" || val == "json")) {
+            g_opts.json = (val == "json");
+        } else {
+            fprintf(stderr, "bad option: %s %s\n", opt.c_str(), val.c_str());
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    perf_init();
+    if (g_perf_fd < 0 && !g_opts.json) {
+        fprintf(stderr, "perf_event_open: %s, no cache misses\n", strerror(errno));
+    }
+    for (const GroupSpec &spec : k_groups) {
+        if (!group_selected(spec.name)) {
+            continue;
+        }
+        if (spec.bytes == 0) {
+            group_run(spec, 0);
+            continue;
+        }
+        for (uint64_t n : g_opts.sizes) {
+            group_run(spec, n);
+        }
+    }
+    return 0;
+}
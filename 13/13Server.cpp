@@ -1,865 +1,4793 @@
-#include <assert.h>
-#include <math.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdio.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <poll.h>
-#include <unistd.h>
-#include <time.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/ip.h>
-#include <string>
-#include <vector>
-// proj
-#include "hashtable.h"
-#include "zset.h"
-#include "list.h"
-#include "heap.h"
-#include "common.h"
-
-
-static void msg(const char *msg) {
-    fprintf(stderr, "%s\n", msg);
-}
-
-static void die(const char *msg) {
-    int err = errno;
-    fprintf(stderr, "[%d] %s\n", err, msg);
-    abort();
-}
-
-static uint64_t get_monotonic_usec() {
-    timespec tv = {0, 0};
-    clock_gettime(CLOCK_MONOTONIC, &tv);
-    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
-}
-
-static void fd_set_nb(int fd) {
-    errno = 0;
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (errno) {
-        die("fcntl error");
-        return;
-    }
-
-    flags |= O_NONBLOCK;
-
-    errno = 0;
-    (void)fcntl(fd, F_SETFL, flags);
-    if (errno) {
-        die("fcntl error");
-    }
-}
-struct Conn;
-
-// global variables
-static struct {
-    HMap db;
-    // a map of all client connections, keyed by fd
-    std::vector<Conn *> fd2conn;
-    // timers for idle connections
-    DList idle_list;
-    // timers for TTLs
-    std::vector<HeapItem> heap;
-} g_data;
-
-const size_t k_max_msg = 4096;
-
-enum {
-    STATE_REQ = 0,
-    STATE_RES = 1,
-    STATE_END = 2,  // mark the connection for deletion
-};
-
-struct Conn {
-    int fd = -1;
-    uint32_t state = 0;     // either STATE_REQ or STATE_RES
-    // buffer for reading
-    size_t rbuf_size = 0;
-    uint8_t rbuf[4 + k_max_msg];
-    // buffer for writing
-    size_t wbuf_size = 0;
-    size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
-    uint64_t idle_start = 0;
-    // timer
-    DList idle_list;
-};
-
-static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
-    if (fd2conn.size() <= (size_t)conn->fd) {
-        fd2conn.resize(conn->fd + 1);
-    }
-    fd2conn[conn->fd] = conn;
-}
-
-static int32_t accept_new_conn(int fd) {
-    // accept
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
-    if (connfd < 0) {
-        msg("accept() error");
-        return -1;  // error
-    }
-
-    // set the new connection fd to nonblocking mode
-    fd_set_nb(connfd);
-    // creating the struct Conn
-    struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn));
-    if (!conn) {
-        close(connfd);
-        return -1;
-    }
-    conn->fd = connfd;
-    conn->state = STATE_REQ;
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
-    conn->wbuf_sent = 0;
-    conn->idle_start = get_monotonic_usec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
-    conn_put(g_data.fd2conn, conn);
-    return 0;
-}
-
-static void state_req(Conn *conn);
-static void state_res(Conn *conn);
-
-const size_t k_max_args = 1024;
-
-static int32_t parse_req(
-    const uint8_t *data, size_t len, std::vector<std::string> &out)
-{
-    if (len < 4) {
-        return -1;
-    }
-    uint32_t n = 0;
-    memcpy(&n, &data[0], 4);
-    if (n > k_max_args) {
-        return -1;
-    }
-
-    size_t pos = 4;
-    while (n--) {
-        if (pos + 4 > len) {
-            return -1;
-        }
-        uint32_t sz = 0;
-        memcpy(&sz, &data[pos], 4);
-        if (pos + 4 + sz > len) {
-            return -1;
-        }
-        out.push_back(std::string((char *)&data[pos + 4], sz));
-        pos += 4 + sz;
-    }
-
-    if (pos != len) {
-        return -1;  // trailing garbage
-    }
-    return 0;
-}
-
-enum {
-    T_STR = 0,
-    T_ZSET = 1,
-};
-
-// the structure for the key
-struct Entry {
-    struct HNode node;
-    std::string key;
-    std::string val;
-    uint32_t type = 0;
-    ZSet *zset = NULL;
-    // for TTLs
-    size_t heap_idx = -1;
-};
-
-static bool entry_eq(HNode *lhs, HNode *rhs) {
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return le->key == re->key;
-}
-
-enum {
-    ERR_UNKNOWN = 1,
-    ERR_2BIG = 2,
-    ERR_TYPE = 3,
-    ERR_ARG = 4,
-};
-
-static void out_nil(std::string &out) {
-    out.push_back(SER_NIL);
-}
-
-static void out_str(std::string &out, const char *s, size_t size) {
-    out.push_back(SER_STR);
-    uint32_t len = (uint32_t)size;
-    out.append((char *)&len, 4);
-    out.append(s, len);
-}
-
-static void out_str(std::string &out, const std::string &val) {
-    return out_str(out, val.data(), val.size());
-}
-
-static void out_int(std::string &out, int64_t val) {
-    out.push_back(SER_INT);
-    out.append((char *)&val, 8);
-}
-
-static void out_dbl(std::string &out, double val) {
-    out.push_back(SER_DBL);
-    out.append((char *)&val, 8);
-}
-
-static void out_err(std::string &out, int32_t code, const std::string &msg) {
-    out.push_back(SER_ERR);
-    out.append((char *)&code, 4);
-    uint32_t len = (uint32_t)msg.size();
-    out.append((char *)&len, 4);
-    out.append(msg);
-}
-
-static void out_arr(std::string &out, uint32_t n) {
-    out.push_back(SER_ARR);
-    out.append((char *)&n, 4);
-}
-
-static void *begin_arr(std::string &out) {
-    out.push_back(SER_ARR);
-    out.append("\0\0\0\0", 4);          // filled in end_arr()
-    return (void *)(out.size() - 4);    // the `ctx` arg
-}
-
-static void end_arr(std::string &out, void *ctx, uint32_t n) {
-    size_t pos = (size_t)ctx;
-    assert(out[pos - 1] == SER_ARR);
-    memcpy(&out[pos], &n, 4);
-}
-
-
-static void do_get(std::vector<std::string>&cmd, std::string &out){
-	Entry key;
-	key.key.swap(cmd[1]);
-	key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        return out_nil(out);
-    }
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->type != T_STR) {
-        return out_err(out, ERR_TYPE, "expect string type");
-    }
-    return out_str(out, ent->val);
-}
-
-static void do_set(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
-        if (ent->type != T_STR) {
-            return out_err(out, ERR_TYPE, "expect string type");
-        }
-        ent->val.swap(cmd[2]);
-    } else {
-        Entry *ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->val.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
-    }
-    return out_nil(out);
-}
-
-// set or remove the TTL
-static void entry_set_ttl(Entry *ent, int64_t ttl_ms){
-	// If ttl_ms is less than 0, it indicates that the TTL should be removed. 
-	// The condition ent->heap_idx != (size_t)-1 checks if the entry is currently in the heap.
-	if(ttl_ms<0 && ent->heap_idx != (size_t)-1){
-		// erase an item from the heap
-        // by replacing it with the last item in the array.
-        size_t pos = ent->heap_idx;
-        // The entry at pos is replaced with the last item in the heap.
-        g_data.heap[pos] = g_data.heap.back();
-        g_data.heap.pop_back();
-        if (pos < g_data.heap.size()) {
-    		heap_update(g_data.heap.data(), pos, g_data.heap.size());
-		}
-		// If pos is not the last position, the heap is updated to maintain the heap property using heap_update().
-		ent->heap_idx = -1;
-	}else if(ttl_ms>=0){ // if ttl_ms is 0 or greater, it indicates that a TTL should be set for the entry.
-		size_t pos = ent->heap_idx;
-		// if pos is -1, it means the entry is not currently in the heap, so a new HeapItem is created.
-		if (pos == (size_t)-1){
-			HeapItem item ;
-			item.ref =  &ent->heap_idx;
-			g_data.heap.push_back(item);
-			// The new HeapItem is added to the heap using push_back(), and pos is updated to the last index of the heap.
-			pos = g_data.heap.size();
-		}
-		g_data.heap[pos].val = get_monotonic_usec() + (uint64_t)ttl_ms * 1000;
-		heap_update(g_data.heap.data(), pos, g_data.heap.size());
-	}
-}
-
-static bool str2int(const std::string &s, int64_t &out) {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
-}
-
-static void do_expire(std::vector<std::string> &cmd, std::string &out){
-	int64_t ttl_ms =0;
-	if (!str2int(cmd[2], ttl_ms)) {
-        return out_err(out, ERR_ARG, "expect int64");
-    }
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
-        entry_set_ttl(ent, ttl_ms);
-    }
-    return out_int(out, node ? 1: 0);
-}
-
-static void do_ttl(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        return out_int(out, -2);
-    }
-
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1) {
-        return out_int(out, -1);
-    }
-
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
-    uint64_t now_us = get_monotonic_usec();
-    return out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0);
-}
-
-static void entry_del(Entry *ent) {
-    switch (ent->type) {
-    case T_ZSET:
-        zset_dispose(ent->zset);
-        delete ent->zset;
-        break;
-    }
-    entry_set_ttl(ent, -1);
-    delete ent;
-}
-
-static void do_del(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        entry_del(container_of(node, Entry, node));
-    }
-    return out_int(out, node ? 1 : 0);
-}
-
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
-    if (tab->size == 0) {
-        return;
-    }
-    for (size_t i = 0; i < tab->mask + 1; ++i) {
-        HNode *node = tab->tab[i];
-        while (node) {
-            f(node, arg);
-            node = node->next;
-        }
-    }
-}
-
-static void cb_scan(HNode *node, void *arg) {
-    std::string &out = *(std::string *)arg;
-    out_str(out, container_of(node, Entry, node)->key);
-}
-
-static void do_keys(std::vector<std::string>&cmd, std::string &out){
-	(void)cmd;
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.ht1, &cb_scan, &out);
-    h_scan(&g_data.db.ht2, &cb_scan, &out);
-}
-
-static bool str2dbl(const std::string &s, double &out) {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
-}
-
-// zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd, std::string &out) {
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_ARG, "expect fp number");
-    }
-
-    // look up or create the zset
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-
-    Entry *ent = NULL;
-    if (!hnode) {
-        ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->type = T_ZSET;
-        ent->zset = new ZSet();
-        hm_insert(&g_data.db, &ent->node);
-    } else {
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            return out_err(out, ERR_TYPE, "expect zset");
-        }
-    }
-
-    // add or update the tuple
-    const std::string &name = cmd[3];
-    bool added = zset_add(ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
-}
-
-static bool expect_zset(std::string &out, std::string &s, Entry **ent) {
-    Entry key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!hnode) {
-        out_nil(out);
-        return false;
-    }
-
-    *ent = container_of(hnode, Entry, node);
-    if ((*ent)->type != T_ZSET) {
-        out_err(out, ERR_TYPE, "expect zset");
-        return false;
-    }
-    return true;
-}
-
-// zrem zset name
-static void do_zrem(std::vector<std::string> &cmd, std::string &out) {
-    Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent)) {
-        return;
-    }
-
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_pop(ent->zset, name.data(), name.size());
-    if (znode) {
-        znode_del(znode);
-    }
-    return out_int(out, znode ? 1 : 0);
-}
-
-// zscore zset name
-static void do_zscore(std::vector<std::string> &cmd, std::string &out) {
-    Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent)) {
-        return;
-    }
-
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(ent->zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
-}
-
-// zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
-    // parse args
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_ARG, "expect fp number");
-    }
-    const std::string &name = cmd[3];
-    int64_t offset = 0;
-    int64_t limit = 0;
-    if (!str2int(cmd[4], offset)) {
-        return out_err(out, ERR_ARG, "expect int");
-    }
-    if (!str2int(cmd[5], limit)) {
-        return out_err(out, ERR_ARG, "expect int");
-    }
-
-    // get the zset
-    Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent)) {
-        if (out[0] == SER_NIL) {
-            out.clear();
-            out_arr(out, 0);
-        }
-        return;
-    }
-
-    // look up the tuple
-    if (limit <= 0) {
-        return out_arr(out, 0);
-    }
-    ZNode *znode = zset_query(ent->zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
-
-    // output
-    void *arr = begin_arr(out);
-    uint32_t n = 0;
-    while (znode && (int64_t)n < limit) {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1);
-        n += 2;
-    }
-    end_arr(out, arr, n);
-}
-
-static bool cmd_is(const std::string &word, const char *cmd) {
-    return 0 == strcasecmp(word.c_str(), cmd);
-}
-
-static void do_request(std::vector<std::string> &cmd, std::string &out) {
-    if (cmd.size() == 1 && cmd_is(cmd[0], "keys")) {
-        do_keys(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "get")) {
-        do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "set")) {
-        do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "del")) {
-        do_del(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpire")) {
-        do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "pttl")) {
-        do_ttl(cmd, out);
-    } else if (cmd.size() == 4 && cmd_is(cmd[0], "zadd")) {
-        do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem")) {
-        do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore")) {
-        do_zscore(cmd, out);
-    } else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery")) {
-        do_zquery(cmd, out);
-    } else {
-        // cmd is not recognized
-        out_err(out, ERR_UNKNOWN, "Unknown cmd");
-    }
-}
-
-static bool try_one_request(Conn *conn) {
-    // try to parse a request from the buffer
-    if (conn->rbuf_size < 4) {
-        // not enough data in the buffer. Will retry in the next iteration
-        return false;
-    }
-    uint32_t len = 0;
-    memcpy(&len, &conn->rbuf[0], 4);
-    if (len > k_max_msg) {
-        msg("too long");
-        conn->state = STATE_END;
-        return false;
-    }
-    if (4 + len > conn->rbuf_size) {
-        // not enough data in the buffer. Will retry in the next iteration
-        return false;
-    }
-
-    // parse the request
-    std::vector<std::string> cmd;
-    if (0 != parse_req(&conn->rbuf[4], len, cmd)) {
-        msg("bad req");
-        conn->state = STATE_END;
-        return false;
-    }
-
-    // got one request, generate the response.
-    std::string out;
-    do_request(cmd, out);
-
-    // pack the response into the buffer
-    if (4 + out.size() > k_max_msg) {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
-    }
-    uint32_t wlen = (uint32_t)out.size();
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = 4 + wlen;
-
-    // remove the request from the buffer.
-    // note: frequent memmove is inefficient.
-    // note: need better handling for production code.
-    size_t remain = conn->rbuf_size - 4 - len;
-    if (remain) {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
-    }
-    conn->rbuf_size = remain;
-
-    // change state
-    conn->state = STATE_RES;
-    state_res(conn);
-
-    // continue the outer loop if the request was fully processed
-    return (conn->state == STATE_REQ);
-}
-
-static bool try_fill_buffer(Conn *conn) {
-    // try to fill the buffer
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
-    ssize_t rv = 0;
-    do {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
-    } while (rv < 0 && errno == EINTR);
-    if (rv < 0 && errno == EAGAIN) {
-        // got EAGAIN, stop.
-        return false;
-    }
-    if (rv < 0) {
-        msg("read() error");
-        conn->state = STATE_END;
-        return false;
-    }
-    if (rv == 0) {
-        if (conn->rbuf_size > 0) {
-            msg("unexpected EOF");
-        } else {
-            msg("EOF");
-        }
-        conn->state = STATE_END;
-        return false;
-    }
-
-    conn->rbuf_size += (size_t)rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf));
-
-    // Try to process requests one by one.
-    // Why is there a loop? Please read the explanation of "pipelining".
-    while (try_one_request(conn)) {}
-    return (conn->state == STATE_REQ);
-}
-
-static void state_req(Conn *conn) {
-    while (try_fill_buffer(conn)) {}
-}
-
-static bool try_flush_buffer(Conn *conn) {
-    ssize_t rv = 0;
-    do {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
-    } while (rv < 0 && errno == EINTR);
-    if (rv < 0 && errno == EAGAIN) {
-        // got EAGAIN, stop.
-        return false;
-    }
-    if (rv < 0) {
-        msg("write() error");
-        conn->state = STATE_END;
-        return false;
-    }
-    conn->wbuf_sent += (size_t)rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
-    if (conn->wbuf_sent == conn->wbuf_size) {
-        // response was fully sent, change state back
-        conn->state = STATE_REQ;
-        conn->wbuf_sent = 0;
-        conn->wbuf_size = 0;
-        return false;
-    }
-    // still got some data in wbuf, could try to write again
-    return true;
-}
-
-static void state_res(Conn *conn) {
-    while (try_flush_buffer(conn)) {}
-}
-
-static void connection_io(Conn *conn){
-	// waked up by poll, update the idle timer
-    // by moving conn to the end of the list.
-
-    // Get the current time in microseconds and set it as the new idle start time for the connection.
-    conn->idle_start = get_monotonic_usec();
-    // Detach the connection from its current position in the idle list.
-    dlist_detach(&conn->idle_list);
-    
-    // Insert the connection back into the idle list, just before the list's sentinel node,
-    // effectively moving it to the end of the list (making it the most recently used).
-    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
-    
-    // do the work
-    if (conn->state == STATE_REQ) {
-        state_req(conn);
-    } else if (conn->state == STATE_RES) {
-        state_res(conn);
-    } else {
-        assert(0);  // not expected
-    }
-}
-
-const uint64_t k_idle_timeout_ms = 5 * 1000;
-
-static uint32_t next_timer_ms() {
-    uint64_t now_us = get_monotonic_usec();
-    uint64_t next_us = (uint64_t)-1; // Initialize next_us to the maximum possible value (-1), indicating that no timeout has been set yet.
-
-    //  If the idle list is not empty, there are idle timers to consider.
-    if (!dlist_empty(&g_data.idle_list)) {
-        Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
-        // Calculates the absolute time (next_us) in microseconds when the next connection (next) will timeout. 
-		// This is done by adding the idle start time (next->idle_start) and the idle timeout duration (k_idle_timeout_ms * 1000, converted to microseconds).
-        next_us = next->idle_start + k_idle_timeout_ms * 1000;
-    }
-
-    // if the heap is not empty and the next TTL timer is sooner than the current next_us.
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_us) {
-        next_us = g_data.heap[0].val; // Update next_us to the time of the next TTL timer.
-    }
-
-    if (next_us == (uint64_t)-1) {
-        return 10000;   // no timer, the value doesn't matter
-    }
-
-    if (next_us <= now_us) {
-        // missed?
-        return 0;
-    }
-    return (uint32_t)((next_us - now_us) / 1000);
-}
-
-static void conn_done(Conn *conn) {
-    g_data.fd2conn[conn->fd] = NULL;
-    (void)close(conn->fd);
-    dlist_detach(&conn->idle_list);
-    free(conn);
-}
-
-static bool hnode_same(HNode *lhs, HNode *rhs) {
-    return lhs == rhs;
-}
-
-// The process_timers function efficiently handles idle connections and TTL timers, ensuring that the server maintains performance 
-// and responsiveness by carefully managing the number of operations performed in each iteration.
-static void process_timers(){
-	// the extra 1000us is for the ms resolution of poll()
-    uint64_t now_us = get_monotonic_usec() + 1000;
-    while(!dlist_empty(&g_data.idle_list)){
-    	// Get the next connection from the idle list
-    	Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
-    	
-    	// Calculate the target/absolute time for the next timer event in microseconds
-        uint64_t next_us = next->idle_start + k_idle_timeout_ms * 1000;
-        if (next_us >= now_us) {
-            // not ready
-            break;
-        }
-
-        printf("removing idle connection: %d\n", next->fd);
-        conn_done(next);
-	}
-	// TTL timers
-    const size_t k_max_works = 2000;
-    size_t nworks = 0;
-	while(!g_data.heap.empty() && g_data.heap[0].val<now_us){
-		Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
-        HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
-        assert(node == &ent->node);
-        entry_del(ent);
-        if (nworks++ >= k_max_works) {
-            // don't stall the server if too many keys are expiring at once
-            break;
-        }
-	}
-}
-
-int main(){
-	// some initializations
-    dlist_init(&g_data.idle_list);
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(fd<0)
-    	die("socket()");
-    int val =1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val,sizeof(val));
-    
-    //bind
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0);
-    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-    if(rv<0)
-    	die("bind()");
-    
-    //listen
-    rv = listen(fd,SOMAXCONN);
-    if(rv<0)
-    	die("listen()");
-    
-    // set the listen fd to nonblocking mode
-    fd_set_nb(fd);
-
-    // the event loop
-    std::vector<struct pollfd> poll_args;
-    while(true){
-    	//prepare the arguement of the poll
-    	poll_args.clear();
-    	
-    	struct pollfd pfd={fd,POLLIN,0};
-    	poll_args.push_back(pfd);
-    	for(Conn *conn: g_data.fd2conn){
-    		if(!conn)
-    			continue;
-    		
-    		struct pollfd pfd={};
-    		pfd.fd = conn->fd;
-    		pfd.events = (conn->state==STATE_REQ)?POLLIN:POLLOUT;
-    		pfd.events = pfd.events | POLLERR;
-    		poll_args.push_back(pfd);
-		}
-		// poll for active fds
-		int timeout_ms = (int)next_timer_ms();
-		rv =poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
-		if(rv<0)
-			die("poll");
-		
-		//process active connection
-		for(size_t i=1; i<poll_args.size(); i++){
-			if(poll_args[i].revents){
-				Conn *conn = g_data.fd2conn[poll_args[i].fd];
-				connection_io(conn);
-				if(conn->state==STATE_END){
-					conn_done(conn);
-				}
-			}
-		}
-		// handle timers
-        process_timers();
-
-        // try to accept a new connection if the listening fd is active
-        if (poll_args[0].revents) {
-            (void)accept_new_conn(fd);
-        }
-	}
-    
-    return 0;
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+// proj
+#include "hashtable.h"
+#include "zset.h"
+#include "hash.h"
+#include "qlist.h"
+#include "set.h"
+#include "bitops.h"
+#include "hll.h"
+#include "hist.h"
+#include "slowlog.h"
+#include "cmdhash.h"
+#include "list.h"
+#include "heap.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "backlog.h"
+#include "pubsub.h"
+#include "common.h"
+
+
+static void msg(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+}
+
+// msg() with a printf() format
+__attribute__((format(printf, 1, 2)))
+static void msgf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static void die(const char *msg) {
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+static uint64_t get_monotonic_usec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// unix time, for absolute deadlines given by clients
+static int64_t get_realtime_msec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return int64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
+}
+
+static void fd_set_nb(int fd) {
+    errno = 0;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (errno) {
+        die("fcntl error");
+        return;
+    }
+
+    flags |= O_NONBLOCK;
+
+    errno = 0;
+    (void)fcntl(fd, F_SETFL, flags);
+    if (errno) {
+        die("fcntl error");
+    }
+}
+struct Conn;
+
+// the subscribers of a channel or a pattern
+struct Channel {
+    HNode node;
+    std::string name;
+    bool pattern = false;
+    DList subs;             // Subscription::node
+    size_t nsubs = 0;
+};
+
+struct Subscription {
+    DList node;
+    Channel *chan = NULL;
+    Conn *conn = NULL;
+};
+
+// the link of a replica to its primary
+enum {
+    LINK_NONE = 0,          // waiting to reconnect
+    LINK_CONNECTING = 1,
+    LINK_HANDSHAKE = 2,     // waiting for the reply to psync
+    LINK_TRANSFER = 3,      // receiving the snapshot of a full sync
+    LINK_STREAM = 4,        // applying the replication stream
+};
+
+struct ReplLink {
+    int fd = -1;
+    uint32_t state = LINK_NONE;
+    std::string rbuf;
+    int file_fd = -1;           // the snapshot being received
+    uint64_t file_left = 0;
+    uint64_t retry_us = 0;      // the next reconnection
+    uint64_t ack_us = 0;        // the last ack sent
+};
+
+// global variables
+static struct {
+    HMap db;
+    // a map of all client connections, keyed by fd
+    std::vector<Conn *> fd2conn;
+    // timers for idle connections
+    DList idle_list;
+    // timers for TTLs
+    Heap heap;
+    // the child process of BGSAVE
+    pid_t bgsave_pid = -1;
+    // the append-only file
+    AOF aof;
+    pid_t aofrw_pid = -1;
+    // connections whose replies wait for the AOF write
+    std::vector<Conn *> aof_waiting;
+    // replication, as the primary
+    std::string replid;         // names the history of the replication stream
+    uint64_t repl_offset = 0;   // the end of the replication stream
+    Backlog backlog;            // allocated when the first replica attaches
+    std::vector<Conn *> replicas;
+    pid_t replsync_pid = -1;    // the child writing a snapshot for full syncs
+    uint64_t replsync_offset = 0;
+    // replication, as a replica
+    ReplLink link;
+    // version stamps for WATCH
+    uint64_t version = 0;
+    uint64_t missing_version = 0;   // the last time a key was found missing
+    size_t watching = 0;            // connections that watch keys
+    // pub/sub
+    HMap channels;
+    HMap patterns;
+    // commands slower than `slowlog_usec`
+    SlowLog slowlog;
+} g_data;
+
+// server options
+static struct {
+    std::string snapshot = "dump.13db";
+    size_t load_threads = std::max(1u, std::thread::hardware_concurrency());
+    bool appendonly = false;
+    uint32_t appendfsync = AOF_FSYNC_EVERYSEC;
+    std::string aof = "appendonly.13aof";
+    uint16_t port = 1234;
+    // replicate from this primary if `primary_port` is set
+    std::string primary_host;
+    uint32_t primary_addr = 0;  // network byte order
+    uint16_t primary_port = 0;
+    size_t repl_backlog = 1 << 20;
+    // a subscriber is dropped once this much output is queued
+    size_t pubsub_limit = 32 << 20;
+    // commands are logged from this duration, -1 disables
+    int64_t slowlog_usec = 10000;
+    // the event loop phases are timed if set
+    uint64_t stall_usec = 0;
+} g_conf;
+
+// the phases of an event loop iteration, for LATENCY LATEST
+enum {
+    PHASE_POLL = 0,     // building the poll set, the wait is idle time
+    PHASE_IO = 1,       // connection I/O and the commands
+    PHASE_LINK = 2,     // the link to the primary
+    PHASE_AOF = 3,      // writing the AOF, then the replies held for it
+    PHASE_TIMERS = 4,   // idle connections, TTLs and the replica's timers
+    PHASE_CHILDREN = 5, // reaping BGSAVE and AOF rewrite children
+    PHASE_ACCEPT = 6,
+    PHASE_LOOP = 7,     // the whole iteration, without the wait
+    PHASE_COUNT = 8,
+};
+
+// the phases that took longer than `stall_usec`
+struct Stall {
+    uint64_t count = 0;
+    int64_t unix_ms = 0;    // the latest
+    uint64_t latest_us = 0;
+    uint64_t max_us = 0;
+};
+
+// counters for INFO, the commands are counted by their histograms
+const size_t k_ops_samples = 16;
+
+static struct {
+    uint64_t start_us = 0;
+    uint64_t conns_total = 0;   // accepted
+    uint64_t net_in = 0;        // bytes read from sockets
+    uint64_t net_out = 0;       // bytes written to sockets
+    uint64_t expired = 0;       // keys deleted by their TTL
+    // commands per second, sampled every 100ms
+    uint64_t sample_us = 0;
+    uint64_t sample_cmds = 0;
+    uint64_t ops[k_ops_samples] = {};
+    size_t ops_idx = 0;
+    Stall stalls[PHASE_COUNT];
+} g_stats;
+
+const size_t k_max_msg = 4096;
+
+enum {
+    STATE_REQ = 0,
+    STATE_RES = 1,
+    STATE_END = 2,  // mark the connection for deletion
+    STATE_REPLICA = 3,  // a replica attached by psync
+};
+
+// a key watched by a connection
+struct Watch {
+    std::string key;
+    bool exists = false;
+    uint64_t version = 0;   // of the entry, or of the keyspace if missing
+};
+
+struct Conn {
+    int fd = -1;
+    uint32_t state = 0;     // STATE_REQ, STATE_RES or STATE_REPLICA
+    // buffer for reading
+    size_t rbuf_size = 0;
+    uint8_t rbuf[4 + k_max_msg];
+    // buffer for writing
+    size_t wbuf_size = 0;
+    size_t wbuf_sent = 0;
+    uint8_t wbuf[4 + k_max_msg];
+    uint64_t idle_start = 0;
+    // timer
+    DList idle_list;
+    // a replica attached to this server
+    uint32_t repl_state = 0;
+    uint64_t repl_ack = 0;      // the offset acknowledged by the replica
+    std::string obuf;           // the replication stream not yet sent
+    size_t obuf_sent = 0;
+    int sync_fd = -1;           // the snapshot of a full sync, sent first
+    uint64_t sync_left = 0;
+    // MULTI and WATCH
+    bool in_multi = false;
+    std::vector<std::vector<std::string>> queued;
+    std::vector<Watch> watched;
+    // a subscriber writes from a queue of shared messages instead of `wbuf`
+    bool pubsub = false;
+    std::vector<Subscription *> subs;
+    std::deque<PubMsg *> outq;
+    size_t outq_sent = 0;       // of the first message
+    size_t outq_bytes = 0;
+};
+
+static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
+    if (fd2conn.size() <= (size_t)conn->fd) {
+        fd2conn.resize(conn->fd + 1);
+    }
+    fd2conn[conn->fd] = conn;
+}
+
+static int32_t accept_new_conn(int fd) {
+    // accept
+    struct sockaddr_in client_addr = {};
+    socklen_t socklen = sizeof(client_addr);
+    int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+    if (connfd < 0) {
+        msg("accept() error");
+        return -1;  // error
+    }
+
+    // set the new connection fd to nonblocking mode
+    fd_set_nb(connfd);
+    // replies are written as they are generated; don't let Nagle hold
+    // back the rest of a pipeline until the client's delayed ACK.
+    int val = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    // creating the struct Conn
+    struct Conn *conn = new Conn();
+    conn->fd = connfd;
+    conn->state = STATE_REQ;
+    conn->rbuf_size = 0;
+    conn->wbuf_size = 0;
+    conn->wbuf_sent = 0;
+    conn->idle_start = get_monotonic_usec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+    conn_put(g_data.fd2conn, conn);
+    g_stats.conns_total++;
+    return 0;
+}
+
+static void state_req(Conn *conn);
+static void state_res(Conn *conn);
+static void conn_done(Conn *conn);
+
+const size_t k_max_args = 1024;
+
+static int32_t parse_req(
+    const uint8_t *data, size_t len, std::vector<std::string> &out)
+{
+    if (len < 4) {
+        return -1;
+    }
+    uint32_t n = 0;
+    memcpy(&n, &data[0], 4);
+    if (n > k_max_args) {
+        return -1;
+    }
+
+    size_t pos = 4;
+    while (n--) {
+        if (pos + 4 > len) {
+            return -1;
+        }
+        uint32_t sz = 0;
+        memcpy(&sz, &data[pos], 4);
+        if (pos + 4 + sz > len) {
+            return -1;
+        }
+        out.push_back(std::string((char *)&data[pos + 4], sz));
+        pos += 4 + sz;
+    }
+
+    if (pos != len) {
+        return -1;  // trailing garbage
+    }
+    return 0;
+}
+
+enum {
+    T_STR = 0,
+    T_ZSET = 1,
+    T_HASH = 2,
+    T_LIST = 3,
+    T_SET = 4,
+};
+
+// the encodings of T_STR. counters are kept as numbers,
+// and rendered as strings when read.
+enum {
+    STR_RAW = 0,    // `val`
+    STR_INT = 1,    // `ival`
+    STR_DBL = 2,    // `dval`
+};
+
+// the structure for the key
+struct Entry {
+    struct HNode node;
+    std::string key;
+    std::string val;
+    uint32_t type = 0;
+    uint32_t enc = STR_RAW;
+    union {
+        int64_t ival = 0;
+        double dval;
+    };
+    uint64_t version = 0;   // bumped on updates while keys are watched
+    ZSet *zset = NULL;
+    Hash *hash = NULL;
+    QList *list = NULL;
+    Set *set = NULL;
+    // for TTLs
+    size_t heap_idx = -1;
+};
+
+static bool entry_eq(HNode *lhs, HNode *rhs) {
+    struct Entry *le = container_of(lhs, struct Entry, node);
+    struct Entry *re = container_of(rhs, struct Entry, node);
+    return le->key == re->key;
+}
+
+enum {
+    ERR_UNKNOWN = 1,
+    ERR_2BIG = 2,
+    ERR_TYPE = 3,
+    ERR_ARG = 4,
+    ERR_IO = 5,
+    ERR_READONLY = 6,
+};
+
+static void out_nil(std::string &out) {
+    out.push_back(SER_NIL);
+}
+
+static void out_str(std::string &out, const char *s, size_t size) {
+    out.push_back(SER_STR);
+    uint32_t len = (uint32_t)size;
+    out.append((char *)&len, 4);
+    out.append(s, len);
+}
+
+static void out_str(std::string &out, const std::string &val) {
+    return out_str(out, val.data(), val.size());
+}
+
+static void out_int(std::string &out, int64_t val) {
+    out.push_back(SER_INT);
+    out.append((char *)&val, 8);
+}
+
+static void out_dbl(std::string &out, double val) {
+    out.push_back(SER_DBL);
+    out.append((char *)&val, 8);
+}
+
+// the shortest form that reads back as the same double
+static std::string dbl2str(double val) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", val);
+    if (strtod(buf, NULL) != val) {
+        snprintf(buf, sizeof(buf), "%.17g", val);
+    }
+    return buf;
+}
+
+static void out_err(std::string &out, int32_t code, const std::string &msg) {
+    out.push_back(SER_ERR);
+    out.append((char *)&code, 4);
+    uint32_t len = (uint32_t)msg.size();
+    out.append((char *)&len, 4);
+    out.append(msg);
+}
+
+static void out_arr(std::string &out, uint32_t n) {
+    out.push_back(SER_ARR);
+    out.append((char *)&n, 4);
+}
+
+static void *begin_arr(std::string &out) {
+    out.push_back(SER_ARR);
+    out.append("\0\0\0\0", 4);          // filled in end_arr()
+    return (void *)(out.size() - 4);    // the `ctx` arg
+}
+
+static void end_arr(std::string &out, void *ctx, uint32_t n) {
+    size_t pos = (size_t)ctx;
+    assert(out[pos - 1] == SER_ARR);
+    memcpy(&out[pos], &n, 4);
+}
+
+
+// set the deadline in monotonic microseconds
+static void entry_set_expire(Entry *ent, uint64_t expire_at) {
+	if (ent->heap_idx == (size_t)-1) {
+		heap_push(&g_data.heap, expire_at, &ent->heap_idx);
+	} else {
+		heap_update(&g_data.heap, ent->heap_idx, expire_at);
+	}
+}
+
+// set or remove the TTL
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms){
+	if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
+		heap_delete(&g_data.heap, ent->heap_idx);
+		ent->heap_idx = -1;
+	} else if (ttl_ms >= 0) {
+		entry_set_expire(ent, get_monotonic_usec() + (uint64_t)ttl_ms * 1000);
+	}
+}
+
+// convert a unix time in ms to a monotonic deadline, the past is now
+static uint64_t unix_ms_to_deadline(int64_t at_ms) {
+    uint64_t now_us = get_monotonic_usec();
+    int64_t delta_ms = at_ms - get_realtime_msec();
+    return delta_ms > 0 ? now_us + (uint64_t)delta_ms * 1000 : now_us;
+}
+
+static bool entry_expired(Entry *ent, uint64_t now_us) {
+    return ent->heap_idx != (size_t)-1 && g_data.heap.a[ent->heap_idx].val <= now_us;
+}
+
+static void entry_del(Entry *ent) {
+    switch (ent->type) {
+    case T_ZSET:
+        zset_dispose(ent->zset);
+        delete ent->zset;
+        break;
+    case T_HASH:
+        hash_dispose(ent->hash);
+        delete ent->hash;
+        break;
+    case T_LIST:
+        qlist_dispose(ent->list);
+        delete ent->list;
+        break;
+    case T_SET:
+        set_dispose(ent->set);
+        delete ent->set;
+        break;
+    }
+    entry_set_ttl(ent, -1);
+    delete ent;
+}
+
+// the value of a T_STR entry
+static std::string entry_str(Entry *ent) {
+    switch (ent->enc) {
+    case STR_INT:
+        return std::to_string(ent->ival);
+    case STR_DBL:
+        return dbl2str(ent->dval);
+    default:
+        return ent->val;
+    }
+}
+
+static void out_val(std::string &out, Entry *ent) {
+    if (ent->enc == STR_RAW) {
+        return out_str(out, ent->val);
+    }
+    return out_str(out, entry_str(ent));
+}
+
+static bool hnode_same(HNode *lhs, HNode *rhs) {
+    return lhs == rhs;
+}
+
+// look up a key. an expired key is deleted on access and not returned,
+// even if the timers haven't reached it yet.
+static HNode *db_lookup(Entry *key) {
+    HNode *node = hm_lookup(&g_data.db, &key->node, &entry_eq);
+    if (node && entry_expired(container_of(node, Entry, node), get_monotonic_usec())) {
+        hm_pop(&g_data.db, node, &hnode_same);
+        entry_del(container_of(node, Entry, node));
+        g_stats.expired++;
+        node = NULL;
+    }
+    return node;
+}
+
+// for each key of cmd[start:end], the position of its first occurrence.
+// a command with many keys looks up a repeated key only once, as another
+// lookup could expire it and free the entry found the first time.
+static std::vector<size_t> first_keys(
+    const std::vector<std::string> &cmd, size_t start, size_t end)
+{
+    std::vector<size_t> first(end - start);
+    for (size_t i = start; i < end; ++i) {
+        size_t j = start;
+        while (cmd[j] != cmd[i]) {
+            j++;
+        }
+        first[i - start] = j;
+    }
+    return first;
+}
+
+// remove a key, returns NULL if it doesn't exist or has expired
+static Entry *db_pop(Entry *key) {
+    HNode *node = hm_pop(&g_data.db, &key->node, &entry_eq);
+    if (!node) {
+        return NULL;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent, get_monotonic_usec())) {
+        entry_del(ent);
+        g_stats.expired++;
+        return NULL;
+    }
+    return ent;
+}
+
+// a mutating command on the key has run. the stamp is only needed
+// while some connection is watching.
+static void touch_key(const std::string &name) {
+    g_data.version++;
+    Entry key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (node) {
+        container_of(node, Entry, node)->version = g_data.version;
+    } else {
+        g_data.missing_version = g_data.version;
+    }
+}
+
+static void do_get(std::vector<std::string>&cmd, std::string &out){
+	Entry key;
+	key.key.swap(cmd[1]);
+	key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key);
+    if (!node) {
+        return out_nil(out);
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    return out_val(out, ent);
+}
+
+static bool str2int(const std::string &s, int64_t &out) {
+    char *endp = NULL;
+    errno = 0;
+    out = strtoll(s.c_str(), &endp, 10);
+    return !s.empty() && errno != ERANGE && endp == s.c_str() + s.size();
+}
+
+static bool str2dbl(const std::string &s, double &out) {
+    char *endp = NULL;
+    out = strtod(s.c_str(), &endp);
+    return !s.empty() && endp == s.c_str() + s.size() && !isnan(out);
+}
+
+// an upper bound that keeps deadlines in microseconds from overflowing
+const int64_t k_max_expire_ms = (int64_t)1 << 50;
+
+// parse [EX s | PX ms | EXAT s | PXAT ms] at cmd[pos] into a deadline.
+// returns 0 if cmd[pos] is not one of them, -1 for a bad number.
+static int parse_expire(
+    const std::vector<std::string> &cmd, size_t pos, uint64_t &expire_at)
+{
+    const char *word = cmd[pos].c_str();
+    bool ex = 0 == strcasecmp(word, "ex");
+    bool px = 0 == strcasecmp(word, "px");
+    bool exat = 0 == strcasecmp(word, "exat");
+    bool pxat = 0 == strcasecmp(word, "pxat");
+    if (!ex && !px && !exat && !pxat) {
+        return 0;
+    }
+    int64_t num = 0;
+    int64_t max = (ex || exat) ? k_max_expire_ms / 1000 : k_max_expire_ms;
+    if (pos + 1 >= cmd.size() || !str2int(cmd[pos + 1], num) || num <= 0 || num > max) {
+        return -1;
+    }
+    int64_t ms = (ex || exat) ? num * 1000 : num;
+    if (ex || px) {
+        expire_at = get_monotonic_usec() + (uint64_t)ms * 1000;
+    } else {
+        expire_at = unix_ms_to_deadline(ms);
+    }
+    return 1;
+}
+
+// set key val [NX|XX] [GET] [EX s|PX ms|EXAT s|PXAT ms|KEEPTTL]
+// the TTL is removed unless given or KEEPTTL.
+// replies: the old value with GET, otherwise (int) 1/0 with NX or XX, otherwise nil.
+static void do_set(std::vector<std::string> &cmd, std::string &out) {
+    bool nx = false, xx = false, get = false, keepttl = false, has_expire = false;
+    uint64_t expire_at = 0;
+    for (size_t pos = 3; pos < cmd.size(); ++pos) {
+        const char *word = cmd[pos].c_str();
+        if (0 == strcasecmp(word, "nx")) {
+            nx = true;
+        } else if (0 == strcasecmp(word, "xx")) {
+            xx = true;
+        } else if (0 == strcasecmp(word, "get")) {
+            get = true;
+        } else if (0 == strcasecmp(word, "keepttl")) {
+            keepttl = true;
+        } else {
+            int rv = parse_expire(cmd, pos, expire_at);
+            if (rv == 0 || has_expire) {
+                return out_err(out, ERR_ARG, "syntax error");
+            }
+            if (rv < 0) {
+                return out_err(out, ERR_ARG, "invalid expire time");
+            }
+            has_expire = true;
+            ++pos;
+        }
+    }
+    if ((nx && xx) || (keepttl && has_expire)) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+
+    // a single lookup for the value and the TTL
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    if (get) {
+        ent ? out_val(out, ent) : out_nil(out);
+    }
+    if ((nx && ent) || (xx && !ent)) {
+        return get ? (void)0 : out_int(out, 0);
+    }
+
+    if (!ent) {
+        ent = new Entry();
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        hm_insert(&g_data.db, &ent->node);
+    }
+    ent->val.swap(cmd[2]);
+    ent->enc = STR_RAW;
+    if (has_expire) {
+        entry_set_expire(ent, expire_at);
+    } else if (!keepttl) {
+        entry_set_ttl(ent, -1);
+    }
+    if (!get) {
+        return (nx || xx) ? out_int(out, 1) : out_nil(out);
+    }
+}
+
+// getex key [EX s|PX ms|EXAT s|PXAT ms|PERSIST]
+static void do_getex(std::vector<std::string> &cmd, std::string &out) {
+    bool persist = false, has_expire = false;
+    uint64_t expire_at = 0;
+    if (cmd.size() == 3 && 0 == strcasecmp(cmd[2].c_str(), "persist")) {
+        persist = true;
+    } else if (cmd.size() > 2) {
+        int rv = parse_expire(cmd, 2, expire_at);
+        if (rv == 0 || cmd.size() != 4) {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+        if (rv < 0) {
+            return out_err(out, ERR_ARG, "invalid expire time");
+        }
+        has_expire = true;
+    }
+
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    if (!node) {
+        return out_nil(out);
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    if (has_expire) {
+        entry_set_expire(ent, expire_at);
+    } else if (persist) {
+        entry_set_ttl(ent, -1);
+    }
+    return out_val(out, ent);
+}
+
+// the entry of a counter, a missing key starts from 0
+static Entry *counter_entry(std::string &name, std::string &out) {
+    Entry key;
+    key.key.swap(name);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    if (!node) {
+        Entry *ent = new Entry();
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        ent->enc = STR_INT;
+        hm_insert(&g_data.db, &ent->node);
+        return ent;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR) {
+        out_err(out, ERR_TYPE, "expect string type");
+        return NULL;
+    }
+    return ent;
+}
+
+static bool entry_int(Entry *ent, int64_t &val) {
+    switch (ent->enc) {
+    case STR_INT:
+        val = ent->ival;
+        return true;
+    case STR_DBL:
+        return str2int(dbl2str(ent->dval), val);
+    default:
+        return str2int(ent->val, val);
+    }
+}
+
+static bool entry_dbl(Entry *ent, double &val) {
+    switch (ent->enc) {
+    case STR_INT:
+        val = (double)ent->ival;
+        return true;
+    case STR_DBL:
+        val = ent->dval;
+        return true;
+    default:
+        return str2dbl(ent->val, val) && isfinite(val);
+    }
+}
+
+// incr key, decr key, incrby key n, decrby key n.
+// the TTL is kept. replies with the new value.
+static void do_incrby(std::vector<std::string> &cmd, std::string &out, bool decr) {
+    int64_t delta = 1;
+    if (cmd.size() == 3 && !str2int(cmd[2], delta)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    if (decr && delta == INT64_MIN) {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    delta = decr ? -delta : delta;
+
+    Entry *ent = counter_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    int64_t val = 0;
+    if (!entry_int(ent, val)) {
+        return out_err(out, ERR_TYPE, "the value is not an integer");
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    if (ent->enc == STR_RAW) {
+        std::string().swap(ent->val);
+    }
+    ent->enc = STR_INT;
+    ent->ival = val;
+    return out_int(out, val);
+}
+
+// incrbyfloat key x, replies with the new value as a string
+static void do_incrbyfloat(std::vector<std::string> &cmd, std::string &out) {
+    double delta = 0;
+    if (!str2dbl(cmd[2], delta) || !isfinite(delta)) {
+        return out_err(out, ERR_ARG, "expect float");
+    }
+    Entry *ent = counter_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    double val = 0;
+    if (!entry_dbl(ent, val)) {
+        return out_err(out, ERR_TYPE, "the value is not a float");
+    }
+    val += delta;
+    if (!isfinite(val)) {
+        return out_err(out, ERR_ARG, "increment would produce NaN or Infinity");
+    }
+    if (ent->enc == STR_RAW) {
+        std::string().swap(ent->val);
+    }
+    ent->enc = STR_DBL;
+    ent->dval = val;
+    return out_str(out, dbl2str(val));
+}
+
+// bitmaps are string values. bit 0 is the most significant bit of the
+// first byte, and a string is zero-extended when a bit past its end is set.
+
+// bits take u32 offsets, so a bitmap is at most 512MB
+const int64_t k_max_bit_offset = ((int64_t)1 << 32) - 1;
+
+// look up a string, `*ent` is NULL if the key is missing.
+// returns false on a type error.
+static bool find_str(std::string &out, std::string &s, Entry **ent) {
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    *ent = NULL;
+    if (!hnode) {
+        return true;
+    }
+    Entry *found = container_of(hnode, Entry, node);
+    if (found->type != T_STR) {
+        out_err(out, ERR_TYPE, "expect string type");
+        return false;
+    }
+    *ent = found;
+    return true;
+}
+
+// the bytes of a string, a number is formatted into `tmp`
+static const std::string &entry_bytes(Entry *ent, std::string &tmp) {
+    if (ent->enc == STR_RAW) {
+        return ent->val;
+    }
+    tmp = entry_str(ent);
+    return tmp;
+}
+
+static bool parse_bit_offset(const std::string &s, int64_t &offset) {
+    return str2int(s, offset) && offset >= 0 && offset <= k_max_bit_offset;
+}
+
+// setbit key offset 0|1, replies with the old bit
+static void do_setbit(std::vector<std::string> &cmd, std::string &out) {
+    int64_t offset = 0, bit = 0;
+    if (!parse_bit_offset(cmd[2], offset)) {
+        return out_err(out, ERR_ARG, "bit offset is not an integer or out of range");
+    }
+    if (!str2int(cmd[3], bit) || (bit != 0 && bit != 1)) {
+        return out_err(out, ERR_ARG, "bit is not an integer or out of range");
+    }
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    if (!ent) {
+        ent = new Entry();
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        hm_insert(&g_data.db, &ent->node);
+    }
+    if (ent->enc != STR_RAW) {
+        ent->val = entry_str(ent);
+        ent->enc = STR_RAW;
+    }
+    size_t idx = (size_t)(offset / 8);
+    if (ent->val.size() <= idx) {
+        ent->val.resize(idx + 1);   // zero filled
+    }
+    uint8_t mask = (uint8_t)(0x80 >> (offset % 8));
+    uint8_t byte = (uint8_t)ent->val[idx];
+    ent->val[idx] = (char)(bit ? (byte | mask) : (byte & ~mask));
+    return out_int(out, (byte & mask) ? 1 : 0);
+}
+
+// getbit key offset
+static void do_getbit(std::vector<std::string> &cmd, std::string &out) {
+    int64_t offset = 0;
+    if (!parse_bit_offset(cmd[2], offset)) {
+        return out_err(out, ERR_ARG, "bit offset is not an integer or out of range");
+    }
+    Entry *ent = NULL;
+    if (!find_str(out, cmd[1], &ent)) {
+        return;
+    }
+    std::string tmp;
+    const std::string &val = ent ? entry_bytes(ent, tmp) : tmp;
+    size_t idx = (size_t)(offset / 8);
+    if (idx >= val.size()) {
+        return out_int(out, 0);
+    }
+    return out_int(out, ((uint8_t)val[idx] >> (7 - offset % 8)) & 1);
+}
+
+// [start [end [BYTE|BIT]]] at cmd[pos:] as the bits [start, stop) of a
+// string of `size` bytes. negative indexes count from the end, and
+// the end is inclusive. the range is empty if start > end.
+static bool parse_bit_range(
+    const std::vector<std::string> &cmd, size_t pos, size_t size,
+    uint64_t &start, uint64_t &stop)
+{
+    int64_t lo = 0, hi = -1;
+    bool bits = false;
+    if (cmd.size() > pos && !str2int(cmd[pos], lo)) {
+        return false;
+    }
+    if (cmd.size() > pos + 1 && !str2int(cmd[pos + 1], hi)) {
+        return false;
+    }
+    if (cmd.size() > pos + 2) {
+        bits = 0 == strcasecmp(cmd[pos + 2].c_str(), "bit");
+        if (!bits && 0 != strcasecmp(cmd[pos + 2].c_str(), "byte")) {
+            return false;
+        }
+    }
+    int64_t total = (int64_t)size * (bits ? 8 : 1);
+    lo = lo < 0 ? std::max(lo + total, (int64_t)0) : lo;
+    hi = hi < 0 ? std::max(hi + total, (int64_t)0) : hi;
+    hi = std::min(hi, total - 1);
+    if (total == 0 || lo > hi) {
+        start = stop = 0;
+    } else if (bits) {
+        start = (uint64_t)lo;
+        stop = (uint64_t)hi + 1;
+    } else {
+        start = (uint64_t)lo * 8;
+        stop = ((uint64_t)hi + 1) * 8;
+    }
+    return true;
+}
+
+// bitcount key [start end [BYTE|BIT]]
+static void do_bitcount(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd.size() == 3) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    Entry *ent = NULL;
+    if (!find_str(out, cmd[1], &ent)) {
+        return;
+    }
+    std::string tmp;
+    const std::string &val = ent ? entry_bytes(ent, tmp) : tmp;
+    uint64_t start = 0, stop = 0;
+    if (!parse_bit_range(cmd, 2, val.size(), start, stop)) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    uint64_t n = bits_count((const uint8_t *)val.data(), start, stop);
+    return out_int(out, (int64_t)n);
+}
+
+// bitpos key 0|1 [start [end [BYTE|BIT]]], replies with the position
+// of the first matching bit or -1. when looking for a 0 without an end,
+// a string of all 1s is treated as followed by 0s.
+static void do_bitpos(std::vector<std::string> &cmd, std::string &out) {
+    int64_t bit = 0;
+    if (!str2int(cmd[2], bit) || (bit != 0 && bit != 1)) {
+        return out_err(out, ERR_ARG, "the bit argument must be 1 or 0");
+    }
+    Entry *ent = NULL;
+    if (!find_str(out, cmd[1], &ent)) {
+        return;
+    }
+    if (!ent) {
+        return out_int(out, bit ? -1 : 0);
+    }
+    std::string tmp;
+    const std::string &val = entry_bytes(ent, tmp);
+    uint64_t start = 0, stop = 0;
+    if (!parse_bit_range(cmd, 3, val.size(), start, stop)) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    int64_t pos = bits_pos((const uint8_t *)val.data(), start, stop, bit != 0);
+    if (pos < 0 && !bit && cmd.size() <= 4 && start < stop) {
+        pos = (int64_t)stop;
+    }
+    return out_int(out, pos);
+}
+
+// bitop AND|OR|XOR|NOT dest key [key ...], replies with the length of
+// the result. shorter inputs are zero-extended, an empty result deletes dest.
+static void do_bitop(std::vector<std::string> &cmd, std::string &out) {
+    static const char *const k_ops[] = {"and", "or", "xor", "not"};
+    uint32_t op = 0;
+    while (op < 4 && 0 != strcasecmp(cmd[1].c_str(), k_ops[op])) {
+        op++;
+    }
+    if (op == 4) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    if (op == BITOP_NOT && cmd.size() != 4) {
+        return out_err(out, ERR_ARG, "BITOP NOT takes a single source key");
+    }
+    // the destination is looked up first, and only once: a source that
+    // names it reuses the entry, as another lookup could expire it.
+    std::vector<size_t> first = first_keys(cmd, 2, cmd.size());
+    Entry key;
+    key.key.swap(cmd[2]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    Entry *dest = hnode ? container_of(hnode, Entry, node) : NULL;
+
+    // the inputs, missing keys are empty
+    size_t n = cmd.size() - 3;
+    std::vector<std::string> tmps(n);
+    std::vector<const std::string *> srcs(n);
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t j = first[1 + i];
+        Entry *ent = NULL;
+        if (j == 2) {
+            if (dest && dest->type != T_STR) {
+                return out_err(out, ERR_TYPE, "expect string type");
+            }
+            ent = dest;
+        } else if (j != 3 + i) {
+            srcs[i] = srcs[j - 3];
+            continue;
+        } else if (!find_str(out, cmd[3 + i], &ent)) {
+            return;
+        }
+        srcs[i] = ent ? &entry_bytes(ent, tmps[i]) : &tmps[i];
+        len = std::max(len, srcs[i]->size());
+    }
+
+    // the buffer of an existing destination is reused, which spares
+    // the page faults of a fresh allocation, unless it's also an input.
+    std::string res;
+    if (dest && dest->type == T_STR && dest->enc == STR_RAW
+        && std::find(srcs.begin(), srcs.end(), &dest->val) == srcs.end())
+    {
+        res.swap(dest->val);
+    }
+    res.assign(*srcs[0]);
+    res.resize(len);    // zero-extended
+    if (op == BITOP_NOT) {
+        bits_op(op, (uint8_t *)&res[0], NULL, len);
+    }
+    for (size_t i = 1; i < n; ++i) {
+        const std::string &src = *srcs[i];
+        bits_op(op, (uint8_t *)&res[0], (const uint8_t *)src.data(), src.size());
+        if (op == BITOP_AND) {
+            memset(&res[src.size()], 0, len - src.size());
+        }
+    }
+
+    // replace the destination
+    if (dest && (len == 0 || dest->type != T_STR)) {
+        hm_pop(&g_data.db, &dest->node, &hnode_same);
+        entry_del(dest);
+        dest = NULL;
+    }
+    if (len > 0) {
+        if (!dest) {
+            dest = new Entry();
+            dest->key.swap(key.key);
+            dest->node.hcode = key.node.hcode;
+            hm_insert(&g_data.db, &dest->node);
+        }
+        dest->val.swap(res);
+        dest->enc = STR_RAW;
+        entry_set_ttl(dest, -1);
+    }
+    return out_int(out, (int64_t)len);
+}
+
+// hyperloglogs are string values with a header, see hll.h
+
+// look up a hyperloglog, `*ent` is NULL if the key is missing.
+// returns false if the key holds something else.
+static bool find_hll(std::string &out, std::string &s, Entry **ent) {
+    if (!find_str(out, s, ent)) {
+        return false;
+    }
+    if (*ent && ((*ent)->enc != STR_RAW || !hll_valid((*ent)->val))) {
+        out_err(out, ERR_TYPE, "expect HyperLogLog");
+        return false;
+    }
+    return true;
+}
+
+// pfadd key [element ...], replies 1 if the key was created or changed
+static void do_pfadd(std::vector<std::string> &cmd, std::string &out) {
+    std::string name = cmd[1];
+    Entry *ent = NULL;
+    if (!find_hll(out, cmd[1], &ent)) {
+        return;
+    }
+    bool changed = false;
+    if (!ent) {
+        ent = new Entry();
+        ent->key.swap(name);
+        ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+        hll_init(ent->val);
+        hm_insert(&g_data.db, &ent->node);
+        changed = true;
+    }
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        changed |= hll_add(ent->val, cmd[i].data(), cmd[i].size());
+    }
+    return out_int(out, changed ? 1 : 0);
+}
+
+// the union of the hyperloglogs in cmd[start:], unpacked to a byte per register
+static bool hll_union(
+    std::string &out, std::vector<std::string> &cmd, size_t start, uint8_t *regs)
+{
+    memset(regs, 0, k_hll_regs);
+    for (size_t i = start; i < cmd.size(); ++i) {
+        Entry *ent = NULL;
+        if (!find_hll(out, cmd[i], &ent)) {
+            return false;
+        }
+        if (ent) {
+            hll_merge(regs, ent->val);
+        }
+    }
+    return true;
+}
+
+// pfcount key [key ...], the estimate of the union.
+// a single key is answered from its cached estimate.
+static void do_pfcount(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd.size() == 2) {
+        Entry *ent = NULL;
+        if (!find_hll(out, cmd[1], &ent)) {
+            return;
+        }
+        return out_int(out, ent ? (int64_t)hll_count(ent->val) : 0);
+    }
+    uint8_t regs[k_hll_regs];
+    if (!hll_union(out, cmd, 1, regs)) {
+        return;
+    }
+    return out_int(out, (int64_t)hll_count_regs(regs));
+}
+
+// pfmerge dest [key ...], dest becomes the union of itself and the keys
+static void do_pfmerge(std::vector<std::string> &cmd, std::string &out) {
+    std::string name = cmd[1];
+    uint8_t regs[k_hll_regs];
+    if (!hll_union(out, cmd, 1, regs)) {
+        return;
+    }
+    Entry key;
+    key.key.swap(name);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (!ent) {
+        ent = new Entry();
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        hm_insert(&g_data.db, &ent->node);
+    }
+    hll_store(ent->val, regs);
+    return out_nil(out);
+}
+
+static void do_expire(std::vector<std::string> &cmd, std::string &out){
+	int64_t ttl_ms =0;
+	if (!str2int(cmd[2], ttl_ms)) {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key);
+    if (node) {
+        Entry *ent = container_of(node, Entry, node);
+        entry_set_ttl(ent, ttl_ms);
+    }
+    return out_int(out, node ? 1: 0);
+}
+
+// pexpireat key unix_ms
+static void do_expireat(std::vector<std::string> &cmd, std::string &out) {
+    int64_t at_ms = 0;
+    if (!str2int(cmd[2], at_ms) || at_ms > k_max_expire_ms) {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key);
+    if (node) {
+        entry_set_expire(container_of(node, Entry, node), unix_ms_to_deadline(at_ms));
+    }
+    return out_int(out, node ? 1 : 0);
+}
+
+// persist key
+static void do_persist(std::vector<std::string> &cmd, std::string &out) {
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key);
+    if (!node) {
+        return out_int(out, 0);
+    }
+    Entry *ent = container_of(node, Entry, node);
+    bool had_ttl = ent->heap_idx != (size_t)-1;
+    entry_set_ttl(ent, -1);
+    return out_int(out, had_ttl ? 1 : 0);
+}
+
+static void do_ttl(std::vector<std::string> &cmd, std::string &out) {
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key);
+    if (!node) {
+        return out_int(out, -2);
+    }
+
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->heap_idx == (size_t)-1) {
+        return out_int(out, -1);
+    }
+
+    uint64_t expire_at = g_data.heap.a[ent->heap_idx].val;
+    uint64_t now_us = get_monotonic_usec();
+    return out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0);
+}
+
+static void do_del(std::vector<std::string> &cmd, std::string &out) {
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    Entry *ent = db_pop(&key);
+    if (ent) {
+        entry_del(ent);
+    }
+    return out_int(out, ent ? 1 : 0);
+}
+
+struct ScanCtx {
+    std::string *out = NULL;
+    uint64_t now_us = 0;
+    uint32_t n = 0;
+};
+
+// expired keys are skipped, the timers will delete them
+static void cb_scan(HNode *node, void *arg) {
+    ScanCtx *ctx = (ScanCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (!entry_expired(ent, ctx->now_us)) {
+        out_str(*ctx->out, ent->key);
+        ctx->n++;
+    }
+}
+
+static void do_keys(std::vector<std::string>&cmd, std::string &out){
+	(void)cmd;
+    ScanCtx ctx;
+    ctx.out = &out;
+    ctx.now_us = get_monotonic_usec();
+    void *arr = begin_arr(out);
+    hm_foreach(&g_data.db, &cb_scan, &ctx);
+    end_arr(out, arr, ctx.n);
+}
+
+// zadd zset [NX|XX] [GT|LT] [CH] [INCR] score name [score name ...]
+static void do_zadd(std::vector<std::string> &cmd, std::string &out) {
+    // parse the flags
+    uint32_t flags = 0;
+    bool ch = false;
+    size_t pos = 2;
+    for (; pos < cmd.size(); ++pos) {
+        const std::string &word = cmd[pos];
+        if (0 == strcasecmp(word.c_str(), "nx")) {
+            flags |= ZADD_NX;
+        } else if (0 == strcasecmp(word.c_str(), "xx")) {
+            flags |= ZADD_XX;
+        } else if (0 == strcasecmp(word.c_str(), "gt")) {
+            flags |= ZADD_GT;
+        } else if (0 == strcasecmp(word.c_str(), "lt")) {
+            flags |= ZADD_LT;
+        } else if (0 == strcasecmp(word.c_str(), "incr")) {
+            flags |= ZADD_INCR;
+        } else if (0 == strcasecmp(word.c_str(), "ch")) {
+            ch = true;
+        } else {
+            break;
+        }
+    }
+    if ((flags & ZADD_NX) && (flags & (ZADD_XX | ZADD_GT | ZADD_LT))) {
+        return out_err(out, ERR_ARG, "NX is not compatible with XX, GT or LT");
+    }
+    if ((flags & ZADD_GT) && (flags & ZADD_LT)) {
+        return out_err(out, ERR_ARG, "GT and LT are not compatible");
+    }
+    size_t npairs = (cmd.size() - pos) / 2;
+    if (npairs == 0 || (cmd.size() - pos) % 2 != 0) {
+        return out_err(out, ERR_ARG, "expect score name pairs");
+    }
+    if ((flags & ZADD_INCR) && npairs != 1) {
+        return out_err(out, ERR_ARG, "INCR expects a single pair");
+    }
+
+    // parse all scores before making any change
+    std::vector<ZItem> items(npairs);
+    for (size_t i = 0; i < npairs; ++i) {
+        const std::string &name = cmd[pos + 2 * i + 1];
+        if (!str2dbl(cmd[pos + 2 * i], items[i].score)) {
+            return out_err(out, ERR_ARG, "expect fp number");
+        }
+        items[i].name = name.data();
+        items[i].len = name.size();
+    }
+
+    // look up or create the zset
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+
+    Entry *ent = NULL;
+    if (!hnode) {
+        if (flags & ZADD_XX) {
+            return (flags & ZADD_INCR) ? out_nil(out) : out_int(out, 0);
+        }
+        ent = new Entry();
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        ent->type = T_ZSET;
+        ent->zset = new ZSet();
+        hm_insert(&g_data.db, &ent->node);
+    } else {
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_ZSET) {
+            return out_err(out, ERR_TYPE, "expect zset");
+        }
+    }
+
+    // add or update the tuples
+    if (flags & ZADD_INCR) {
+        double score = items[0].score;
+        int rv = zset_upsert(ent->zset, items[0].name, items[0].len, &score, flags);
+        if (rv == ZADD_NAN) {
+            return out_err(out, ERR_ARG, "resulting score is not a number");
+        }
+        return rv == ZADD_SKIPPED ? out_nil(out) : out_dbl(out, score);
+    }
+    size_t updated = 0;
+    size_t added = zset_add_batch(ent->zset, items.data(), npairs, flags, &updated);
+    return out_int(out, (int64_t)(ch ? added + updated : added));
+}
+
+static bool expect_zset(std::string &out, std::string &s, Entry **ent) {
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    if (!hnode) {
+        out_nil(out);
+        return false;
+    }
+
+    *ent = container_of(hnode, Entry, node);
+    if ((*ent)->type != T_ZSET) {
+        out_err(out, ERR_TYPE, "expect zset");
+        return false;
+    }
+    return true;
+}
+
+// a sorted set left empty is deleted
+static void zset_check_empty(Entry *ent) {
+    if (zset_size(ent->zset) == 0) {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+}
+
+// zrem zset name
+static void do_zrem(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        return;
+    }
+
+    const std::string &name = cmd[2];
+    bool deleted = zset_del(ent->zset, name.data(), name.size());
+    zset_check_empty(ent);
+    return out_int(out, deleted ? 1 : 0);
+}
+
+// a score bound, prefixed with "(" to be exclusive
+static bool str2bound(const std::string &s, double &out, bool &inclusive) {
+    inclusive = s.empty() || s[0] != '(';
+    return str2dbl(inclusive ? s : s.substr(1), out);
+}
+
+// zremrangebyscore zset min max
+static void do_zremrangebyscore(std::vector<std::string> &cmd, std::string &out) {
+    double min = 0, max = 0;
+    bool min_inc = true, max_inc = true;
+    if (!str2bound(cmd[2], min, min_inc) || !str2bound(cmd[3], max, max_inc)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        if (out[0] == SER_NIL) {
+            out.clear();
+            out_int(out, 0);
+        }
+        return;
+    }
+    // the bounds are located by rank, then removed as one range
+    size_t start = zset_rank_score(ent->zset, min, !min_inc);
+    size_t stop = zset_rank_score(ent->zset, max, max_inc);
+    size_t n = zset_del_range(ent->zset, start, stop);
+    zset_check_empty(ent);
+    return out_int(out, (int64_t)n);
+}
+
+// zremrangebyrank zset start stop
+static void do_zremrangebyrank(std::vector<std::string> &cmd, std::string &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        if (out[0] == SER_NIL) {
+            out.clear();
+            out_int(out, 0);
+        }
+        return;
+    }
+    // inclusive, negative ranks count from the end
+    int64_t size = (int64_t)zset_size(ent->zset);
+    if (start < 0) {
+        start = std::max(start + size, (int64_t)0);
+    }
+    if (stop < 0) {
+        stop += size;
+    }
+    if (start > stop || start >= size) {
+        return out_int(out, 0);
+    }
+    size_t n = zset_del_range(ent->zset, (size_t)start, (size_t)stop + 1);
+    zset_check_empty(ent);
+    return out_int(out, (int64_t)n);
+}
+
+// zscore zset name
+static void do_zscore(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        return;
+    }
+
+    const std::string &name = cmd[2];
+    double score = 0;
+    bool found = zset_lookup(ent->zset, name.data(), name.size(), &score);
+    return found ? out_dbl(out, score) : out_nil(out);
+}
+
+// zquery zset score name offset limit
+static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
+    // parse args
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    const std::string &name = cmd[3];
+    int64_t offset = 0;
+    int64_t limit = 0;
+    if (!str2int(cmd[4], offset)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    if (!str2int(cmd[5], limit)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+
+    // get the zset
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        if (out[0] == SER_NIL) {
+            out.clear();
+            out_arr(out, 0);
+        }
+        return;
+    }
+
+    // look up the tuple
+    if (limit <= 0) {
+        return out_arr(out, 0);
+    }
+    ZIter iter = zset_query(ent->zset, score, name.data(), name.size());
+    ziter_offset(&iter, offset);
+
+    // output
+    void *arr = begin_arr(out);
+    uint32_t n = 0;
+    while (iter.name && (int64_t)n < limit) {
+        out_str(out, iter.name, iter.len);
+        out_dbl(out, iter.score);
+        ziter_offset(&iter, +1);
+        n += 2;
+    }
+    end_arr(out, arr, n);
+}
+
+// zunionstore dst numkeys key [key ...] [WEIGHTS weight ...] [AGGREGATE SUM|MIN|MAX]
+// zinterstore dst numkeys key [key ...] [WEIGHTS weight ...] [AGGREGATE SUM|MIN|MAX]
+// zdiffstore dst numkeys key [key ...]
+static void do_zstore(std::vector<std::string> &cmd, std::string &out, uint32_t op) {
+    int64_t nkeys = 0;
+    if (!str2int(cmd[2], nkeys) || nkeys < 1) {
+        return out_err(out, ERR_ARG, "expect positive int");
+    }
+    if ((size_t)nkeys > cmd.size() - 3) {
+        return out_err(out, ERR_ARG, "not enough keys");
+    }
+
+    // parse the options
+    std::vector<double> weights(nkeys, 1);
+    uint32_t agg = ZAGG_SUM;
+    for (size_t pos = 3 + nkeys; pos < cmd.size();) {
+        const char *word = cmd[pos].c_str();
+        if (op != ZOP_DIFF && 0 == strcasecmp(word, "weights")
+            && pos + nkeys < cmd.size())
+        {
+            for (int64_t i = 0; i < nkeys; ++i) {
+                if (!str2dbl(cmd[pos + 1 + i], weights[i])) {
+                    return out_err(out, ERR_ARG, "expect fp number");
+                }
+            }
+            pos += 1 + nkeys;
+        } else if (op != ZOP_DIFF && 0 == strcasecmp(word, "aggregate")
+            && pos + 1 < cmd.size())
+        {
+            const char *mode = cmd[pos + 1].c_str();
+            if (0 == strcasecmp(mode, "sum")) {
+                agg = ZAGG_SUM;
+            } else if (0 == strcasecmp(mode, "min")) {
+                agg = ZAGG_MIN;
+            } else if (0 == strcasecmp(mode, "max")) {
+                agg = ZAGG_MAX;
+            } else {
+                return out_err(out, ERR_ARG, "expect SUM, MIN or MAX");
+            }
+            pos += 2;
+        } else {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+    }
+
+    // get the inputs, missing keys are empty sets
+    std::vector<ZSet *> srcs(nkeys);
+    std::vector<size_t> first = first_keys(cmd, 3, 3 + nkeys);
+    for (int64_t i = 0; i < nkeys; ++i) {
+        if (first[i] != 3 + (size_t)i) {
+            srcs[i] = srcs[first[i] - 3];
+            continue;
+        }
+        Entry key;
+        key.key = cmd[3 + i];
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        HNode *hnode = db_lookup(&key);
+        if (!hnode) {
+            continue;
+        }
+        Entry *ent = container_of(hnode, Entry, node);
+        if (ent->type != T_ZSET) {
+            return out_err(out, ERR_TYPE, "expect zset");
+        }
+        srcs[i] = ent->zset;
+    }
+
+    ZSet *zset = new ZSet();
+    zset_combine(zset, op, srcs.data(), weights.data(), srcs.size(), agg);
+    size_t size = zset_size(zset);
+
+    // replace the destination, which may also be an input
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = hm_pop(&g_data.db, &key.node, &entry_eq);
+    if (hnode) {
+        entry_del(container_of(hnode, Entry, node));
+    }
+    if (size == 0) {
+        zset_dispose(zset);
+        delete zset;
+    } else {
+        Entry *ent = new Entry();
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        ent->type = T_ZSET;
+        ent->zset = zset;
+        hm_insert(&g_data.db, &ent->node);
+    }
+    return out_int(out, (int64_t)size);
+}
+
+// hashes. a small hash is a packed array of pairs, converted to a
+// hashtable of fields past the limits of `g_hash_conf`.
+
+// look up a hash, `*hash` is NULL if the key is missing.
+// returns false on a type error.
+static bool find_hash(std::string &out, std::string &s, Hash **hash) {
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    *hash = NULL;
+    if (!hnode) {
+        return true;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    if (ent->type != T_HASH) {
+        out_err(out, ERR_TYPE, "expect hash");
+        return false;
+    }
+    *hash = ent->hash;
+    return true;
+}
+
+// look up or create a hash, NULL on a type error
+static Entry *hash_entry(std::string &s, std::string &out) {
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    if (hnode) {
+        Entry *ent = container_of(hnode, Entry, node);
+        if (ent->type != T_HASH) {
+            out_err(out, ERR_TYPE, "expect hash");
+            return NULL;
+        }
+        return ent;
+    }
+    Entry *ent = new Entry();
+    ent->key.swap(key.key);
+    ent->node.hcode = key.node.hcode;
+    ent->type = T_HASH;
+    ent->hash = new Hash();
+    hm_insert(&g_data.db, &ent->node);
+    return ent;
+}
+
+// hset key field value [field value ...], replies with the number of new fields
+static void do_hset(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_ARG, "expect field value pairs");
+    }
+    Entry *ent = hash_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        const std::string &field = cmd[i];
+        const std::string &val = cmd[i + 1];
+        added += hash_set(ent->hash, field.data(), field.size(), val.data(), val.size());
+    }
+    return out_int(out, added);
+}
+
+// hget key field
+static void do_hget(std::vector<std::string> &cmd, std::string &out) {
+    Hash *hash = NULL;
+    if (!find_hash(out, cmd[1], &hash)) {
+        return;
+    }
+    const char *val = NULL;
+    size_t vlen = 0;
+    if (!hash || !hash_get(hash, cmd[2].data(), cmd[2].size(), &val, &vlen)) {
+        return out_nil(out);
+    }
+    return out_str(out, val, vlen);
+}
+
+// hmget key field [field ...], nil for the missing fields
+static void do_hmget(std::vector<std::string> &cmd, std::string &out) {
+    Hash *hash = NULL;
+    if (!find_hash(out, cmd[1], &hash)) {
+        return;
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        const char *val = NULL;
+        size_t vlen = 0;
+        if (hash && hash_get(hash, cmd[i].data(), cmd[i].size(), &val, &vlen)) {
+            out_str(out, val, vlen);
+        } else {
+            out_nil(out);
+        }
+    }
+}
+
+// hdel key field [field ...], an empty hash is deleted
+static void do_hdel(std::vector<std::string> &cmd, std::string &out) {
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    if (!hnode) {
+        return out_int(out, 0);
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    if (ent->type != T_HASH) {
+        return out_err(out, ERR_TYPE, "expect hash");
+    }
+    int64_t n = 0;
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        n += hash_del(ent->hash, cmd[i].data(), cmd[i].size());
+    }
+    if (hash_size(ent->hash) == 0) {
+        hm_pop(&g_data.db, hnode, &hnode_same);
+        entry_del(ent);
+    }
+    return out_int(out, n);
+}
+
+// hincrby key field n
+static void do_hincrby(std::vector<std::string> &cmd, std::string &out) {
+    int64_t delta = 0;
+    if (!str2int(cmd[3], delta)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = hash_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    const std::string &field = cmd[2];
+    int64_t val = 0;
+    const char *old = NULL;
+    size_t olen = 0;
+    if (hash_get(ent->hash, field.data(), field.size(), &old, &olen)
+        && !str2int(std::string(old, olen), val))
+    {
+        return out_err(out, ERR_TYPE, "the value is not an integer");
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    std::string str = std::to_string(val);
+    hash_set(ent->hash, field.data(), field.size(), str.data(), str.size());
+    return out_int(out, val);
+}
+
+struct HashOutCtx {
+    std::string *out = NULL;
+    uint32_t n = 0;
+};
+
+static void cb_hash_out(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    HashOutCtx *ctx = (HashOutCtx *)arg;
+    out_str(*ctx->out, field, flen);
+    out_str(*ctx->out, val, vlen);
+    ctx->n += 2;
+}
+
+// hgetall key, replies with field value pairs
+static void do_hgetall(std::vector<std::string> &cmd, std::string &out) {
+    Hash *hash = NULL;
+    if (!find_hash(out, cmd[1], &hash)) {
+        return;
+    }
+    HashOutCtx ctx;
+    ctx.out = &out;
+    void *arr = begin_arr(out);
+    if (hash) {
+        hash_foreach(hash, &cb_hash_out, &ctx);
+    }
+    end_arr(out, arr, ctx.n);
+}
+
+// hscan key cursor [COUNT n], replies with [next cursor, [field value ...]].
+// the cursor is 0 when the scan is complete.
+static void do_hscan(std::vector<std::string> &cmd, std::string &out) {
+    int64_t cursor = 0;
+    int64_t count = 10;
+    if (!str2int(cmd[2], cursor)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    if (cmd.size() == 4 || (cmd.size() == 5 && (0 != strcasecmp(cmd[3].c_str(), "count")
+        || !str2int(cmd[4], count) || count < 1)))
+    {
+        return out_err(out, ERR_ARG, "expect COUNT n");
+    }
+    Hash *hash = NULL;
+    if (!find_hash(out, cmd[1], &hash)) {
+        return;
+    }
+    std::string items;
+    HashOutCtx ctx;
+    ctx.out = &items;
+    uint64_t next = 0;
+    if (hash) {
+        next = hash_scan(hash, (uint64_t)cursor, (size_t)count, &cb_hash_out, &ctx);
+    }
+    out_arr(out, 2);
+    out_str(out, std::to_string(next));
+    out_arr(out, ctx.n);
+    out.append(items);
+}
+
+// lists. elements are packed into chunks, see qlist.h.
+
+// look up a list, `*ent` is NULL if the key is missing.
+// returns false on a type error.
+static bool find_list(std::string &out, std::string &s, Entry **ent) {
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    *ent = NULL;
+    if (!hnode) {
+        return true;
+    }
+    Entry *found = container_of(hnode, Entry, node);
+    if (found->type != T_LIST) {
+        out_err(out, ERR_TYPE, "expect list");
+        return false;
+    }
+    *ent = found;
+    return true;
+}
+
+// a list left empty is deleted
+static void list_check_empty(Entry *ent) {
+    if (ent->list->size == 0) {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+}
+
+// lpush key value [value ...], rpush key value [value ...]
+// replies with the new length
+static void do_push(std::vector<std::string> &cmd, std::string &out, bool front) {
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    Entry *ent = NULL;
+    if (hnode) {
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_LIST) {
+            return out_err(out, ERR_TYPE, "expect list");
+        }
+    } else {
+        ent = new Entry();
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        ent->type = T_LIST;
+        ent->list = new QList();
+        qlist_init(ent->list);
+        hm_insert(&g_data.db, &ent->node);
+    }
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        qlist_push(ent->list, cmd[i].data(), cmd[i].size(), front);
+    }
+    return out_int(out, (int64_t)ent->list->size);
+}
+
+// lpop key [count], rpop key [count]
+// replies with an element, or an array of them if the count is given
+static void do_pop(std::vector<std::string> &cmd, std::string &out, bool front) {
+    int64_t count = 1;
+    if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)) {
+        return out_err(out, ERR_ARG, "expect non-negative int");
+    }
+    Entry *ent = NULL;
+    if (!find_list(out, cmd[1], &ent)) {
+        return;
+    }
+    if (!ent) {
+        return out_nil(out);
+    }
+    std::string val;
+    if (cmd.size() == 2) {
+        qlist_pop(ent->list, val, front);
+        out_str(out, val);
+    } else {
+        void *arr = begin_arr(out);
+        uint32_t n = 0;
+        for (; n < count && qlist_pop(ent->list, val, front); ++n) {
+            out_str(out, val);
+        }
+        end_arr(out, arr, n);
+    }
+    list_check_empty(ent);
+}
+
+// an inclusive range with negative indexes counting from the back,
+// converted to [lo, hi)
+static void list_range(
+    size_t size, int64_t start, int64_t stop, size_t &lo, size_t &hi)
+{
+    int64_t n = (int64_t)size;
+    start = start < 0 ? std::max<int64_t>(start + n, 0) : start;
+    stop = stop < 0 ? stop + n : std::min(stop, n - 1);
+    if (start > stop) {
+        lo = hi = 0;
+    } else {
+        lo = (size_t)start;
+        hi = (size_t)stop + 1;
+    }
+}
+
+// lrange key start stop
+static void do_lrange(std::vector<std::string> &cmd, std::string &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!find_list(out, cmd[1], &ent)) {
+        return;
+    }
+    size_t lo = 0, hi = 0;
+    if (ent) {
+        list_range(ent->list->size, start, stop, lo, hi);
+    }
+    out_arr(out, (uint32_t)(hi - lo));
+    if (hi == lo) {
+        return;
+    }
+    QIter iter = qlist_at(ent->list, lo);
+    for (size_t i = lo; i < hi; ++i) {
+        out_str(out, iter.data, iter.len);
+        qiter_next(ent->list, &iter);
+    }
+}
+
+// ltrim key start stop
+static void do_ltrim(std::vector<std::string> &cmd, std::string &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!find_list(out, cmd[1], &ent)) {
+        return;
+    }
+    if (ent) {
+        size_t lo = 0, hi = 0;
+        list_range(ent->list->size, start, stop, lo, hi);
+        qlist_trim(ent->list, lo, hi);
+        list_check_empty(ent);
+    }
+    return out_nil(out);
+}
+
+// llen key
+static void do_llen(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = NULL;
+    if (!find_list(out, cmd[1], &ent)) {
+        return;
+    }
+    return out_int(out, ent ? (int64_t)ent->list->size : 0);
+}
+
+// lindex key index
+static void do_lindex(std::vector<std::string> &cmd, std::string &out) {
+    int64_t idx = 0;
+    if (!str2int(cmd[2], idx)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!find_list(out, cmd[1], &ent)) {
+        return;
+    }
+    if (!ent) {
+        return out_nil(out);
+    }
+    idx = idx < 0 ? idx + (int64_t)ent->list->size : idx;
+    QIter iter = qlist_at(ent->list, idx < 0 ? SIZE_MAX : (size_t)idx);
+    return iter.data ? out_str(out, iter.data, iter.len) : out_nil(out);
+}
+
+// sets. integer sets are sorted arrays, other sets are hashtables.
+
+// look up a set, `*ent` is NULL if the key is missing.
+// returns false on a type error.
+static bool find_set(std::string &out, std::string &s, Entry **ent) {
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    *ent = NULL;
+    if (!hnode) {
+        return true;
+    }
+    Entry *found = container_of(hnode, Entry, node);
+    if (found->type != T_SET) {
+        out_err(out, ERR_TYPE, "expect set");
+        return false;
+    }
+    *ent = found;
+    return true;
+}
+
+// the sets of cmd[start:end], missing keys are NULL
+static bool find_sets(
+    std::string &out, std::vector<std::string> &cmd, size_t start, size_t end,
+    std::vector<Set *> &sets)
+{
+    std::vector<size_t> first = first_keys(cmd, start, end);
+    size_t base = sets.size();
+    for (size_t i = start; i < end; ++i) {
+        if (first[i - start] != i) {
+            sets.push_back(sets[base + first[i - start] - start]);
+            continue;
+        }
+        Entry *ent = NULL;
+        if (!find_set(out, cmd[i], &ent)) {
+            return false;
+        }
+        sets.push_back(ent ? ent->set : NULL);
+    }
+    return true;
+}
+
+// sadd key member [member ...], replies with the number of new members
+static void do_sadd(std::vector<std::string> &cmd, std::string &out) {
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key);
+    Entry *ent = NULL;
+    if (hnode) {
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_SET) {
+            return out_err(out, ERR_TYPE, "expect set");
+        }
+    } else {
+        ent = new Entry();
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        ent->type = T_SET;
+        ent->set = new Set();
+        hm_insert(&g_data.db, &ent->node);
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        added += set_add(ent->set, cmd[i].data(), cmd[i].size());
+    }
+    return out_int(out, added);
+}
+
+// srem key member [member ...], an empty set is deleted
+static void do_srem(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = NULL;
+    if (!find_set(out, cmd[1], &ent)) {
+        return;
+    }
+    int64_t n = 0;
+    for (size_t i = 2; ent && i < cmd.size(); ++i) {
+        n += set_del(ent->set, cmd[i].data(), cmd[i].size());
+    }
+    if (ent && set_size(ent->set) == 0) {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+    return out_int(out, n);
+}
+
+// sismember key member
+static void do_sismember(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = NULL;
+    if (!find_set(out, cmd[1], &ent)) {
+        return;
+    }
+    bool found = ent && set_has(ent->set, cmd[2].data(), cmd[2].size());
+    return out_int(out, found ? 1 : 0);
+}
+
+// scard key
+static void do_scard(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = NULL;
+    if (!find_set(out, cmd[1], &ent)) {
+        return;
+    }
+    return out_int(out, ent ? (int64_t)set_size(ent->set) : 0);
+}
+
+struct SetOutCtx {
+    std::string *out = NULL;
+    uint32_t n = 0;
+};
+
+static void cb_set_out(const char *data, size_t len, void *arg) {
+    SetOutCtx *ctx = (SetOutCtx *)arg;
+    out_str(*ctx->out, data, len);
+    ctx->n++;
+}
+
+// smembers key
+static void do_smembers(std::vector<std::string> &cmd, std::string &out) {
+    Entry *ent = NULL;
+    if (!find_set(out, cmd[1], &ent)) {
+        return;
+    }
+    SetOutCtx ctx;
+    ctx.out = &out;
+    void *arr = begin_arr(out);
+    if (ent) {
+        set_foreach(ent->set, &cb_set_out, &ctx);
+    }
+    end_arr(out, arr, ctx.n);
+}
+
+// sinter key [key ...], a missing key is an empty set
+static void do_sinter(std::vector<std::string> &cmd, std::string &out) {
+    std::vector<Set *> sets;
+    if (!find_sets(out, cmd, 1, cmd.size(), sets)) {
+        return;
+    }
+    SetOutCtx ctx;
+    ctx.out = &out;
+    void *arr = begin_arr(out);
+    if (std::find(sets.begin(), sets.end(), (Set *)NULL) == sets.end()) {
+        set_inter(sets.data(), sets.size(), 0, &cb_set_out, &ctx);
+    }
+    end_arr(out, arr, ctx.n);
+}
+
+// sintercard numkeys key [key ...] [LIMIT limit]
+static void do_sintercard(std::vector<std::string> &cmd, std::string &out) {
+    int64_t nkeys = 0;
+    if (!str2int(cmd[1], nkeys) || nkeys < 1) {
+        return out_err(out, ERR_ARG, "expect positive int");
+    }
+    if ((size_t)nkeys > cmd.size() - 2) {
+        return out_err(out, ERR_ARG, "not enough keys");
+    }
+    int64_t limit = 0;
+    size_t pos = 2 + (size_t)nkeys;
+    if (pos != cmd.size() && (pos + 2 != cmd.size()
+        || 0 != strcasecmp(cmd[pos].c_str(), "limit")
+        || !str2int(cmd[pos + 1], limit) || limit < 0))
+    {
+        return out_err(out, ERR_ARG, "expect LIMIT limit");
+    }
+    std::vector<Set *> sets;
+    if (!find_sets(out, cmd, 2, pos, sets)) {
+        return;
+    }
+    if (std::find(sets.begin(), sets.end(), (Set *)NULL) != sets.end()) {
+        return out_int(out, 0);
+    }
+    size_t n = set_inter(sets.data(), sets.size(), (size_t)limit, NULL, NULL);
+    return out_int(out, (int64_t)n);
+}
+
+static void cb_set_add(const char *data, size_t len, void *arg) {
+    set_add((Set *)arg, data, len);
+}
+
+// sunion key [key ...]
+static void do_sunion(std::vector<std::string> &cmd, std::string &out) {
+    std::vector<Set *> sets;
+    if (!find_sets(out, cmd, 1, cmd.size(), sets)) {
+        return;
+    }
+    Set merged;
+    for (Set *set : sets) {
+        if (set) {
+            set_foreach(set, &cb_set_add, &merged);
+        }
+    }
+    SetOutCtx ctx;
+    ctx.out = &out;
+    void *arr = begin_arr(out);
+    set_foreach(&merged, &cb_set_out, &ctx);
+    end_arr(out, arr, ctx.n);
+    set_dispose(&merged);
+}
+
+struct DiffCtx {
+    Set *const *rest = NULL;
+    size_t nrest = 0;
+    SetOutCtx out;
+};
+
+static void cb_diff(const char *data, size_t len, void *arg) {
+    DiffCtx *ctx = (DiffCtx *)arg;
+    for (size_t i = 0; i < ctx->nrest; ++i) {
+        if (ctx->rest[i] && set_has(ctx->rest[i], data, len)) {
+            return;
+        }
+    }
+    cb_set_out(data, len, &ctx->out);
+}
+
+// sdiff key [key ...], the members of the first set not in the others
+static void do_sdiff(std::vector<std::string> &cmd, std::string &out) {
+    std::vector<Set *> sets;
+    if (!find_sets(out, cmd, 1, cmd.size(), sets)) {
+        return;
+    }
+    DiffCtx ctx;
+    ctx.rest = sets.data() + 1;
+    ctx.nrest = sets.size() - 1;
+    ctx.out.out = &out;
+    void *arr = begin_arr(out);
+    if (sets[0]) {
+        set_foreach(sets[0], &cb_diff, &ctx);
+    }
+    end_arr(out, arr, ctx.out.n);
+}
+
+struct SaveCtx {
+    SnapWriter *w = NULL;
+    uint64_t now_us = 0;
+    int64_t now_ms = 0;
+};
+
+static void cb_save_field(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    SnapWriter *w = (SnapWriter *)arg;
+    snap_put_str(w, field, flen);
+    snap_put_str(w, val, vlen);
+}
+
+static void cb_save_member(const char *data, size_t len, void *arg) {
+    snap_put_str((SnapWriter *)arg, data, len);
+}
+
+static void cb_save(HNode *node, void *arg) {
+    SaveCtx *ctx = (SaveCtx *)arg;
+    SnapWriter *w = ctx->w;
+    Entry *ent = container_of(node, Entry, node);
+    // the remaining TTL is stored as an absolute unix time
+    uint64_t deadline_ms = 0;
+    if (ent->heap_idx != (size_t)-1) {
+        uint64_t expire_at = g_data.heap.a[ent->heap_idx].val;
+        if (expire_at <= ctx->now_us) {
+            return;
+        }
+        deadline_ms = (uint64_t)ctx->now_ms + (expire_at - ctx->now_us) / 1000;
+    }
+
+    static const uint8_t k_snap_types[] = {SNAP_STR, SNAP_ZSET, SNAP_HASH, SNAP_LIST, SNAP_SET};
+    snap_put_u8(w, k_snap_types[ent->type]);
+    snap_put_varint(w, deadline_ms);
+    snap_put_str(w, ent->key.data(), ent->key.size());
+    if (ent->type == T_HASH) {
+        snap_put_varint(w, hash_size(ent->hash));
+        hash_foreach(ent->hash, &cb_save_field, w);
+    } else if (ent->type == T_SET) {
+        snap_put_varint(w, set_size(ent->set));
+        set_foreach(ent->set, &cb_save_member, w);
+    } else if (ent->type == T_LIST) {
+        snap_put_varint(w, ent->list->size);
+        QIter iter = qlist_at(ent->list, 0);
+        for (; iter.data; qiter_next(ent->list, &iter)) {
+            snap_put_str(w, iter.data, iter.len);
+        }
+    } else if (ent->type == T_ZSET) {
+        snap_put_varint(w, zset_size(ent->zset));
+        ZIter iter = zset_query(ent->zset, -INFINITY, "", 0);
+        for (; iter.name; ziter_offset(&iter, +1)) {
+            snap_put_dbl(w, iter.score);
+            snap_put_str(w, iter.name, iter.len);
+        }
+    } else {
+        std::string val = entry_str(ent);
+        snap_put_str(w, val.data(), val.size());
+    }
+    snap_end_key(w);
+}
+
+// write the keyspace to a temporary file, then rename it to `path`
+static bool db_save(const char *path, uint64_t *nkeys) {
+    std::string tmp = std::string(path) + ".tmp." + std::to_string(getpid());
+    SnapWriter w;
+    if (!snap_open(&w, tmp.c_str())) {
+        return false;
+    }
+    SaveCtx ctx;
+    ctx.w = &w;
+    ctx.now_us = get_monotonic_usec();
+    ctx.now_ms = get_realtime_msec();
+    hm_foreach(&g_data.db, &cb_save, &ctx);
+    if (!snap_close(&w) || 0 != rename(tmp.c_str(), path)) {
+        (void)unlink(tmp.c_str());
+        return false;
+    }
+    *nkeys = w.nkeys;
+    return true;
+}
+
+// decode a key without touching any global state, NULL on corruption
+static Entry *load_entry(SnapReader *r, uint64_t *deadline_ms) {
+    uint8_t type = snap_get_u8(r);
+    *deadline_ms = snap_get_varint(r);
+    size_t klen = 0;
+    const char *kdata = snap_get_str(r, &klen);
+    if (r->failed || type > SNAP_SET) {
+        return NULL;
+    }
+
+    Entry *ent = new Entry();
+    ent->key.assign(kdata, klen);
+    ent->node.hcode = str_hash((uint8_t *)kdata, klen);
+    if (type == SNAP_STR) {
+        size_t vlen = 0;
+        const char *vdata = snap_get_str(r, &vlen);
+        ent->val.assign(vdata ? vdata : "", vlen);
+    } else if (type == SNAP_SET) {
+        ent->type = T_SET;
+        ent->set = new Set();
+        uint64_t n = snap_get_varint(r);
+        for (uint64_t i = 0; i < n && !r->failed; ++i) {
+            size_t len = 0;
+            const char *data = snap_get_str(r, &len);
+            if (!r->failed) {
+                set_add(ent->set, data, len);
+            }
+        }
+    } else if (type == SNAP_LIST) {
+        ent->type = T_LIST;
+        ent->list = new QList();
+        qlist_init(ent->list);
+        uint64_t n = snap_get_varint(r);
+        for (uint64_t i = 0; i < n && !r->failed; ++i) {
+            size_t len = 0;
+            const char *data = snap_get_str(r, &len);
+            if (!r->failed) {
+                qlist_push(ent->list, data, len, false);
+            }
+        }
+    } else if (type == SNAP_HASH) {
+        ent->type = T_HASH;
+        ent->hash = new Hash();
+        uint64_t n = snap_get_varint(r);
+        for (uint64_t i = 0; i < n && !r->failed; ++i) {
+            size_t flen = 0, vlen = 0;
+            const char *field = snap_get_str(r, &flen);
+            const char *val = snap_get_str(r, &vlen);
+            if (!r->failed) {
+                hash_set(ent->hash, field, flen, val, vlen);
+            }
+        }
+    } else {
+        ent->type = T_ZSET;
+        ent->zset = new ZSet();
+        uint64_t n = snap_get_varint(r);
+        if (n > (uint64_t)(r->end - r->cur) / 9) {
+            r->failed = true;   // at least 9 bytes per tuple
+            n = 0;
+        }
+        std::vector<ZItem> items(n);
+        for (uint64_t i = 0; i < n; ++i) {
+            items[i].score = snap_get_dbl(r);
+            items[i].name = snap_get_str(r, &items[i].len);
+        }
+        if (!r->failed) {
+            // already sorted, no tree insertions
+            zset_build(ent->zset, items.data(), items.size());
+        }
+    }
+    if (r->failed) {
+        entry_del(ent);
+        return NULL;
+    }
+    return ent;
+}
+
+struct LoadedKey {
+    Entry *ent = NULL;
+    uint64_t deadline_ms = 0;
+};
+
+// the result of decoding a section on a loader thread
+struct LoadedSection {
+    std::vector<LoadedKey> keys;
+    bool ok = false;
+};
+
+static void load_section(const SnapSection &sec, LoadedSection &out) {
+    if (!snap_verify(sec)) {
+        return;
+    }
+    SnapReader r;
+    r.cur = sec.data;
+    r.end = sec.data + sec.size;
+    out.keys.reserve(sec.nkeys);
+    for (uint64_t i = 0; i < sec.nkeys; ++i) {
+        LoadedKey key;
+        key.ent = load_entry(&r, &key.deadline_ms);
+        if (!key.ent) {
+            return;
+        }
+        out.keys.push_back(key);
+    }
+    out.ok = (r.cur == r.end);
+}
+
+// load a snapshot into the empty keyspace.
+// the file is mapped, the sections are decoded on multiple threads,
+// then the entries are inserted into a keyspace sized up front.
+static bool db_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st = {};
+    if (0 != fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    (void)madvise(data, size, MADV_WILLNEED);
+
+    uint64_t nkeys = 0;
+    std::vector<SnapSection> sections;
+    bool ok = snap_parse((const uint8_t *)data, size, &nkeys, sections);
+
+    // decode
+    std::vector<LoadedSection> loaded(sections.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < sections.size();) {
+            load_section(sections[i], loaded[i]);
+        }
+    };
+    size_t nthreads = std::min<size_t>(g_conf.load_threads, sections.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; ok && i < nthreads; ++i) {
+        threads.emplace_back(worker);
+    }
+    if (ok) {
+        worker();
+    }
+    for (std::thread &th : threads) {
+        th.join();
+    }
+    munmap(data, size);
+
+    // insert
+    for (const LoadedSection &sec : loaded) {
+        ok = ok && sec.ok;
+    }
+    if (ok) {
+        hm_reserve(&g_data.db, nkeys);
+    }
+    int64_t now_ms = get_realtime_msec();
+    for (LoadedSection &sec : loaded) {
+        for (LoadedKey &key : sec.keys) {
+            if (!ok || (key.deadline_ms && (int64_t)key.deadline_ms <= now_ms)) {
+                entry_del(key.ent);     // expired, or the snapshot is bad
+                continue;
+            }
+            hm_insert(&g_data.db, &key.ent->node);
+            if (key.deadline_ms) {
+                entry_set_expire(key.ent, unix_ms_to_deadline((int64_t)key.deadline_ms));
+            }
+        }
+    }
+    return ok;
+}
+
+// only one forked child at a time
+static bool child_running() {
+    return g_data.bgsave_pid > 0 || g_data.aofrw_pid > 0 || g_data.replsync_pid > 0;
+}
+
+// save
+static void do_save(std::vector<std::string> &cmd, std::string &out) {
+    (void)cmd;
+    if (g_data.bgsave_pid > 0) {
+        return out_err(out, ERR_IO, "a background save is in progress");
+    }
+    uint64_t nkeys = 0;
+    if (!db_save(g_conf.snapshot.c_str(), &nkeys)) {
+        return out_err(out, ERR_IO, "failed to save the snapshot");
+    }
+    return out_int(out, (int64_t)nkeys);
+}
+
+// bgsave: the forked child writes the memory as it was at the fork,
+// copy-on-write keeps it unchanged while the parent keeps serving.
+// replies with the pid of the child.
+static void do_bgsave(std::vector<std::string> &cmd, std::string &out) {
+    (void)cmd;
+    if (child_running()) {
+        return out_err(out, ERR_IO, "a background save or rewrite is in progress");
+    }
+    fflush(stdout);     // don't let the child duplicate buffered logs
+    uint64_t start_us = get_monotonic_usec();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return out_err(out, ERR_IO, "fork failed");
+    }
+    if (pid == 0) {
+        uint64_t nkeys = 0;
+        bool ok = db_save(g_conf.snapshot.c_str(), &nkeys);
+        uint64_t ms = (get_monotonic_usec() - start_us) / 1000;
+        msgf("bgsave: %s, %lu keys in %lu ms", ok ? "done" : "failed",
+            (unsigned long)nkeys, (unsigned long)ms);
+        _exit(ok ? 0 : 1);
+    }
+    msgf("bgsave: forked %d in %lu us",
+        (int)pid, (unsigned long)(get_monotonic_usec() - start_us));
+    g_data.bgsave_pid = pid;
+    return out_int(out, pid);
+}
+
+static bool cmd_is(const std::string &word, const char *cmd) {
+    return 0 == strcasecmp(word.c_str(), cmd);
+}
+
+// a command in the table `k_cmds`. the arity counts the name, `max_args`
+// 0 is no limit. keys are at [first_key, last_key] every `key_step`, a
+// negative `last_key` counts from the end. besides dispatch, the metadata
+// is for the AOF, the replication and the stats, and to route keys to shards.
+enum {
+    CMD_WRITE = 1 << 0,     // mutates the keyspace, logged and replicated
+    CMD_WRITE_OPTS = 1 << 1,    // a write if it has options (GETEX)
+    CMD_MOVABLE = 1 << 2,   // more keys, counted by an argument
+    CMD_TX = 1 << 3,        // handled by the connection: MULTI, EXEC, ...
+    CMD_PUBSUB = 1 << 4,    // handled by the connection: (P)(UN)SUBSCRIBE
+    CMD_REPL = 1 << 5,      // handled by the connection: PSYNC
+};
+
+typedef void (*cmd_fn)(std::vector<std::string> &cmd, std::string &out);
+
+struct CmdSpec {
+    const char *name;       // lowercase
+    cmd_fn fn;              // NULL if handled by the connection
+    uint32_t min_args;
+    uint32_t max_args;
+    uint32_t flags;
+    int32_t first_key;      // 0 if no keys
+    int32_t last_key;
+    int32_t key_step;
+};
+
+static bool cmd_arity_ok(const CmdSpec *spec, const std::vector<std::string> &cmd) {
+    return cmd.size() >= spec->min_args
+        && (spec->max_args == 0 || cmd.size() <= spec->max_args);
+}
+
+// the AOF. mutating commands are logged after they succeed, and their
+// replies are held until the log is written (group commit).
+
+static std::string deadline_str(int64_t now_ms, int64_t ttl_ms) {
+    return std::to_string(std::min(now_ms + ttl_ms, k_max_expire_ms));
+}
+
+// relative TTLs are logged as unix deadlines, so a replay doesn't extend them.
+// float increments are logged as their results, so a replay can't round differently.
+static void aof_absolute_ttl(std::vector<std::string> &cmd) {
+    int64_t now_ms = get_realtime_msec();
+    int64_t num = 0;
+    if (cmd_is(cmd[0], "incrbyfloat")) {
+        Entry key;
+        key.key = cmd[1];
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+        assert(node);
+        cmd = {"set", cmd[1], entry_str(container_of(node, Entry, node)), "keepttl"};
+        return;
+    }
+    if (cmd_is(cmd[0], "pexpire")) {
+        if (!str2int(cmd[2], num) || num < 0) {
+            cmd = {"persist", cmd[1]};
+        } else {
+            cmd[0] = "pexpireat";
+            cmd[2] = deadline_str(now_ms, std::min(num, k_max_expire_ms));
+        }
+        return;
+    }
+    // set key val [options], getex key [options]
+    if (!cmd_is(cmd[0], "set") && !cmd_is(cmd[0], "getex")) {
+        return;
+    }
+    size_t pos = cmd_is(cmd[0], "set") ? 3 : 2;
+    for (; pos + 1 < cmd.size(); ++pos) {
+        bool ex = cmd_is(cmd[pos], "ex");
+        if ((ex || cmd_is(cmd[pos], "px")) && str2int(cmd[pos + 1], num)) {
+            cmd[pos] = "pxat";
+            cmd[pos + 1] = deadline_str(now_ms, ex ? num * 1000 : num);
+        }
+    }
+}
+
+struct RewriteCtx {
+    int fd = -1;
+    std::string buf;
+    bool failed = false;
+    uint64_t now_us = 0;
+    int64_t now_ms = 0;
+};
+
+static void rewrite_out(RewriteCtx *ctx, const std::vector<std::string> &cmd) {
+    aof_encode(ctx->buf, cmd);
+    if (ctx->buf.size() >= (1 << 20) && !ctx->failed) {
+        ctx->failed = ctx->buf.size() != (size_t)write(ctx->fd, ctx->buf.data(), ctx->buf.size());
+        ctx->buf.clear();
+    }
+}
+
+const size_t k_rewrite_zadd_pairs = 256;
+const size_t k_rewrite_hset_pairs = 256;
+const size_t k_rewrite_rpush_values = 256;
+const size_t k_rewrite_sadd_members = 256;
+
+struct RewriteSetCtx {
+    RewriteCtx *ctx = NULL;
+    std::vector<std::string> cmd;   // sadd key member ...
+};
+
+static void cb_rewrite_member(const char *data, size_t len, void *arg) {
+    RewriteSetCtx *sctx = (RewriteSetCtx *)arg;
+    sctx->cmd.push_back(std::string(data, len));
+    if (sctx->cmd.size() == 2 + k_rewrite_sadd_members) {
+        rewrite_out(sctx->ctx, sctx->cmd);
+        sctx->cmd.resize(2);
+    }
+}
+
+struct RewriteHashCtx {
+    RewriteCtx *ctx = NULL;
+    std::vector<std::string> cmd;   // hset key field value ...
+};
+
+static void cb_rewrite_field(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    RewriteHashCtx *hctx = (RewriteHashCtx *)arg;
+    std::vector<std::string> &cmd = hctx->cmd;
+    cmd.push_back(std::string(field, flen));
+    cmd.push_back(std::string(val, vlen));
+    if (cmd.size() == 2 + 2 * k_rewrite_hset_pairs) {
+        rewrite_out(hctx->ctx, cmd);
+        cmd.resize(2);
+    }
+}
+
+// the shortest commands that recreate a key
+static void cb_rewrite(HNode *node, void *arg) {
+    RewriteCtx *ctx = (RewriteCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    int64_t deadline_ms = 0;
+    if (ent->heap_idx != (size_t)-1) {
+        uint64_t expire_at = g_data.heap.a[ent->heap_idx].val;
+        if (expire_at <= ctx->now_us) {
+            return;
+        }
+        deadline_ms = ctx->now_ms + (int64_t)(expire_at - ctx->now_us) / 1000;
+    }
+
+    std::vector<std::string> cmd;
+    if (ent->type == T_STR) {
+        cmd = {"set", ent->key, entry_str(ent)};
+        if (deadline_ms) {
+            cmd.push_back("pxat");
+            cmd.push_back(std::to_string(deadline_ms));
+        }
+        return rewrite_out(ctx, cmd);
+    }
+    if (ent->type == T_SET) {
+        RewriteSetCtx sctx;
+        sctx.ctx = ctx;
+        sctx.cmd = {"sadd", ent->key};
+        set_foreach(ent->set, &cb_rewrite_member, &sctx);
+        if (sctx.cmd.size() > 2) {
+            rewrite_out(ctx, sctx.cmd);
+        }
+    } else if (ent->type == T_LIST) {
+        QIter iter = qlist_at(ent->list, 0);
+        while (iter.data) {
+            cmd = {"rpush", ent->key};
+            for (size_t i = 0; iter.data && i < k_rewrite_rpush_values; ++i) {
+                cmd.push_back(std::string(iter.data, iter.len));
+                qiter_next(ent->list, &iter);
+            }
+            rewrite_out(ctx, cmd);
+        }
+    } else if (ent->type == T_HASH) {
+        RewriteHashCtx hctx;
+        hctx.ctx = ctx;
+        hctx.cmd = {"hset", ent->key};
+        hash_foreach(ent->hash, &cb_rewrite_field, &hctx);
+        if (hctx.cmd.size() > 2) {
+            rewrite_out(ctx, hctx.cmd);
+        }
+    } else {
+        ZIter iter = zset_query(ent->zset, -INFINITY, "", 0);
+        while (iter.name) {
+            cmd = {"zadd", ent->key};
+            for (size_t i = 0; iter.name && i < k_rewrite_zadd_pairs; ++i) {
+                cmd.push_back(dbl2str(iter.score));
+                cmd.push_back(std::string(iter.name, iter.len));
+                ziter_offset(&iter, +1);
+            }
+            rewrite_out(ctx, cmd);
+        }
+    }
+    if (deadline_ms) {
+        rewrite_out(ctx, {"pexpireat", ent->key, std::to_string(deadline_ms)});
+    }
+}
+
+// write the keyspace as commands into a new file
+static bool aof_write_state(const char *path) {
+    RewriteCtx ctx;
+    ctx.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ctx.fd < 0) {
+        return false;
+    }
+    ctx.now_us = get_monotonic_usec();
+    ctx.now_ms = get_realtime_msec();
+    hm_foreach(&g_data.db, &cb_rewrite, &ctx);
+    if (!ctx.failed && !ctx.buf.empty()) {
+        ctx.failed = ctx.buf.size() != (size_t)write(ctx.fd, ctx.buf.data(), ctx.buf.size());
+    }
+    ctx.failed = ctx.failed || 0 != fsync(ctx.fd);
+    close(ctx.fd);
+    return !ctx.failed;
+}
+
+static std::string aof_tmp_path() {
+    return g_conf.aof + ".rewrite.tmp";
+}
+
+// fork a child to rewrite the AOF from the current state,
+// commands logged in the meantime are kept for aof_switch().
+static bool aof_rewrite_start() {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        _exit(aof_write_state(aof_tmp_path().c_str()) ? 0 : 1);
+    }
+    msgf("aof rewrite: forked %d", (int)pid);
+    g_data.aofrw_pid = pid;
+    g_data.aof.rewriting = true;
+    g_data.aof.rewrite_buf.clear();
+    return true;
+}
+
+// bgrewriteaof, replies with the pid of the child
+static void do_bgrewriteaof(std::vector<std::string> &cmd, std::string &out) {
+    (void)cmd;
+    if (g_data.aof.fd < 0) {
+        return out_err(out, ERR_IO, "the AOF is off");
+    }
+    if (child_running()) {
+        return out_err(out, ERR_IO, "a background save or rewrite is in progress");
+    }
+    if (!aof_rewrite_start()) {
+        return out_err(out, ERR_IO, "fork failed");
+    }
+    return out_int(out, g_data.aofrw_pid);
+}
+
+// replication. the primary sends its mutating commands to the replicas
+// in the AOF format, the offset of the stream counts the bytes sent.
+// a replica that reconnects continues from its offset if the backlog
+// still has it, otherwise it gets a snapshot followed by the stream.
+
+static bool is_replica() {
+    return g_conf.primary_port != 0;
+}
+
+enum {
+    REPL_WAIT_FORK = 0,     // waits for the next snapshot child
+    REPL_WAIT_SNAPSHOT = 1, // the child is running, the stream is buffered
+    REPL_ONLINE = 2,        // sending the snapshot (if any), then the stream
+};
+
+// a replica that doesn't keep up is dropped
+const size_t k_repl_obuf_max = 256 << 20;
+
+// append a mutating command to the replication stream
+static void repl_feed(const std::vector<std::string> &cmd) {
+    if (!g_data.backlog.buf) {
+        return;     // no replica has attached yet
+    }
+    std::string data;
+    aof_encode(data, cmd);
+    backlog_append(&g_data.backlog, data.data(), data.size());
+    g_data.repl_offset += data.size();
+
+    std::vector<Conn *> slow;
+    for (Conn *conn : g_data.replicas) {
+        if (conn->repl_state == REPL_WAIT_FORK) {
+            continue;   // the snapshot will include it
+        }
+        conn->obuf.append(data);
+        if (conn->obuf.size() - conn->obuf_sent > k_repl_obuf_max) {
+            slow.push_back(conn);
+        }
+    }
+    for (Conn *conn : slow) {
+        msgf("replication: dropping the replica %d, too far behind", conn->fd);
+        conn_done(conn);
+    }
+}
+
+static std::string repl_sync_path() {
+    return g_conf.snapshot + ".repl";
+}
+
+// fork a child to write a snapshot for the replicas waiting for a full sync.
+// the stream from this point on is buffered for them.
+static void repl_sync_start() {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return;     // retried by check_children()
+    }
+    if (pid == 0) {
+        uint64_t nkeys = 0;
+        _exit(db_save(repl_sync_path().c_str(), &nkeys) ? 0 : 1);
+    }
+    msgf("replication: forked %d for a full sync", (int)pid);
+    g_data.replsync_pid = pid;
+    g_data.replsync_offset = g_data.repl_offset;
+    for (Conn *conn : g_data.replicas) {
+        if (conn->repl_state == REPL_WAIT_FORK) {
+            conn->repl_state = REPL_WAIT_SNAPSHOT;
+        }
+    }
+}
+
+// the snapshot is ready, start sending it
+static void repl_sync_done(bool ok) {
+    std::string path = repl_sync_path();
+    struct stat st = {};
+    ok = ok && 0 == stat(path.c_str(), &st);
+    std::vector<Conn *> failed;
+    for (Conn *conn : g_data.replicas) {
+        if (conn->repl_state != REPL_WAIT_SNAPSHOT) {
+            continue;
+        }
+        // the header is small and nothing was sent before it
+        std::string head;
+        aof_encode(head, {"fullresync", g_data.replid,
+            std::to_string(g_data.replsync_offset), std::to_string(st.st_size)});
+        int fd = ok ? open(path.c_str(), O_RDONLY) : -1;
+        if (fd < 0 || head.size() != (size_t)write(conn->fd, head.data(), head.size())) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            failed.push_back(conn);
+            continue;
+        }
+        conn->sync_fd = fd;
+        conn->sync_left = (uint64_t)st.st_size;
+        conn->repl_state = REPL_ONLINE;
+    }
+    (void)unlink(path.c_str());     // the open fds keep it
+    for (Conn *conn : failed) {
+        msgf("replication: full sync failed for the replica %d", conn->fd);
+        conn_done(conn);
+    }
+}
+
+// psync <replid> <offset>: turns the connection into a replica
+static void repl_attach(Conn *conn, std::vector<std::string> &cmd) {
+    conn->state = STATE_REPLICA;
+    conn->repl_state = REPL_WAIT_FORK;
+    // replicas are not idle connections
+    dlist_detach(&conn->idle_list);
+    dlist_init(&conn->idle_list);
+    g_data.replicas.push_back(conn);
+    if (!g_data.backlog.buf) {
+        backlog_init(&g_data.backlog, g_conf.repl_backlog, g_data.repl_offset);
+    }
+
+    int64_t offset = 0;
+    std::string data;
+    if (cmd[1] == g_data.replid && str2int(cmd[2], offset) && offset >= 0
+        && backlog_copy(&g_data.backlog, (uint64_t)offset, data))
+    {
+        msgf("replication: replica %d continues from %ld", conn->fd, (long)offset);
+        aof_encode(conn->obuf, {"continue", g_data.replid});
+        conn->obuf.append(data);
+        conn->repl_state = REPL_ONLINE;
+    } else if (!child_running()) {
+        repl_sync_start();
+    }
+    // otherwise it waits for the next fork in check_children()
+}
+
+// the primary side of a replica connection: read the acks,
+// send the snapshot of a full sync, then the stream.
+static void replica_io(Conn *conn) {
+    while (true) {
+        ssize_t rv = read(conn->fd, &conn->rbuf[conn->rbuf_size],
+            sizeof(conn->rbuf) - conn->rbuf_size);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            msg("replica: EOF");
+            conn->state = STATE_END;
+            return;
+        }
+        g_stats.net_in += (uint64_t)rv;
+        conn->rbuf_size += (size_t)rv;
+        // replconf ack <offset>
+        std::vector<std::string> cmd;
+        size_t n = 0;
+        while ((n = aof_decode(conn->rbuf, conn->rbuf_size, cmd)) > 0) {
+            int64_t ack = 0;
+            if (cmd.size() == 3 && cmd_is(cmd[0], "replconf") && cmd_is(cmd[1], "ack")
+                && str2int(cmd[2], ack) && ack >= 0)
+            {
+                conn->repl_ack = (uint64_t)ack;
+            }
+            conn->rbuf_size -= n;
+            memmove(conn->rbuf, &conn->rbuf[n], conn->rbuf_size);
+        }
+        if (conn->rbuf_size == sizeof(conn->rbuf)) {
+            msg("replica: bad message");
+            conn->state = STATE_END;
+            return;
+        }
+    }
+    if (conn->repl_state != REPL_ONLINE) {
+        return;
+    }
+
+    while (conn->sync_fd >= 0) {
+        ssize_t rv = sendfile(conn->fd, conn->sync_fd, NULL, conn->sync_left);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv <= 0) {
+            msg("replica: sendfile() error");
+            conn->state = STATE_END;
+            return;
+        }
+        g_stats.net_out += (uint64_t)rv;
+        conn->sync_left -= (uint64_t)rv;
+        if (conn->sync_left == 0) {
+            close(conn->sync_fd);
+            conn->sync_fd = -1;
+        }
+    }
+    while (conn->obuf_sent < conn->obuf.size()) {
+        ssize_t rv = write(conn->fd, &conn->obuf[conn->obuf_sent],
+            conn->obuf.size() - conn->obuf_sent);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv < 0) {
+            msg("replica: write() error");
+            conn->state = STATE_END;
+            return;
+        }
+        g_stats.net_out += (uint64_t)rv;
+        conn->obuf_sent += (size_t)rv;
+    }
+    if (conn->obuf_sent == conn->obuf.size()) {
+        conn->obuf.clear();
+        conn->obuf_sent = 0;
+    } else if (conn->obuf_sent >= (1 << 20)) {
+        conn->obuf.erase(0, conn->obuf_sent);
+        conn->obuf_sent = 0;
+    }
+}
+
+static bool replica_pending(Conn *conn) {
+    return conn->repl_state == REPL_ONLINE
+        && (conn->sync_fd >= 0 || conn->obuf_sent < conn->obuf.size());
+}
+
+// role
+static void do_role(std::vector<std::string> &cmd, std::string &out) {
+    (void)cmd;
+    if (is_replica()) {
+        static const char *const k_states[] = {
+            "none", "connecting", "handshake", "transfer", "stream",
+        };
+        out_arr(out, 5);
+        out_str(out, "replica");
+        out_str(out, g_conf.primary_host);
+        out_int(out, g_conf.primary_port);
+        out_str(out, k_states[g_data.link.state]);
+        return out_int(out, (int64_t)g_data.repl_offset);
+    }
+    out_arr(out, 3);
+    out_str(out, "primary");
+    out_int(out, (int64_t)g_data.repl_offset);
+    out_arr(out, (uint32_t)g_data.replicas.size());
+    for (Conn *conn : g_data.replicas) {
+        out_arr(out, 2);
+        out_int(out, conn->fd);
+        out_int(out, (int64_t)conn->repl_ack);
+    }
+}
+
+// pub/sub. PUBLISH serializes a message once and queues a reference to
+// it on each subscriber. a subscriber only takes the (P)(UN)SUBSCRIBE
+// commands, and its replies go through the same queue to stay in order.
+
+static bool chan_eq(HNode *lhs, HNode *rhs) {
+    Channel *le = container_of(lhs, Channel, node);
+    Channel *re = container_of(rhs, Channel, node);
+    return le->name == re->name;
+}
+
+static void pubsub_push(Conn *conn, PubMsg *msg) {
+    msg->refs++;
+    conn->outq.push_back(msg);
+    conn->outq_bytes += msg->len;
+}
+
+static void pubsub_reply(Conn *conn, const std::string &out) {
+    PubMsg *msg = pubmsg_new(out);
+    pubsub_push(conn, msg);
+    pubmsg_unref(msg);
+}
+
+// ["subscribe", name, count] and the like
+static void pubsub_ack(Conn *conn, const char *kind, const std::string *name) {
+    std::string out;
+    out_arr(out, 3);
+    out_str(out, kind);
+    name ? out_str(out, *name) : out_nil(out);
+    out_int(out, (int64_t)conn->subs.size());
+    pubsub_reply(conn, out);
+}
+
+static void pubsub_add(Conn *conn, const std::string &name, bool pattern) {
+    for (Subscription *sub : conn->subs) {
+        if (sub->chan->pattern == pattern && sub->chan->name == name) {
+            return;     // already subscribed
+        }
+    }
+    HMap *map = pattern ? &g_data.patterns : &g_data.channels;
+    Channel key;
+    key.name = name;
+    key.node.hcode = str_hash((uint8_t *)name.data(), name.size());
+    HNode *node = hm_lookup(map, &key.node, &chan_eq);
+    Channel *chan = node ? container_of(node, Channel, node) : NULL;
+    if (!chan) {
+        chan = new Channel();
+        chan->name = name;
+        chan->pattern = pattern;
+        chan->node.hcode = key.node.hcode;
+        dlist_init(&chan->subs);
+        hm_insert(map, &chan->node);
+    }
+    Subscription *sub = new Subscription();
+    sub->chan = chan;
+    sub->conn = conn;
+    dlist_insert_before(&chan->subs, &sub->node);
+    chan->nsubs++;
+    conn->subs.push_back(sub);
+}
+
+static void pubsub_del(Conn *conn, size_t i) {
+    Subscription *sub = conn->subs[i];
+    conn->subs[i] = conn->subs.back();
+    conn->subs.pop_back();
+    Channel *chan = sub->chan;
+    dlist_detach(&sub->node);
+    delete sub;
+    if (--chan->nsubs == 0) {
+        HMap *map = chan->pattern ? &g_data.patterns : &g_data.channels;
+        hm_pop(map, &chan->node, &hnode_same);
+        delete chan;
+    }
+}
+
+// subscribers are not idle connections
+static void pubsub_enter(Conn *conn) {
+    conn->pubsub = true;
+    dlist_detach(&conn->idle_list);
+    dlist_init(&conn->idle_list);
+}
+
+// back to normal replies once the queue is drained
+static void pubsub_leave(Conn *conn) {
+    assert(conn->subs.empty() && conn->outq.empty());
+    conn->pubsub = false;
+    conn->idle_start = get_monotonic_usec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+}
+
+// subscribe/psubscribe name..., unsubscribe/punsubscribe [name...].
+// returns false for other commands.
+static bool try_pubsub(
+    Conn *conn, const CmdSpec *spec, std::vector<std::string> &cmd, std::string &out)
+{
+    if (!spec || !(spec->flags & CMD_PUBSUB)) {
+        if (conn->pubsub && !conn->subs.empty()) {
+            out_err(out, ERR_ARG, "only (P)SUBSCRIBE and (P)UNSUBSCRIBE are allowed");
+            return true;
+        }
+        return false;
+    }
+    if (!cmd_arity_ok(spec, cmd)) {
+        out_err(out, ERR_ARG, "expect channels");
+        return true;
+    }
+    if (!conn->pubsub) {
+        pubsub_enter(conn);
+    }
+    const char *kind = spec->name;
+    bool pattern = kind[0] == 'p';
+    bool unsub = 0 == strcmp(kind + pattern, "unsubscribe");
+    if (!unsub) {
+        for (size_t i = 1; i < cmd.size(); ++i) {
+            pubsub_add(conn, cmd[i], pattern);
+            pubsub_ack(conn, kind, &cmd[i]);
+        }
+        return true;
+    }
+
+    // unsubscribe from the named ones, or from all
+    if (cmd.size() == 1) {
+        for (Subscription *s : conn->subs) {
+            if (s->chan->pattern == pattern) {
+                cmd.push_back(s->chan->name);
+            }
+        }
+        if (cmd.size() == 1) {
+            pubsub_ack(conn, kind, NULL);
+        }
+    }
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        for (size_t j = 0; j < conn->subs.size(); ++j) {
+            Channel *chan = conn->subs[j]->chan;
+            if (chan->pattern == pattern && chan->name == cmd[i]) {
+                pubsub_del(conn, j);
+                break;
+            }
+        }
+        pubsub_ack(conn, kind, &cmd[i]);
+    }
+    return true;
+}
+
+// write the queued messages with writev(), without copying them
+static void pubsub_flush(Conn *conn) {
+    while (!conn->outq.empty()) {
+        struct iovec iov[64];
+        int n = 0;
+        size_t skip = conn->outq_sent;
+        for (PubMsg *msg : conn->outq) {
+            if (n == 64) {
+                break;
+            }
+            iov[n].iov_base = &msg->data[skip];
+            iov[n].iov_len = msg->len - skip;
+            skip = 0;
+            n++;
+        }
+        ssize_t rv = writev(conn->fd, iov, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv < 0) {
+            msg("writev() error");
+            conn->state = STATE_END;
+            return;
+        }
+        g_stats.net_out += (uint64_t)rv;
+        // pop the messages fully sent
+        size_t done = (size_t)rv;
+        while (done > 0) {
+            PubMsg *msg = conn->outq.front();
+            size_t remain = msg->len - conn->outq_sent;
+            if (done < remain) {
+                conn->outq_sent += done;
+                break;
+            }
+            done -= remain;
+            conn->outq_sent = 0;
+            conn->outq_bytes -= msg->len;
+            conn->outq.pop_front();
+            pubmsg_unref(msg);
+        }
+    }
+}
+
+// queue the message on every subscriber, the slow ones are collected
+static void pubsub_fanout(Channel *chan, PubMsg *msg, std::vector<Conn *> &slow) {
+    for (DList *node = chan->subs.next; node != &chan->subs; node = node->next) {
+        Conn *conn = container_of(node, Subscription, node)->conn;
+        pubsub_push(conn, msg);
+        if (conn->outq_bytes > g_conf.pubsub_limit && conn->state != STATE_END) {
+            conn->state = STATE_END;
+            slow.push_back(conn);
+        }
+    }
+}
+
+struct PublishCtx {
+    const std::string *chan = NULL;
+    const std::string *payload = NULL;
+    int64_t nrecv = 0;
+    std::vector<Conn *> slow;
+};
+
+static void cb_publish_pattern(HNode *node, void *arg) {
+    PublishCtx *ctx = (PublishCtx *)arg;
+    Channel *pat = container_of(node, Channel, node);
+    const std::string &chan = *ctx->chan;
+    if (!glob_match(pat->name.data(), pat->name.size(), chan.data(), chan.size())) {
+        return;
+    }
+    std::string data;
+    out_arr(data, 4);
+    out_str(data, "pmessage");
+    out_str(data, pat->name);
+    out_str(data, chan);
+    out_str(data, *ctx->payload);
+    if (4 + data.size() > k_max_msg) {
+        return;     // can't be read by the client
+    }
+    PubMsg *msg = pubmsg_new(data);
+    pubsub_fanout(pat, msg, ctx->slow);
+    pubmsg_unref(msg);
+    ctx->nrecv += (int64_t)pat->nsubs;
+}
+
+// publish channel message, replies with the number of receivers
+static void do_publish(std::vector<std::string> &cmd, std::string &out) {
+    std::string data;
+    out_arr(data, 3);
+    out_str(data, "message");
+    out_str(data, cmd[1]);
+    out_str(data, cmd[2]);
+    if (4 + data.size() > k_max_msg) {
+        return out_err(out, ERR_2BIG, "message is too big");
+    }
+    PublishCtx ctx;
+    ctx.chan = &cmd[1];
+    ctx.payload = &cmd[2];
+
+    Channel key;
+    key.name.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.name.data(), key.name.size());
+    HNode *node = hm_lookup(&g_data.channels, &key.node, &chan_eq);
+    key.name.swap(cmd[1]);
+    if (node) {
+        Channel *chan = container_of(node, Channel, node);
+        PubMsg *msg = pubmsg_new(data);
+        pubsub_fanout(chan, msg, ctx.slow);
+        pubmsg_unref(msg);
+        ctx.nrecv += (int64_t)chan->nsubs;
+    }
+    hm_foreach(&g_data.patterns, &cb_publish_pattern, &ctx);
+
+    for (Conn *conn : ctx.slow) {
+        msgf("pubsub: dropping the subscriber %d, %lu bytes queued",
+            conn->fd, (unsigned long)conn->outq_bytes);
+        conn_done(conn);
+    }
+    return out_int(out, ctx.nrecv);
+}
+
+// rewrite automatically once the AOF doubles since the last rewrite
+const uint64_t k_aof_rewrite_min = 64 << 20;
+
+// reap the children of BGSAVE, BGREWRITEAOF and full syncs
+static void check_children() {
+    int status = 0;
+    if (g_data.bgsave_pid > 0
+        && waitpid(g_data.bgsave_pid, &status, WNOHANG) == g_data.bgsave_pid)
+    {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            msgf("bgsave: the child %d failed", (int)g_data.bgsave_pid);
+        }
+        g_data.bgsave_pid = -1;
+    }
+    if (g_data.aofrw_pid > 0
+        && waitpid(g_data.aofrw_pid, &status, WNOHANG) == g_data.aofrw_pid)
+    {
+        std::string tmp = aof_tmp_path();
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0
+            && aof_switch(&g_data.aof, tmp.c_str(), g_conf.aof.c_str());
+        if (!ok) {
+            g_data.aof.rewriting = false;
+            g_data.aof.rewrite_buf.clear();
+            (void)unlink(tmp.c_str());
+        }
+        msgf("aof rewrite: %s, %lu bytes", ok ? "done" : "failed",
+            (unsigned long)g_data.aof.size);
+        g_data.aofrw_pid = -1;
+    }
+    if (g_data.replsync_pid > 0
+        && waitpid(g_data.replsync_pid, &status, WNOHANG) == g_data.replsync_pid)
+    {
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        msgf("replication: snapshot %s", ok ? "done" : "failed");
+        g_data.replsync_pid = -1;
+        repl_sync_done(ok);
+    }
+    // replicas that came while another child was running
+    for (Conn *conn : g_data.replicas) {
+        if (conn->repl_state == REPL_WAIT_FORK && !child_running()) {
+            repl_sync_start();
+        }
+    }
+
+    AOF &aof = g_data.aof;
+    if (aof.fd >= 0 && !child_running()
+        && aof.size >= k_aof_rewrite_min && aof.size >= 2 * aof.base_size)
+    {
+        (void)aof_rewrite_start();
+    }
+}
+
+static void do_incr(std::vector<std::string> &cmd, std::string &out) {
+    do_incrby(cmd, out, false);
+}
+static void do_decr(std::vector<std::string> &cmd, std::string &out) {
+    do_incrby(cmd, out, true);
+}
+static void do_zunionstore(std::vector<std::string> &cmd, std::string &out) {
+    do_zstore(cmd, out, ZOP_UNION);
+}
+static void do_zinterstore(std::vector<std::string> &cmd, std::string &out) {
+    do_zstore(cmd, out, ZOP_INTER);
+}
+static void do_zdiffstore(std::vector<std::string> &cmd, std::string &out) {
+    do_zstore(cmd, out, ZOP_DIFF);
+}
+static void do_lpush(std::vector<std::string> &cmd, std::string &out) {
+    do_push(cmd, out, true);
+}
+static void do_rpush(std::vector<std::string> &cmd, std::string &out) {
+    do_push(cmd, out, false);
+}
+static void do_lpop(std::vector<std::string> &cmd, std::string &out) {
+    do_pop(cmd, out, true);
+}
+static void do_rpop(std::vector<std::string> &cmd, std::string &out) {
+    do_pop(cmd, out, false);
+}
+
+// they list the table
+static void do_info(std::vector<std::string> &cmd, std::string &out);
+static void do_latency(std::vector<std::string> &cmd, std::string &out);
+static void do_slowlog(std::vector<std::string> &cmd, std::string &out);
+
+// looked up by a perfect hash of the name, see cmdhash.h
+static constexpr CmdSpec k_cmds[] = {
+#define CMD(name, fn, min_args, max_args, flags, first_key, last_key, key_step) \
+    {name, fn, min_args, max_args, flags, first_key, last_key, key_step},
+#include "cmdtable.h"
+#undef CMD
+};
+
+const size_t k_ncmds = sizeof(k_cmds) / sizeof(k_cmds[0]);
+
+// 1KB of slots keeps the search short at this load (~7%)
+static constexpr CmdHash<1024> k_cmd_hash = cmd_hash_build<1024>(k_cmds);
+
+// the latency of each command, indexed like `k_cmds`
+static Hist g_cmd_hist[k_ncmds];
+
+// NULL if not a command
+static const CmdSpec *cmd_find(const std::string &name) {
+    int32_t idx = cmd_hash_find(k_cmd_hash, k_cmds, name.c_str(), name.size());
+    return idx < 0 ? NULL : &k_cmds[idx];
+}
+
+static const CmdSpec *cmd_lookup(const std::vector<std::string> &cmd) {
+    return cmd.empty() ? NULL : cmd_find(cmd[0]);
+}
+
+// replies with an error if the command can't be run by `do_request`
+static bool cmd_check(
+    const CmdSpec *spec, const std::vector<std::string> &cmd, std::string &out)
+{
+    if (!spec || !spec->fn) {
+        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+        return false;
+    }
+    if (!cmd_arity_ok(spec, cmd)) {
+        out_err(out, ERR_ARG, "wrong number of arguments");
+        return false;
+    }
+    return true;
+}
+
+static bool cmd_is_write(const CmdSpec *spec, const std::vector<std::string> &cmd) {
+    return spec && ((spec->flags & CMD_WRITE)
+        || ((spec->flags & CMD_WRITE_OPTS) && cmd.size() > 2));
+}
+
+// the key changed by a mutating command
+static const std::string &cmd_write_key(
+    const CmdSpec *spec, const std::vector<std::string> &cmd)
+{
+    return cmd[spec->first_key];
+}
+
+// `spec` has passed `cmd_check`. the time includes the serialized reply.
+static void do_request(
+    const CmdSpec *spec, std::vector<std::string> &cmd, std::string &out)
+{
+    SlowArgs args;
+    bool slowlog = g_conf.slowlog_usec >= 0;
+    if (slowlog) {
+        slow_args_copy(args, cmd);
+    }
+    uint64_t start_ns = get_monotonic_nsec();
+    spec->fn(cmd, out);
+    uint64_t ns = get_monotonic_nsec() - start_ns;
+    hist_add(&g_cmd_hist[spec - k_cmds], ns);
+    if (slowlog && ns >= (uint64_t)g_conf.slowlog_usec * 1000) {
+        slowlog_add(&g_data.slowlog, args, get_realtime_msec(), ns / 1000);
+    }
+}
+
+// INFO [section...]: "key:value" lines under "# Section" headers. the
+// default sections are server, clients, stats and keyspace; commandstats
+// and latencystats list the commands that have been called.
+
+static void info_int(std::string &s, const char *key, uint64_t val) {
+    s.append(key).append(":").append(std::to_string(val)).append("\n");
+}
+
+static bool info_want(const std::vector<std::string> &cmd, const char *section) {
+    bool dflt = 0 != strcmp(section, "commandstats")
+        && 0 != strcmp(section, "latencystats");
+    if (cmd.size() == 1) {
+        return dflt;
+    }
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        if (cmd_is(cmd[i], section) || cmd_is(cmd[i], "all")
+            || (dflt && cmd_is(cmd[i], "default")))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t stats_commands() {
+    uint64_t n = 0;
+    for (const Hist &hist : g_cmd_hist) {
+        n += hist.count;
+    }
+    return n;
+}
+
+// called from the event loop
+static void stats_sample() {
+    uint64_t now_us = get_monotonic_usec();
+    if (now_us < g_stats.sample_us + 100 * 1000) {
+        return;
+    }
+    uint64_t ncmds = stats_commands();
+    if (g_stats.sample_us) {
+        uint64_t ops = (ncmds - g_stats.sample_cmds) * 1000000 / (now_us - g_stats.sample_us);
+        g_stats.ops[g_stats.ops_idx++ % k_ops_samples] = ops;
+    }
+    g_stats.sample_us = now_us;
+    g_stats.sample_cmds = ncmds;
+}
+
+static void do_info(std::vector<std::string> &cmd, std::string &out) {
+    std::string s;
+    if (info_want(cmd, "server")) {
+        s += "# Server\n";
+        info_int(s, "uptime_in_seconds", (get_monotonic_usec() - g_stats.start_us) / 1000000);
+        info_int(s, "process_id", (uint64_t)getpid());
+        info_int(s, "tcp_port", g_conf.port);
+    }
+    if (info_want(cmd, "clients")) {
+        size_t nclients = 0, nsubs = 0;
+        for (Conn *conn : g_data.fd2conn) {
+            if (conn && conn->state != STATE_REPLICA) {
+                nclients++;
+                nsubs += conn->pubsub ? 1 : 0;
+            }
+        }
+        s += "# Clients\n";
+        info_int(s, "connected_clients", nclients);
+        info_int(s, "pubsub_clients", nsubs);
+        info_int(s, "connected_replicas", g_data.replicas.size());
+        info_int(s, "total_connections_received", g_stats.conns_total);
+    }
+    if (info_want(cmd, "stats")) {
+        uint64_t ops = 0;
+        size_t nsamples = std::min(g_stats.ops_idx, k_ops_samples);
+        for (size_t i = 0; i < nsamples; ++i) {
+            ops += g_stats.ops[i];
+        }
+        s += "# Stats\n";
+        info_int(s, "total_commands_processed", stats_commands());
+        info_int(s, "instantaneous_ops_per_sec", nsamples ? ops / nsamples : 0);
+        info_int(s, "total_net_input_bytes", g_stats.net_in);
+        info_int(s, "total_net_output_bytes", g_stats.net_out);
+        info_int(s, "expired_keys", g_stats.expired);
+    }
+    if (info_want(cmd, "keyspace")) {
+        // the keys move from ht2 to ht1 while the table is resized
+        const HMap &db = g_data.db;
+        s += "# Keyspace\n";
+        info_int(s, "keys", hm_size(&g_data.db));
+        info_int(s, "expires", g_data.heap.len);
+        info_int(s, "db_slots", db.ht1.tab ? db.ht1.mask + 1 : 0);
+        info_int(s, "db_rehashing", db.ht2.tab ? 1 : 0);
+        info_int(s, "db_rehash_pos", db.ht2.tab ? db.resizing_pos : 0);
+        info_int(s, "db_rehash_slots", db.ht2.tab ? db.ht2.mask + 1 : 0);
+    }
+    if (info_want(cmd, "commandstats")) {
+        s += "# Commandstats\n";
+        for (size_t i = 0; i < k_ncmds; ++i) {
+            const Hist &hist = g_cmd_hist[i];
+            if (hist.count) {
+                char line[128];
+                snprintf(line, sizeof(line), "cmdstat_%s:calls=%lu,usec=%lu,usec_per_call=%.2f\n",
+                    k_cmds[i].name, (unsigned long)hist.count, (unsigned long)(hist.sum / 1000),
+                    (double)hist.sum / 1000 / (double)hist.count);
+                s += line;
+            }
+        }
+    }
+    if (info_want(cmd, "latencystats")) {
+        s += "# Latencystats\n";
+        for (size_t i = 0; i < k_ncmds; ++i) {
+            const Hist &hist = g_cmd_hist[i];
+            if (hist.count) {
+                char line[160];
+                snprintf(line, sizeof(line),
+                    "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f\n", k_cmds[i].name,
+                    (double)hist_quantile(&hist, 0.5) / 1000,
+                    (double)hist_quantile(&hist, 0.99) / 1000,
+                    (double)hist_quantile(&hist, 0.999) / 1000);
+                s += line;
+            }
+        }
+    }
+    out_str(out, s);
+}
+
+// LATENCY HISTOGRAM [command...]: for each command that has been called,
+// [name, calls, p50, p99, p999, max, [bound, count, ...]] in nanoseconds,
+// where `count` calls took less than `bound` and at least half of it.
+static void latency_histogram(std::vector<std::string> &cmd, std::string &out) {
+    std::vector<size_t> idx;
+    for (size_t i = 0; i < k_ncmds; ++i) {
+        bool named = cmd.size() == 2;
+        for (size_t j = 2; j < cmd.size() && !named; ++j) {
+            named = cmd_find(cmd[j]) == &k_cmds[i];
+        }
+        if (named && g_cmd_hist[i].count) {
+            idx.push_back(i);
+        }
+    }
+    out_arr(out, (uint32_t)idx.size());
+    for (size_t i : idx) {
+        const Hist &hist = g_cmd_hist[i];
+        uint64_t pow2[64];
+        hist_pow2(&hist, pow2);
+        uint32_t nbounds = 0;
+        for (uint64_t n : pow2) {
+            nbounds += n ? 1 : 0;
+        }
+        out_arr(out, 7);
+        out_str(out, k_cmds[i].name);
+        out_int(out, (int64_t)hist.count);
+        out_int(out, (int64_t)hist_quantile(&hist, 0.5));
+        out_int(out, (int64_t)hist_quantile(&hist, 0.99));
+        out_int(out, (int64_t)hist_quantile(&hist, 0.999));
+        out_int(out, (int64_t)hist.max);
+        out_arr(out, 2 * nbounds);
+        for (uint32_t b = 0; b < 64; ++b) {
+            if (pow2[b]) {
+                out_int(out, b < 63 ? (int64_t)1 << b : INT64_MAX);
+                out_int(out, (int64_t)pow2[b]);
+            }
+        }
+    }
+}
+
+static void phase_record(uint32_t phase, uint64_t us) {
+    if (g_conf.stall_usec && us >= g_conf.stall_usec) {
+        Stall &stall = g_stats.stalls[phase];
+        stall.count++;
+        stall.unix_ms = get_realtime_msec();
+        stall.latest_us = us;
+        stall.max_us = std::max(stall.max_us, us);
+    }
+}
+
+// the time to pass to `phase_done`, 0 if the phases are not timed
+static uint64_t phase_start() {
+    return g_conf.stall_usec ? get_monotonic_usec() : 0;
+}
+
+// returns the start of the next phase
+static uint64_t phase_done(uint32_t phase, uint64_t start_us) {
+    if (!g_conf.stall_usec) {
+        return 0;
+    }
+    uint64_t now_us = get_monotonic_usec();
+    phase_record(phase, now_us - start_us);
+    return now_us;
+}
+
+static const char *const k_phase_names[PHASE_COUNT] = {
+    "poll", "conn-io", "repl-link", "aof", "timers", "children", "accept", "loop",
+};
+
+// LATENCY LATEST: [phase, count, unix_ms, latest_us, max_us] for each
+// phase of the event loop that has stalled. LATENCY RESET clears them.
+static void do_latency(std::vector<std::string> &cmd, std::string &out) {
+    if (cmd_is(cmd[1], "histogram")) {
+        return latency_histogram(cmd, out);
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[1], "latest")) {
+        uint32_t n = 0;
+        for (const Stall &stall : g_stats.stalls) {
+            n += stall.count ? 1 : 0;
+        }
+        out_arr(out, n);
+        for (uint32_t i = 0; i < PHASE_COUNT; ++i) {
+            const Stall &stall = g_stats.stalls[i];
+            if (stall.count) {
+                out_arr(out, 5);
+                out_str(out, k_phase_names[i]);
+                out_int(out, (int64_t)stall.count);
+                out_int(out, stall.unix_ms);
+                out_int(out, (int64_t)stall.latest_us);
+                out_int(out, (int64_t)stall.max_us);
+            }
+        }
+        return;
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[1], "reset")) {
+        int64_t n = 0;
+        for (Stall &stall : g_stats.stalls) {
+            n += stall.count ? 1 : 0;
+            stall = Stall();
+        }
+        return out_int(out, n);
+    }
+    out_err(out, ERR_ARG, "expect HISTOGRAM, LATEST or RESET");
+}
+
+// SLOWLOG GET [n]: the latest n entries (10) as [id, unix_ms, usec, [args]],
+// fewer if they don't fit in a reply. SLOWLOG LEN, SLOWLOG RESET.
+static void do_slowlog(std::vector<std::string> &cmd, std::string &out) {
+    SlowLog &log = g_data.slowlog;
+    if (cmd_is(cmd[1], "get")) {
+        int64_t n = 10;
+        if (cmd.size() == 3 && (!str2int(cmd[2], n) || n < 0)) {
+            return out_err(out, ERR_ARG, "expect count");
+        }
+        std::vector<const SlowEntry *> entries;
+        slowlog_latest(&log, (size_t)n, entries);
+        // an entry can take 1.4KB, so stop before the reply gets too big
+        void *arr = begin_arr(out);
+        uint32_t count = 0;
+        std::string item;
+        for (const SlowEntry *ent : entries) {
+            item.clear();
+            out_arr(item, 4);
+            out_int(item, (int64_t)ent->id);
+            out_int(item, ent->unix_ms);
+            out_int(item, (int64_t)ent->usec);
+            out_arr(item, (uint32_t)ent->args.size());
+            for (const std::string &arg : ent->args) {
+                out_str(item, arg);
+            }
+            if (4 + out.size() + item.size() > k_max_msg) {
+                break;
+            }
+            out += item;
+            count++;
+        }
+        return end_arr(out, arr, count);
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[1], "len")) {
+        return out_int(out, (int64_t)log.ring.size());
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[1], "reset")) {
+        slowlog_reset(&log);
+        return out_nil(out);
+    }
+    out_err(out, ERR_ARG, "expect GET, LEN or RESET");
+}
+
+// not through do_request(), the stats are of the commands from clients
+static void cb_replay(std::vector<std::string> &cmd, void *arg) {
+    std::string out;
+    const CmdSpec *spec = cmd_lookup(cmd);
+    if (cmd_check(spec, cmd, out)) {
+        spec->fn(cmd, out);
+    }
+    (*(size_t *)arg)++;
+}
+
+// replay the AOF into the empty keyspace, a damaged tail is cut off
+static bool aof_load(const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st = {};
+    if (0 != fstat(fd, &st)) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    size_t ncmds = 0;
+    size_t valid = aof_replay((const uint8_t *)data, size, &cb_replay, &ncmds);
+    munmap(data, size);
+    if (valid != size) {
+        msgf("aof: truncating a damaged tail of %lu bytes", (unsigned long)(size - valid));
+        if (0 != ftruncate(fd, (off_t)valid)) {
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    msgf("aof: replayed %lu commands", (unsigned long)ncmds);
+    return true;
+}
+
+// the replica side. the link connects to the primary, asks for the
+// stream from its offset, and applies the snapshot and the commands
+// it gets. acks are sent once per second; a broken link reconnects.
+
+const uint64_t k_link_retry_ms = 1000;
+const uint64_t k_link_ack_ms = 1000;
+
+static std::string link_tmp_path() {
+    return g_conf.snapshot + ".sync.tmp";
+}
+
+static void link_close() {
+    ReplLink &link = g_data.link;
+    if (link.fd >= 0) {
+        close(link.fd);
+    }
+    if (link.file_fd >= 0) {
+        close(link.file_fd);
+        (void)unlink(link_tmp_path().c_str());
+    }
+    link.fd = link.file_fd = -1;
+    link.rbuf.clear();
+    link.state = LINK_NONE;
+    link.retry_us = get_monotonic_usec() + k_link_retry_ms * 1000;
+}
+
+// the messages to the primary are small, a short write is an error
+static void link_send(const std::vector<std::string> &cmd) {
+    std::string data;
+    aof_encode(data, cmd);
+    ssize_t rv = write(g_data.link.fd, data.data(), data.size());
+    if (rv != (ssize_t)data.size()) {
+        msg("replication: write() error");
+        return link_close();
+    }
+    g_stats.net_out += (uint64_t)rv;
+}
+
+static void link_connect() {
+    ReplLink &link = g_data.link;
+    link.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (link.fd < 0) {
+        return link_close();
+    }
+    fd_set_nb(link.fd);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_conf.primary_port);
+    addr.sin_addr.s_addr = g_conf.primary_addr;
+    int rv = connect(link.fd, (const sockaddr *)&addr, sizeof(addr));
+    if (rv < 0 && errno != EINPROGRESS) {
+        return link_close();
+    }
+    link.state = LINK_CONNECTING;   // completed by link_io()
+}
+
+static void cb_clear(HNode *node, void *arg) {
+    (void)arg;
+    entry_del(container_of(node, Entry, node));
+}
+
+static void db_clear() {
+    hm_foreach(&g_data.db, &cb_clear, NULL);
+    hm_destroy(&g_data.db);
+    g_data.missing_version = ++g_data.version;
+}
+
+// the snapshot is received, it replaces the keyspace
+static void link_load() {
+    ReplLink &link = g_data.link;
+    close(link.file_fd);
+    link.file_fd = -1;
+    std::string tmp = link_tmp_path();
+    uint64_t start_us = get_monotonic_usec();
+    db_clear();
+    bool ok = db_load(tmp.c_str());
+    (void)unlink(tmp.c_str());
+    if (!ok) {
+        msg("replication: bad snapshot");
+        db_clear();
+        return link_close();
+    }
+    msgf("replication: loaded %lu keys in %lu ms", (unsigned long)hm_size(&g_data.db),
+        (unsigned long)(get_monotonic_usec() - start_us) / 1000);
+    link.state = LINK_STREAM;
+    // the AOF restarts from the new keyspace
+    if (g_data.aof.fd >= 0 && (child_running() || !aof_rewrite_start())) {
+        msg("replication: the AOF is not rewritten after the full sync");
+    }
+}
+
+// the commands from the primary are already made absolute for the AOF.
+// like cb_replay(), they are left out of the command stats.
+static void cb_link_apply(std::vector<std::string> &cmd, void *arg) {
+    (void)arg;
+    std::string out;
+    const CmdSpec *spec = cmd_lookup(cmd);
+    if (!cmd_check(spec, cmd, out)) {
+        return;
+    }
+    std::vector<std::string> logged;
+    bool is_write = cmd_is_write(spec, cmd);
+    bool logging = g_data.aof.fd >= 0 && is_write;
+    if (logging) {
+        logged = cmd;
+    }
+    std::string key = (is_write && g_data.watching) ? cmd_write_key(spec, cmd) : "";
+    spec->fn(cmd, out);
+    if (is_write && g_data.watching) {
+        touch_key(key);
+    }
+    if (logging && out[0] != SER_ERR) {
+        aof_append(&g_data.aof, logged);
+    }
+}
+
+// the first record is complete but can't be decoded
+static bool record_bad(const std::string &buf) {
+    uint32_t len = 0;
+    if (buf.size() < 4) {
+        return false;
+    }
+    memcpy(&len, buf.data(), 4);
+    std::vector<std::string> cmd;
+    return buf.size() - 4 >= len
+        && 0 == aof_decode((const uint8_t *)buf.data(), buf.size(), cmd);
+}
+
+static void link_process() {
+    ReplLink &link = g_data.link;
+    if (link.state == LINK_HANDSHAKE) {
+        std::vector<std::string> cmd;
+        size_t n = aof_decode((const uint8_t *)link.rbuf.data(), link.rbuf.size(), cmd);
+        if (n == 0) {
+            // a complete message that is not a psync reply, e.g. an error
+            if (record_bad(link.rbuf)) {
+                msg("replication: psync refused");
+                link_close();
+            }
+            return;
+        }
+        link.rbuf.erase(0, n);
+        int64_t offset = 0, size = 0;
+        if (cmd.size() == 4 && cmd[0] == "fullresync"
+            && str2int(cmd[2], offset) && offset >= 0 && str2int(cmd[3], size) && size > 0)
+        {
+            link.file_fd = open(link_tmp_path().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (link.file_fd < 0) {
+                return link_close();
+            }
+            link.file_left = (uint64_t)size;
+            g_data.replid = cmd[1];
+            g_data.repl_offset = (uint64_t)offset;
+            link.state = LINK_TRANSFER;
+            msgf("replication: full sync, %ld bytes at offset %ld", (long)size, (long)offset);
+        } else if (cmd.size() == 2 && cmd[0] == "continue" && cmd[1] == g_data.replid) {
+            link.state = LINK_STREAM;
+            msgf("replication: continuing from offset %lu",
+                (unsigned long)g_data.repl_offset);
+        } else {
+            msg("replication: psync refused");
+            return link_close();
+        }
+    }
+    if (link.state == LINK_TRANSFER) {
+        size_t n = (size_t)std::min<uint64_t>(link.file_left, link.rbuf.size());
+        if (n && n != (size_t)write(link.file_fd, link.rbuf.data(), n)) {
+            msg("replication: write() error");
+            return link_close();
+        }
+        link.rbuf.erase(0, n);
+        link.file_left -= n;
+        if (link.file_left == 0) {
+            link_load();
+        }
+    }
+    if (link.state == LINK_STREAM) {
+        size_t n = aof_replay(
+            (const uint8_t *)link.rbuf.data(), link.rbuf.size(), &cb_link_apply, NULL);
+        link.rbuf.erase(0, n);
+        g_data.repl_offset += n;
+        // the rest is an incomplete command or transaction
+        if (record_bad(link.rbuf) || link.rbuf.size() > k_repl_obuf_max) {
+            msg("replication: bad stream");
+            link_close();
+        }
+    }
+}
+
+static void link_io(short revents) {
+    ReplLink &link = g_data.link;
+    if (link.state == LINK_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (0 != getsockopt(link.fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+            return link_close();
+        }
+        msgf("replication: connected to %s:%d",
+            g_conf.primary_host.c_str(), (int)g_conf.primary_port);
+        link.state = LINK_HANDSHAKE;
+        link.ack_us = get_monotonic_usec();
+        // continue from our offset if the primary still has it
+        return link_send({"psync", g_data.replid, std::to_string(g_data.repl_offset)});
+    }
+    if (!(revents & (POLLIN | POLLERR | POLLHUP))) {
+        return;
+    }
+    char buf[64 << 10];
+    while (link.state != LINK_NONE) {
+        ssize_t rv = read(link.fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            msg("replication: lost the primary");
+            return link_close();
+        }
+        g_stats.net_in += (uint64_t)rv;
+        link.rbuf.append(buf, (size_t)rv);
+        link_process();
+    }
+}
+
+// reconnect and send acks
+static void link_timers() {
+    ReplLink &link = g_data.link;
+    uint64_t now_us = get_monotonic_usec();
+    if (link.state == LINK_NONE && now_us >= link.retry_us) {
+        link_connect();
+    } else if (link.state >= LINK_HANDSHAKE && now_us >= link.ack_us + k_link_ack_ms * 1000) {
+        link.ack_us = now_us;
+        link_send({"replconf", "ack", std::to_string(g_data.repl_offset)});
+    }
+}
+
+static bool log_enabled() {
+    return g_data.aof.fd >= 0 || g_data.backlog.buf;
+}
+
+// to the AOF and the replicas
+static void log_write(const std::vector<std::string> &cmd) {
+    repl_feed(cmd);
+    if (g_data.aof.fd >= 0) {
+        aof_append(&g_data.aof, cmd);
+    }
+}
+
+// run a command from a client and log it if it mutates the keyspace.
+// returns true if the reply must wait for the AOF.
+static bool run_cmd(
+    const CmdSpec *spec, std::vector<std::string> &cmd, std::string &out)
+{
+    if (!cmd_check(spec, cmd, out)) {
+        return false;
+    }
+    bool is_write = cmd_is_write(spec, cmd);
+    if (is_write && is_replica()) {
+        out_err(out, ERR_READONLY, "the replica is read-only");
+        return false;
+    }
+    // a copy of a mutating command is kept for logging,
+    // as the handlers may consume the arguments.
+    std::vector<std::string> logged;
+    bool logging = is_write && log_enabled();
+    if (logging) {
+        logged = cmd;
+    }
+    std::string key = (is_write && g_data.watching) ? cmd_write_key(spec, cmd) : "";
+    size_t start = out.size();
+    do_request(spec, cmd, out);
+    if (is_write && g_data.watching) {
+        touch_key(key);
+    }
+    if (!logging || out[start] == SER_ERR) {
+        return false;
+    }
+    aof_absolute_ttl(logged);
+    log_write(logged);
+    return g_data.aof.fd >= 0;
+}
+
+// transactions. MULTI queues the commands, EXEC runs them back to back
+// and replies with an array. WATCH records the version stamps of keys,
+// EXEC fails with nil if any of them has changed since.
+
+static void unwatch(Conn *conn) {
+    if (!conn->watched.empty()) {
+        g_data.watching--;
+        conn->watched.clear();
+    }
+}
+
+static void do_watch(Conn *conn, std::vector<std::string> &cmd, std::string &out) {
+    if (conn->watched.empty()) {
+        g_data.watching++;
+    }
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        Entry key;
+        key.key.swap(cmd[i]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        HNode *node = db_lookup(&key);
+        Watch w;
+        w.exists = (node != NULL);
+        w.version = node ? container_of(node, Entry, node)->version : g_data.version;
+        w.key.swap(key.key);
+        conn->watched.push_back(w);
+    }
+    return out_nil(out);
+}
+
+static bool watch_changed(Watch &w) {
+    Entry key;
+    key.key.swap(w.key);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key);
+    w.key.swap(key.key);
+    if (node) {
+        return !w.exists || container_of(node, Entry, node)->version != w.version;
+    }
+    return w.exists || g_data.missing_version > w.version;
+}
+
+// the writes are logged between `multi` and `exec` records,
+// so a replay or a replica applies them all or none.
+// returns true if the reply must wait for the AOF.
+static bool do_exec(Conn *conn, std::string &out) {
+    std::vector<std::vector<std::string>> queued;
+    queued.swap(conn->queued);
+    conn->in_multi = false;
+    bool changed = false;
+    for (Watch &w : conn->watched) {
+        changed = changed || watch_changed(w);
+    }
+    unwatch(conn);
+    if (changed) {
+        out_nil(out);
+        return false;
+    }
+
+    std::vector<const CmdSpec *> specs;
+    size_t nwrites = 0;
+    for (const std::vector<std::string> &cmd : queued) {
+        specs.push_back(cmd_lookup(cmd));
+        nwrites += cmd_is_write(specs.back(), cmd) ? 1 : 0;
+    }
+    bool block = nwrites > 1 && log_enabled() && !is_replica();
+    if (block) {
+        log_write({"multi"});
+    }
+    bool held = false;
+    out_arr(out, (uint32_t)queued.size());
+    for (size_t i = 0; i < queued.size(); ++i) {
+        held = run_cmd(specs[i], queued[i], out) || held;
+    }
+    if (block) {
+        log_write({"exec"});
+    }
+    return held;
+}
+
+// MULTI, EXEC, DISCARD, WATCH, UNWATCH, and queuing inside MULTI.
+// returns false for other commands.
+static bool try_transaction(Conn *conn, const CmdSpec *spec,
+    std::vector<std::string> &cmd, std::string &out, bool &held)
+{
+    if (!spec || !(spec->flags & CMD_TX)) {
+        if (!conn->in_multi) {
+            return false;
+        }
+        conn->queued.push_back(std::move(cmd));
+        out_str(out, "QUEUED");
+    } else if (!cmd_arity_ok(spec, cmd)) {
+        out_err(out, ERR_ARG, "wrong number of arguments");
+    } else if (cmd_is(cmd[0], "exec")) {
+        if (!conn->in_multi) {
+            out_err(out, ERR_ARG, "EXEC without MULTI");
+        } else {
+            held = do_exec(conn, out);
+        }
+    } else if (cmd_is(cmd[0], "discard")) {
+        if (!conn->in_multi) {
+            out_err(out, ERR_ARG, "DISCARD without MULTI");
+        } else {
+            conn->in_multi = false;
+            conn->queued.clear();
+            unwatch(conn);
+            out_nil(out);
+        }
+    } else if (cmd_is(cmd[0], "multi")) {
+        if (conn->in_multi) {
+            out_err(out, ERR_ARG, "MULTI calls can not be nested");
+        } else {
+            conn->in_multi = true;
+            out_nil(out);
+        }
+    } else if (cmd_is(cmd[0], "watch")) {
+        if (conn->in_multi) {
+            out_err(out, ERR_ARG, "WATCH inside MULTI is not allowed");
+        } else {
+            do_watch(conn, cmd, out);
+        }
+    } else {
+        // unwatch
+        unwatch(conn);
+        out_nil(out);
+    }
+    return true;
+}
+
+static bool try_one_request(Conn *conn) {
+    // a former subscriber sends what is queued first
+    if (conn->pubsub && conn->subs.empty()) {
+        if (!conn->outq.empty()) {
+            return false;
+        }
+        pubsub_leave(conn);
+    }
+    // try to parse a request from the buffer
+    if (conn->rbuf_size < 4) {
+        // not enough data in the buffer. Will retry in the next iteration
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf[0], 4);
+    if (len > k_max_msg) {
+        msg("too long");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (4 + len > conn->rbuf_size) {
+        // not enough data in the buffer. Will retry in the next iteration
+        return false;
+    }
+
+    // parse the request
+    std::vector<std::string> cmd;
+    if (0 != parse_req(&conn->rbuf[4], len, cmd)) {
+        msg("bad req");
+        conn->state = STATE_END;
+        return false;
+    }
+
+    // a replica is attached instead of replied to
+    const CmdSpec *spec = cmd_lookup(cmd);
+    bool psync = spec && (spec->flags & CMD_REPL) && cmd_arity_ok(spec, cmd);
+    if (psync && !is_replica() && !conn->in_multi) {
+        conn->rbuf_size -= 4 + len;
+        memmove(conn->rbuf, &conn->rbuf[4 + len], conn->rbuf_size);
+        repl_attach(conn, cmd);
+        return false;
+    }
+
+    // got one request, generate the response
+    std::string out;
+    bool held = false;
+    if (!conn->in_multi && try_pubsub(conn, spec, cmd, out)) {
+        // the replies are queued, `out` only has errors
+    } else if (!try_transaction(conn, spec, cmd, out, held)) {
+        held = run_cmd(spec, cmd, out);
+    }
+
+    // remove the request from the buffer.
+    // note: frequent memmove is inefficient.
+    // note: need better handling for production code.
+    size_t remain = conn->rbuf_size - 4 - len;
+    if (remain) {
+        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+    }
+    conn->rbuf_size = remain;
+
+    if (conn->pubsub) {
+        if (!out.empty()) {
+            pubsub_reply(conn, out);
+        }
+        return true;    // written by pubsub_flush()
+    }
+
+    // pack the response into the buffer
+    if (4 + out.size() > k_max_msg) {
+        out.clear();
+        out_err(out, ERR_2BIG, "response is too big");
+    }
+    uint32_t wlen = (uint32_t)out.size();
+    memcpy(&conn->wbuf[0], &wlen, 4);
+    memcpy(&conn->wbuf[4], out.data(), out.size());
+    conn->wbuf_size = 4 + wlen;
+
+    // change state
+    conn->state = STATE_RES;
+    if (held) {
+        // the reply is sent by aof_release()
+        g_data.aof_waiting.push_back(conn);
+        return false;
+    }
+    state_res(conn);
+
+    // continue the outer loop if the request was fully processed
+    return (conn->state == STATE_REQ);
+}
+
+static bool try_fill_buffer(Conn *conn) {
+    // try to fill the buffer
+    assert(conn->rbuf_size < sizeof(conn->rbuf));
+    ssize_t rv = 0;
+    do {
+        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
+        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0 && errno == EAGAIN) {
+        // got EAGAIN, stop.
+        return false;
+    }
+    if (rv < 0) {
+        msg("read() error");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (rv == 0) {
+        if (conn->rbuf_size > 0) {
+            msg("unexpected EOF");
+        } else {
+            msg("EOF");
+        }
+        conn->state = STATE_END;
+        return false;
+    }
+
+    g_stats.net_in += (uint64_t)rv;
+    conn->rbuf_size += (size_t)rv;
+    assert(conn->rbuf_size <= sizeof(conn->rbuf));
+
+    // Try to process requests one by one.
+    // Why is there a loop? Please read the explanation of "pipelining".
+    while (try_one_request(conn)) {}
+    return (conn->state == STATE_REQ);
+}
+
+static void state_req(Conn *conn) {
+    while (try_fill_buffer(conn)) {}
+}
+
+static bool try_flush_buffer(Conn *conn) {
+    ssize_t rv = 0;
+    do {
+        size_t remain = conn->wbuf_size - conn->wbuf_sent;
+        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0 && errno == EAGAIN) {
+        // got EAGAIN, stop.
+        return false;
+    }
+    if (rv < 0) {
+        msg("write() error");
+        conn->state = STATE_END;
+        return false;
+    }
+    g_stats.net_out += (uint64_t)rv;
+    conn->wbuf_sent += (size_t)rv;
+    assert(conn->wbuf_sent <= conn->wbuf_size);
+    if (conn->wbuf_sent == conn->wbuf_size) {
+        // response was fully sent, change state back
+        conn->state = STATE_REQ;
+        conn->wbuf_sent = 0;
+        conn->wbuf_size = 0;
+        return false;
+    }
+    // still got some data in wbuf, could try to write again
+    return true;
+}
+
+static void state_res(Conn *conn) {
+    while (try_flush_buffer(conn)) {}
+}
+
+static void connection_io(Conn *conn){
+	// waked up by poll, update the idle timer
+    // by moving conn to the end of the list.
+
+    // Get the current time in microseconds and set it as the new idle start time for the connection.
+    conn->idle_start = get_monotonic_usec();
+    // Detach the connection from its current position in the idle list.
+    dlist_detach(&conn->idle_list);
+    
+    // Insert the connection back into the idle list, just before the list's sentinel node,
+    // effectively moving it to the end of the list (making it the most recently used).
+    // replicas and subscribers are not in the list.
+    if (conn->state != STATE_REPLICA && !conn->pubsub) {
+        dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+    }
+    
+    // do the work
+    if (conn->state == STATE_REPLICA) {
+        replica_io(conn);
+    } else if (conn->pubsub) {
+        if (conn->rbuf_size < sizeof(conn->rbuf)) {
+            state_req(conn);
+        }
+        if (conn->state == STATE_REQ) {
+            pubsub_flush(conn);
+        }
+        // the requests held by a drained former subscriber
+        if (conn->state == STATE_REQ && conn->subs.empty() && conn->outq.empty()) {
+            while (try_one_request(conn)) {}
+        }
+    } else if (conn->state == STATE_REQ) {
+        state_req(conn);
+    } else if (conn->state == STATE_RES) {
+        state_res(conn);
+    } else {
+        assert(0);  // not expected
+    }
+}
+
+const uint64_t k_idle_timeout_ms = 5 * 1000;
+
+static uint32_t next_timer_ms() {
+    uint64_t now_us = get_monotonic_usec();
+    uint64_t next_us = (uint64_t)-1; // Initialize next_us to the maximum possible value (-1), indicating that no timeout has been set yet.
+
+    //  If the idle list is not empty, there are idle timers to consider.
+    if (!dlist_empty(&g_data.idle_list)) {
+        Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
+        // Calculates the absolute time (next_us) in microseconds when the next connection (next) will timeout. 
+		// This is done by adding the idle start time (next->idle_start) and the idle timeout duration (k_idle_timeout_ms * 1000, converted to microseconds).
+        next_us = next->idle_start + k_idle_timeout_ms * 1000;
+    }
+
+    // if the heap is not empty and the next TTL timer is sooner than the current next_us.
+    if (g_data.heap.len && g_data.heap.a[0].val < next_us) {
+        next_us = g_data.heap.a[0].val; // Update next_us to the time of the next TTL timer.
+    }
+
+    // the everysec fsync of the AOF
+    AOF &aof = g_data.aof;
+    if (aof.fd >= 0 && aof.fsync == AOF_FSYNC_EVERYSEC && aof.synced_size != aof.size) {
+        next_us = std::min(next_us, std::max(aof.last_fsync_us + 1000000, now_us + 1000));
+    }
+
+    // the replication link
+    const ReplLink &link = g_data.link;
+    if (link.state == LINK_NONE && is_replica()) {
+        next_us = std::min(next_us, link.retry_us);
+    } else if (link.state >= LINK_HANDSHAKE) {
+        next_us = std::min(next_us, link.ack_us + k_link_ack_ms * 1000);
+    }
+
+    if (next_us == (uint64_t)-1) {
+        return 10000;   // no timer, the value doesn't matter
+    }
+
+    if (next_us <= now_us) {
+        // missed?
+        return 0;
+    }
+    return (uint32_t)((next_us - now_us) / 1000);
+}
+
+static void conn_done(Conn *conn) {
+    unwatch(conn);
+    while (!conn->subs.empty()) {
+        pubsub_del(conn, conn->subs.size() - 1);
+    }
+    for (PubMsg *msg : conn->outq) {
+        pubmsg_unref(msg);
+    }
+    g_data.fd2conn[conn->fd] = NULL;
+    (void)close(conn->fd);
+    dlist_detach(&conn->idle_list);
+    // replicas end up here as STATE_END too
+    std::vector<Conn *> &v = g_data.replicas;
+    std::vector<Conn *>::iterator it = std::find(v.begin(), v.end(), conn);
+    if (it != v.end()) {
+        v.erase(it);
+    }
+    if (conn->sync_fd >= 0) {
+        close(conn->sync_fd);
+    }
+    delete conn;
+}
+
+// group commit: write the commands logged in this iteration with one
+// write (and fsync), then send the replies held for them.
+static void aof_release() {
+    if (g_data.aof.fd < 0) {
+        return;
+    }
+    do {
+        if (!aof_flush(&g_data.aof, get_monotonic_usec())) {
+            // don't acknowledge writes that are not logged
+            die("failed to write the AOF");
+        }
+        std::vector<Conn *> conns;
+        conns.swap(g_data.aof_waiting);
+        for (Conn *conn : conns) {
+            state_res(conn);
+            // continue with pipelined requests, which may wait again
+            while (conn->state == STATE_REQ && try_one_request(conn)) {}
+            if (conn->state == STATE_END) {
+                conn_done(conn);
+            }
+        }
+    } while (!g_data.aof_waiting.empty());
+}
+
+// The process_timers function efficiently handles idle connections and TTL timers, ensuring that the server maintains performance 
+// and responsiveness by carefully managing the number of operations performed in each iteration.
+static void process_timers(){
+	// the extra 1000us is for the ms resolution of poll()
+    uint64_t now_us = get_monotonic_usec() + 1000;
+    while(!dlist_empty(&g_data.idle_list)){
+    	// Get the next connection from the idle list
+    	Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
+    	
+    	// Calculate the target/absolute time for the next timer event in microseconds
+        uint64_t next_us = next->idle_start + k_idle_timeout_ms * 1000;
+        if (next_us >= now_us) {
+            // not ready
+            break;
+        }
+
+        printf("removing idle connection: %d\n", next->fd);
+        conn_done(next);
+	}
+	// TTL timers
+    const size_t k_max_works = 2000;
+    size_t nworks = 0;
+	while(g_data.heap.len && g_data.heap.a[0].val<now_us){
+		Entry *ent = container_of(g_data.heap.a[0].ref, Entry, heap_idx);
+        HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
+        assert(node == &ent->node);
+        entry_del(ent);
+        g_stats.expired++;
+        if (nworks++ >= k_max_works) {
+            // don't stall the server if too many keys are expiring at once
+            break;
+        }
+	}
+}
+
+// --replicaof host:port
+static bool parse_primary(const std::string &val) {
+    size_t colon = val.rfind(':');
+    int64_t port = 0;
+    if (colon == std::string::npos || !str2int(val.substr(colon + 1), port)
+        || port < 1 || port > 65535)
+    {
+        return false;
+    }
+    std::string host = val.substr(0, colon);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (0 != getaddrinfo(host.c_str(), NULL, &hints, &res)) {
+        return false;
+    }
+    g_conf.primary_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(res);
+    g_conf.primary_host = host;
+    g_conf.primary_port = (uint16_t)port;
+    return true;
+}
+
+// command line options, given as `--name value` pairs
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i += 2) {
+        std::string opt = argv[i];
+        std::string val = (i + 1 < argc) ? argv[i + 1] : "";
+        int64_t num = 0;
+        bool is_uint = str2int(val, num) && !val.empty() && num >= 0;
+        if (opt == "--zset-max-pack-len" && is_uint) {
+            g_zset_conf.max_pack_len = (uint32_t)num;
+        } else if (opt == "--zset-max-pack-name" && is_uint && num <= 255) {
+            g_zset_conf.max_pack_name = (uint32_t)num;
+        } else if (opt == "--zset-large" && (val == "avl" || val == "btree")) {
+            g_zset_conf.large = (val == "btree") ? ZSET_BTREE : ZSET_AVL;
+        } else if (opt == "--zset-threads" && is_uint && num >= 1) {
+            g_zset_conf.threads = (uint32_t)num;
+        } else if (opt == "--hash-max-pack-len" && is_uint) {
+            g_hash_conf.max_pack_len = (uint32_t)num;
+        } else if (opt == "--hash-max-pack-value" && is_uint && num <= 255) {
+            g_hash_conf.max_pack_value = (uint32_t)num;
+        } else if (opt == "--set-max-intset-len" && is_uint) {
+            g_set_conf.max_ints = (uint32_t)num;
+        } else if (opt == "--hll-sparse-max-bytes" && is_uint) {
+            g_hll_conf.sparse_max = (size_t)num;
+        } else if (opt == "--snapshot" && !val.empty()) {
+            g_conf.snapshot = val;
+        } else if (opt == "--load-threads" && is_uint && num >= 1) {
+            g_conf.load_threads = (size_t)num;
+        } else if (opt == "--appendonly" && (val == "yes" || val == "no")) {
+            g_conf.appendonly = (val == "yes");
+        } else if (opt == "--appendfsync"
+            && (val == "always" || val == "everysec" || val == "no"))
+        {
+            g_conf.appendfsync = val == "always" ? AOF_FSYNC_ALWAYS
+                : (val == "everysec" ? AOF_FSYNC_EVERYSEC : AOF_FSYNC_NO);
+        } else if (opt == "--appendfilename" && !val.empty()) {
+            g_conf.aof = val;
+        } else if (opt == "--port" && is_uint && num >= 1 && num <= 65535) {
+            g_conf.port = (uint16_t)num;
+        } else if (opt == "--replicaof" && parse_primary(val)) {
+            // resolved
+        } else if (opt == "--repl-backlog-size" && is_uint && num >= 1) {
+            g_conf.repl_backlog = (size_t)num;
+        } else if (opt == "--pubsub-output-limit" && is_uint && num >= 1) {
+            g_conf.pubsub_limit = (size_t)num;
+        } else if (opt == "--slowlog-log-slower-than" && str2int(val, num) && num >= -1) {
+            g_conf.slowlog_usec = num;
+        } else if (opt == "--slowlog-max-len" && is_uint) {
+            g_data.slowlog.max_len = (size_t)num;
+        } else if (opt == "--latency-monitor-threshold" && is_uint) {
+            g_conf.stall_usec = (uint64_t)num * 1000;     // in ms
+        } else {
+            fprintf(stderr, "bad option: %s %s\n", opt.c_str(), val.c_str());
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv){
+	// some initializations
+    parse_args(argc, argv);
+    g_stats.start_us = get_monotonic_usec();
+    dlist_init(&g_data.idle_list);
+    // a peer that went away is reported by write(), not by a signal
+    signal(SIGPIPE, SIG_IGN);
+    // a new history of the replication stream on each start
+    srand((unsigned)(get_monotonic_usec() ^ getpid()));
+    for (int i = 0; i < 40; ++i) {
+        g_data.replid.push_back("0123456789abcdef"[rand() % 16]);
+    }
+
+    // restore the keyspace, from the AOF if there is one
+    uint64_t start_us = get_monotonic_usec();
+    bool has_aof = g_conf.appendonly && 0 == access(g_conf.aof.c_str(), F_OK);
+    if (has_aof) {
+        if (!aof_load(g_conf.aof.c_str())) {
+            die("failed to load the AOF");
+        }
+    } else if (0 == access(g_conf.snapshot.c_str(), F_OK)) {
+        if (!db_load(g_conf.snapshot.c_str())) {
+            die("failed to load the snapshot");
+        }
+    }
+    msgf("loaded %lu keys in %lu ms", (unsigned long)hm_size(&g_data.db),
+        (unsigned long)(get_monotonic_usec() - start_us) / 1000);
+
+    if (g_conf.appendonly) {
+        // a new AOF starts with the loaded state
+        if (!has_aof && !aof_write_state(g_conf.aof.c_str())) {
+            die("failed to create the AOF");
+        }
+        if (!aof_open(&g_data.aof, g_conf.aof.c_str())) {
+            die("failed to open the AOF");
+        }
+        g_data.aof.fsync = g_conf.appendfsync;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd<0)
+    	die("socket()");
+    int val =1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val,sizeof(val));
+    
+    //bind
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(g_conf.port);
+    addr.sin_addr.s_addr = ntohl(0);
+    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+    if(rv<0)
+    	die("bind()");
+    
+    //listen
+    rv = listen(fd,SOMAXCONN);
+    if(rv<0)
+    	die("listen()");
+    
+    // set the listen fd to nonblocking mode
+    fd_set_nb(fd);
+
+    // the event loop
+    std::vector<struct pollfd> poll_args;
+    while(true){
+        uint64_t loop_us = phase_start();
+    	//prepare the arguement of the poll
+    	poll_args.clear();
+    	
+    	struct pollfd pfd={fd,POLLIN,0};
+    	poll_args.push_back(pfd);
+    	for(Conn *conn: g_data.fd2conn){
+    		if(!conn)
+    			continue;
+    		
+    		struct pollfd pfd={};
+    		pfd.fd = conn->fd;
+    		pfd.events = (conn->state==STATE_REQ)?POLLIN:POLLOUT;
+    		if (conn->state == STATE_REPLICA) {
+    		    pfd.events = POLLIN | (replica_pending(conn) ? POLLOUT : 0);
+    		} else if (conn->pubsub) {
+    		    pfd.events = POLLIN | (conn->outq.empty() ? 0 : POLLOUT);
+    		}
+    		pfd.events = pfd.events | POLLERR;
+    		poll_args.push_back(pfd);
+		}
+		// the link to the primary is the last one
+		ReplLink &link = g_data.link;
+		bool has_link = link.fd >= 0;
+		if (has_link) {
+		    short events = (link.state == LINK_CONNECTING) ? POLLOUT : POLLIN;
+		    poll_args.push_back({link.fd, (short)(events | POLLERR), 0});
+		}
+		// poll for active fds
+		int timeout_ms = (int)next_timer_ms();
+        uint64_t busy_us = phase_done(PHASE_POLL, loop_us) - loop_us;
+		rv =poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
+		if(rv<0)
+			die("poll");
+        uint64_t wake_us = phase_start();
+        uint64_t now_us = wake_us;
+		
+		//process active connection
+		size_t nconns = poll_args.size() - (has_link ? 1 : 0);
+		for(size_t i=1; i<nconns; i++){
+			if(poll_args[i].revents){
+				Conn *conn = g_data.fd2conn[poll_args[i].fd];
+				if (!conn) {
+				    continue;   // a replica dropped by repl_feed()
+				}
+				connection_io(conn);
+				if(conn->state==STATE_END){
+					conn_done(conn);
+				}
+			}
+		}
+        now_us = phase_done(PHASE_IO, now_us);
+        if (has_link && poll_args.back().revents) {
+            link_io(poll_args.back().revents);
+        }
+        now_us = phase_done(PHASE_LINK, now_us);
+        // write the AOF, then reply
+        aof_release();
+        now_us = phase_done(PHASE_AOF, now_us);
+		// handle timers
+        process_timers();
+        stats_sample();
+        if (is_replica()) {
+            link_timers();
+        }
+        now_us = phase_done(PHASE_TIMERS, now_us);
+        check_children();
+        now_us = phase_done(PHASE_CHILDREN, now_us);
+
+        // try to accept a new connection if the listening fd is active
+        if (poll_args[0].revents) {
+            (void)accept_new_conn(fd);
+        }
+        now_us = phase_done(PHASE_ACCEPT, now_us);
+        phase_record(PHASE_LOOP, busy_us + (now_us - wake_us));
+	}
+    
+    return 0;
 }
\ No newline at end of file
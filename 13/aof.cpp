@@ -0,0 +1,198 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+// proj
+#include "aof.h"
+#include "bgjob.h"
+
+
+// set while a background fsync is pending
+static std::atomic<bool> g_fsync_busy{false};
+
+void aof_encode(std::string &out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    uint32_t n = (uint32_t)cmd.size();
+    out.append((char *)&len, 4);    // assume little endian
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd) {
+        uint32_t sz = (uint32_t)s.size();
+        out.append((char *)&sz, 4);
+        out.append(s);
+    }
+}
+
+// open the file for appending
+bool aof_open(AOF *aof, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st = {};
+    if (0 != fstat(fd, &st)) {
+        close(fd);
+        return false;
+    }
+    aof->fd = fd;
+    aof->size = aof->base_size = aof->synced_size = (uint64_t)st.st_size;
+    return true;
+}
+
+// log a mutating command, written by the next aof_flush()
+void aof_append(AOF *aof, const std::vector<std::string> &cmd) {
+    aof_encode(aof->buf, cmd);
+    if (aof->rewriting) {
+        aof_encode(aof->rewrite_buf, cmd);
+    }
+}
+
+static bool write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t rv = write(fd, data, size);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        size -= (size_t)rv;
+    }
+    return true;
+}
+
+static void cb_fsync(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    (void)fsync(fd);
+    close(fd);
+    g_fsync_busy = false;
+}
+
+// group commit: write everything logged since the last call with one
+// write(), then fsync according to the policy. called once per event loop
+// iteration before the replies of the logged commands are sent.
+bool aof_flush(AOF *aof, uint64_t now_us) {
+    if (!aof->buf.empty()) {
+        if (!write_all(aof->fd, aof->buf.data(), aof->buf.size())) {
+            return false;   // keep the data for a retry
+        }
+        aof->size += aof->buf.size();
+        aof->buf.clear();
+    }
+    if (aof->synced_size == aof->size) {
+        return true;
+    }
+    if (aof->fsync == AOF_FSYNC_ALWAYS) {
+        if (0 != fdatasync(aof->fd)) {
+            return false;
+        }
+        aof->synced_size = aof->size;
+    } else if (aof->fsync == AOF_FSYNC_EVERYSEC
+        && now_us >= aof->last_fsync_us + 1000000 && !g_fsync_busy)
+    {
+        // the fd is duplicated since the file may be switched meanwhile
+        int fd = dup(aof->fd);
+        if (fd >= 0) {
+            g_fsync_busy = true;
+            bg_submit(&cb_fsync, (void *)(intptr_t)fd);
+            aof->synced_size = aof->size;
+            aof->last_fsync_us = now_us;
+        }
+    }
+    return true;
+}
+
+// finish a background rewrite: append the commands logged during the
+// rewrite to the new file `tmp`, then replace the file at `path` with it.
+bool aof_switch(AOF *aof, const char *tmp, const char *path) {
+    aof->rewriting = false;
+    int fd = open(tmp, O_WRONLY | O_APPEND);
+    bool ok = fd >= 0
+        && write_all(fd, aof->rewrite_buf.data(), aof->rewrite_buf.size())
+        && 0 == fsync(fd)
+        && 0 == rename(tmp, path);
+    aof->rewrite_buf.clear();
+    aof->rewrite_buf.shrink_to_fit();
+    if (!ok) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        (void)unlink(tmp);
+        return false;
+    }
+    // commands in `buf` are not in either file yet, they go to the new one
+    close(aof->fd);
+    struct stat st = {};
+    (void)fstat(fd, &st);
+    aof->fd = fd;
+    aof->size = aof->base_size = aof->synced_size = (uint64_t)st.st_size;
+    return true;
+}
+
+// decode one command, returns the number of bytes consumed,
+// or 0 if the data is incomplete or garbled.
+size_t aof_decode(const uint8_t *data, size_t size, std::vector<std::string> &cmd) {
+    if (size < 8) {
+        return 0;
+    }
+    uint32_t len = 0, n = 0;
+    memcpy(&len, &data[0], 4);
+    memcpy(&n, &data[4], 4);
+    if (len < 4 || len > size - 4) {
+        return 0;
+    }
+    size_t end = 4 + (size_t)len;
+    size_t cur = 8;
+    cmd.clear();
+    while (n > 0 && end - cur >= 4) {
+        uint32_t sz = 0;
+        memcpy(&sz, &data[cur], 4);
+        if (sz > end - cur - 4) {
+            break;
+        }
+        cmd.push_back(std::string((const char *)&data[cur + 4], sz));
+        cur += 4 + sz;
+        n--;
+    }
+    return (n == 0 && cur == end) ? end : 0;
+}
+
+// call `f` on each logged command, returns the size of the valid prefix.
+// a truncated or garbled tail is left for the caller to cut off.
+// the commands of a `multi` ... `exec` block are passed only when the
+// block is complete, so a transaction is replayed entirely or not at all.
+size_t aof_replay(
+    const uint8_t *data, size_t size,
+    void (*f)(std::vector<std::string> &cmd, void *arg), void *arg)
+{
+    size_t valid = 0, pos = 0;
+    bool in_block = false;
+    std::vector<std::vector<std::string>> block;
+    std::vector<std::string> cmd;
+    while (size_t n = aof_decode(&data[pos], size - pos, cmd)) {
+        pos += n;
+        if (cmd.size() == 1 && cmd[0] == "multi") {
+            in_block = true;
+            block.clear();
+        } else if (in_block && cmd.size() == 1 && cmd[0] == "exec") {
+            for (std::vector<std::string> &c : block) {
+                f(c, arg);
+            }
+            in_block = false;
+            block.clear();
+            valid = pos;
+        } else if (in_block) {
+            block.push_back(cmd);
+        } else {
+            f(cmd, arg);
+            valid = pos;
+        }
+    }
+    return valid;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// the append-only file is a sequence of requests in the wire format:
+//   len (4) | nstr (4) | (len (4) | str) ...
+// a transaction is wrapped in `multi` and `exec` records.
+enum {
+    AOF_FSYNC_NO = 0,       // leave it to the OS
+    AOF_FSYNC_EVERYSEC = 1, // fsync on the background thread once per second
+    AOF_FSYNC_ALWAYS = 2,   // fsync before replying
+};
+
+struct AOF {
+    int fd = -1;
+    uint32_t fsync = AOF_FSYNC_EVERYSEC;
+    std::string buf;            // commands not yet written
+    uint64_t size = 0;          // bytes in the file
+    uint64_t base_size = 0;     // the size after the last rewrite
+    uint64_t synced_size = 0;   // the size at the last fsync
+    uint64_t last_fsync_us = 0;
+    // commands since a background rewrite started
+    bool rewriting = false;
+    std::string rewrite_buf;
+};
+
+void aof_encode(std::string &out, const std::vector<std::string> &cmd);
+bool aof_open(AOF *aof, const char *path);
+void aof_append(AOF *aof, const std::vector<std::string> &cmd);
+bool aof_flush(AOF *aof, uint64_t now_us);
+bool aof_switch(AOF *aof, const char *tmp, const char *path);
+size_t aof_decode(const uint8_t *data, size_t size, std::vector<std::string> &cmd);
+size_t aof_replay(
+    const uint8_t *data, size_t size,
+    void (*f)(std::vector<std::string> &cmd, void *arg), void *arg);
@@ -159,3 +159,99 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset) {
     }
     return node;
 }
+
+static AVLNode *avl_build_rec(AVLNode **nodes, size_t n, AVLNode *parent) {
+    if (n == 0) {
+        return NULL;
+    }
+    size_t mid = n / 2;
+    AVLNode *node = nodes[mid];
+    node->parent = parent;
+    node->left = avl_build_rec(nodes, mid, node);
+    node->right = avl_build_rec(nodes + mid + 1, n - mid - 1, node);
+    avl_update(node);
+    return node;
+}
+
+// build a balanced tree bottom-up from nodes in sorted order, returns the root.
+// this is O(n), compared to O(n*log(n)) for n insertions.
+AVLNode *avl_build(AVLNode **nodes, size_t n) {
+    return avl_build_rec(nodes, n, NULL);
+}
+
+// join 2 trees and a node in between them: `left` < `node` < `right`.
+// the shorter tree is attached to the spine of the taller tree,
+// so the cost is O(the difference of the depths).
+AVLNode *avl_join(AVLNode *left, AVLNode *node, AVLNode *right) {
+    uint32_t l = avl_depth(left);
+    uint32_t r = avl_depth(right);
+    if (l > r + 1) {
+        // walk down the right spine of `left` to a subtree of similar depth
+        AVLNode *cur = left;
+        while (avl_depth(cur->right) > r + 1) {
+            cur = cur->right;
+        }
+        node->left = cur->right;
+        node->right = right;
+        cur->right = node;
+        node->parent = cur;
+    } else if (r > l + 1) {
+        AVLNode *cur = right;
+        while (avl_depth(cur->left) > l + 1) {
+            cur = cur->left;
+        }
+        node->left = left;
+        node->right = cur->left;
+        cur->left = node;
+        node->parent = cur;
+    } else {
+        node->left = left;
+        node->right = right;
+        node->parent = NULL;
+    }
+    if (node->left) {
+        node->left->parent = node;
+    }
+    if (node->right) {
+        node->right->parent = node;
+    }
+    return avl_fix(node);
+}
+
+// join 2 trees: `left` < `right`
+AVLNode *avl_merge(AVLNode *left, AVLNode *right) {
+    if (!left || !right) {
+        return left ? left : right;
+    }
+    AVLNode *first = right;
+    while (first->left) {
+        first = first->left;
+    }
+    right = avl_del(first);
+    return avl_join(left, first, right);
+}
+
+// split a tree so that `left` gets the first `rank` nodes, in O(log(n)).
+void avl_split(AVLNode *root, size_t rank, AVLNode **left, AVLNode **right) {
+    if (!root) {
+        *left = *right = NULL;
+        return;
+    }
+    AVLNode *l = root->left;
+    AVLNode *r = root->right;
+    if (l) {
+        l->parent = NULL;
+    }
+    if (r) {
+        r->parent = NULL;
+    }
+    if (rank <= avl_cnt(l)) {
+        AVLNode *mid = NULL;
+        avl_split(l, rank, left, &mid);
+        *right = avl_join(mid, root, r);
+    } else {
+        AVLNode *mid = NULL;
+        avl_split(r, rank - avl_cnt(l) - 1, &mid, right);
+        *left = avl_join(l, root, mid);
+    }
+}
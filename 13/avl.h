@@ -21,3 +21,7 @@ inline void avl_init(AVLNode *node) {
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
 AVLNode *avl_offset(AVLNode *node, int64_t offset);
+AVLNode *avl_build(AVLNode **nodes, size_t n);
+AVLNode *avl_join(AVLNode *left, AVLNode *node, AVLNode *right);
+AVLNode *avl_merge(AVLNode *left, AVLNode *right);
+void avl_split(AVLNode *root, size_t rank, AVLNode **left, AVLNode **right);
@@ -0,0 +1,45 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backlog.h"
+
+
+// start an empty backlog at a stream offset
+void backlog_init(Backlog *bl, size_t cap, uint64_t offset) {
+    free(bl->buf);
+    bl->buf = (char *)malloc(cap);
+    assert(bl->buf);
+    bl->cap = cap;
+    bl->end = offset;
+    bl->len = 0;
+}
+
+void backlog_append(Backlog *bl, const char *data, size_t size) {
+    bl->end += size;
+    if (size >= bl->cap) {
+        // only the tail fits
+        data += size - bl->cap;
+        size = bl->cap;
+    }
+    size_t pos = (size_t)((bl->end - size) % bl->cap);
+    size_t first = size < bl->cap - pos ? size : bl->cap - pos;
+    memcpy(&bl->buf[pos], data, first);
+    memcpy(&bl->buf[0], data + first, size - first);
+    bl->len = bl->len + size < bl->cap ? bl->len + size : bl->cap;
+}
+
+// append the bytes from `offset` to the end, false if they are gone
+bool backlog_copy(const Backlog *bl, uint64_t offset, std::string &out) {
+    if (offset > bl->end || bl->end - offset > bl->len) {
+        return false;
+    }
+    size_t size = (size_t)(bl->end - offset);
+    if (size == 0) {
+        return true;
+    }
+    size_t pos = (size_t)(offset % bl->cap);
+    size_t first = size < bl->cap - pos ? size : bl->cap - pos;
+    out.append(&bl->buf[pos], first);
+    out.append(&bl->buf[0], size - first);
+    return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+
+// the replication backlog: a ring buffer holding the most recent bytes
+// of the replication stream, addressed by their offsets in the stream.
+struct Backlog {
+    char *buf = NULL;
+    size_t cap = 0;
+    uint64_t end = 0;   // the stream offset after the last byte
+    size_t len = 0;     // the number of bytes held, up to `cap`
+};
+
+void backlog_init(Backlog *bl, size_t cap, uint64_t offset);
+void backlog_append(Backlog *bl, const char *data, size_t size);
+bool backlog_copy(const Backlog *bl, uint64_t offset, std::string &out);
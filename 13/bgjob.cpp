@@ -0,0 +1,44 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "bgjob.h"
+
+
+struct BgJob {
+    void (*f)(void *arg) = NULL;
+    void *arg = NULL;
+};
+
+struct BgQueue {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<BgJob> jobs;
+    bool started = false;
+};
+
+// never destroyed, the thread is still waiting on it at exit
+static BgQueue *g_bg = new BgQueue();
+
+static void bg_main() {
+    while (true) {
+        BgJob job;
+        {
+            std::unique_lock<std::mutex> lock(g_bg->mu);
+            g_bg->cv.wait(lock, [] { return !g_bg->jobs.empty(); });
+            job = g_bg->jobs.front();
+            g_bg->jobs.pop_front();
+        }
+        job.f(job.arg);
+    }
+}
+
+void bg_submit(void (*f)(void *arg), void *arg) {
+    std::lock_guard<std::mutex> lock(g_bg->mu);
+    if (!g_bg->started) {
+        std::thread(&bg_main).detach();
+        g_bg->started = true;
+    }
+    g_bg->jobs.push_back(BgJob{f, arg});
+    g_bg->cv.notify_one();
+}
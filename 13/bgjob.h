@@ -0,0 +1,7 @@
+#pragma once
+
+
+// a background thread for slow work that does not touch any shared state,
+// such as freeing data structures that are already detached.
+// jobs run one at a time in the order of submission.
+void bg_submit(void (*f)(void *arg), void *arg);
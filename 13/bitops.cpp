@@ -0,0 +1,210 @@
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+// proj
+#include "bitops.h"
+
+
+// the kernels work on whole bytes, the partial bytes at the ends of
+// a bit range are handled by the callers below.
+
+static size_t count_scalar(const uint8_t *data, size_t len) {
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, &data[i], 8);
+        n += __builtin_popcountll(w);
+    }
+    for (; i < len; ++i) {
+        n += __builtin_popcount(data[i]);
+    }
+    return n;
+}
+
+template <uint32_t op>
+static inline uint64_t op64(uint64_t a, uint64_t b) {
+    switch (op) {
+    case BITOP_AND: return a & b;
+    case BITOP_OR:  return a | b;
+    case BITOP_XOR: return a ^ b;
+    default:        return ~a;
+    }
+}
+
+template <uint32_t op>
+static void op_scalar(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b = 0;
+        memcpy(&a, &dst[i], 8);
+        if (op != BITOP_NOT) {
+            memcpy(&b, &src[i], 8);
+        }
+        a = op64<op>(a, b);
+        memcpy(&dst[i], &a, 8);
+    }
+    for (; i < len; ++i) {
+        dst[i] = (uint8_t)op64<op>(dst[i], op == BITOP_NOT ? 0 : src[i]);
+    }
+}
+
+// the build targets the x86-64 baseline, so POPCNT and AVX2 are
+// compiled per function and picked at startup.
+#if defined(__x86_64__)
+
+__attribute__((target("popcnt")))
+static size_t count_popcnt(const uint8_t *data, size_t len) {
+    uint64_t n0 = 0, n1 = 0, n2 = 0, n3 = 0;   // independent adds
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w[4];
+        memcpy(w, &data[i], 32);
+        n0 += _mm_popcnt_u64(w[0]);
+        n1 += _mm_popcnt_u64(w[1]);
+        n2 += _mm_popcnt_u64(w[2]);
+        n3 += _mm_popcnt_u64(w[3]);
+    }
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, &data[i], 8);
+        n0 += _mm_popcnt_u64(w);
+    }
+    for (; i < len; ++i) {
+        n0 += _mm_popcnt_u32(data[i]);
+    }
+    return n0 + n1 + n2 + n3;
+}
+
+// each nibble is counted with a 16-entry table lookup (vpshufb). the byte
+// counts add up for at most 8 rounds (8 * 8 < 256), then are summed by vpsadbw.
+__attribute__((target("avx2,popcnt")))
+static size_t count_avx2(const uint8_t *data, size_t len) {
+    const __m256i table = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i bytes = _mm256_setzero_si256();
+        for (int k = 0; k < 8 && i + 32 <= len; ++k, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+            __m256i lo = _mm256_and_si256(v, low);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+            bytes = _mm256_add_epi8(bytes, _mm256_shuffle_epi8(table, lo));
+            bytes = _mm256_add_epi8(bytes, _mm256_shuffle_epi8(table, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    size_t n = (size_t)_mm256_extract_epi64(total, 0) + (size_t)_mm256_extract_epi64(total, 1)
+        + (size_t)_mm256_extract_epi64(total, 2) + (size_t)_mm256_extract_epi64(total, 3);
+    return n + count_popcnt(&data[i], len - i);
+}
+
+template <uint32_t op>
+__attribute__((target("avx2")))
+static void op_avx2(uint8_t *dst, const uint8_t *src, size_t len) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&dst[i]);
+        __m256i b = ones;
+        if (op != BITOP_NOT) {
+            b = _mm256_loadu_si256((const __m256i *)&src[i]);
+        }
+        switch (op) {
+        case BITOP_AND: a = _mm256_and_si256(a, b); break;
+        case BITOP_OR:  a = _mm256_or_si256(a, b); break;
+        default:        a = _mm256_xor_si256(a, b); break;  // XOR, NOT
+        }
+        _mm256_storeu_si256((__m256i *)&dst[i], a);
+    }
+    op_scalar<op>(&dst[i], op == BITOP_NOT ? NULL : &src[i], len - i);
+}
+
+#endif  // __x86_64__
+
+typedef size_t (*count_fn)(const uint8_t *data, size_t len);
+typedef void (*op_fn)(uint8_t *dst, const uint8_t *src, size_t len);
+
+struct BitKernels {
+    count_fn count = &count_scalar;
+    op_fn op[4] = {
+        &op_scalar<BITOP_AND>, &op_scalar<BITOP_OR>,
+        &op_scalar<BITOP_XOR>, &op_scalar<BITOP_NOT>,
+    };
+};
+
+static BitKernels pick_kernels() {
+    BitKernels k;
+#if defined(__x86_64__)
+    __builtin_cpu_init();   // may run before the libgcc constructor
+    if (__builtin_cpu_supports("popcnt")) {
+        k.count = &count_popcnt;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        k.count = &count_avx2;
+        k.op[BITOP_AND] = &op_avx2<BITOP_AND>;
+        k.op[BITOP_OR] = &op_avx2<BITOP_OR>;
+        k.op[BITOP_XOR] = &op_avx2<BITOP_XOR>;
+        k.op[BITOP_NOT] = &op_avx2<BITOP_NOT>;
+    }
+#endif
+    return k;
+}
+
+static const BitKernels g_kernels = pick_kernels();
+
+void bits_op(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len) {
+    g_kernels.op[op](dst, src, len);
+}
+
+static bool get_bit(const uint8_t *data, uint64_t pos) {
+    return (data[pos / 8] >> (7 - pos % 8)) & 1;
+}
+
+uint64_t bits_count(const uint8_t *data, uint64_t start, uint64_t stop) {
+    if (start >= stop) {
+        return 0;
+    }
+    uint64_t first = start / 8;
+    uint64_t last = (stop - 1) / 8;
+    uint64_t n = g_kernels.count(&data[first], (size_t)(last - first + 1));
+    // minus the bits outside the range in the first and the last byte
+    uint32_t head = start % 8;
+    uint32_t tail = stop % 8;
+    if (head) {
+        n -= __builtin_popcount(data[first] >> (8 - head));
+    }
+    if (tail) {
+        n -= __builtin_popcount(data[last] & (0xff >> tail));
+    }
+    return n;
+}
+
+// skips 8 bytes at a time over bytes that can't hold the bit
+int64_t bits_pos(const uint8_t *data, uint64_t start, uint64_t stop, bool bit) {
+    uint64_t pos = start;
+    for (; pos < stop && pos % 8; ++pos) {
+        if (get_bit(data, pos) == bit) {
+            return (int64_t)pos;
+        }
+    }
+    uint64_t skip = bit ? 0 : ~(uint64_t)0;
+    for (; pos + 64 <= stop; pos += 64) {
+        uint64_t w;
+        memcpy(&w, &data[pos / 8], 8);
+        if (w != skip) {
+            break;
+        }
+    }
+    for (; pos + 8 <= stop && data[pos / 8] == (uint8_t)skip; pos += 8) {}
+    for (; pos < stop; ++pos) {
+        if (get_bit(data, pos) == bit) {
+            return (int64_t)pos;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// bit operations on string values. bit 0 is the most significant bit
+// of the first byte, positions are in bits.
+
+// the number of set bits in [start, stop)
+uint64_t bits_count(const uint8_t *data, uint64_t start, uint64_t stop);
+// the first bit equal to `bit` in [start, stop), -1 if none
+int64_t bits_pos(const uint8_t *data, uint64_t start, uint64_t stop, bool bit);
+
+enum {
+    BITOP_AND = 0,
+    BITOP_OR = 1,
+    BITOP_XOR = 2,
+    BITOP_NOT = 3,  // `src` is unused
+};
+
+// dst[i] = dst[i] op src[i] for the first `len` bytes
+void bits_op(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len);
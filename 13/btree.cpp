@@ -0,0 +1,565 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "btree.h"
+
+
+static BLeaf *as_leaf(BNode *node) {
+    return (BLeaf *)node;
+}
+
+static BInner *as_inner(BNode *node) {
+    return (BInner *)node;
+}
+
+// compare the stored item with the search key.
+// the score is in the node, so `cmp` is only called on ties.
+static int item_cmp(
+    BTree *tree, double score, void *ref, double kscore, const void *key)
+{
+    if (score != kscore) {
+        return score < kscore ? -1 : 1;
+    }
+    return tree->cmp(ref, key);
+}
+
+// the first slot whose item is greater or equal to the key
+static uint32_t leaf_lower_bound(
+    BTree *tree, BLeaf *leaf, double score, const void *key)
+{
+    uint32_t lo = 0;
+    uint32_t hi = leaf->base.n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (item_cmp(tree, leaf->score[mid], leaf->ref[mid], score, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the child that may contain the key: the number of separators <= key
+static uint32_t inner_child(
+    BTree *tree, BInner *inner, double score, const void *key)
+{
+    uint32_t lo = 0;
+    uint32_t hi = inner->base.n - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (item_cmp(tree, inner->score[mid], inner->ref[mid], score, key) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static BLeaf *leaf_new() {
+    BLeaf *leaf = (BLeaf *)malloc(sizeof(BLeaf));
+    assert(leaf);
+    leaf->base.n = 0;
+    leaf->prev = leaf->next = NULL;
+    return leaf;
+}
+
+static BInner *inner_new() {
+    BInner *inner = (BInner *)malloc(sizeof(BInner));
+    assert(inner);
+    inner->base.n = 0;
+    return inner;
+}
+
+static size_t node_cnt(BNode *node, uint32_t height) {
+    if (height == 0) {
+        return node->n;
+    }
+    BInner *inner = as_inner(node);
+    size_t cnt = 0;
+    for (uint32_t i = 0; i < inner->base.n; ++i) {
+        cnt += inner->cnt[i];
+    }
+    return cnt;
+}
+
+// the result of splitting an overflowed node
+struct BSplit {
+    BNode *right = NULL;
+    double score = 0;   // the separator: the first item under `right`
+    void *ref = NULL;
+};
+
+static void leaf_split(BLeaf *leaf, BSplit *split) {
+    BLeaf *right = leaf_new();
+    uint32_t keep = leaf->base.n / 2;
+    right->base.n = leaf->base.n - keep;
+    memcpy(right->score, &leaf->score[keep], right->base.n * sizeof(double));
+    memcpy(right->ref, &leaf->ref[keep], right->base.n * sizeof(void *));
+    leaf->base.n = keep;
+    // link the leaves
+    right->next = leaf->next;
+    right->prev = leaf;
+    if (leaf->next) {
+        leaf->next->prev = right;
+    }
+    leaf->next = right;
+
+    split->right = &right->base;
+    split->score = right->score[0];
+    split->ref = right->ref[0];
+}
+
+static void inner_split(BInner *inner, BSplit *split) {
+    BInner *right = inner_new();
+    uint32_t keep = inner->base.n / 2;
+    right->base.n = inner->base.n - keep;
+    memcpy(right->child, &inner->child[keep], right->base.n * sizeof(BNode *));
+    memcpy(right->cnt, &inner->cnt[keep], right->base.n * sizeof(size_t));
+    memcpy(right->score, &inner->score[keep], (right->base.n - 1) * sizeof(double));
+    memcpy(right->ref, &inner->ref[keep], (right->base.n - 1) * sizeof(void *));
+    // the separator between the halves moves up
+    split->right = &right->base;
+    split->score = inner->score[keep - 1];
+    split->ref = inner->ref[keep - 1];
+    inner->base.n = keep;
+}
+
+// returns true if the node was split
+static bool insert_rec(
+    BTree *tree, BNode *node, uint32_t height,
+    double score, void *ref, const void *key, BSplit *split)
+{
+    if (height == 0) {
+        BLeaf *leaf = as_leaf(node);
+        uint32_t slot = leaf_lower_bound(tree, leaf, score, key);
+        uint32_t tail = leaf->base.n - slot;
+        memmove(&leaf->score[slot + 1], &leaf->score[slot], tail * sizeof(double));
+        memmove(&leaf->ref[slot + 1], &leaf->ref[slot], tail * sizeof(void *));
+        leaf->score[slot] = score;
+        leaf->ref[slot] = ref;
+        leaf->base.n++;
+        if (leaf->base.n <= k_bt_max) {
+            return false;
+        }
+        leaf_split(leaf, split);
+        return true;
+    }
+
+    BInner *inner = as_inner(node);
+    uint32_t i = inner_child(tree, inner, score, key);
+    inner->cnt[i]++;
+    BSplit sub;
+    if (!insert_rec(tree, inner->child[i], height - 1, score, ref, key, &sub)) {
+        return false;
+    }
+
+    // insert the new child at i + 1
+    uint32_t tail = inner->base.n - (i + 1);
+    memmove(&inner->child[i + 2], &inner->child[i + 1], tail * sizeof(BNode *));
+    memmove(&inner->cnt[i + 2], &inner->cnt[i + 1], tail * sizeof(size_t));
+    memmove(&inner->score[i + 1], &inner->score[i], tail * sizeof(double));
+    memmove(&inner->ref[i + 1], &inner->ref[i], tail * sizeof(void *));
+    inner->child[i + 1] = sub.right;
+    inner->score[i] = sub.score;
+    inner->ref[i] = sub.ref;
+    inner->cnt[i + 1] = node_cnt(sub.right, height - 1);
+    inner->cnt[i] -= inner->cnt[i + 1];
+    inner->base.n++;
+    if (inner->base.n <= k_bt_max) {
+        return false;
+    }
+    inner_split(inner, split);
+    return true;
+}
+
+// insert an item, the key must not be in the tree
+void bt_insert(BTree *tree, double score, void *ref, const void *key) {
+    tree->size++;
+    if (!tree->root) {
+        tree->root = &leaf_new()->base;
+        tree->height = 0;
+    }
+    BSplit split;
+    if (!insert_rec(tree, tree->root, tree->height, score, ref, key, &split)) {
+        return;
+    }
+    // grow a new root
+    BInner *root = inner_new();
+    root->base.n = 2;
+    root->child[0] = tree->root;
+    root->child[1] = split.right;
+    root->score[0] = split.score;
+    root->ref[0] = split.ref;
+    root->cnt[1] = node_cnt(split.right, tree->height);
+    root->cnt[0] = tree->size - root->cnt[1];
+    tree->root = &root->base;
+    tree->height++;
+}
+
+// a node of the level being built by bt_build()
+struct BBuilt {
+    BNode *node = NULL;
+    size_t cnt = 0;
+    double score = 0;   // the first item under the node
+    void *ref = NULL;
+};
+
+// split `n` into the fewest groups of at most `k_bt_max`, with sizes
+// that differ by at most 1 so that every group is above `k_bt_min`.
+static size_t group_size(size_t n, size_t ngroups, size_t i) {
+    return n / ngroups + (i < n % ngroups ? 1 : 0);
+}
+
+// build the tree bottom-up from sorted items, replacing the tree content.
+// leaves are filled up instead of being split in half by insertions.
+void bt_build(BTree *tree, const double *score, void *const *ref, size_t n) {
+    bt_dispose(tree, NULL);
+    if (n == 0) {
+        return;
+    }
+    tree->size = n;
+
+    // the leaves
+    std::vector<BBuilt> level;
+    size_t nleaves = (n + k_bt_max - 1) / k_bt_max;
+    BLeaf *prev = NULL;
+    for (size_t i = 0, pos = 0; i < nleaves; ++i) {
+        BLeaf *leaf = leaf_new();
+        leaf->base.n = (uint32_t)group_size(n, nleaves, i);
+        memcpy(leaf->score, &score[pos], leaf->base.n * sizeof(double));
+        memcpy(leaf->ref, &ref[pos], leaf->base.n * sizeof(void *));
+        leaf->prev = prev;
+        if (prev) {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        pos += leaf->base.n;
+        level.push_back(BBuilt{&leaf->base, leaf->base.n, leaf->score[0], leaf->ref[0]});
+    }
+
+    // the inner levels
+    while (level.size() > 1) {
+        std::vector<BBuilt> upper;
+        size_t ngroups = (level.size() + k_bt_max - 1) / k_bt_max;
+        for (size_t i = 0, pos = 0; i < ngroups; ++i) {
+            BInner *inner = inner_new();
+            inner->base.n = (uint32_t)group_size(level.size(), ngroups, i);
+            size_t cnt = 0;
+            for (uint32_t j = 0; j < inner->base.n; ++j) {
+                const BBuilt &child = level[pos + j];
+                inner->child[j] = child.node;
+                inner->cnt[j] = child.cnt;
+                if (j > 0) {
+                    inner->score[j - 1] = child.score;
+                    inner->ref[j - 1] = child.ref;
+                }
+                cnt += child.cnt;
+            }
+            upper.push_back(BBuilt{&inner->base, cnt, level[pos].score, level[pos].ref});
+            pos += inner->base.n;
+        }
+        level.swap(upper);
+        tree->height++;
+    }
+    tree->root = level[0].node;
+}
+
+// move the last item or child of child i - 1 to the front of child i
+static void borrow_left(BInner *parent, uint32_t i, uint32_t height) {
+    if (height == 0) {
+        BLeaf *left = as_leaf(parent->child[i - 1]);
+        BLeaf *leaf = as_leaf(parent->child[i]);
+        uint32_t n = leaf->base.n;
+        memmove(&leaf->score[1], &leaf->score[0], n * sizeof(double));
+        memmove(&leaf->ref[1], &leaf->ref[0], n * sizeof(void *));
+        left->base.n--;
+        leaf->score[0] = left->score[left->base.n];
+        leaf->ref[0] = left->ref[left->base.n];
+        leaf->base.n++;
+        parent->score[i - 1] = leaf->score[0];
+        parent->ref[i - 1] = leaf->ref[0];
+        parent->cnt[i - 1]--;
+        parent->cnt[i]++;
+        return;
+    }
+
+    BInner *left = as_inner(parent->child[i - 1]);
+    BInner *inner = as_inner(parent->child[i]);
+    uint32_t n = inner->base.n;
+    memmove(&inner->child[1], &inner->child[0], n * sizeof(BNode *));
+    memmove(&inner->cnt[1], &inner->cnt[0], n * sizeof(size_t));
+    memmove(&inner->score[1], &inner->score[0], (n - 1) * sizeof(double));
+    memmove(&inner->ref[1], &inner->ref[0], (n - 1) * sizeof(void *));
+    uint32_t last = left->base.n - 1;
+    inner->child[0] = left->child[last];
+    inner->cnt[0] = left->cnt[last];
+    inner->score[0] = parent->score[i - 1];
+    inner->ref[0] = parent->ref[i - 1];
+    inner->base.n++;
+    parent->score[i - 1] = left->score[last - 1];
+    parent->ref[i - 1] = left->ref[last - 1];
+    left->base.n--;
+    parent->cnt[i - 1] -= inner->cnt[0];
+    parent->cnt[i] += inner->cnt[0];
+}
+
+// move the first item or child of child i + 1 to the end of child i
+static void borrow_right(BInner *parent, uint32_t i, uint32_t height) {
+    if (height == 0) {
+        BLeaf *leaf = as_leaf(parent->child[i]);
+        BLeaf *right = as_leaf(parent->child[i + 1]);
+        leaf->score[leaf->base.n] = right->score[0];
+        leaf->ref[leaf->base.n] = right->ref[0];
+        leaf->base.n++;
+        right->base.n--;
+        uint32_t n = right->base.n;
+        memmove(&right->score[0], &right->score[1], n * sizeof(double));
+        memmove(&right->ref[0], &right->ref[1], n * sizeof(void *));
+        parent->score[i] = right->score[0];
+        parent->ref[i] = right->ref[0];
+        parent->cnt[i]++;
+        parent->cnt[i + 1]--;
+        return;
+    }
+
+    BInner *inner = as_inner(parent->child[i]);
+    BInner *right = as_inner(parent->child[i + 1]);
+    uint32_t n = inner->base.n;
+    inner->child[n] = right->child[0];
+    inner->cnt[n] = right->cnt[0];
+    inner->score[n - 1] = parent->score[i];
+    inner->ref[n - 1] = parent->ref[i];
+    inner->base.n++;
+    parent->score[i] = right->score[0];
+    parent->ref[i] = right->ref[0];
+    parent->cnt[i] += right->cnt[0];
+    parent->cnt[i + 1] -= right->cnt[0];
+    right->base.n--;
+    n = right->base.n;
+    memmove(&right->child[0], &right->child[1], n * sizeof(BNode *));
+    memmove(&right->cnt[0], &right->cnt[1], n * sizeof(size_t));
+    memmove(&right->score[0], &right->score[1], (n - 1) * sizeof(double));
+    memmove(&right->ref[0], &right->ref[1], (n - 1) * sizeof(void *));
+}
+
+// merge child i + 1 into child i
+static void merge_right(BInner *parent, uint32_t i, uint32_t height) {
+    if (height == 0) {
+        BLeaf *leaf = as_leaf(parent->child[i]);
+        BLeaf *right = as_leaf(parent->child[i + 1]);
+        uint32_t n = leaf->base.n;
+        memcpy(&leaf->score[n], right->score, right->base.n * sizeof(double));
+        memcpy(&leaf->ref[n], right->ref, right->base.n * sizeof(void *));
+        leaf->base.n += right->base.n;
+        leaf->next = right->next;
+        if (right->next) {
+            right->next->prev = leaf;
+        }
+        free(right);
+    } else {
+        BInner *inner = as_inner(parent->child[i]);
+        BInner *right = as_inner(parent->child[i + 1]);
+        uint32_t n = inner->base.n;
+        inner->score[n - 1] = parent->score[i];
+        inner->ref[n - 1] = parent->ref[i];
+        memcpy(&inner->child[n], right->child, right->base.n * sizeof(BNode *));
+        memcpy(&inner->cnt[n], right->cnt, right->base.n * sizeof(size_t));
+        memcpy(&inner->score[n], right->score, (right->base.n - 1) * sizeof(double));
+        memcpy(&inner->ref[n], right->ref, (right->base.n - 1) * sizeof(void *));
+        inner->base.n += right->base.n;
+        free(right);
+    }
+
+    // remove the separator i and the child i + 1 from the parent
+    parent->cnt[i] += parent->cnt[i + 1];
+    uint32_t tail = parent->base.n - (i + 2);
+    memmove(&parent->child[i + 1], &parent->child[i + 2], tail * sizeof(BNode *));
+    memmove(&parent->cnt[i + 1], &parent->cnt[i + 2], tail * sizeof(size_t));
+    memmove(&parent->score[i], &parent->score[i + 1], tail * sizeof(double));
+    memmove(&parent->ref[i], &parent->ref[i + 1], tail * sizeof(void *));
+    parent->base.n--;
+}
+
+// child i is below the minimum, borrow from or merge with a sibling
+static void fix_child(BInner *parent, uint32_t i, uint32_t height) {
+    BNode *left = i > 0 ? parent->child[i - 1] : NULL;
+    BNode *right = i + 1 < parent->base.n ? parent->child[i + 1] : NULL;
+    if (left && left->n > k_bt_min) {
+        borrow_left(parent, i, height);
+    } else if (right && right->n > k_bt_min) {
+        borrow_right(parent, i, height);
+    } else if (left) {
+        merge_right(parent, i - 1, height);
+    } else {
+        merge_right(parent, i, height);
+    }
+}
+
+// the new first item of a subtree whose first item was deleted
+struct BMin {
+    bool changed = false;
+    double score = 0;
+    void *ref = NULL;
+};
+
+static void *delete_rec(
+    BTree *tree, BNode *node, uint32_t height,
+    double score, const void *key, BMin *min)
+{
+    if (height == 0) {
+        BLeaf *leaf = as_leaf(node);
+        uint32_t slot = leaf_lower_bound(tree, leaf, score, key);
+        if (slot == leaf->base.n
+            || item_cmp(tree, leaf->score[slot], leaf->ref[slot], score, key) != 0)
+        {
+            return NULL;
+        }
+        void *ref = leaf->ref[slot];
+        leaf->base.n--;
+        uint32_t tail = leaf->base.n - slot;
+        memmove(&leaf->score[slot], &leaf->score[slot + 1], tail * sizeof(double));
+        memmove(&leaf->ref[slot], &leaf->ref[slot + 1], tail * sizeof(void *));
+        if (slot == 0 && leaf->base.n > 0) {
+            min->changed = true;
+            min->score = leaf->score[0];
+            min->ref = leaf->ref[0];
+        }
+        return ref;
+    }
+
+    BInner *inner = as_inner(node);
+    uint32_t i = inner_child(tree, inner, score, key);
+    void *ref = delete_rec(tree, inner->child[i], height - 1, score, key, min);
+    if (!ref) {
+        return NULL;
+    }
+    inner->cnt[i]--;
+    if (min->changed && i > 0) {
+        // the separator was a copy of the deleted item
+        inner->score[i - 1] = min->score;
+        inner->ref[i - 1] = min->ref;
+        min->changed = false;
+    }
+    if (inner->child[i]->n < k_bt_min) {
+        fix_child(inner, i, height - 1);
+    }
+    return ref;
+}
+
+// remove the item equal to the key, returns its ref
+void *bt_delete(BTree *tree, double score, const void *key) {
+    if (!tree->root) {
+        return NULL;
+    }
+    BMin min;
+    void *ref = delete_rec(tree, tree->root, tree->height, score, key, &min);
+    if (!ref) {
+        return NULL;
+    }
+    tree->size--;
+    // shrink the root
+    if (tree->height > 0 && tree->root->n == 1) {
+        BNode *root = tree->root;
+        tree->root = as_inner(root)->child[0];
+        tree->height--;
+        free(root);
+    } else if (tree->height == 0 && tree->root->n == 0) {
+        free(tree->root);
+        tree->root = NULL;
+    }
+    return ref;
+}
+
+// find the first item that is greater or equal to the key,
+// `rank` is set to the number of items less than the key.
+BPos bt_lower_bound(BTree *tree, double score, const void *key, size_t *rank) {
+    BPos pos;
+    *rank = 0;
+    if (!tree->root) {
+        return pos;
+    }
+    BNode *node = tree->root;
+    for (uint32_t h = tree->height; h > 0; --h) {
+        BInner *inner = as_inner(node);
+        uint32_t i = inner_child(tree, inner, score, key);
+        for (uint32_t j = 0; j < i; ++j) {
+            *rank += inner->cnt[j];
+        }
+        node = inner->child[i];
+    }
+    BLeaf *leaf = as_leaf(node);
+    pos.slot = leaf_lower_bound(tree, leaf, score, key);
+    *rank += pos.slot;
+    if (pos.slot == leaf->base.n) {
+        pos.leaf = leaf->next;
+        pos.slot = 0;
+    } else {
+        pos.leaf = leaf;
+    }
+    return pos;
+}
+
+// the item at a 0-based rank
+BPos bt_select(BTree *tree, size_t rank) {
+    BPos pos;
+    if (rank >= tree->size) {
+        return pos;
+    }
+    BNode *node = tree->root;
+    for (uint32_t h = tree->height; h > 0; --h) {
+        BInner *inner = as_inner(node);
+        uint32_t i = 0;
+        while (rank >= inner->cnt[i]) {
+            rank -= inner->cnt[i];
+            i++;
+        }
+        node = inner->child[i];
+    }
+    pos.leaf = as_leaf(node);
+    pos.slot = (uint32_t)rank;
+    return pos;
+}
+
+void bt_next(BPos *pos) {
+    if (++pos->slot >= pos->leaf->base.n) {
+        pos->leaf = pos->leaf->next;
+        pos->slot = 0;
+    }
+}
+
+void bt_prev(BPos *pos) {
+    if (pos->slot > 0) {
+        pos->slot--;
+        return;
+    }
+    pos->leaf = pos->leaf->prev;
+    pos->slot = pos->leaf ? pos->leaf->base.n - 1 : 0;
+}
+
+static void dispose_rec(BNode *node, uint32_t height, void (*del)(void *ref)) {
+    if (height == 0) {
+        BLeaf *leaf = as_leaf(node);
+        for (uint32_t i = 0; del && i < leaf->base.n; ++i) {
+            del(leaf->ref[i]);
+        }
+    } else {
+        BInner *inner = as_inner(node);
+        for (uint32_t i = 0; i < inner->base.n; ++i) {
+            dispose_rec(inner->child[i], height - 1, del);
+        }
+    }
+    free(node);
+}
+
+// free all nodes, `del` is called on each ref
+void bt_dispose(BTree *tree, void (*del)(void *ref)) {
+    if (tree->root) {
+        dispose_rec(tree->root, tree->height, del);
+    }
+    tree->root = NULL;
+    tree->height = 0;
+    tree->size = 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// an order-statistic B+tree of (score, ref) items.
+// items are ordered by score, ties are broken by `BTree::cmp`.
+const uint32_t k_bt_max = 32;           // max items per leaf or children per inner node
+const uint32_t k_bt_min = k_bt_max / 2; // non-root nodes never go below this
+
+struct BNode {
+    uint32_t n = 0;     // number of items (leaf) or children (inner)
+};
+
+// leaves are linked for range scans
+struct BLeaf {
+    BNode base;
+    BLeaf *prev = NULL;
+    BLeaf *next = NULL;
+    double score[k_bt_max + 1];     // 1 extra slot before splitting
+    void *ref[k_bt_max + 1];
+};
+
+// separator i is the first item of child i + 1,
+// cnt[i] is the number of items under child i.
+struct BInner {
+    BNode base;
+    double score[k_bt_max];
+    void *ref[k_bt_max];
+    size_t cnt[k_bt_max + 1];
+    BNode *child[k_bt_max + 1];
+};
+
+struct BTree {
+    BNode *root = NULL;
+    uint32_t height = 0;    // number of inner levels above the leaves
+    size_t size = 0;
+    // compares the ref of an item with a search key, used for equal scores
+    int (*cmp)(const void *ref, const void *key) = NULL;
+};
+
+// a position in the tree, `leaf` is NULL when out of range
+struct BPos {
+    BLeaf *leaf = NULL;
+    uint32_t slot = 0;
+};
+
+void bt_build(BTree *tree, const double *score, void *const *ref, size_t n);
+void bt_insert(BTree *tree, double score, void *ref, const void *key);
+void *bt_delete(BTree *tree, double score, const void *key);
+BPos bt_lower_bound(BTree *tree, double score, const void *key, size_t *rank);
+BPos bt_select(BTree *tree, size_t rank);
+void bt_next(BPos *pos);
+void bt_prev(BPos *pos);
+void bt_dispose(BTree *tree, void (*del)(void *ref));
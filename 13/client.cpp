@@ -0,0 +1,421 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+// proj
+#include "client.h"
+#include "common.h"
+
+
+const size_t k_max_msg = 4096;
+
+// the values are checked the same way as the server writes them:
+// a tag, then fixed-size fields, then the string or the elements
+static int32_t reply_parse_value(const uint8_t *data, size_t size, ReplyView *out) {
+    if (size < 1) {
+        return -1;
+    }
+    out->type = data[0];
+    switch (data[0]) {
+    case SER_NIL:
+        return 1;
+    case SER_ERR: {
+        uint32_t len = 0;
+        if (size < 1 + 8) {
+            return -1;
+        }
+        memcpy(&out->code, &data[1], 4);
+        memcpy(&len, &data[1 + 4], 4);
+        if (size - (1 + 8) < len) {
+            return -1;
+        }
+        out->str = (const char *)&data[1 + 8];
+        out->len = len;
+        return (int32_t)(1 + 8 + len);
+    }
+    case SER_STR: {
+        uint32_t len = 0;
+        if (size < 1 + 4) {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        if (size - (1 + 4) < len) {
+            return -1;
+        }
+        out->str = (const char *)&data[1 + 4];
+        out->len = len;
+        return (int32_t)(1 + 4 + len);
+    }
+    case SER_INT:
+        if (size < 1 + 8) {
+            return -1;
+        }
+        memcpy(&out->ival, &data[1], 8);
+        return 1 + 8;
+    case SER_DBL:
+        if (size < 1 + 8) {
+            return -1;
+        }
+        memcpy(&out->dval, &data[1], 8);
+        return 1 + 8;
+    case SER_ARR: {
+        uint32_t len = 0;
+        if (size < 1 + 4) {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        size_t arr_bytes = 1 + 4;
+        for (uint32_t i = 0; i < len; ++i) {
+            ReplyView elem;
+            int32_t rv = reply_parse_value(&data[arr_bytes], size - arr_bytes, &elem);
+            if (rv < 0) {
+                return rv;
+            }
+            arr_bytes += (size_t)rv;
+        }
+        out->len = len;
+        out->elems = &data[1 + 4];
+        out->elems_size = arr_bytes - (1 + 4);
+        return (int32_t)arr_bytes;
+    }
+    default:
+        return -1;
+    }
+}
+
+int32_t reply_parse(const uint8_t *data, size_t size, ReplyView *out) {
+    *out = ReplyView{};
+    int32_t rv = reply_parse_value(data, size, out);
+    if (rv > 0) {
+        out->raw = data;
+        out->raw_size = (size_t)rv;
+    }
+    return rv;
+}
+
+ReplyIter reply_iter(const ReplyView *arr) {
+    assert(arr->type == SER_ARR);
+    ReplyIter iter;
+    iter.data = arr->elems;
+    iter.size = arr->elems_size;
+    iter.left = arr->len;
+    return iter;
+}
+
+bool reply_next(ReplyIter *iter, ReplyView *out) {
+    if (iter->left == 0) {
+        return false;
+    }
+    int32_t rv = reply_parse(iter->data, iter->size, out);
+    assert(rv > 0);     // checked by reply_parse() of the array
+    iter->data += rv;
+    iter->size -= (size_t)rv;
+    iter->left--;
+    return true;
+}
+
+// the callbacks may queue more requests, so each one is removed first
+static void conn_fail(ClientConn *conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->wbuf.clear();
+    conn->wbuf_sent = 0;
+    conn->rbuf.clear();
+    conn->rbuf_read = conn->rbuf_len = 0;
+    while (!conn->pending.empty()) {
+        ClientPending p = conn->pending.front();
+        conn->pending.pop_front();
+        p.cb(p.arg, NULL);
+    }
+}
+
+static int conn_connect(uint32_t addr, uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in sa = {};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = addr;
+    if (connect(fd, (const struct sockaddr *)&sa, sizeof(sa))) {
+        close(fd);
+        return -1;
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+int32_t client_open(Client *client, const char *host, uint16_t port, uint32_t nconns) {
+    struct in_addr addr = {};
+    if (nconns == 0 || inet_pton(AF_INET, host, &addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    client->conns.resize(nconns);
+    for (ClientConn &conn : client->conns) {
+        conn.fd = conn_connect(addr.s_addr, port);
+        if (conn.fd < 0) {
+            int err = errno;
+            client_close(client);
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void client_close(Client *client) {
+    for (ClientConn &conn : client->conns) {
+        conn_fail(&conn);
+    }
+    client->conns.clear();
+    client->next = 0;
+}
+
+// writes what the socket takes without blocking
+static void conn_flush(ClientConn *conn) {
+    while (conn->wbuf_sent < conn->wbuf.size()) {
+        ssize_t rv = write(
+            conn->fd, &conn->wbuf[conn->wbuf_sent], conn->wbuf.size() - conn->wbuf_sent);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv < 0) {
+            conn_fail(conn);
+            return;
+        }
+        conn->wbuf_sent += (size_t)rv;
+    }
+    conn->wbuf.clear();
+    conn->wbuf_sent = 0;
+}
+
+static ClientConn *conn_pick(Client *client) {
+    ClientConn *best = NULL;
+    size_t n = client->conns.size();
+    for (size_t i = 0; i < n; ++i) {
+        ClientConn *conn = &client->conns[(client->next + i) % n];
+        if (conn->fd >= 0 && (!best || conn->pending.size() < best->pending.size())) {
+            best = conn;
+        }
+    }
+    client->next = n ? (client->next + 1) % n : 0;
+    return best;
+}
+
+int32_t client_send(Client *client, const ClientArg *args, size_t n, ReplyCb cb, void *arg) {
+    uint32_t len = 4;
+    for (size_t i = 0; i < n; ++i) {
+        if (args[i].len > k_max_msg) {
+            return -1;
+        }
+        len += 4 + (uint32_t)args[i].len;
+        if (len > k_max_msg) {
+            return -1;
+        }
+    }
+    ClientConn *conn = conn_pick(client);
+    if (!conn) {
+        return -1;
+    }
+    // the format of a request: | len | nstr | len | str1 | len | str2 | ...
+    uint32_t nstr = (uint32_t)n;
+    conn->wbuf.append((char *)&len, 4);     // assume little endian
+    conn->wbuf.append((char *)&nstr, 4);
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t p = (uint32_t)args[i].len;
+        conn->wbuf.append((char *)&p, 4);
+        conn->wbuf.append(args[i].data, args[i].len);
+    }
+    conn->pending.push_back(ClientPending{cb, arg});
+    if (conn->wbuf.size() - conn->wbuf_sent >= client->max_wbuf) {
+        conn_flush(conn);   // the callback runs if the connection is lost
+    }
+    return 0;
+}
+
+int32_t client_send(
+    Client *client, const std::vector<std::string> &cmd, ReplyCb cb, void *arg)
+{
+    std::vector<ClientArg> args(cmd.size());
+    for (size_t i = 0; i < cmd.size(); ++i) {
+        args[i] = ClientArg{cmd[i].data(), cmd[i].size()};
+    }
+    return client_send(client, args.data(), args.size(), cb, arg);
+}
+
+// runs the callbacks of the complete replies in the buffer.
+// returns the number of callbacks, or -1 on a bad reply.
+static int32_t conn_dispatch(ClientConn *conn) {
+    int32_t ncb = 0;
+    while (conn->rbuf_len - conn->rbuf_read >= 4) {
+        const uint8_t *frame = &conn->rbuf[conn->rbuf_read];
+        uint32_t len = 0;
+        memcpy(&len, frame, 4);
+        if (len > k_max_msg || conn->pending.empty()) {
+            return -1;
+        }
+        if (conn->rbuf_len - conn->rbuf_read < 4 + (size_t)len) {
+            break;
+        }
+        ReplyView reply;
+        if (reply_parse(&frame[4], len, &reply) != (int32_t)len) {
+            return -1;
+        }
+        ClientPending p = conn->pending.front();
+        conn->pending.pop_front();
+        conn->rbuf_read += 4 + len;
+        p.cb(p.arg, &reply);
+        ncb++;
+    }
+    // keep the partial reply at the front, then room for a full one
+    if (conn->rbuf_read == conn->rbuf_len) {
+        conn->rbuf_read = conn->rbuf_len = 0;
+    } else if (conn->rbuf_read > 0) {
+        memmove(conn->rbuf.data(), &conn->rbuf[conn->rbuf_read],
+            conn->rbuf_len - conn->rbuf_read);
+        conn->rbuf_len -= conn->rbuf_read;
+        conn->rbuf_read = 0;
+    }
+    return ncb;
+}
+
+// reads straight into the buffer, without a copy from a stack buffer
+static int32_t conn_read(ClientConn *conn) {
+    const size_t k_read_min = 64 * 1024;
+    int32_t ncb = 0;
+    while (true) {
+        if (conn->rbuf.size() - conn->rbuf_len < k_read_min) {
+            conn->rbuf.resize(conn->rbuf_len + k_read_min);
+        }
+        size_t room = conn->rbuf.size() - conn->rbuf_len;
+        ssize_t rv = read(conn->fd, &conn->rbuf[conn->rbuf_len], room);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return ncb;
+        }
+        if (rv <= 0) {
+            conn_fail(conn);    // an error or EOF
+            return ncb;
+        }
+        conn->rbuf_len += (size_t)rv;
+        int32_t rv2 = conn_dispatch(conn);
+        if (rv2 < 0) {
+            conn_fail(conn);
+            return ncb;
+        }
+        ncb += rv2;
+        if ((size_t)rv < room || conn->fd < 0) {
+            return ncb;
+        }
+    }
+}
+
+int32_t client_poll(Client *client, int timeout_ms) {
+    std::vector<struct pollfd> poll_args;
+    std::vector<ClientConn *> polled;
+    for (ClientConn &conn : client->conns) {
+        if (conn.fd >= 0 && conn.wbuf.size() > conn.wbuf_sent) {
+            conn_flush(&conn);
+        }
+        if (conn.fd < 0 || (conn.pending.empty() && conn.wbuf.empty())) {
+            continue;
+        }
+        struct pollfd pfd = {conn.fd, POLLIN, 0};
+        if (conn.wbuf.size() > conn.wbuf_sent) {
+            pfd.events |= POLLOUT;
+        }
+        poll_args.push_back(pfd);
+        polled.push_back(&conn);
+    }
+    if (poll_args.empty()) {
+        for (ClientConn &conn : client->conns) {
+            if (conn.fd >= 0) {
+                return 0;   // nothing to wait for
+            }
+        }
+        return -1;
+    }
+
+    int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
+    if (rv < 0 && errno == EINTR) {
+        return 0;
+    }
+    assert(rv >= 0);
+    int32_t ncb = 0;
+    for (size_t i = 0; i < poll_args.size(); ++i) {
+        ClientConn *conn = polled[i];
+        short ready = poll_args[i].revents;
+        if (conn->fd >= 0 && (ready & POLLOUT)) {
+            conn_flush(conn);
+        }
+        if (conn->fd >= 0 && (ready & (POLLIN | POLLERR | POLLHUP))) {
+            ncb += conn_read(conn);
+        }
+    }
+    return ncb;
+}
+
+size_t client_pending(const Client *client) {
+    size_t n = 0;
+    for (const ClientConn &conn : client->conns) {
+        n += conn.pending.size();
+    }
+    return n;
+}
+
+static void future_done(void *arg, const ReplyView *reply) {
+    ClientFuture *fut = (ClientFuture *)arg;
+    fut->done = true;
+    if (!reply) {
+        fut->failed = true;
+        return;
+    }
+    fut->data.assign((const char *)reply->raw, reply->raw_size);
+}
+
+int32_t client_send_future(
+    Client *client, const std::vector<std::string> &cmd, ClientFuture *fut)
+{
+    *fut = ClientFuture{};
+    return client_send(client, cmd, &future_done, fut);
+}
+
+int32_t client_wait(Client *client, ClientFuture *fut, ReplyView *out) {
+    while (!fut->done) {
+        if (client_poll(client, -1) < 0 && !fut->done) {
+            return -1;  // not sent, or lost without a callback
+        }
+    }
+    if (fut->failed) {
+        return -1;
+    }
+    int32_t rv = reply_parse((const uint8_t *)fut->data.data(), fut->data.size(), out);
+    assert(rv == (int32_t)fut->data.size());
+    return 0;
+}
+
+int32_t client_call(
+    Client *client, const std::vector<std::string> &cmd, ClientFuture *fut, ReplyView *out)
+{
+    if (client_send_future(client, cmd, fut) < 0) {
+        return -1;
+    }
+    return client_wait(client, fut, out);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+
+// a reply parsed in place. the strings point into the parsed buffer,
+// an array keeps its serialized elements, to be walked by ReplyIter.
+struct ReplyView {
+    uint32_t type = 0;          // SER_*
+    int32_t code = 0;           // SER_ERR
+    const char *str = NULL;     // SER_STR, or the message of SER_ERR
+    uint32_t len = 0;           // the bytes of `str`, or the elements of SER_ARR
+    int64_t ival = 0;           // SER_INT
+    double dval = 0;            // SER_DBL
+    const uint8_t *elems = NULL;    // SER_ARR
+    size_t elems_size = 0;
+    const uint8_t *raw = NULL;      // the whole value, as serialized
+    size_t raw_size = 0;
+};
+
+// parses and checks a whole value, nested arrays included.
+// returns its size in bytes, or -1 if it's malformed.
+int32_t reply_parse(const uint8_t *data, size_t size, ReplyView *out);
+
+// the elements of an array that reply_parse() returned
+struct ReplyIter {
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    uint32_t left = 0;
+};
+
+ReplyIter reply_iter(const ReplyView *arr);
+bool reply_next(ReplyIter *iter, ReplyView *out);
+
+// a client over a pool of non-blocking connections. requests are queued
+// without waiting and written in batches, each connection matches its
+// replies to its requests in order. client_poll() does the IO and runs the
+// callbacks, from one thread, like the event loop of the server.
+// requests on different connections may run in any order, so a client
+// with a single connection is needed when one request depends on another.
+// the pub/sub mode is not supported, its messages are not replies.
+
+// called once per request. `reply` is NULL when the connection was lost
+// before the reply came. the view is valid until the callback returns.
+// a callback may send requests, but must not poll or close the client.
+typedef void (*ReplyCb)(void *arg, const ReplyView *reply);
+
+struct ClientArg {
+    const char *data;
+    size_t len;
+};
+
+struct ClientPending {
+    ReplyCb cb;
+    void *arg;
+};
+
+struct ClientConn {
+    int fd = -1;                // -1 once lost
+    std::string wbuf;
+    size_t wbuf_sent = 0;
+    std::vector<uint8_t> rbuf;  // replies are parsed where they are read
+    size_t rbuf_read = 0;       // parsed up to here
+    size_t rbuf_len = 0;        // read up to here
+    std::deque<ClientPending> pending;
+};
+
+struct Client {
+    std::vector<ClientConn> conns;
+    size_t next = 0;            // where the search for the least busy starts
+    size_t max_wbuf = 64 * 1024;    // written without waiting for client_poll()
+};
+
+// connects to an IPv4 address. returns 0, or -1 with the client closed.
+int32_t client_open(Client *client, const char *host, uint16_t port, uint32_t nconns);
+// the pending requests fail
+void client_close(Client *client);
+// queues a request on the least busy connection.
+// returns -1 if it's too big or all connections are lost.
+int32_t client_send(Client *client, const ClientArg *args, size_t n, ReplyCb cb, void *arg);
+int32_t client_send(
+    Client *client, const std::vector<std::string> &cmd, ReplyCb cb, void *arg);
+// writes the queued requests, reads the replies and runs their callbacks,
+// waiting up to `timeout_ms` (-1 is forever) for the sockets to be ready.
+// returns the number of callbacks, or -1 if all connections are lost.
+int32_t client_poll(Client *client, int timeout_ms);
+size_t client_pending(const Client *client);
+
+// a reply kept beyond the callback, to wait for a single request.
+// it must stay in place until it's done.
+struct ClientFuture {
+    bool done = false;
+    bool failed = false;        // the connection was lost
+    std::string data;           // the serialized reply
+};
+
+int32_t client_send_future(
+    Client *client, const std::vector<std::string> &cmd, ClientFuture *fut);
+// polls until the future is done, `out` points into `fut->data`.
+// returns 0, or -1 if the request failed.
+int32_t client_wait(Client *client, ClientFuture *fut, ReplyView *out);
+// client_send_future() and client_wait()
+int32_t client_call(
+    Client *client, const std::vector<std::string> &cmd, ClientFuture *fut, ReplyView *out);
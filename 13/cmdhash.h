@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+
+// a perfect hash of command names, found at compile time. names are
+// hashed with the ASCII case bit set, so the lookup is case-insensitive.
+// a hit must still be compared, as other words land in the same slots.
+
+// FNV-1a, the last xorshift spreads the high bits to the low bits
+constexpr uint32_t cmd_hash(const char *s, size_t len, uint32_t seed) {
+    uint32_t h = 0x811c9dc5u ^ seed;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (uint8_t)(s[i] | 0x20)) * 0x01000193u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr size_t cmd_name_len(const char *s) {
+    size_t n = 0;
+    while (s[n]) {
+        n++;
+    }
+    return n;
+}
+
+const uint8_t k_cmd_slot_empty = 0xff;
+
+// `slots` maps a hash to an index in the table, `nslots` is a power of 2
+template <size_t nslots>
+struct CmdHash {
+    uint32_t seed = 0;
+    uint8_t slots[nslots] = {};
+};
+
+// tries seeds until no 2 names share a slot. `T` has a `name` member.
+template <size_t nslots, class T, size_t n>
+constexpr CmdHash<nslots> cmd_hash_build(const T (&table)[n]) {
+    static_assert((nslots & (nslots - 1)) == 0, "nslots is a power of 2");
+    static_assert(n < k_cmd_slot_empty, "too many commands");
+    CmdHash<nslots> h;
+    for (uint32_t seed = 1; ; ++seed) {
+        h.seed = seed;
+        for (size_t i = 0; i < nslots; ++i) {
+            h.slots[i] = k_cmd_slot_empty;
+        }
+        bool ok = true;
+        for (size_t i = 0; i < n && ok; ++i) {
+            const char *name = table[i].name;
+            uint32_t slot = cmd_hash(name, cmd_name_len(name), seed) & (nslots - 1);
+            ok = h.slots[slot] == k_cmd_slot_empty;
+            h.slots[slot] = (uint8_t)i;
+        }
+        if (ok) {
+            return h;
+        }
+    }
+}
+
+// the index of the command `name` in the table built into `h`, or -1.
+// all `len` bytes are compared, a NUL in `name` doesn't end it.
+template <size_t nslots, class T, size_t n>
+inline int32_t cmd_hash_find(
+    const CmdHash<nslots> &h, const T (&table)[n], const char *name, size_t len)
+{
+    uint8_t idx = h.slots[cmd_hash(name, len, h.seed) & (nslots - 1)];
+    if (idx == k_cmd_slot_empty || len != cmd_name_len(table[idx].name)
+        || 0 != strncasecmp(name, table[idx].name, len))
+    {
+        return -1;
+    }
+    return idx;
+}
@@ -0,0 +1,80 @@
+// the commands, one CMD() each, for the files that define CMD():
+//   CMD(name, handler, min_args, max_args, flags, first_key, last_key, key_step)
+// 13Server.cpp builds `k_cmds` from them, see CmdSpec. 13MicroBench.cpp
+// takes only the names, so the handlers and flags are not declared there.
+// no include guard, it's included once per table.
+
+//  name               handler                 arity   flags               keys
+CMD("keys",            &do_keys,               1, 1,   0,                  0, 0, 0)
+CMD("get",             &do_get,                2, 2,   0,                  1, 1, 1)
+CMD("set",             &do_set,                3, 0,   CMD_WRITE,          1, 1, 1)
+CMD("del",             &do_del,                2, 2,   CMD_WRITE,          1, 1, 1)
+CMD("setbit",          &do_setbit,             4, 4,   CMD_WRITE,          1, 1, 1)
+CMD("getbit",          &do_getbit,             3, 3,   0,                  1, 1, 1)
+CMD("bitcount",        &do_bitcount,           2, 5,   0,                  1, 1, 1)
+CMD("bitpos",          &do_bitpos,             3, 6,   0,                  1, 1, 1)
+CMD("bitop",           &do_bitop,              4, 0,   CMD_WRITE,          2, -1, 1)
+CMD("pfadd",           &do_pfadd,              2, 0,   CMD_WRITE,          1, 1, 1)
+CMD("pfcount",         &do_pfcount,            2, 0,   0,                  1, -1, 1)
+CMD("pfmerge",         &do_pfmerge,            2, 0,   CMD_WRITE,          1, -1, 1)
+CMD("incr",            &do_incr,               2, 2,   CMD_WRITE,          1, 1, 1)
+CMD("decr",            &do_decr,               2, 2,   CMD_WRITE,          1, 1, 1)
+CMD("incrby",          &do_incr,               3, 3,   CMD_WRITE,          1, 1, 1)
+CMD("decrby",          &do_decr,               3, 3,   CMD_WRITE,          1, 1, 1)
+CMD("incrbyfloat",     &do_incrbyfloat,        3, 3,   CMD_WRITE,          1, 1, 1)
+CMD("pexpire",         &do_expire,             3, 3,   CMD_WRITE,          1, 1, 1)
+CMD("pexpireat",       &do_expireat,           3, 3,   CMD_WRITE,          1, 1, 1)
+CMD("persist",         &do_persist,            2, 2,   CMD_WRITE,          1, 1, 1)
+CMD("getex",           &do_getex,              2, 4,   CMD_WRITE_OPTS,     1, 1, 1)
+CMD("pttl",            &do_ttl,                2, 2,   0,                  1, 1, 1)
+CMD("save",            &do_save,               1, 1,   0,                  0, 0, 0)
+CMD("bgsave",          &do_bgsave,             1, 1,   0,                  0, 0, 0)
+CMD("bgrewriteaof",    &do_bgrewriteaof,       1, 1,   0,                  0, 0, 0)
+CMD("role",            &do_role,               1, 1,   0,                  0, 0, 0)
+CMD("publish",         &do_publish,            3, 3,   0,                  0, 0, 0)
+CMD("info",            &do_info,               1, 0,   0,                  0, 0, 0)
+CMD("latency",         &do_latency,            2, 0,   0,                  0, 0, 0)
+CMD("slowlog",         &do_slowlog,            2, 3,   0,                  0, 0, 0)
+CMD("zadd",            &do_zadd,               4, 0,   CMD_WRITE,          1, 1, 1)
+CMD("zrem",            &do_zrem,               3, 3,   CMD_WRITE,          1, 1, 1)
+CMD("zremrangebyscore", &do_zremrangebyscore,  4, 4,   CMD_WRITE,          1, 1, 1)
+CMD("zremrangebyrank", &do_zremrangebyrank,    4, 4,   CMD_WRITE,          1, 1, 1)
+CMD("zscore",          &do_zscore,             3, 3,   0,                  1, 1, 1)
+CMD("zquery",          &do_zquery,             6, 6,   0,                  1, 1, 1)
+CMD("zunionstore",     &do_zunionstore,        4, 0,   CMD_WRITE | CMD_MOVABLE, 1, 1, 1)
+CMD("zinterstore",     &do_zinterstore,        4, 0,   CMD_WRITE | CMD_MOVABLE, 1, 1, 1)
+CMD("zdiffstore",      &do_zdiffstore,         4, 0,   CMD_WRITE | CMD_MOVABLE, 1, 1, 1)
+CMD("hset",            &do_hset,               4, 0,   CMD_WRITE,          1, 1, 1)
+CMD("hget",            &do_hget,               3, 3,   0,                  1, 1, 1)
+CMD("hmget",           &do_hmget,              3, 0,   0,                  1, 1, 1)
+CMD("hdel",            &do_hdel,               3, 0,   CMD_WRITE,          1, 1, 1)
+CMD("hincrby",         &do_hincrby,            4, 4,   CMD_WRITE,          1, 1, 1)
+CMD("hgetall",         &do_hgetall,            2, 2,   0,                  1, 1, 1)
+CMD("hscan",           &do_hscan,              3, 5,   0,                  1, 1, 1)
+CMD("lpush",           &do_lpush,              3, 0,   CMD_WRITE,          1, 1, 1)
+CMD("rpush",           &do_rpush,              3, 0,   CMD_WRITE,          1, 1, 1)
+CMD("lpop",            &do_lpop,               2, 3,   CMD_WRITE,          1, 1, 1)
+CMD("rpop",            &do_rpop,               2, 3,   CMD_WRITE,          1, 1, 1)
+CMD("lrange",          &do_lrange,             4, 4,   0,                  1, 1, 1)
+CMD("ltrim",           &do_ltrim,              4, 4,   CMD_WRITE,          1, 1, 1)
+CMD("llen",            &do_llen,               2, 2,   0,                  1, 1, 1)
+CMD("lindex",          &do_lindex,             3, 3,   0,                  1, 1, 1)
+CMD("sadd",            &do_sadd,               3, 0,   CMD_WRITE,          1, 1, 1)
+CMD("srem",            &do_srem,               3, 0,   CMD_WRITE,          1, 1, 1)
+CMD("sismember",       &do_sismember,          3, 3,   0,                  1, 1, 1)
+CMD("smembers",        &do_smembers,           2, 2,   0,                  1, 1, 1)
+CMD("scard",           &do_scard,              2, 2,   0,                  1, 1, 1)
+CMD("sinter",          &do_sinter,             2, 0,   0,                  1, -1, 1)
+CMD("sintercard",      &do_sintercard,         3, 0,   CMD_MOVABLE,        0, 0, 0)
+CMD("sunion",          &do_sunion,             2, 0,   0,                  1, -1, 1)
+CMD("sdiff",           &do_sdiff,              2, 0,   0,                  1, -1, 1)
+CMD("multi",           NULL,                   1, 1,   CMD_TX,             0, 0, 0)
+CMD("exec",            NULL,                   1, 1,   CMD_TX,             0, 0, 0)
+CMD("discard",         NULL,                   1, 1,   CMD_TX,             0, 0, 0)
+CMD("watch",           NULL,                   2, 0,   CMD_TX,             1, -1, 1)
+CMD("unwatch",         NULL,                   1, 1,   CMD_TX,             0, 0, 0)
+CMD("subscribe",       NULL,                   2, 0,   CMD_PUBSUB,         0, 0, 0)
+CMD("psubscribe",      NULL,                   2, 0,   CMD_PUBSUB,         0, 0, 0)
+CMD("unsubscribe",     NULL,                   1, 0,   CMD_PUBSUB,         0, 0, 0)
+CMD("punsubscribe",    NULL,                   1, 0,   CMD_PUBSUB,         0, 0, 0)
+CMD("psync",           NULL,                   3, 3,   CMD_REPL,           0, 0, 0)
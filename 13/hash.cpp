@@ -0,0 +1,267 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+// proj
+#include "hash.h"
+#include "common.h"
+
+
+HashConf g_hash_conf;
+
+// the compact encoding.
+// each pair is laid out as: | flen (1 byte) | vlen (1 byte) | field | value |
+const size_t k_pair_hdr = 1 + 1;
+
+static size_t pack_max_value() {
+    return g_hash_conf.max_pack_value < 255 ? g_hash_conf.max_pack_value : 255;
+}
+
+// the byte position of the pair holding `field`, -1 if none
+static int64_t pack_find(HPack *pack, const char *field, size_t flen) {
+    uint32_t pos = 0;
+    while (pos < pack->used) {
+        size_t fl = pack->buf[pos];
+        size_t vl = pack->buf[pos + 1];
+        if (fl == flen && 0 == memcmp(&pack->buf[pos + k_pair_hdr], field, flen)) {
+            return pos;
+        }
+        pos += (uint32_t)(k_pair_hdr + fl + vl);
+    }
+    return -1;
+}
+
+static void pack_reserve(HPack *pack, size_t bytes) {
+    if (pack->used + bytes <= pack->cap) {
+        return;
+    }
+    size_t cap = pack->cap ? pack->cap : 64;
+    while (cap < pack->used + bytes) {
+        cap *= 2;
+    }
+    pack->buf = (uint8_t *)realloc(pack->buf, cap);
+    assert(pack->buf);
+    pack->cap = (uint32_t)cap;
+}
+
+static void pack_remove(HPack *pack, uint32_t pos) {
+    uint32_t sz = (uint32_t)(k_pair_hdr + pack->buf[pos] + pack->buf[pos + 1]);
+    memmove(&pack->buf[pos], &pack->buf[pos + sz], pack->used - pos - sz);
+    pack->n--;
+    pack->used -= sz;
+}
+
+static void pack_append(
+    HPack *pack, const char *field, size_t flen, const char *val, size_t vlen)
+{
+    size_t sz = k_pair_hdr + flen + vlen;
+    pack_reserve(pack, sz);
+    uint8_t *p = &pack->buf[pack->used];
+    p[0] = (uint8_t)flen;
+    p[1] = (uint8_t)vlen;
+    memcpy(&p[k_pair_hdr], field, flen);
+    memcpy(&p[k_pair_hdr + flen], val, vlen);
+    pack->n++;
+    pack->used += (uint32_t)sz;
+}
+
+static void pack_dispose(HPack *pack) {
+    free(pack->buf);
+    *pack = HPack{};
+}
+
+static HField *hfield_new(const char *field, size_t flen, const char *val, size_t vlen) {
+    HField *node = (HField *)malloc(sizeof(HField) + flen + vlen);
+    assert(node);   // not a good idea in real projects
+    node->node.next = NULL;
+    node->node.hcode = str_hash((uint8_t *)field, flen);
+    node->flen = (uint32_t)flen;
+    node->vlen = (uint32_t)vlen;
+    memcpy(&node->data[0], field, flen);
+    memcpy(&node->data[flen], val, vlen);
+    return node;
+}
+
+// a helper structure for the hashtable lookup
+struct HKey {
+    HNode node;
+    const char *field = NULL;
+    size_t flen = 0;
+};
+
+static bool hcmp(HNode *node, HNode *key) {
+    HField *hf = container_of(node, HField, node);
+    HKey *hkey = container_of(key, HKey, node);
+    return hf->flen == hkey->flen && 0 == memcmp(hf->data, hkey->field, hf->flen);
+}
+
+static HKey hkey_of(const char *field, size_t flen) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)field, flen);
+    key.field = field;
+    key.flen = flen;
+    return key;
+}
+
+static HField *map_lookup(Hash *hash, const char *field, size_t flen) {
+    HKey key = hkey_of(field, flen);
+    HNode *node = hm_lookup(&hash->hmap, &key.node, &hcmp);
+    return node ? container_of(node, HField, node) : NULL;
+}
+
+// switch from the compact encoding to the hashtable
+static void hash_convert(Hash *hash) {
+    assert(hash->enc == HASH_PACK);
+    HPack *pack = &hash->pack;
+    hm_reserve(&hash->hmap, pack->n + 1);
+    uint32_t pos = 0;
+    while (pos < pack->used) {
+        size_t fl = pack->buf[pos];
+        size_t vl = pack->buf[pos + 1];
+        const char *field = (const char *)&pack->buf[pos + k_pair_hdr];
+        HField *node = hfield_new(field, fl, field + fl, vl);
+        hm_insert(&hash->hmap, &node->node);
+        pos += (uint32_t)(k_pair_hdr + fl + vl);
+    }
+    pack_dispose(pack);
+    hash->enc = HASH_MAP;
+}
+
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen) {
+    if (hash->enc == HASH_PACK) {
+        int64_t pos = pack_find(&hash->pack, field, flen);
+        if (pos < 0) {
+            return false;
+        }
+        *val = (const char *)&hash->pack.buf[pos + k_pair_hdr + flen];
+        *vlen = hash->pack.buf[pos + 1];
+        return true;
+    }
+    HField *node = map_lookup(hash, field, flen);
+    if (!node) {
+        return false;
+    }
+    *val = &node->data[node->flen];
+    *vlen = node->vlen;
+    return true;
+}
+
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen) {
+    if (hash->enc == HASH_PACK) {
+        HPack *pack = &hash->pack;
+        int64_t pos = pack_find(pack, field, flen);
+        if (pos >= 0 && pack->buf[pos + 1] == vlen) {
+            memcpy(&pack->buf[pos + k_pair_hdr + flen], val, vlen);     // in place
+            return false;
+        }
+        bool added = pos < 0;
+        size_t n = pack->n + (added ? 1 : 0);
+        if (n <= g_hash_conf.max_pack_len
+            && flen <= pack_max_value() && vlen <= pack_max_value())
+        {
+            if (!added) {
+                pack_remove(pack, (uint32_t)pos);
+            }
+            pack_append(pack, field, flen, val, vlen);
+            return added;
+        }
+        hash_convert(hash);
+    }
+
+    HKey key = hkey_of(field, flen);
+    HNode *old = hm_lookup(&hash->hmap, &key.node, &hcmp);
+    if (old) {
+        HField *node = container_of(old, HField, node);
+        if (node->vlen == vlen) {
+            memcpy(&node->data[flen], val, vlen);   // in place
+            return false;
+        }
+        hm_pop(&hash->hmap, &key.node, &hcmp);
+        free(node);
+    }
+    HField *node = hfield_new(field, flen, val, vlen);
+    hm_insert(&hash->hmap, &node->node);
+    return !old;
+}
+
+bool hash_del(Hash *hash, const char *field, size_t flen) {
+    if (hash->enc == HASH_PACK) {
+        int64_t pos = pack_find(&hash->pack, field, flen);
+        if (pos < 0) {
+            return false;
+        }
+        pack_remove(&hash->pack, (uint32_t)pos);
+        return true;
+    }
+    HKey key = hkey_of(field, flen);
+    HNode *node = hm_pop(&hash->hmap, &key.node, &hcmp);
+    if (!node) {
+        return false;
+    }
+    free(container_of(node, HField, node));
+    return true;
+}
+
+size_t hash_size(Hash *hash) {
+    return hash->enc == HASH_PACK ? hash->pack.n : hm_size(&hash->hmap);
+}
+
+static void cb_free(HNode *node, void *arg) {
+    (void)arg;
+    free(container_of(node, HField, node));
+}
+
+void hash_dispose(Hash *hash) {
+    pack_dispose(&hash->pack);
+    hm_foreach(&hash->hmap, &cb_free, NULL);
+    hm_destroy(&hash->hmap);
+    hash->enc = HASH_PACK;
+}
+
+struct VisitCtx {
+    hash_visit_fn f = NULL;
+    void *arg = NULL;
+    size_t n = 0;
+};
+
+static void cb_visit(HNode *node, void *arg) {
+    VisitCtx *ctx = (VisitCtx *)arg;
+    HField *hf = container_of(node, HField, node);
+    ctx->f(hf->data, hf->flen, &hf->data[hf->flen], hf->vlen, ctx->arg);
+    ctx->n++;
+}
+
+static void pack_foreach(HPack *pack, hash_visit_fn f, void *arg) {
+    uint32_t pos = 0;
+    while (pos < pack->used) {
+        size_t fl = pack->buf[pos];
+        size_t vl = pack->buf[pos + 1];
+        const char *field = (const char *)&pack->buf[pos + k_pair_hdr];
+        f(field, fl, field + fl, vl, arg);
+        pos += (uint32_t)(k_pair_hdr + fl + vl);
+    }
+}
+
+void hash_foreach(Hash *hash, hash_visit_fn f, void *arg) {
+    if (hash->enc == HASH_PACK) {
+        return pack_foreach(&hash->pack, f, arg);
+    }
+    VisitCtx ctx;
+    ctx.f = f;
+    ctx.arg = arg;
+    hm_foreach(&hash->hmap, &cb_visit, &ctx);
+}
+
+// the compact encoding is small enough to be returned in one go
+uint64_t hash_scan(Hash *hash, uint64_t cursor, size_t count, hash_visit_fn f, void *arg) {
+    if (hash->enc == HASH_PACK) {
+        pack_foreach(&hash->pack, f, arg);
+        return 0;
+    }
+    VisitCtx ctx;
+    ctx.f = f;
+    ctx.arg = arg;
+    do {
+        cursor = hm_scan(&hash->hmap, cursor, &cb_visit, &ctx);
+    } while (cursor != 0 && ctx.n < count);
+    return cursor;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "hashtable.h"
+
+
+enum {
+    HASH_PACK = 0,  // small hashes: field/value pairs packed back to back
+    HASH_MAP = 1,   // large hashes: a hashtable of fields
+};
+
+// the compact encoding. pairs are unordered, a lookup is a linear scan.
+struct HPack {
+    uint8_t *buf = NULL;
+    uint32_t n = 0;         // number of pairs
+    uint32_t used = 0;      // bytes used in `buf`
+    uint32_t cap = 0;       // capacity of `buf`
+};
+
+struct Hash {
+    uint32_t enc = HASH_PACK;
+    HPack pack;
+    HMap hmap;
+};
+
+// a field of the large encoding, the value follows the field
+struct HField {
+    HNode node;
+    uint32_t flen = 0;
+    uint32_t vlen = 0;
+    char data[0];
+};
+
+// a hash is converted to the large encoding once it exceeds either limit
+struct HashConf {
+    uint32_t max_pack_len = 128;    // number of pairs
+    uint32_t max_pack_value = 64;   // length of a field or a value, 255 at most
+};
+
+extern HashConf g_hash_conf;
+
+// the value is valid until the hash is modified
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen);
+// returns true if the field is new
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen);
+bool hash_del(Hash *hash, const char *field, size_t flen);
+size_t hash_size(Hash *hash);
+void hash_dispose(Hash *hash);
+
+typedef void (*hash_visit_fn)(
+    const char *field, size_t flen, const char *val, size_t vlen, void *arg);
+void hash_foreach(Hash *hash, hash_visit_fn f, void *arg);
+// visit some fields and return the next cursor, 0 when done.
+// a field present for the whole scan is visited at least once.
+uint64_t hash_scan(Hash *hash, uint64_t cursor, size_t count, hash_visit_fn f, void *arg);
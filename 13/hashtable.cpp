@@ -103,6 +103,17 @@ void hm_insert(HMap *hmap, HNode *node) {
     hm_help_resizing(hmap);
 }
 
+// size an empty map for `n` nodes, so that inserting them never resizes
+void hm_reserve(HMap *hmap, size_t n) {
+    assert(hm_size(hmap) == 0);
+    size_t slots = 4;
+    while (slots < n) {
+        slots *= 2;
+    }
+    hm_destroy(hmap);
+    h_init(&hmap->ht1, slots);
+}
+
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
     hm_help_resizing(hmap);
     if (HNode **from = h_lookup(&hmap->ht1, key, eq)) {
@@ -118,6 +129,74 @@ size_t hm_size(HMap *hmap) {
     return hmap->ht1.size + hmap->ht2.size;
 }
 
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
+    if (tab->size == 0) {
+        return;
+    }
+    for (size_t i = 0; i < tab->mask + 1; ++i) {
+        HNode *node = tab->tab[i];
+        while (node) {
+            HNode *next = node->next;   // `f` may free the node
+            f(node, arg);
+            node = next;
+        }
+    }
+}
+
+// call `f` on every node. `f` may free the node, but must not use the map.
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg) {
+    h_scan(&hmap->ht1, f, arg);
+    h_scan(&hmap->ht2, f, arg);
+}
+
+static void h_scan_slot(HTab *tab, size_t pos, void (*f)(HNode *, void *), void *arg) {
+    HNode *node = tab->tab[pos];
+    while (node) {
+        HNode *next = node->next;
+        f(node, arg);
+        node = next;
+    }
+}
+
+static uint64_t bit_reverse(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555) | ((v & 0x5555555555555555) << 1);
+    v = ((v >> 2) & 0x3333333333333333) | ((v & 0x3333333333333333) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0F) | ((v & 0x0F0F0F0F0F0F0F0F) << 4);
+    v = ((v >> 8) & 0x00FF00FF00FF00FF) | ((v & 0x00FF00FF00FF00FF) << 8);
+    v = ((v >> 16) & 0x0000FFFF0000FFFF) | ((v & 0x0000FFFF0000FFFF) << 16);
+    return (v >> 32) | (v << 32);
+}
+
+// the next slot, counting from the high bits of the mask
+static uint64_t scan_next(uint64_t cursor, size_t mask) {
+    cursor |= ~(uint64_t)mask;
+    return bit_reverse(bit_reverse(cursor) + 1);
+}
+
+// visit a slot and return the next cursor, 0 when done. the cursor counts
+// from the high bits, so the slots visited so far stay visited when the
+// table is doubled. a node present for the whole scan is visited at least
+// once, the ones inserted or removed meanwhile may or may not be.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg) {
+    if (hm_size(hmap) == 0) {
+        return 0;
+    }
+    HTab *big = &hmap->ht1;
+    HTab *small = &hmap->ht2;
+    if (!small->tab) {
+        h_scan_slot(big, cursor & big->mask, f, arg);
+        return scan_next(cursor, big->mask);
+    }
+    // the older table is half the size, one of its slots
+    // is split into 2 slots of the newer table.
+    h_scan_slot(small, cursor & small->mask, f, arg);
+    do {
+        h_scan_slot(big, cursor & big->mask, f, arg);
+        cursor = scan_next(cursor, big->mask);
+    } while (cursor & (small->mask ^ big->mask));
+    return cursor;
+}
+
 void hm_destroy(HMap *hmap) {
     free(hmap->ht1.tab);
     free(hmap->ht2.tab);
@@ -27,6 +27,9 @@ struct HMap {
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
+void hm_reserve(HMap *hmap, size_t n);
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg);
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
 void hm_destroy(HMap *hmap);
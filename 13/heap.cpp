@@ -1,68 +1,127 @@
-#include <stddef.h>
-#include <stdint.h>
-#include "heap.h"
-
-//computes the index of the parent node for a given node in a binary heap stored as an array.
-static size_t heap_parent(size_t i) {
-    return (i + 1) / 2 - 1;
-}
-
-static size_t heap_left(size_t i) {
-    return i * 2 + 1;
-}
-
-static size_t heap_right(size_t i) {
-    return i * 2 + 2;
-}
-
-// The heap_up function is used to restore the heap property after inserting a new element at the end of the heap or modifying an element's value in the heap. (min heap property)
-static void heap_up(HeapItem *a, size_t pos){
-	HeapItem t = a[pos];
-	// parent node's value is greater than the value of the element t
-	while(pos>0 && a[heap_parent(pos)].val>t.val){
-		//swap with the parent
-		a[pos] = a[heap_parent(pos)]; // This line assigns the value of the parent node to the current position pos
-		*a[pos].ref = pos; // a[pos].ref is a pointer to the position of the heap item. This line updates the reference to the new position pos.
-		pos = heap_parent(pos); // This line updates pos to be the index of the parent node. The loop will continue, and the element t will be compared with its new parent.
-	}
-	a[pos] = t;
-	*a[pos].ref = pos;
-}
-
-// The heap_down function ensures that the heap property is maintained by moving the element at the given position pos down the heap until it is in the correct position. 
-// It repeatedly compares the element with its children, swapping it with the smaller child if necessary.(ACBT property)
-static void heap_down(HeapItem *a, size_t pos, size_t len){
-	HeapItem t = a[pos];
-	while(true){
-		// find the smallest one among the parent and their kids
-		size_t l = heap_left(pos);
-        size_t r = heap_right(pos);
-        size_t min_pos = -1;
-        size_t min_val = t.val;
-        //  Check if the left child is within the heap bounds and if its value is less than the current minimum value.
-        if (l < len && a[l].val < min_val){
-        	min_pos = l;
-        	min_val=a[l].val;
-		}
-		// Check if the right child is within the heap bounds and if its value is less than the current minimum value.
-		if(r<len && a[r].val<min_val){
-			min_pos =r;
-		}
-		// check for no swap case
-		if (min_pos == (size_t)-1) {
-            break;
-        }
-        a[pos] = a[min_pos];
-        *a[pos].ref = pos;
-        pos = min_pos;
-	}
-	a[pos] = t;
-    *a[pos].ref = pos;
-}
-void heap_update(HeapItem *a, size_t pos, size_t len) {
-    if (pos > 0 && a[heap_parent(pos)].val > a[pos].val) {
-        heap_up(a, pos);
-    } else {
-        heap_down(a, pos, len);
-    }
-}
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap.h"
+
+// the array is offset by `k_heap_pad` items so that the children of
+// node i, [4i+1, 4i+4], start at a multiple of 4 items (64 bytes).
+const size_t k_heap_pad = k_heap_arity - 1;
+const size_t k_heap_align = 64;
+
+static_assert(sizeof(HeapItem) * k_heap_arity == k_heap_align, "a cache line per group");
+
+//computes the index of the parent node for a given node in a 4-ary heap stored as an array.
+static size_t heap_parent(size_t i) {
+    return (i - 1) / k_heap_arity;
+}
+
+static size_t heap_child(size_t i) {
+    return i * k_heap_arity + 1;
+}
+
+// The heap_up function is used to restore the heap property after inserting a new element at the end of the heap or modifying an element's value in the heap. (min heap property)
+static void heap_up(HeapItem *a, size_t pos){
+	HeapItem t = a[pos];
+	// parent node's value is greater than the value of the element t
+	while(pos>0 && a[heap_parent(pos)].val>t.val){
+		//swap with the parent
+		a[pos] = a[heap_parent(pos)]; // This line assigns the value of the parent node to the current position pos
+		*a[pos].ref = pos; // a[pos].ref is a pointer to the position of the heap item. This line updates the reference to the new position pos.
+		pos = heap_parent(pos); // This line updates pos to be the index of the parent node. The loop will continue, and the element t will be compared with its new parent.
+	}
+	a[pos] = t;
+	*a[pos].ref = pos;
+}
+
+// The heap_down function ensures that the heap property is maintained by moving the element at the given position pos down the heap until it is in the correct position. 
+// It repeatedly compares the element with its children, swapping it with the smallest child if necessary.
+static void heap_down(HeapItem *a, size_t pos, size_t len){
+	HeapItem t = a[pos];
+	while(true){
+		// find the smallest one among the parent and their kids,
+		// the kids are in the same cache line.
+		size_t first = heap_child(pos);
+		size_t last = first + k_heap_arity < len ? first + k_heap_arity : len;
+		size_t min_pos = -1;
+		uint64_t min_val = t.val;
+		for (size_t i = first; i < last; ++i) {
+			if (a[i].val < min_val) {
+				min_pos = i;
+				min_val = a[i].val;
+			}
+		}
+		// check for no swap case
+		if (min_pos == (size_t)-1) {
+			break;
+		}
+		a[pos] = a[min_pos];
+		*a[pos].ref = pos;
+		pos = min_pos;
+	}
+	a[pos] = t;
+	*a[pos].ref = pos;
+}
+
+static void heap_fix(Heap *heap, size_t pos) {
+    HeapItem *a = heap->a;
+    if (pos > 0 && a[heap_parent(pos)].val > a[pos].val) {
+        heap_up(a, pos);
+    } else {
+        heap_down(a, pos, heap->len);
+    }
+}
+
+// grow the array, keeping the alignment of the children groups
+static void heap_reserve(Heap *heap, size_t cap) {
+    if (cap <= heap->cap) {
+        return;
+    }
+    size_t new_cap = heap->cap ? heap->cap : 64 - k_heap_pad;
+    while (new_cap < cap) {
+        new_cap = (new_cap + k_heap_pad) * 2 - k_heap_pad;
+    }
+    // (new_cap + k_heap_pad) is a multiple of k_heap_arity
+    size_t bytes = (new_cap + k_heap_pad) * sizeof(HeapItem);
+    HeapItem *mem = (HeapItem *)aligned_alloc(k_heap_align, bytes);
+    assert(mem);
+    if (heap->a) {
+        memcpy(mem + k_heap_pad, heap->a, heap->len * sizeof(HeapItem));
+        free(heap->a - k_heap_pad);
+    }
+    heap->a = mem + k_heap_pad;
+    heap->cap = new_cap;
+}
+
+// add an item, its position is written to `*ref` and kept up to date
+void heap_push(Heap *heap, uint64_t val, size_t *ref) {
+    heap_reserve(heap, heap->len + 1);
+    size_t pos = heap->len++;
+    heap->a[pos].val = val;
+    heap->a[pos].ref = ref;
+    heap_up(heap->a, pos);
+}
+
+// remove an item by replacing it with the last item in the array
+void heap_delete(Heap *heap, size_t pos) {
+    assert(pos < heap->len);
+    heap->a[pos] = heap->a[--heap->len];
+    if (pos < heap->len) {
+        heap_fix(heap, pos);
+    }
+}
+
+// change the value of an item
+void heap_update(Heap *heap, size_t pos, uint64_t val) {
+    assert(pos < heap->len);
+    heap->a[pos].val = val;
+    heap_fix(heap, pos);
+}
+
+void heap_dispose(Heap *heap) {
+    if (heap->a) {
+        free(heap->a - k_heap_pad);
+    }
+    *heap = Heap{};
+}
@@ -10,4 +10,18 @@ struct HeapItem {
     size_t *ref = NULL; //  This member is used to store the reference to the position of this HeapItem in the heap. It is initialized to NULL
 };
 
-void heap_update(HeapItem *a, size_t pos, size_t len);
+// a 4-ary min-heap. the 4 children of a node are adjacent and start on a
+// 64-byte boundary, so comparing them touches a single cache line,
+// and the tree is half as deep as a binary heap.
+const size_t k_heap_arity = 4;
+
+struct Heap {
+    HeapItem *a = NULL;     // the root, preceded by k_heap_arity - 1 unused items
+    size_t len = 0;
+    size_t cap = 0;
+};
+
+void heap_push(Heap *heap, uint64_t val, size_t *ref);
+void heap_delete(Heap *heap, size_t pos);
+void heap_update(Heap *heap, size_t pos, uint64_t val);
+void heap_dispose(Heap *heap);
@@ -0,0 +1,86 @@
+#include <assert.h>
+#include <math.h>
+// proj
+#include "hist.h"
+
+
+static size_t bucket_of(uint64_t val) {
+    if (val < (1u << k_hist_sub_bits)) {
+        return (size_t)val;
+    }
+    uint32_t exp = 63 - __builtin_clzll(val);
+    if (exp > k_hist_max_exp) {
+        return k_hist_buckets - 1;
+    }
+    uint32_t shift = exp - k_hist_sub_bits;
+    size_t sub = (size_t)(val >> shift) & ((1u << k_hist_sub_bits) - 1);
+    return ((size_t)(shift + 1) << k_hist_sub_bits) + sub;
+}
+
+// the largest value in a bucket
+static uint64_t bucket_max(size_t idx) {
+    if (idx < (1u << k_hist_sub_bits)) {
+        return idx;
+    }
+    uint32_t shift = (uint32_t)(idx >> k_hist_sub_bits) - 1;
+    uint64_t sub = idx & ((1u << k_hist_sub_bits) - 1);
+    uint64_t lo = ((1ull << k_hist_sub_bits) + sub) << shift;
+    return lo + (1ull << shift) - 1;
+}
+
+void hist_add(Hist *hist, uint64_t val) {
+    hist->buckets[bucket_of(val)]++;
+    hist->count++;
+    hist->sum += val;
+    if (val > hist->max) {
+        hist->max = val;
+    }
+}
+
+void hist_merge(Hist *dst, const Hist *src) {
+    for (size_t i = 0; i < k_hist_buckets; ++i) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t hist_quantile(const Hist *hist, double q) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    // the rank of the value, from 1
+    uint64_t rank = (uint64_t)ceil(q * (double)hist->count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > hist->count) {
+        rank = hist->count;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_hist_buckets; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t val = bucket_max(i);
+            return val < hist->max ? val : hist->max;
+        }
+    }
+    assert(!"unreachable");
+    return hist->max;
+}
+
+void hist_pow2(const Hist *hist, uint64_t out[64]) {
+    for (size_t i = 0; i < 64; ++i) {
+        out[i] = 0;
+    }
+    for (size_t i = 0; i < k_hist_buckets; ++i) {
+        if (hist->buckets[i]) {
+            // the buckets don't straddle powers of 2
+            uint64_t top = bucket_max(i);
+            out[64 - __builtin_clzll(top | 1)] += hist->buckets[i];
+        }
+    }
+}
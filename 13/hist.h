@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// a log-linear histogram of durations in nanoseconds. each power of 2
+// is split into 16 buckets of equal width, so a value is known to within
+// 1/16. values below 16 have their own buckets, and values above 2^40
+// (about 18 minutes) are counted in the last bucket.
+const uint32_t k_hist_sub_bits = 4;
+const uint32_t k_hist_max_exp = 40;
+const size_t k_hist_buckets = (k_hist_max_exp - k_hist_sub_bits + 2) << k_hist_sub_bits;
+
+struct Hist {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    uint64_t buckets[k_hist_buckets] = {};
+};
+
+void hist_add(Hist *hist, uint64_t val);
+void hist_merge(Hist *dst, const Hist *src);
+// the largest value in the bucket that holds the q-quantile, q in [0, 1]
+uint64_t hist_quantile(const Hist *hist, double q);
+// the counts summed per power of 2: `out[i]` counts the values in
+// [2^(i-1), 2^i), and `out[1]` also counts 0
+void hist_pow2(const Hist *hist, uint64_t out[64]);
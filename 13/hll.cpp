@@ -0,0 +1,504 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+// proj
+#include "hll.h"
+
+
+HLLConf g_hll_conf;
+
+const char k_hll_magic[4] = {'H', 'Y', 'L', 'L'};
+const size_t k_dense_bytes = k_hll_regs * 6 / 8;
+
+// MurmurHash64A. the key hash is only 32 bits, too few for the
+// index and the run of zeros at large counts.
+static uint64_t hash64(const uint8_t *data, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0xadc83b19ULL ^ (len * m);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t k;
+        memcpy(&k, &data[i], 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7) {
+    case 7: h ^= (uint64_t)data[i + 6] << 48;   // fallthrough
+    case 6: h ^= (uint64_t)data[i + 5] << 40;   // fallthrough
+    case 5: h ^= (uint64_t)data[i + 4] << 32;   // fallthrough
+    case 4: h ^= (uint64_t)data[i + 3] << 24;   // fallthrough
+    case 3: h ^= (uint64_t)data[i + 2] << 16;   // fallthrough
+    case 2: h ^= (uint64_t)data[i + 1] << 8;    // fallthrough
+    case 1: h ^= (uint64_t)data[i];
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// the header
+
+static uint8_t *body(std::string &val) {
+    return (uint8_t *)&val[k_hll_header];
+}
+
+static const uint8_t *body(const std::string &val) {
+    return (const uint8_t *)&val[k_hll_header];
+}
+
+static uint32_t encoding(const std::string &val) {
+    return (uint8_t)val[4];
+}
+
+static void cache_invalidate(std::string &val) {
+    val[k_hll_header - 1] |= (char)0x80;
+}
+
+static void cache_set(std::string &val, uint64_t count) {
+    memcpy(&val[8], &count, 8);
+}
+
+static bool cache_get(const std::string &val, uint64_t *count) {
+    memcpy(count, &val[8], 8);
+    return (*count >> 63) == 0;
+}
+
+static size_t sparse_len(const std::string &val) {
+    return (val.size() - k_hll_header) / 4;
+}
+
+static uint32_t sparse_at(const uint8_t *entries, size_t i) {
+    uint32_t e;
+    memcpy(&e, &entries[4 * i], 4);
+    return e;
+}
+
+bool hll_valid(const std::string &val) {
+    if (val.size() < k_hll_header || 0 != memcmp(val.data(), k_hll_magic, 4)) {
+        return false;
+    }
+    if (encoding(val) == HLL_DENSE) {
+        return val.size() == k_hll_header + k_dense_bytes;
+    }
+    if (encoding(val) != HLL_SPARSE || (val.size() - k_hll_header) % 4) {
+        return false;
+    }
+    // the registers are written by index
+    int64_t prev = -1;
+    for (size_t i = 0; i < sparse_len(val); ++i) {
+        uint32_t e = sparse_at(body(val), i);
+        if ((int64_t)(e >> 8) <= prev || (e >> 8) >= k_hll_regs || (e & 0xff) > k_hll_q + 1) {
+            return false;
+        }
+        prev = e >> 8;
+    }
+    return true;
+}
+
+void hll_init(std::string &val) {
+    val.assign(k_hll_header, '\0');
+    memcpy(&val[0], k_hll_magic, 4);
+    val[4] = HLL_SPARSE;
+}
+
+// the dense encoding. every 3 bytes hold 4 registers, which are the
+// 24-bit little endian value v: (v >> 0, 6, 12, 18) & 63. as a byte
+// each, the 4 registers are the u32 (v & 0x3f) | (v << 2 & 0x3f00) |
+// (v << 4 & 0x3f0000) | (v << 6 & 0x3f000000), so no shifts per byte.
+
+static uint8_t dense_get(const uint8_t *dense, uint32_t idx) {
+    uint32_t bit = idx * 6;
+    uint32_t v = dense[bit / 8] >> (bit % 8);
+    if (bit % 8 > 2) {
+        v |= (uint32_t)dense[bit / 8 + 1] << (8 - bit % 8);
+    }
+    return v & 63;
+}
+
+static void dense_set(uint8_t *dense, uint32_t idx, uint8_t val) {
+    uint32_t bit = idx * 6;
+    uint32_t shift = bit % 8;
+    uint32_t mask = 63u << shift;
+    uint8_t *p = &dense[bit / 8];
+    p[0] = (uint8_t)((p[0] & ~mask) | (val << shift));
+    if (shift > 2) {
+        p[1] = (uint8_t)((p[1] & ~(mask >> 8)) | (val >> (8 - shift)));
+    }
+}
+
+static uint32_t group_unpack(const uint8_t *p) {
+    uint32_t v = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+    return (v & 0x3f) | (v << 2 & 0x3f00) | (v << 4 & 0x3f0000) | (v << 6 & 0x3f000000);
+}
+
+static void group_pack(uint32_t x, uint8_t *p) {
+    uint32_t v = (x & 0x3f) | (x >> 2 & 0xfc0) | (x >> 4 & 0x3f000) | (x >> 6 & 0xfc0000);
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+}
+
+// the scalar versions from group `g` to the end
+
+static void unpack_from(const uint8_t *dense, uint8_t *regs, uint32_t g) {
+    for (; g < k_hll_regs / 4; ++g) {
+        uint32_t x = group_unpack(&dense[3 * g]);
+        memcpy(&regs[4 * g], &x, 4);
+    }
+}
+
+static void pack_from(const uint8_t *regs, uint8_t *dense, uint32_t g) {
+    for (; g < k_hll_regs / 4; ++g) {
+        uint32_t x;
+        memcpy(&x, &regs[4 * g], 4);
+        group_pack(x, &dense[3 * g]);
+    }
+}
+
+static void merge_from(uint8_t *regs, const uint8_t *dense, uint32_t g) {
+    for (; g < k_hll_regs / 4; ++g) {
+        uint32_t x = group_unpack(&dense[3 * g]);
+        for (uint32_t k = 0; k < 4; ++k) {
+            uint8_t r = (uint8_t)(x >> (8 * k));
+            regs[4 * g + k] = regs[4 * g + k] < r ? r : regs[4 * g + k];
+        }
+    }
+}
+
+static void unpack_scalar(const uint8_t *dense, uint8_t *regs) {
+    unpack_from(dense, regs, 0);
+}
+
+static void pack_scalar(const uint8_t *regs, uint8_t *dense) {
+    pack_from(regs, dense, 0);
+}
+
+static void merge_scalar(uint8_t *regs, const uint8_t *dense) {
+    merge_from(regs, dense, 0);
+}
+
+// the sum of 2^-r over the registers of 1 to q, and the counts of the others
+struct RegSum {
+    double sum = 0;
+    uint32_t zeros = 0;
+    uint32_t full = 0;  // above q
+};
+
+static RegSum sum_scalar(const uint8_t *regs) {
+    uint32_t hist[64] = {};
+    for (uint32_t i = 0; i < k_hll_regs; ++i) {
+        hist[regs[i] & 63]++;
+    }
+    RegSum s;
+    for (uint32_t r = 1; r <= k_hll_q; ++r) {
+        s.sum += ldexp(hist[r], -(int)r);
+    }
+    s.zeros = hist[0];
+    for (uint32_t r = k_hll_q + 1; r < 64; ++r) {
+        s.full += hist[r];
+    }
+    return s;
+}
+
+// the build targets the x86-64 baseline, so the AVX2 versions are
+// compiled per function and picked at startup.
+#if defined(__x86_64__)
+
+// 24 bytes to 32 registers. vpshufb can't cross the 128-bit lanes,
+// so the lanes are loaded from 12 bytes apart.
+__attribute__((target("avx2")))
+static inline __m256i unpack24_avx2(const uint8_t *p) {
+    const __m256i shuf = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+        _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+    __m256i v = _mm256_shuffle_epi8(in, shuf);
+    __m256i r0 = _mm256_and_si256(v, _mm256_set1_epi32(0x3f));
+    __m256i r1 = _mm256_and_si256(_mm256_slli_epi32(v, 2), _mm256_set1_epi32(0x3f00));
+    __m256i r2 = _mm256_and_si256(_mm256_slli_epi32(v, 4), _mm256_set1_epi32(0x3f0000));
+    __m256i r3 = _mm256_and_si256(_mm256_slli_epi32(v, 6), _mm256_set1_epi32(0x3f000000));
+    return _mm256_or_si256(_mm256_or_si256(r0, r1), _mm256_or_si256(r2, r3));
+}
+
+// the loads read 4 bytes past each 24, so the last 32 registers are scalar
+const uint32_t k_simd_groups = k_hll_regs / 4 - 8;
+
+__attribute__((target("avx2")))
+static void unpack_avx2(const uint8_t *dense, uint8_t *regs) {
+    for (uint32_t g = 0; g < k_simd_groups; g += 8) {
+        _mm256_storeu_si256((__m256i *)&regs[4 * g], unpack24_avx2(&dense[3 * g]));
+    }
+    unpack_from(dense, regs, k_simd_groups);
+}
+
+__attribute__((target("avx2")))
+static void merge_avx2(uint8_t *regs, const uint8_t *dense) {
+    for (uint32_t g = 0; g < k_simd_groups; g += 8) {
+        __m256i *p = (__m256i *)&regs[4 * g];
+        __m256i r = _mm256_max_epu8(_mm256_loadu_si256(p), unpack24_avx2(&dense[3 * g]));
+        _mm256_storeu_si256(p, r);
+    }
+    merge_from(regs, dense, k_simd_groups);
+}
+
+// each lane writes 16 bytes for its 12, the extra bytes are
+// overwritten by the next store, so the last 32 registers are scalar.
+__attribute__((target("avx2")))
+static void pack_avx2(const uint8_t *regs, uint8_t *dense) {
+    const __m256i shuf = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for (uint32_t g = 0; g < k_simd_groups; g += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)&regs[4 * g]);
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_and_si256(x, _mm256_set1_epi32(0x3f)),
+                _mm256_and_si256(_mm256_srli_epi32(x, 2), _mm256_set1_epi32(0xfc0))),
+            _mm256_or_si256(
+                _mm256_and_si256(_mm256_srli_epi32(x, 4), _mm256_set1_epi32(0x3f000)),
+                _mm256_and_si256(_mm256_srli_epi32(x, 6), _mm256_set1_epi32(0xfc0000))));
+        v = _mm256_shuffle_epi8(v, shuf);
+        _mm_storeu_si128((__m128i *)&dense[3 * g], _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *)&dense[3 * g + 12], _mm256_extracti128_si256(v, 1));
+    }
+    pack_from(regs, dense, k_simd_groups);
+}
+
+// 2^-r is the float with the exponent 127 - r
+__attribute__((target("avx2,popcnt")))
+static RegSum sum_avx2(const uint8_t *regs) {
+    const __m256i bias = _mm256_set1_epi32(127);
+    const __m256i q = _mm256_set1_epi8((char)k_hll_q);
+    __m256 acc[4] = {
+        _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(),
+    };
+    uint32_t zeros = 0, full = 0;
+    for (uint32_t i = 0; i < k_hll_regs; i += 32) {
+        __m256i x = _mm256_and_si256(
+            _mm256_loadu_si256((const __m256i *)&regs[i]), _mm256_set1_epi8(63));
+        zeros += _mm_popcnt_u32(
+            (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_setzero_si256())));
+        full += _mm_popcnt_u32((uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(x, q)));
+        for (int k = 0; k < 4; ++k) {
+            __m256i r = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&regs[i + 8 * k]));
+            r = _mm256_and_si256(r, _mm256_set1_epi32(63));
+            __m256 f = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_sub_epi32(bias, r), 23));
+            acc[k] = _mm256_add_ps(acc[k], f);
+        }
+    }
+    __m256 total = _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3]));
+    float lanes[8];
+    _mm256_storeu_ps(lanes, total);
+    RegSum s;
+    for (float f : lanes) {
+        s.sum += f;
+    }
+    // without the zeros, 1 each, and the full registers, about 2^-(q+1) each
+    s.sum -= zeros + ldexp(full, -(int)(k_hll_q + 1));
+    s.zeros = zeros;
+    s.full = full;
+    return s;
+}
+
+#endif  // __x86_64__
+
+struct HLLKernels {
+    void (*unpack)(const uint8_t *dense, uint8_t *regs) = &unpack_scalar;
+    void (*pack)(const uint8_t *regs, uint8_t *dense) = &pack_scalar;
+    void (*merge)(uint8_t *regs, const uint8_t *dense) = &merge_scalar;
+    RegSum (*sum)(const uint8_t *regs) = &sum_scalar;
+};
+
+static HLLKernels pick_kernels() {
+    HLLKernels k;
+#if defined(__x86_64__)
+    __builtin_cpu_init();   // may run before the libgcc constructor
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        k.unpack = &unpack_avx2;
+        k.pack = &pack_avx2;
+        k.merge = &merge_avx2;
+        k.sum = &sum_avx2;
+    }
+#endif
+    return k;
+}
+
+static const HLLKernels g_kernels = pick_kernels();
+
+// the estimator of Ertl, "New cardinality estimation algorithms for
+// HyperLogLog sketches", which needs no bias correction.
+
+static double sigma(double x) {
+    if (x == 1.0) {
+        return INFINITY;
+    }
+    double y = 1.0;
+    double z = x;
+    double prev = 0;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (prev != z);
+    return z;
+}
+
+static double tau(double x) {
+    if (x == 0.0 || x == 1.0) {
+        return 0.0;
+    }
+    double y = 1.0;
+    double z = 1 - x;
+    double prev = 0;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= (1 - x) * (1 - x) * y;
+    } while (prev != z);
+    return z / 3;
+}
+
+static uint64_t estimate(const RegSum &s) {
+    double m = k_hll_regs;
+    double z = m * tau((m - s.full) / m) * ldexp(1.0, -(int)k_hll_q)
+        + s.sum + m * sigma(s.zeros / m);
+    return (uint64_t)llround(0.721347520444481703680 / z * m * m);     // 1 / (2 ln 2)
+}
+
+uint64_t hll_count_regs(const uint8_t *regs) {
+    return estimate(g_kernels.sum(regs));
+}
+
+// the sparse encoding
+
+static uint64_t sparse_estimate(const std::string &val) {
+    RegSum s;
+    size_t n = sparse_len(val);
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t r = sparse_at(body(val), i) & 0xff;
+        if (r <= k_hll_q) {
+            s.sum += ldexp(1.0, -(int)r);
+        } else {
+            s.full++;
+        }
+    }
+    s.zeros = k_hll_regs - (uint32_t)n;
+    return estimate(s);
+}
+
+static void sparse_to_regs(const std::string &val, uint8_t *regs) {
+    for (size_t i = 0; i < sparse_len(val); ++i) {
+        uint32_t e = sparse_at(body(val), i);
+        uint8_t r = (uint8_t)e;
+        regs[e >> 8] = regs[e >> 8] < r ? r : regs[e >> 8];
+    }
+}
+
+void hll_store(std::string &val, const uint8_t *regs) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < k_hll_regs; ++i) {
+        n += regs[i] != 0;
+    }
+    hll_init(val);
+    if ((size_t)n * 4 <= g_hll_conf.sparse_max) {
+        val.resize(k_hll_header + (size_t)n * 4);
+        uint8_t *p = body(val);
+        for (uint32_t i = 0; i < k_hll_regs; ++i) {
+            if (regs[i]) {
+                uint32_t e = i << 8 | regs[i];
+                memcpy(p, &e, 4);
+                p += 4;
+            }
+        }
+    } else {
+        val[4] = HLL_DENSE;
+        val.resize(k_hll_header + k_dense_bytes);
+        g_kernels.pack(regs, body(val));
+    }
+    cache_invalidate(val);
+}
+
+static bool sparse_add(std::string &val, uint32_t idx, uint8_t r) {
+    const uint8_t *entries = body(val);
+    size_t lo = 0, hi = sparse_len(val);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((sparse_at(entries, mid) >> 8) < idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    uint32_t e = idx << 8 | r;
+    if (lo < sparse_len(val) && (sparse_at(entries, lo) >> 8) == idx) {
+        if ((sparse_at(entries, lo) & 0xff) >= r) {
+            return false;
+        }
+        memcpy(body(val) + 4 * lo, &e, 4);
+        return true;
+    }
+    if ((sparse_len(val) + 1) * 4 > g_hll_conf.sparse_max) {
+        uint8_t regs[k_hll_regs] = {};
+        sparse_to_regs(val, regs);
+        regs[idx] = r;
+        hll_store(val, regs);
+        return true;
+    }
+    val.insert(k_hll_header + 4 * lo, (const char *)&e, 4);
+    return true;
+}
+
+bool hll_add(std::string &val, const char *data, size_t len) {
+    uint64_t h = hash64((const uint8_t *)data, len);
+    uint32_t idx = (uint32_t)(h & (k_hll_regs - 1));
+    // the run of zeros is capped at q by the sentinel bit
+    uint8_t r = (uint8_t)(__builtin_ctzll((h >> k_hll_p) | (1ULL << k_hll_q)) + 1);
+    bool changed = false;
+    if (encoding(val) == HLL_SPARSE) {
+        changed = sparse_add(val, idx, r);
+    } else if (dense_get(body(val), idx) < r) {
+        dense_set(body(val), idx, r);
+        changed = true;
+    }
+    if (changed) {
+        cache_invalidate(val);
+    }
+    return changed;
+}
+
+uint64_t hll_count(std::string &val) {
+    uint64_t n = 0;
+    if (cache_get(val, &n)) {
+        return n;
+    }
+    if (encoding(val) == HLL_SPARSE) {
+        n = sparse_estimate(val);
+    } else {
+        uint8_t regs[k_hll_regs];
+        g_kernels.unpack(body(val), regs);
+        n = hll_count_regs(regs);
+    }
+    cache_set(val, n);
+    return n;
+}
+
+void hll_merge(uint8_t *regs, const std::string &val) {
+    if (encoding(val) == HLL_SPARSE) {
+        sparse_to_regs(val, regs);
+    } else {
+        g_kernels.merge(regs, body(val));
+    }
+}
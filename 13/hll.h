@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+
+// a HyperLogLog is a string value, so it's saved and replicated as one:
+//   | "HYLL" | encoding (1) | unused (3) | cached count (8) | registers |
+// the cached count is little endian, its top bit is set when stale.
+// registers are indexed by 14 bits of a 64-bit hash, each holding the
+// longest run of trailing zeros + 1 seen in the remaining 50 bits.
+const uint32_t k_hll_p = 14;
+const uint32_t k_hll_regs = 1 << k_hll_p;
+const uint32_t k_hll_q = 64 - k_hll_p;      // a register is at most q + 1
+const size_t k_hll_header = 16;
+
+enum {
+    // 6 bits per register, packed from the low bits of each byte, 12KB
+    HLL_DENSE = 0,
+    // the non-zero registers as sorted u32 entries: index << 8 | value
+    HLL_SPARSE = 1,
+};
+
+// a sparse HLL is converted to the dense encoding past this many bytes
+struct HLLConf {
+    size_t sparse_max = 3000;
+};
+
+extern HLLConf g_hll_conf;
+
+// checks the header and the size, and that sparse entries are in range
+bool hll_valid(const std::string &val);
+// an empty HLL in the sparse encoding
+void hll_init(std::string &val);
+// returns true if a register changed
+bool hll_add(std::string &val, const char *data, size_t len);
+// the estimate, from the cache if it's fresh. the cache is updated.
+uint64_t hll_count(std::string &val);
+
+// unions work on registers unpacked to a byte each, `k_hll_regs` bytes
+void hll_merge(uint8_t *regs, const std::string &val);
+uint64_t hll_count_regs(const uint8_t *regs);
+// replace `val` with the registers, sparse if they fit
+void hll_store(std::string &val, const uint8_t *regs);
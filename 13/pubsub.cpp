@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pubsub.h"
+
+
+// the creator holds the first reference
+PubMsg *pubmsg_new(const std::string &payload) {
+    uint32_t size = (uint32_t)payload.size();
+    PubMsg *msg = (PubMsg *)malloc(sizeof(PubMsg) + 4 + size);
+    assert(msg);
+    msg->refs = 1;
+    msg->len = 4 + size;
+    memcpy(&msg->data[0], &size, 4);
+    memcpy(&msg->data[4], payload.data(), size);
+    return msg;
+}
+
+void pubmsg_unref(PubMsg *msg) {
+    assert(msg->refs > 0);
+    if (--msg->refs == 0) {
+        free(msg);
+    }
+}
+
+// match `c` against the set of a `[...]` at `pat`, `*end` is set past the `]`
+static bool glob_class(const char *pat, const char *pend, char c, const char **end) {
+    bool neg = (pat < pend && (*pat == '^' || *pat == '!'));
+    pat += neg ? 1 : 0;
+    bool hit = false;
+    bool first = true;
+    while (pat < pend && (first || *pat != ']')) {
+        first = false;
+        char lo = *pat;
+        if (lo == '\\' && pat + 1 < pend) {
+            lo = *++pat;
+        }
+        char hi = lo;
+        if (pat + 2 < pend && pat[1] == '-' && pat[2] != ']') {
+            hi = pat[2];
+            if (hi == '\\' && pat + 3 < pend) {
+                hi = pat[3];
+                pat++;
+            }
+            pat += 2;
+        }
+        hit = hit || (lo <= hi ? (lo <= c && c <= hi) : (hi <= c && c <= lo));
+        pat++;
+    }
+    *end = (pat < pend) ? pat + 1 : pend;   // an unclosed `[` takes the rest
+    return hit != neg;
+}
+
+// glob-style matching: `*`, `?`, `[abc]`, `[^a-z]` and `\` escapes.
+// backtracks only to the last `*`, so it's linear in practice.
+bool glob_match(const char *pat, size_t plen, const char *str, size_t slen) {
+    const char *p = pat, *pend = pat + plen;
+    const char *s = str, *send = str + slen;
+    const char *star = NULL, *star_s = NULL;
+    while (s < send) {
+        if (p < pend && *p == '*') {
+            star = ++p;
+            star_s = s;
+            continue;
+        }
+        if (p < pend) {
+            const char *next = p + 1;
+            bool ok = false;
+            if (*p == '?') {
+                ok = true;
+            } else if (*p == '[') {
+                ok = glob_class(p + 1, pend, *s, &next);
+            } else if (*p == '\\' && p + 1 < pend) {
+                ok = (p[1] == *s);
+                next = p + 2;
+            } else {
+                ok = (*p == *s);
+            }
+            if (ok) {
+                p = next;
+                s++;
+                continue;
+            }
+        }
+        if (!star) {
+            return false;
+        }
+        // let the last `*` take one more char
+        p = star;
+        s = ++star_s;
+    }
+    while (p < pend && *p == '*') {
+        p++;
+    }
+    return p == pend;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+
+// a published message, serialized once with its length prefix and
+// shared by the output queues of all subscribers.
+struct PubMsg {
+    uint32_t refs;
+    uint32_t len;       // of `data`
+    uint8_t data[0];
+};
+
+PubMsg *pubmsg_new(const std::string &payload);
+void pubmsg_unref(PubMsg *msg);
+
+bool glob_match(const char *pat, size_t plen, const char *str, size_t slen);
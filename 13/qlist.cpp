@@ -0,0 +1,292 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+// proj
+#include "qlist.h"
+#include "common.h"
+
+
+const uint32_t k_qchunk_min = 64;
+
+static size_t len_size(size_t len) {
+    return len < 0xff ? 1 : 5;
+}
+
+// the bytes taken by an element
+static size_t elem_size(size_t len) {
+    return 2 * len_size(len) + len;
+}
+
+static void put_len(uint8_t *p, size_t len, bool trailing) {
+    if (len < 0xff) {
+        p[0] = (uint8_t)len;
+        return;
+    }
+    uint32_t v = (uint32_t)len;
+    if (trailing) {
+        memcpy(&p[0], &v, 4);
+        p[4] = 0xff;
+    } else {
+        p[0] = 0xff;
+        memcpy(&p[1], &v, 4);
+    }
+}
+
+// write an element at `pos`
+static void put_elem(QChunk *chunk, uint32_t pos, const char *data, size_t len) {
+    uint8_t *p = &chunk->data[pos];
+    size_t ls = len_size(len);
+    put_len(p, len, false);
+    memcpy(&p[ls], data, len);
+    put_len(&p[ls + len], len, true);
+}
+
+// the element starting at `pos`
+static const char *get_elem(QChunk *chunk, uint32_t pos, size_t *len) {
+    const uint8_t *p = &chunk->data[pos];
+    if (p[0] < 0xff) {
+        *len = p[0];
+        return (const char *)&p[1];
+    }
+    uint32_t v = 0;
+    memcpy(&v, &p[1], 4);
+    *len = v;
+    return (const char *)&p[5];
+}
+
+// the start of the element ending at `end`
+static uint32_t prev_elem(QChunk *chunk, uint32_t end) {
+    const uint8_t *p = &chunk->data[end - 1];
+    size_t len = p[0];
+    if (len == 0xff) {
+        uint32_t v = 0;
+        memcpy(&v, p - 4, 4);
+        len = v;
+    }
+    return end - (uint32_t)elem_size(len);
+}
+
+static QChunk *chunk_new(size_t cap) {
+    QChunk *chunk = (QChunk *)malloc(sizeof(QChunk) + cap);
+    assert(chunk);  // not a good idea in real projects
+    chunk->node.prev = chunk->node.next = NULL;
+    chunk->n = 0;
+    chunk->head = chunk->tail = 0;
+    chunk->cap = (uint32_t)cap;
+    return chunk;
+}
+
+static QChunk *chunk_of(DList *node) {
+    return container_of(node, QChunk, node);
+}
+
+// move the used bytes against one end of a chunk of size `cap`,
+// which replaces `chunk` in the list if the size differs.
+static QChunk *chunk_repack(QChunk *chunk, size_t cap, bool to_end) {
+    uint32_t used = chunk->tail - chunk->head;
+    uint32_t head = to_end ? (uint32_t)cap - used : 0;
+    if (cap == chunk->cap) {
+        memmove(&chunk->data[head], &chunk->data[chunk->head], used);
+    } else {
+        QChunk *bigger = chunk_new(cap);
+        bigger->n = chunk->n;
+        memcpy(&bigger->data[head], &chunk->data[chunk->head], used);
+        dlist_insert_before(&chunk->node, &bigger->node);
+        dlist_detach(&chunk->node);
+        free(chunk);
+        chunk = bigger;
+    }
+    chunk->head = head;
+    chunk->tail = head + used;
+    return chunk;
+}
+
+void qlist_init(QList *list) {
+    dlist_init(&list->chunks);
+    list->size = 0;
+}
+
+// the chunk at the end that has room for `sz` more bytes, NULL if none
+static QChunk *room_at_end(QList *list, size_t sz, bool front) {
+    if (dlist_empty(&list->chunks)) {
+        return NULL;
+    }
+    QChunk *chunk = chunk_of(front ? list->chunks.next : list->chunks.prev);
+    size_t room = front ? chunk->head : chunk->cap - chunk->tail;
+    if (room >= sz) {
+        return chunk;
+    }
+    size_t used = chunk->tail - chunk->head;
+    if (used + sz > k_qchunk_max) {
+        return NULL;
+    }
+    // repack the data against the other end, doubling the chunk until it's
+    // at most half full. so the bytes moved are amortized over the pushes.
+    size_t cap = chunk->cap;
+    while (cap < k_qchunk_max && cap < 2 * (used + sz)) {
+        cap *= 2;
+    }
+    if (cap == chunk->cap && 2 * used > cap) {
+        return NULL;
+    }
+    return chunk_repack(chunk, cap, front);
+}
+
+void qlist_push(QList *list, const char *data, size_t len, bool front) {
+    size_t sz = elem_size(len);
+    QChunk *chunk = room_at_end(list, sz, front);
+    if (!chunk) {
+        size_t cap = k_qchunk_min;
+        while (cap < sz) {
+            cap *= 2;
+        }
+        chunk = chunk_new(cap < k_qchunk_max ? cap : sz);
+        chunk->head = chunk->tail = front ? chunk->cap : 0;
+        if (front) {
+            dlist_insert_before(list->chunks.next, &chunk->node);
+        } else {
+            dlist_insert_before(&list->chunks, &chunk->node);
+        }
+    }
+    if (front) {
+        chunk->head -= (uint32_t)sz;
+        put_elem(chunk, chunk->head, data, len);
+    } else {
+        put_elem(chunk, chunk->tail, data, len);
+        chunk->tail += (uint32_t)sz;
+    }
+    chunk->n++;
+    list->size++;
+}
+
+static void chunk_del(QChunk *chunk) {
+    dlist_detach(&chunk->node);
+    free(chunk);
+}
+
+bool qlist_pop(QList *list, std::string &out, bool front) {
+    if (list->size == 0) {
+        return false;
+    }
+    QChunk *chunk = chunk_of(front ? list->chunks.next : list->chunks.prev);
+    uint32_t pos = front ? chunk->head : prev_elem(chunk, chunk->tail);
+    size_t len = 0;
+    const char *data = get_elem(chunk, pos, &len);
+    out.assign(data, len);
+    if (front) {
+        chunk->head += (uint32_t)elem_size(len);
+    } else {
+        chunk->tail = pos;
+    }
+    chunk->n--;
+    list->size--;
+    if (chunk->n == 0) {
+        chunk_del(chunk);
+    }
+    return true;
+}
+
+// drop `k` elements off the front or the back
+static void drop(QList *list, size_t k, bool front) {
+    while (k > 0) {
+        QChunk *chunk = chunk_of(front ? list->chunks.next : list->chunks.prev);
+        if (chunk->n <= k) {
+            k -= chunk->n;
+            list->size -= chunk->n;
+            chunk_del(chunk);
+            continue;
+        }
+        for (; k > 0; --k) {
+            if (front) {
+                size_t len = 0;
+                get_elem(chunk, chunk->head, &len);
+                chunk->head += (uint32_t)elem_size(len);
+            } else {
+                chunk->tail = prev_elem(chunk, chunk->tail);
+            }
+            chunk->n--;
+            list->size--;
+        }
+    }
+}
+
+void qlist_trim(QList *list, size_t start, size_t stop) {
+    stop = stop < list->size ? stop : list->size;
+    if (start >= stop) {
+        return qlist_dispose(list);
+    }
+    drop(list, list->size - stop, false);
+    drop(list, start, true);
+}
+
+void qlist_dispose(QList *list) {
+    while (!dlist_empty(&list->chunks)) {
+        chunk_del(chunk_of(list->chunks.next));
+    }
+    list->size = 0;
+}
+
+static void iter_load(QIter *iter) {
+    iter->data = get_elem(iter->chunk, iter->pos, &iter->len);
+}
+
+// whole chunks are skipped from the nearer end
+QIter qlist_at(QList *list, size_t idx) {
+    QIter iter;
+    if (idx >= list->size) {
+        return iter;
+    }
+    QChunk *chunk = NULL;
+    if (idx < list->size / 2) {
+        DList *node = list->chunks.next;
+        while (idx >= chunk_of(node)->n) {
+            idx -= chunk_of(node)->n;
+            node = node->next;
+        }
+        chunk = chunk_of(node);
+    } else {
+        size_t ridx = list->size - 1 - idx;     // from the back
+        DList *node = list->chunks.prev;
+        while (ridx >= chunk_of(node)->n) {
+            ridx -= chunk_of(node)->n;
+            node = node->prev;
+        }
+        chunk = chunk_of(node);
+        idx = chunk->n - 1 - ridx;
+    }
+    // then from the nearer end of the chunk
+    uint32_t pos = chunk->head;
+    if (idx < chunk->n / 2) {
+        for (; idx > 0; --idx) {
+            size_t len = 0;
+            get_elem(chunk, pos, &len);
+            pos += (uint32_t)elem_size(len);
+        }
+    } else {
+        pos = chunk->tail;
+        for (size_t k = chunk->n - idx; k > 0; --k) {
+            pos = prev_elem(chunk, pos);
+        }
+    }
+    iter.chunk = chunk;
+    iter.pos = pos;
+    iter_load(&iter);
+    return iter;
+}
+
+void qiter_next(QList *list, QIter *iter) {
+    if (!iter->data) {
+        return;
+    }
+    iter->pos += (uint32_t)elem_size(iter->len);
+    if (iter->pos == iter->chunk->tail) {
+        DList *next = iter->chunk->node.next;
+        if (next == &list->chunks) {
+            *iter = QIter{};
+            return;
+        }
+        iter->chunk = chunk_of(next);
+        iter->pos = iter->chunk->head;
+    }
+    iter_load(iter);
+}
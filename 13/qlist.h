@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "list.h"
+
+
+// a list of strings stored as a doubly linked list of packed chunks.
+// elements are laid out back to back in a chunk as:
+//   | len (1 or 5 bytes) | data | len (1 or 5 bytes) |
+// the trailing length allows walking a chunk backwards. a length below
+// 255 takes 1 byte, otherwise it's a 0xff marker and 4 bytes.
+// a chunk has free space at both ends, so both ends take O(1) pushes.
+struct QChunk {
+    DList node;
+    uint32_t n = 0;     // number of elements
+    uint32_t head = 0;  // the first byte used
+    uint32_t tail = 0;  // past the last byte used
+    uint32_t cap = 0;   // size of `data`
+    uint8_t data[0];
+};
+
+struct QList {
+    DList chunks;       // QChunk::node
+    size_t size = 0;    // number of elements
+};
+
+// a chunk grows up to this size before a new one is started,
+// an element larger than this gets a chunk of its own.
+const uint32_t k_qchunk_max = 8192;
+
+// a position in the list, invalidated by any modification of the list
+struct QIter {
+    // the current element, `data` is NULL when out of range
+    const char *data = NULL;
+    size_t len = 0;
+    // private
+    QChunk *chunk = NULL;
+    uint32_t pos = 0;
+};
+
+void qlist_init(QList *list);
+void qlist_push(QList *list, const char *data, size_t len, bool front);
+bool qlist_pop(QList *list, std::string &out, bool front);
+// keep the elements in [start, stop)
+void qlist_trim(QList *list, size_t start, size_t stop);
+void qlist_dispose(QList *list);
+QIter qlist_at(QList *list, size_t idx);
+void qiter_next(QList *list, QIter *iter);
@@ -0,0 +1,506 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// proj
+#include "set.h"
+#include "common.h"
+
+
+SetConf g_set_conf;
+
+// an integer in the form it's printed back, so "007" or "+7" stay strings
+static bool str2int_canon(const char *data, size_t len, int64_t &out) {
+    char buf[24];
+    if (len == 0 || len >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+    char *endp = NULL;
+    errno = 0;
+    out = strtoll(buf, &endp, 10);
+    if (errno == ERANGE || endp != buf + len) {
+        return false;
+    }
+    char back[24];
+    int n = snprintf(back, sizeof(back), "%lld", (long long)out);
+    return (size_t)n == len && 0 == memcmp(back, buf, len);
+}
+
+// the integer encoding
+
+static int64_t ints_get(const IntSet *ints, size_t i) {
+    if (ints->width == 2) {
+        int16_t v;
+        memcpy(&v, &ints->buf[2 * i], 2);
+        return v;
+    } else if (ints->width == 4) {
+        int32_t v;
+        memcpy(&v, &ints->buf[4 * i], 4);
+        return v;
+    }
+    int64_t v;
+    memcpy(&v, &ints->buf[8 * i], 8);
+    return v;
+}
+
+static void ints_put(IntSet *ints, size_t i, int64_t val) {
+    if (ints->width == 2) {
+        int16_t v = (int16_t)val;
+        memcpy(&ints->buf[2 * i], &v, 2);
+    } else if (ints->width == 4) {
+        int32_t v = (int32_t)val;
+        memcpy(&ints->buf[4 * i], &v, 4);
+    } else {
+        memcpy(&ints->buf[8 * i], &val, 8);
+    }
+}
+
+static uint32_t width_of(int64_t val) {
+    if (val >= INT16_MIN && val <= INT16_MAX) {
+        return 2;
+    }
+    return (val >= INT32_MIN && val <= INT32_MAX) ? 4 : 8;
+}
+
+// binary search, `*pos` is where the integer is or would be inserted
+static bool ints_find(const IntSet *ints, int64_t val, uint32_t *pos) {
+    uint32_t lo = 0;
+    uint32_t hi = ints->n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ints_get(ints, mid) < val) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return lo < ints->n && ints_get(ints, lo) == val;
+}
+
+// reallocate for `cap` integers of `width` bytes
+static void ints_resize(IntSet *ints, uint32_t cap, uint32_t width) {
+    if (width == ints->width) {
+        ints->buf = (uint8_t *)realloc(ints->buf, (size_t)cap * width);
+        assert(ints->buf);
+        ints->cap = cap;
+        return;
+    }
+    IntSet wider;
+    wider.buf = (uint8_t *)malloc((size_t)cap * width);
+    assert(wider.buf);
+    wider.width = width;
+    wider.n = ints->n;
+    wider.cap = cap;
+    for (uint32_t i = 0; i < ints->n; ++i) {
+        ints_put(&wider, i, ints_get(ints, i));
+    }
+    free(ints->buf);
+    *ints = wider;
+}
+
+static bool ints_add(IntSet *ints, int64_t val) {
+    uint32_t width = std::max(ints->width, width_of(val));
+    uint32_t pos = 0;
+    if (width == ints->width && ints_find(ints, val, &pos)) {
+        return false;
+    }
+    if (width != ints->width) {
+        pos = val < 0 ? 0 : ints->n;    // out of the current range
+    }
+    if (ints->n == ints->cap || width != ints->width) {
+        uint32_t cap = ints->cap;
+        if (ints->n == cap) {
+            cap = cap ? cap * 2 : 4;
+        }
+        ints_resize(ints, cap, width);
+    }
+    uint8_t *p = &ints->buf[(size_t)pos * width];
+    memmove(p + width, p, (size_t)(ints->n - pos) * width);
+    ints_put(ints, pos, val);
+    ints->n++;
+    return true;
+}
+
+static bool ints_del(IntSet *ints, int64_t val) {
+    uint32_t pos = 0;
+    if (!ints_find(ints, val, &pos)) {
+        return false;
+    }
+    uint8_t *p = &ints->buf[(size_t)pos * ints->width];
+    memmove(p, p + ints->width, (size_t)(ints->n - pos - 1) * ints->width);
+    ints->n--;
+    return true;
+}
+
+// the hashtable encoding
+
+static SMember *smember_new(const char *data, size_t len) {
+    SMember *node = (SMember *)malloc(sizeof(SMember) + len);
+    assert(node);   // not a good idea in real projects
+    node->node.next = NULL;
+    node->node.hcode = str_hash((uint8_t *)data, len);
+    node->len = (uint32_t)len;
+    memcpy(&node->data[0], data, len);
+    return node;
+}
+
+// a helper structure for the hashtable lookup
+struct HKey {
+    HNode node;
+    const char *data = NULL;
+    size_t len = 0;
+};
+
+static bool hcmp(HNode *node, HNode *key) {
+    SMember *m = container_of(node, SMember, node);
+    HKey *hkey = container_of(key, HKey, node);
+    return m->len == hkey->len && 0 == memcmp(m->data, hkey->data, m->len);
+}
+
+static HKey hkey_of(const char *data, size_t len) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)data, len);
+    key.data = data;
+    key.len = len;
+    return key;
+}
+
+static size_t int2str(int64_t val, char *buf) {
+    return (size_t)snprintf(buf, 24, "%lld", (long long)val);
+}
+
+static void set_convert(Set *set) {
+    assert(set->enc == SET_INTS);
+    IntSet *ints = &set->ints;
+    hm_reserve(&set->hmap, ints->n + 1);
+    for (uint32_t i = 0; i < ints->n; ++i) {
+        char buf[24];
+        size_t len = int2str(ints_get(ints, i), buf);
+        hm_insert(&set->hmap, &smember_new(buf, len)->node);
+    }
+    free(ints->buf);
+    *ints = IntSet{};
+    set->enc = SET_MAP;
+}
+
+bool set_add(Set *set, const char *data, size_t len) {
+    if (set->enc == SET_INTS) {
+        int64_t val = 0;
+        if (str2int_canon(data, len, val)) {
+            uint32_t pos = 0;
+            if (ints_find(&set->ints, val, &pos)) {
+                return false;
+            }
+            if (set->ints.n < g_set_conf.max_ints) {
+                return ints_add(&set->ints, val);
+            }
+        }
+        set_convert(set);
+    }
+    HKey key = hkey_of(data, len);
+    if (hm_lookup(&set->hmap, &key.node, &hcmp)) {
+        return false;
+    }
+    hm_insert(&set->hmap, &smember_new(data, len)->node);
+    return true;
+}
+
+bool set_del(Set *set, const char *data, size_t len) {
+    if (set->enc == SET_INTS) {
+        int64_t val = 0;
+        return str2int_canon(data, len, val) && ints_del(&set->ints, val);
+    }
+    HKey key = hkey_of(data, len);
+    HNode *node = hm_pop(&set->hmap, &key.node, &hcmp);
+    if (!node) {
+        return false;
+    }
+    free(container_of(node, SMember, node));
+    return true;
+}
+
+bool set_has(Set *set, const char *data, size_t len) {
+    if (set->enc == SET_INTS) {
+        int64_t val = 0;
+        uint32_t pos = 0;
+        return str2int_canon(data, len, val) && ints_find(&set->ints, val, &pos);
+    }
+    HKey key = hkey_of(data, len);
+    return hm_lookup(&set->hmap, &key.node, &hcmp) != NULL;
+}
+
+static bool set_has_int(Set *set, int64_t val) {
+    if (set->enc == SET_INTS) {
+        uint32_t pos = 0;
+        return ints_find(&set->ints, val, &pos);
+    }
+    char buf[24];
+    size_t len = int2str(val, buf);
+    HKey key = hkey_of(buf, len);
+    return hm_lookup(&set->hmap, &key.node, &hcmp) != NULL;
+}
+
+size_t set_size(Set *set) {
+    return set->enc == SET_INTS ? set->ints.n : hm_size(&set->hmap);
+}
+
+static void cb_free(HNode *node, void *arg) {
+    (void)arg;
+    free(container_of(node, SMember, node));
+}
+
+void set_dispose(Set *set) {
+    free(set->ints.buf);
+    set->ints = IntSet{};
+    hm_foreach(&set->hmap, &cb_free, NULL);
+    hm_destroy(&set->hmap);
+    set->enc = SET_INTS;
+}
+
+struct VisitCtx {
+    set_visit_fn f = NULL;
+    void *arg = NULL;
+};
+
+static void cb_visit(HNode *node, void *arg) {
+    VisitCtx *ctx = (VisitCtx *)arg;
+    SMember *m = container_of(node, SMember, node);
+    ctx->f(m->data, m->len, ctx->arg);
+}
+
+void set_foreach(Set *set, set_visit_fn f, void *arg) {
+    if (set->enc == SET_INTS) {
+        for (uint32_t i = 0; i < set->ints.n; ++i) {
+            char buf[24];
+            size_t len = int2str(ints_get(&set->ints, i), buf);
+            f(buf, len, arg);
+        }
+        return;
+    }
+    VisitCtx ctx;
+    ctx.f = f;
+    ctx.arg = arg;
+    hm_foreach(&set->hmap, &cb_visit, &ctx);
+}
+
+// intersections of sorted arrays
+
+// the first position in [lo, n) with a value >= `val`, probing
+// 1, 2, 4, ... ahead before the binary search.
+template <class T>
+static size_t gallop(const T *a, size_t lo, size_t n, T val) {
+    size_t step = 1;
+    size_t hi = lo;
+    while (hi < n && a[hi] < val) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    hi = std::min(hi, n);
+    return std::lower_bound(a + lo, a + hi, val) - a;
+}
+
+// when one side is much smaller, search for its values in the other
+const size_t k_gallop_ratio = 32;
+
+template <class T>
+static size_t inter_gallop(const T *a, size_t na, const T *b, size_t nb, T *out) {
+    size_t n = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < na && j < nb; ++i) {
+        j = gallop(b, j, nb, a[i]);
+        if (j < nb && b[j] == a[i]) {
+            if (out) {
+                out[n] = a[i];
+            }
+            n++;
+            j++;
+        }
+    }
+    return n;
+}
+
+template <class T>
+static size_t inter_merge(const T *a, size_t na, const T *b, size_t nb, T *out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            if (out) {
+                out[n] = a[i];
+            }
+            n++;
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+// 4 values of `a` are compared with 4 values of `b` in all 4 rotations,
+// then the block with the smaller maximum is advanced.
+size_t inter32(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out) {
+    if (na > nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    if (na * k_gallop_ratio < nb) {
+        return inter_gallop(a, na, b, nb, out);
+    }
+    size_t i = 0, j = 0, n = 0;
+#if defined(__SSE2__)
+    size_t na4 = na & ~(size_t)3;
+    size_t nb4 = nb & ~(size_t)3;
+    while (i < na4 && j < nb4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+        __m128i vb = _mm_loadu_si128((const __m128i *)&b[j]);
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi32(va, vb),
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (out) {
+            for (; mask; mask &= mask - 1) {
+                out[n++] = a[i + __builtin_ctz(mask)];
+            }
+        } else {
+            n += __builtin_popcount(mask);
+        }
+        int32_t amax = a[i + 3];
+        int32_t bmax = b[j + 3];
+        i += (amax <= bmax) ? 4 : 0;
+        j += (bmax <= amax) ? 4 : 0;
+    }
+#endif
+    return n + inter_merge(a + i, na - i, b + j, nb - j, out ? out + n : NULL);
+}
+
+template <class T>
+static std::vector<int64_t> inter_sorted(
+    const uint8_t *a, size_t na, const uint8_t *b, size_t nb)
+{
+    const T *ta = (const T *)a;
+    const T *tb = (const T *)b;
+    if (na > nb) {
+        std::swap(ta, tb);
+        std::swap(na, nb);
+    }
+    std::vector<T> tmp(na);
+    size_t n = (na * k_gallop_ratio < nb)
+        ? inter_gallop(ta, na, tb, nb, tmp.data())
+        : inter_merge(ta, na, tb, nb, tmp.data());
+    return std::vector<int64_t>(tmp.begin(), tmp.begin() + n);
+}
+
+// the intersection of 2 integer sets
+static std::vector<int64_t> ints_inter(const IntSet *a, const IntSet *b) {
+    if (a->width == 4 && b->width == 4) {
+        std::vector<int32_t> tmp(std::min(a->n, b->n));
+        size_t n = inter32(
+            (const int32_t *)a->buf, a->n, (const int32_t *)b->buf, b->n, tmp.data());
+        return std::vector<int64_t>(tmp.begin(), tmp.begin() + n);
+    }
+    if (a->width == b->width) {
+        return a->width == 2
+            ? inter_sorted<int16_t>(a->buf, a->n, b->buf, b->n)
+            : inter_sorted<int64_t>(a->buf, a->n, b->buf, b->n);
+    }
+    // mixed widths: widen both to int64
+    std::vector<int64_t> va(a->n), vb(b->n);
+    for (uint32_t i = 0; i < a->n; ++i) {
+        va[i] = ints_get(a, i);
+    }
+    for (uint32_t i = 0; i < b->n; ++i) {
+        vb[i] = ints_get(b, i);
+    }
+    return inter_sorted<int64_t>(
+        (const uint8_t *)va.data(), va.size(), (const uint8_t *)vb.data(), vb.size());
+}
+
+static bool set_smaller(Set *lhs, Set *rhs) {
+    return set_size(lhs) < set_size(rhs);
+}
+
+struct InterCtx {
+    Set *const *rest = NULL;
+    size_t nrest = 0;
+    size_t limit = 0;
+    size_t count = 0;
+    set_visit_fn f = NULL;
+    void *arg = NULL;
+};
+
+static void cb_inter(const char *data, size_t len, void *arg) {
+    InterCtx *ctx = (InterCtx *)arg;
+    if (ctx->limit && ctx->count >= ctx->limit) {
+        return;
+    }
+    for (size_t k = 0; k < ctx->nrest; ++k) {
+        if (!set_has(ctx->rest[k], data, len)) {
+            return;
+        }
+    }
+    if (ctx->f) {
+        ctx->f(data, len, ctx->arg);
+    }
+    ctx->count++;
+}
+
+// start from the smallest set. if the 2 smallest are integer sets,
+// they are intersected as sorted arrays, then filtered by the rest.
+size_t set_inter(Set *const *sets, size_t n, size_t limit, set_visit_fn f, void *arg) {
+    std::vector<Set *> order(sets, sets + n);
+    std::sort(order.begin(), order.end(), &set_smaller);
+    if (n == 0 || set_size(order[0]) == 0) {
+        return 0;
+    }
+    Set *a = order[0];
+    if (n < 2 || a->enc != SET_INTS || order[1]->enc != SET_INTS) {
+        InterCtx ctx;
+        ctx.rest = order.data() + 1;
+        ctx.nrest = n - 1;
+        ctx.limit = limit;
+        ctx.f = f;
+        ctx.arg = arg;
+        set_foreach(a, &cb_inter, &ctx);
+        return ctx.count;
+    }
+    IntSet *ia = &a->ints;
+    IntSet *ib = &order[1]->ints;
+    if (n == 2 && !f && !limit && ia->width == 4 && ib->width == 4) {
+        return inter32((const int32_t *)ia->buf, ia->n, (const int32_t *)ib->buf, ib->n, NULL);
+    }
+    size_t count = 0;
+    for (int64_t val : ints_inter(ia, ib)) {
+        bool found = true;
+        for (size_t k = 2; k < n && found; ++k) {
+            found = set_has_int(order[k], val);
+        }
+        if (!found) {
+            continue;
+        }
+        if (f) {
+            char buf[24];
+            f(buf, int2str(val, buf), arg);
+        }
+        if (++count == limit) {
+            break;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "hashtable.h"
+
+
+enum {
+    SET_INTS = 0,   // integers only: a sorted array of int16, int32 or int64
+    SET_MAP = 1,    // anything else: a hashtable of members
+};
+
+// the integer encoding. all integers take `width` bytes, the array is
+// rewritten with a wider type once an integer doesn't fit.
+struct IntSet {
+    uint8_t *buf = NULL;
+    uint32_t width = 2;     // 2, 4 or 8 bytes
+    uint32_t n = 0;
+    uint32_t cap = 0;       // in integers
+};
+
+struct Set {
+    uint32_t enc = SET_INTS;
+    IntSet ints;
+    HMap hmap;
+};
+
+struct SMember {
+    HNode node;
+    uint32_t len = 0;
+    char data[0];
+};
+
+// a set is converted to a hashtable once it exceeds this or
+// takes a member that isn't an integer in its canonical form.
+struct SetConf {
+    uint32_t max_ints = 1 << 16;
+};
+
+extern SetConf g_set_conf;
+
+bool set_add(Set *set, const char *data, size_t len);
+bool set_del(Set *set, const char *data, size_t len);
+bool set_has(Set *set, const char *data, size_t len);
+size_t set_size(Set *set);
+void set_dispose(Set *set);
+
+typedef void (*set_visit_fn)(const char *data, size_t len, void *arg);
+void set_foreach(Set *set, set_visit_fn f, void *arg);
+// the members found in all `n` sets are passed to `f`, which may be NULL
+// to only count them. stops after `limit` members unless it's 0.
+size_t set_inter(Set *const *sets, size_t n, size_t limit, set_visit_fn f, void *arg);
+
+// the intersection of sorted int32 arrays, `out` may be NULL to only count
+size_t inter32(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out);
@@ -0,0 +1,66 @@
+#include <string.h>
+// proj
+#include "slowlog.h"
+
+
+void slow_args_copy(SlowArgs &args, const std::vector<std::string> &cmd) {
+    args.nargs = (uint32_t)cmd.size();
+    size_t n = cmd.size() < k_slow_args ? cmd.size() : k_slow_args;
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = cmd[i].size();
+        args.len[i] = (uint32_t)len;
+        memcpy(args.data[i], cmd[i].data(), len < k_slow_arg_len ? len : k_slow_arg_len);
+    }
+}
+
+static void slow_args_decode(const SlowArgs &args, std::vector<std::string> &out) {
+    out.clear();
+    // the last kept slot names the arguments left out
+    size_t n = args.nargs;
+    if (n > k_slow_args) {
+        n = k_slow_args - 1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (args.len[i] <= k_slow_arg_len) {
+            out.emplace_back(args.data[i], args.len[i]);
+            continue;
+        }
+        out.emplace_back(args.data[i], k_slow_arg_len);
+        out.back() += "... (" + std::to_string(args.len[i] - k_slow_arg_len) + " more bytes)";
+    }
+    if (n < args.nargs) {
+        out.push_back("... (" + std::to_string(args.nargs - n) + " more arguments)");
+    }
+}
+
+void slowlog_add(SlowLog *log, const SlowArgs &args, int64_t unix_ms, uint64_t usec) {
+    if (log->max_len == 0) {
+        return;
+    }
+    SlowEntry *ent = NULL;
+    if (log->ring.size() < log->max_len) {
+        log->ring.emplace_back();
+        ent = &log->ring.back();
+    } else {
+        // overwrite the oldest
+        ent = &log->ring[log->head];
+        log->head = (log->head + 1) % log->max_len;
+    }
+    ent->id = log->next_id++;
+    ent->unix_ms = unix_ms;
+    ent->usec = usec;
+    slow_args_decode(args, ent->args);
+}
+
+void slowlog_latest(const SlowLog *log, size_t n, std::vector<const SlowEntry *> &out) {
+    size_t size = log->ring.size();
+    for (size_t i = 0; i < n && i < size; ++i) {
+        // the newest is just before `head`
+        out.push_back(&log->ring[(log->head + size - 1 - i) % size]);
+    }
+}
+
+void slowlog_reset(SlowLog *log) {
+    log->ring.clear();
+    log->head = 0;
+}
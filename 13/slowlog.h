@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// the slow log keeps the latest commands that ran longer than a threshold.
+// the handlers consume their arguments, so a truncated copy is taken
+// before each command, into a fixed buffer without allocating.
+const size_t k_slow_args = 16;      // the rest are counted
+const size_t k_slow_arg_len = 64;   // longer arguments are cut
+
+struct SlowArgs {
+    uint32_t nargs = 0;             // all of them
+    uint32_t len[k_slow_args];      // the full lengths
+    char data[k_slow_args][k_slow_arg_len];
+};
+
+void slow_args_copy(SlowArgs &args, const std::vector<std::string> &cmd);
+
+struct SlowEntry {
+    uint64_t id = 0;
+    int64_t unix_ms = 0;            // when it finished
+    uint64_t usec = 0;
+    std::vector<std::string> args;  // a cut argument ends with "... (n more bytes)"
+};
+
+struct SlowLog {
+    size_t max_len = 128;
+    std::vector<SlowEntry> ring;
+    size_t head = 0;                // the oldest entry once full
+    uint64_t next_id = 0;
+};
+
+void slowlog_add(SlowLog *log, const SlowArgs &args, int64_t unix_ms, uint64_t usec);
+// the latest entries first
+void slowlog_latest(const SlowLog *log, size_t n, std::vector<const SlowEntry *> &out);
+void slowlog_reset(SlowLog *log);
@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+// proj
+#include "snapshot.h"
+
+
+// CRC-32C (Castagnoli), slicing-by-8
+static uint32_t g_crc_table[8][256];
+
+static bool crc_init() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; ++k) {
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        }
+        g_crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t) {
+            uint32_t prev = g_crc_table[t - 1][i];
+            g_crc_table[t][i] = (prev >> 8) ^ g_crc_table[0][prev & 0xff];
+        }
+    }
+    return true;
+}
+
+static bool g_crc_ready = crc_init();
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    assert(g_crc_ready);
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for (; size >= 8; size -= 8, p += 8) {
+        uint64_t word = 0;
+        memcpy(&word, p, 8);    // assume little endian
+        word ^= crc;
+        crc = g_crc_table[7][word & 0xff] ^ g_crc_table[6][(word >> 8) & 0xff]
+            ^ g_crc_table[5][(word >> 16) & 0xff] ^ g_crc_table[4][(word >> 24) & 0xff]
+            ^ g_crc_table[3][(word >> 32) & 0xff] ^ g_crc_table[2][(word >> 40) & 0xff]
+            ^ g_crc_table[1][(word >> 48) & 0xff] ^ g_crc_table[0][word >> 56];
+    }
+    for (; size > 0; --size, ++p) {
+        crc = (crc >> 8) ^ g_crc_table[0][(crc ^ *p) & 0xff];
+    }
+    return ~crc;
+}
+
+static void write_all(SnapWriter *w, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (!w->failed && size > 0) {
+        ssize_t rv = write(w->fd, p, size);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            w->failed = true;
+            break;
+        }
+        p += rv;
+        size -= (size_t)rv;
+        w->bytes += (size_t)rv;
+    }
+}
+
+static void write_section(SnapWriter *w) {
+    uint64_t hdr[2] = {w->buf.size(), w->section_keys};
+    uint32_t crc = crc32c(0, w->buf.data(), w->buf.size());
+    write_all(w, hdr, sizeof(hdr));
+    write_all(w, w->buf.data(), w->buf.size());
+    write_all(w, &crc, 4);
+    w->buf.clear();
+    w->section_keys = 0;
+}
+
+// create the file, the header is written by snap_close()
+bool snap_open(SnapWriter *w, const char *path) {
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        return false;
+    }
+    w->buf.reserve(k_snap_section_max + 4096);
+    uint8_t zeros[k_snap_header] = {};
+    write_all(w, zeros, sizeof(zeros));
+    if (w->failed) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    return !w->failed;
+}
+
+void snap_put_u8(SnapWriter *w, uint8_t val) {
+    w->buf.push_back((char)val);
+}
+
+// LEB128
+void snap_put_varint(SnapWriter *w, uint64_t val) {
+    while (val >= 0x80) {
+        w->buf.push_back((char)(val | 0x80));
+        val >>= 7;
+    }
+    w->buf.push_back((char)val);
+}
+
+void snap_put_dbl(SnapWriter *w, double val) {
+    w->buf.append((char *)&val, 8);
+}
+
+void snap_put_str(SnapWriter *w, const char *data, size_t len) {
+    snap_put_varint(w, len);
+    w->buf.append(data, len);
+}
+
+// a key is complete, start a new section if this one is large enough
+void snap_end_key(SnapWriter *w) {
+    w->nkeys++;
+    w->section_keys++;
+    if (w->buf.size() >= k_snap_section_max) {
+        write_section(w);
+    }
+}
+
+// write the remaining data and the header, then sync and close the file
+bool snap_close(SnapWriter *w) {
+    if (w->section_keys) {
+        write_section(w);
+    }
+    write_section(w);   // the empty end section
+
+    uint8_t hdr[k_snap_header];
+    memcpy(&hdr[0], k_snap_magic, 8);
+    memcpy(&hdr[8], &w->nkeys, 8);
+    uint32_t crc = crc32c(0, hdr, 16);
+    memcpy(&hdr[16], &crc, 4);
+    if (!w->failed && pwrite(w->fd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+        w->failed = true;
+    }
+    if (!w->failed && fsync(w->fd) != 0) {
+        w->failed = true;
+    }
+    close(w->fd);
+    w->fd = -1;
+    return !w->failed;
+}
+
+// verify the header and locate all sections.
+// the payloads are checked separately with snap_verify(), possibly in parallel.
+bool snap_parse(
+    const uint8_t *data, size_t size, uint64_t *nkeys, std::vector<SnapSection> &sections)
+{
+    if (size < k_snap_header || memcmp(data, k_snap_magic, 8) != 0) {
+        return false;
+    }
+    uint32_t crc = 0;
+    memcpy(&crc, &data[16], 4);
+    if (crc != crc32c(0, data, 16)) {
+        return false;
+    }
+    memcpy(nkeys, &data[8], 8);
+
+    uint64_t total = 0;
+    size_t pos = k_snap_header;
+    while (true) {
+        uint64_t hdr[2];
+        if (size - pos < sizeof(hdr)) {
+            return false;
+        }
+        memcpy(hdr, &data[pos], sizeof(hdr));
+        pos += sizeof(hdr);
+        if (hdr[0] > size - pos || size - pos - hdr[0] < 4) {
+            return false;
+        }
+        SnapSection sec;
+        sec.data = &data[pos];
+        sec.size = hdr[0];
+        sec.nkeys = hdr[1];
+        pos += sec.size;
+        memcpy(&sec.crc, &data[pos], 4);
+        pos += 4;
+        if (sec.size == 0 && sec.nkeys == 0) {
+            if (!snap_verify(sec)) {
+                return false;
+            }
+            break;  // the end
+        }
+        sections.push_back(sec);
+        total += sec.nkeys;
+    }
+    return pos == size && total == *nkeys;
+}
+
+bool snap_verify(const SnapSection &sec) {
+    return sec.crc == crc32c(0, sec.data, sec.size);
+}
+
+uint8_t snap_get_u8(SnapReader *r) {
+    if (r->cur >= r->end) {
+        r->failed = true;
+        return 0;
+    }
+    return *r->cur++;
+}
+
+uint64_t snap_get_varint(SnapReader *r) {
+    uint64_t val = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = snap_get_u8(r);
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return val;
+        }
+    }
+    r->failed = true;
+    return 0;
+}
+
+double snap_get_dbl(SnapReader *r) {
+    double val = 0;
+    if (r->end - r->cur < 8) {
+        r->failed = true;
+        return 0;
+    }
+    memcpy(&val, r->cur, 8);
+    r->cur += 8;
+    return val;
+}
+
+// returns a pointer into the payload
+const char *snap_get_str(SnapReader *r, size_t *len) {
+    uint64_t n = snap_get_varint(r);
+    if (r->failed || n > (uint64_t)(r->end - r->cur)) {
+        r->failed = true;
+        *len = 0;
+        return NULL;
+    }
+    const char *data = (const char *)r->cur;
+    r->cur += n;
+    *len = (size_t)n;
+    return data;
+}
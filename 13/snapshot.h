@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// the snapshot file format. integers are little endian.
+//   header:   magic (8) | nkeys (8) | crc of the previous 16 bytes (4)
+//   sections: size (8) | nkeys (8) | payload (size) | crc of the payload (4)
+//   end:      a section with a size and nkeys of 0
+// each section holds whole keys, so sections can be decoded independently.
+// a key in the payload:
+//   type (1) | deadline in unix ms, 0 if none (varint) | key | value
+// strings are a varint length followed by the bytes.
+// values:
+//   SNAP_STR:  string
+//   SNAP_ZSET: count (varint) | (score (8) | name) ... in sorted order
+//   SNAP_HASH: count (varint) | (field | value) ...
+//   SNAP_LIST: count (varint) | string ... from the front
+//   SNAP_SET:  count (varint) | member ...
+const char k_snap_magic[8] = {'1', '3', 'S', 'N', 'A', 'P', 0, 1};
+const size_t k_snap_header = 8 + 8 + 4;
+const size_t k_snap_section_max = 4 << 20;  // payload bytes before starting a new section
+
+enum {
+    SNAP_STR = 0,
+    SNAP_ZSET = 1,
+    SNAP_HASH = 2,
+    SNAP_LIST = 3,
+    SNAP_SET = 4,
+};
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+struct SnapWriter {
+    int fd = -1;
+    std::string buf;        // the payload of the current section
+    uint64_t section_keys = 0;
+    uint64_t nkeys = 0;
+    uint64_t bytes = 0;     // written to the file so far
+    bool failed = false;
+};
+
+bool snap_open(SnapWriter *w, const char *path);
+void snap_put_u8(SnapWriter *w, uint8_t val);
+void snap_put_varint(SnapWriter *w, uint64_t val);
+void snap_put_dbl(SnapWriter *w, double val);
+void snap_put_str(SnapWriter *w, const char *data, size_t len);
+void snap_end_key(SnapWriter *w);
+bool snap_close(SnapWriter *w);
+
+// a section of a snapshot in memory
+struct SnapSection {
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    uint64_t nkeys = 0;
+    uint32_t crc = 0;
+};
+
+bool snap_parse(
+    const uint8_t *data, size_t size, uint64_t *nkeys, std::vector<SnapSection> &sections);
+bool snap_verify(const SnapSection &sec);
+
+// decodes a payload, `failed` is set on truncated input
+struct SnapReader {
+    const uint8_t *cur = NULL;
+    const uint8_t *end = NULL;
+    bool failed = false;
+};
+
+uint8_t snap_get_u8(SnapReader *r);
+uint64_t snap_get_varint(SnapReader *r);
+double snap_get_dbl(SnapReader *r);
+const char *snap_get_str(SnapReader *r, size_t *len);
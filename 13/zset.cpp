@@ -1,11 +1,18 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
 // proj
 #include "zset.h"
+#include "bgjob.h"
 #include "common.h"
 
 
+ZSetConf g_zset_conf;
+
 static ZNode *znode_new(const char *name, size_t len, double score) {
     ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
     assert(node);   // not a good idea in real projects
@@ -24,17 +31,24 @@ static uint32_t min(size_t lhs, size_t rhs) {
 
 // compare by the (score, name) tuple
 static bool zless(
-    AVLNode *lhs, double score, const char *name, size_t len)
+    double ls, const char *lname, size_t llen,
+    double rs, const char *rname, size_t rlen)
 {
-    ZNode *zl = container_of(lhs, ZNode, tree);
-    if (zl->score != score) {
-        return zl->score < score;
+    if (ls != rs) {
+        return ls < rs;
     }
-    int rv = memcmp(zl->name, name, min(zl->len, len));
+    int rv = memcmp(lname, rname, min(llen, rlen));
     if (rv != 0) {
         return rv < 0;
     }
-    return zl->len < len;
+    return llen < rlen;
+}
+
+static bool zless(
+    AVLNode *lhs, double score, const char *name, size_t len)
+{
+    ZNode *zl = container_of(lhs, ZNode, tree);
+    return zless(zl->score, zl->name, zl->len, score, name, len);
 }
 
 static bool zless(AVLNode *lhs, AVLNode *rhs) {
@@ -42,45 +56,147 @@ static bool zless(AVLNode *lhs, AVLNode *rhs) {
     return zless(lhs, zr->score, zr->name, zr->len);
 }
 
-// insert into the AVL tree
-static void tree_add(ZSet *zset, ZNode *node) {
-    AVLNode *cur = NULL;            // current node
-    AVLNode **from = &zset->tree;   // the incoming pointer to the next node
-    while (*from) {                 // tree search
-        cur = *from;
-        from = zless(&node->tree, cur) ? &cur->left : &cur->right;
+// the compact encoding.
+// each tuple is laid out as: | score (8 bytes) | len (1 byte) | name |
+const size_t k_tuple_hdr = 8 + 1;
+
+static double pack_score(ZPack *pack, size_t i) {
+    double score = 0;
+    memcpy(&score, &pack->buf[pack->off[i]], 8);
+    return score;
+}
+
+static size_t pack_len(ZPack *pack, size_t i) {
+    return pack->buf[pack->off[i] + 8];
+}
+
+static const char *pack_name(ZPack *pack, size_t i) {
+    return (const char *)&pack->buf[pack->off[i] + k_tuple_hdr];
+}
+
+static size_t pack_max_name() {
+    return min(g_zset_conf.max_pack_name, 255);
+}
+
+// linear search by name, the tuples are contiguous so this is cheap
+static int64_t pack_find(ZPack *pack, const char *name, size_t len) {
+    for (uint32_t i = 0; i < pack->n; ++i) {
+        if (pack_len(pack, i) == len && 0 == memcmp(pack_name(pack, i), name, len)) {
+            return i;
+        }
     }
-    *from = &node->tree;            // attach the new node
-    node->tree.parent = cur;
-    zset->tree = avl_fix(&node->tree);
+    return -1;
 }
 
-// update the score of an existing node (AVL tree reinsertion)
-static void zset_update(ZSet *zset, ZNode *node, double score) {
-    if (node->score == score) {
-        return;
+// binary search for the first tuple that is greater or equal to the argument
+static uint32_t pack_lower_bound(
+    ZPack *pack, double score, const char *name, size_t len)
+{
+    uint32_t lo = 0;
+    uint32_t hi = pack->n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (zless(pack_score(pack, mid), pack_name(pack, mid), pack_len(pack, mid),
+                score, name, len)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    zset->tree = avl_del(&node->tree);
-    node->score = score;
-    avl_init(&node->tree);
-    tree_add(zset, node);
+    return lo;
 }
 
-// add a new (score, name) tuple, or update the score of the existing tuple
-bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
-    ZNode *node = zset_lookup(zset, name, len);
-    if (node) {
-        zset_update(zset, node, score);
-        return false;
-    } else {
-        node = znode_new(name, len, score);
-        hm_insert(&zset->hmap, &node->hmap);
-        tree_add(zset, node);
-        return true;
+static void pack_reserve(ZPack *pack, size_t bytes) {
+    if (pack->used + bytes > pack->cap) {
+        size_t cap = pack->cap ? pack->cap : 64;
+        while (cap < pack->used + bytes) {
+            cap *= 2;
+        }
+        pack->buf = (uint8_t *)realloc(pack->buf, cap);
+        assert(pack->buf);
+        pack->cap = (uint32_t)cap;
+    }
+    if (pack->n + 1 > pack->ncap) {
+        pack->ncap = pack->ncap ? pack->ncap * 2 : 4;
+        pack->off = (uint32_t *)realloc(pack->off, pack->ncap * sizeof(uint32_t));
+        assert(pack->off);
+    }
+}
+
+static void pack_insert(ZPack *pack, double score, const char *name, size_t len) {
+    size_t sz = k_tuple_hdr + len;
+    pack_reserve(pack, sz);
+    uint32_t i = pack_lower_bound(pack, score, name, len);
+    uint32_t pos = (i < pack->n) ? pack->off[i] : pack->used;
+    // make room for the new tuple
+    memmove(&pack->buf[pos + sz], &pack->buf[pos], pack->used - pos);
+    for (uint32_t j = pack->n; j > i; --j) {
+        pack->off[j] = pack->off[j - 1] + (uint32_t)sz;
+    }
+    pack->off[i] = pos;
+    memcpy(&pack->buf[pos], &score, 8);
+    pack->buf[pos + 8] = (uint8_t)len;
+    memcpy(&pack->buf[pos + k_tuple_hdr], name, len);
+    pack->n++;
+    pack->used += (uint32_t)sz;
+}
+
+static void pack_remove(ZPack *pack, uint32_t i) {
+    uint32_t pos = pack->off[i];
+    uint32_t sz = (uint32_t)(k_tuple_hdr + pack_len(pack, i));
+    memmove(&pack->buf[pos], &pack->buf[pos + sz], pack->used - pos - sz);
+    for (uint32_t j = i; j + 1 < pack->n; ++j) {
+        pack->off[j] = pack->off[j + 1] - sz;
+    }
+    pack->n--;
+    pack->used -= sz;
+}
+
+// remove the tuples in [start, stop) with a single move
+static void pack_remove_range(ZPack *pack, uint32_t start, uint32_t stop) {
+    uint32_t pos = pack->off[start];
+    uint32_t end = stop < pack->n ? pack->off[stop] : pack->used;
+    uint32_t sz = end - pos;
+    memmove(&pack->buf[pos], &pack->buf[end], pack->used - end);
+    for (uint32_t j = stop; j < pack->n; ++j) {
+        pack->off[j - (stop - start)] = pack->off[j] - sz;
+    }
+    pack->n -= stop - start;
+    pack->used -= sz;
+}
+
+// update the score of an existing tuple by moving it
+static void pack_update(ZPack *pack, uint32_t i, double score) {
+    if (pack_score(pack, i) == score) {
+        return;
     }
+    char name[255];
+    size_t len = pack_len(pack, i);
+    memcpy(name, pack_name(pack, i), len);
+    pack_remove(pack, i);
+    pack_insert(pack, score, name, len);
+}
+
+// append a tuple that is greater than all existing ones
+static void pack_append(ZPack *pack, double score, const char *name, size_t len) {
+    size_t sz = k_tuple_hdr + len;
+    pack_reserve(pack, sz);
+    uint32_t pos = pack->used;
+    pack->off[pack->n] = pos;
+    memcpy(&pack->buf[pos], &score, 8);
+    pack->buf[pos + 8] = (uint8_t)len;
+    memcpy(&pack->buf[pos + k_tuple_hdr], name, len);
+    pack->n++;
+    pack->used += (uint32_t)sz;
+}
+
+static void pack_dispose(ZPack *pack) {
+    free(pack->buf);
+    free(pack->off);
+    *pack = ZPack{};
 }
 
-// a helper structure for the hashtable lookup
+// a helper structure for the hashtable lookup and B+tree search keys
 struct HKey {
     HNode node;
     const char *name = NULL;
@@ -96,63 +212,335 @@ static bool hcmp(HNode *node, HNode *key) {
     return 0 == memcmp(znode->name, hkey->name, znode->len);
 }
 
-// lookup by name
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
-    if (!zset->tree) {
-        return NULL;
+// B+tree tie-breaker: compare names when scores are equal
+static int name_cmp(const void *ref, const void *key) {
+    const ZNode *znode = (const ZNode *)ref;
+    const HKey *hkey = (const HKey *)key;
+    int rv = memcmp(znode->name, hkey->name, min(znode->len, hkey->len));
+    if (rv != 0) {
+        return rv;
     }
+    return znode->len < hkey->len ? -1 : (znode->len > hkey->len ? 1 : 0);
+}
 
+static HKey hkey_of(const char *name, size_t len) {
     HKey key;
     key.node.hcode = str_hash((uint8_t *)name, len);
     key.name = name;
     key.len = len;
+    return key;
+}
+
+// insert into the AVL tree
+static void tree_add(ZSet *zset, ZNode *node) {
+    AVLNode *cur = NULL;            // current node
+    AVLNode **from = &zset->tree;   // the incoming pointer to the next node
+    while (*from) {                 // tree search
+        cur = *from;
+        from = zless(&node->tree, cur) ? &cur->left : &cur->right;
+    }
+    *from = &node->tree;            // attach the new node
+    node->tree.parent = cur;
+    zset->tree = avl_fix(&node->tree);
+}
+
+// insert into the tree of the large encoding
+static void index_add(ZSet *zset, ZNode *node) {
+    if (zset->enc == ZSET_AVL) {
+        tree_add(zset, node);
+    } else {
+        HKey key = hkey_of(node->name, node->len);
+        bt_insert(&zset->btree, node->score, node, &key);
+    }
+}
+
+// detach from the tree of the large encoding
+static void index_del(ZSet *zset, ZNode *node) {
+    if (zset->enc == ZSET_AVL) {
+        zset->tree = avl_del(&node->tree);
+        avl_init(&node->tree);
+    } else {
+        HKey key = hkey_of(node->name, node->len);
+        void *ref = bt_delete(&zset->btree, node->score, &key);
+        assert(ref == node);
+        (void)ref;
+    }
+}
+
+// build the tree of the large encoding from nodes in sorted order
+static void index_build(ZSet *zset, const std::vector<ZNode *> &nodes) {
+    if (zset->enc == ZSET_AVL) {
+        std::vector<AVLNode *> tnodes(nodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            tnodes[i] = &nodes[i]->tree;
+        }
+        zset->tree = avl_build(tnodes.data(), tnodes.size());
+    } else {
+        std::vector<double> scores(nodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            scores[i] = nodes[i]->score;
+        }
+        bt_build(&zset->btree, scores.data(), (void *const *)nodes.data(), nodes.size());
+    }
+}
+
+static void cb_collect(HNode *node, void *arg) {
+    ((std::vector<ZNode *> *)arg)->push_back(container_of(node, ZNode, hmap));
+}
+
+static bool znode_less(ZNode *lhs, ZNode *rhs) {
+    return zless(lhs->score, lhs->name, lhs->len, rhs->score, rhs->name, rhs->len);
+}
+
+// sort all nodes in the hashtable and rebuild the tree from scratch
+static void index_rebuild(ZSet *zset) {
+    std::vector<ZNode *> nodes;
+    nodes.reserve(hm_size(&zset->hmap));
+    hm_foreach(&zset->hmap, &cb_collect, &nodes);
+    std::sort(nodes.begin(), nodes.end(), &znode_less);
+    index_build(zset, nodes);
+}
+
+// switch from the compact encoding to the large encoding,
+// the tree is built only if `build` is set.
+static void zset_convert(ZSet *zset, bool build) {
+    assert(zset->enc == ZSET_PACK);
+    zset->enc = g_zset_conf.large == ZSET_BTREE ? ZSET_BTREE : ZSET_AVL;
+    zset->btree.cmp = &name_cmp;
+    ZPack *pack = &zset->pack;
+    std::vector<ZNode *> nodes(pack->n);
+    for (uint32_t i = 0; i < pack->n; ++i) {
+        nodes[i] = znode_new(pack_name(pack, i), pack_len(pack, i), pack_score(pack, i));
+        hm_insert(&zset->hmap, &nodes[i]->hmap);
+    }
+    pack_dispose(pack);
+    if (build) {
+        index_build(zset, nodes);   // already sorted
+    }
+}
+
+// drop the tree, leaving the nodes in the hashtable to be rebuilt later
+static void index_detach(ZSet *zset) {
+    if (zset->enc == ZSET_PACK) {
+        zset_convert(zset, false);
+    } else if (zset->enc == ZSET_AVL) {
+        zset->tree = NULL;
+    } else {
+        bt_dispose(&zset->btree, NULL);
+    }
+}
+
+// update the score of an existing node (tree reinsertion)
+static void zset_update(ZSet *zset, ZNode *node, double score) {
+    if (node->score == score) {
+        return;
+    }
+    index_del(zset, node);
+    node->score = score;
+    index_add(zset, node);
+}
+
+static ZNode *tree_lookup(ZSet *zset, const char *name, size_t len) {
+    HKey key = hkey_of(name, len);
     HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
     return found ? container_of(found, ZNode, hmap) : NULL;
 }
 
+// decide the new score of an existing tuple
+static int apply_flags(double old, double *score, uint32_t flags) {
+    if (flags & ZADD_NX) {
+        return ZADD_SKIPPED;
+    }
+    double val = (flags & ZADD_INCR) ? old + *score : *score;
+    if (isnan(val)) {
+        return ZADD_NAN;
+    }
+    if (((flags & ZADD_GT) && !(val > old)) || ((flags & ZADD_LT) && !(val < old))) {
+        return ZADD_SKIPPED;
+    }
+    *score = val;
+    return val == old ? ZADD_UNCHANGED : ZADD_UPDATED;
+}
+
+// add a new (score, name) tuple, or update the score of the existing tuple,
+// subject to the ZADD_* flags. `score` is updated to the resulting score.
+int zset_upsert(
+    ZSet *zset, const char *name, size_t len, double *score, uint32_t flags)
+{
+    if (zset->enc == ZSET_PACK) {
+        int64_t i = pack_find(&zset->pack, name, len);
+        if (i >= 0) {
+            int rv = apply_flags(pack_score(&zset->pack, (size_t)i), score, flags);
+            if (rv == ZADD_UPDATED) {
+                pack_update(&zset->pack, (uint32_t)i, *score);
+            }
+            return rv;
+        }
+        if (flags & ZADD_XX) {
+            return ZADD_SKIPPED;
+        }
+        if (zset->pack.n < g_zset_conf.max_pack_len && len <= pack_max_name()) {
+            pack_insert(&zset->pack, *score, name, len);
+            return ZADD_ADDED;
+        }
+        zset_convert(zset, true);
+    }
+
+    ZNode *node = tree_lookup(zset, name, len);
+    if (node) {
+        int rv = apply_flags(node->score, score, flags);
+        if (rv == ZADD_UPDATED) {
+            zset_update(zset, node, *score);
+        }
+        return rv;
+    }
+    if (flags & ZADD_XX) {
+        return ZADD_SKIPPED;
+    }
+    node = znode_new(name, len, *score);
+    hm_insert(&zset->hmap, &node->hmap);
+    index_add(zset, node);
+    return ZADD_ADDED;
+}
+
+// add a new (score, name) tuple, or update the score of the existing tuple
+bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
+    return zset_upsert(zset, name, len, &score, 0) == ZADD_ADDED;
+}
+
+// batches at least this large are bulk loaded into smaller zsets
+const size_t k_bulk_min = 64;
+
+// zset_upsert() on each item in order, without ZADD_INCR.
+// returns the number of added tuples, `updated` is the number of changed scores.
+size_t zset_add_batch(
+    ZSet *zset, const ZItem *items, size_t n, uint32_t flags, size_t *updated)
+{
+    assert(!(flags & ZADD_INCR));
+    size_t added = 0;
+    *updated = 0;
+    bool bulk = n >= k_bulk_min && zset_size(zset) <= n && !(flags & ZADD_XX)
+        && (zset->enc != ZSET_PACK || zset->pack.n + n > g_zset_conf.max_pack_len);
+    if (!bulk) {
+        for (size_t i = 0; i < n; ++i) {
+            double score = items[i].score;
+            int rv = zset_upsert(zset, items[i].name, items[i].len, &score, flags);
+            added += (rv == ZADD_ADDED);
+            *updated += (rv == ZADD_UPDATED);
+        }
+        return added;
+    }
+
+    // update the hashtable only, then sort and build the tree in one go
+    // instead of rebalancing the tree for each item.
+    index_detach(zset);
+    for (size_t i = 0; i < n; ++i) {
+        const ZItem &item = items[i];
+        ZNode *node = tree_lookup(zset, item.name, item.len);
+        if (node) {
+            double score = item.score;
+            if (apply_flags(node->score, &score, flags) == ZADD_UPDATED) {
+                node->score = score;
+                (*updated)++;
+            }
+        } else {
+            node = znode_new(item.name, item.len, item.score);
+            hm_insert(&zset->hmap, &node->hmap);
+            added++;
+        }
+    }
+    index_rebuild(zset);
+    return added;
+}
+
+// lookup by name
+bool zset_lookup(ZSet *zset, const char *name, size_t len, double *score) {
+    if (zset->enc == ZSET_PACK) {
+        int64_t i = pack_find(&zset->pack, name, len);
+        if (i < 0) {
+            return false;
+        }
+        *score = pack_score(&zset->pack, (size_t)i);
+        return true;
+    }
+
+    ZNode *node = tree_lookup(zset, name, len);
+    if (!node) {
+        return false;
+    }
+    *score = node->score;
+    return true;
+}
+
 // deletion by name
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len) {
-    if (!zset->tree) {
-        return NULL;
+bool zset_del(ZSet *zset, const char *name, size_t len) {
+    if (zset->enc == ZSET_PACK) {
+        int64_t i = pack_find(&zset->pack, name, len);
+        if (i < 0) {
+            return false;
+        }
+        pack_remove(&zset->pack, (uint32_t)i);
+        return true;
     }
 
-    HKey key;
-    key.node.hcode = str_hash((uint8_t *)name, len);
-    key.name = name;
-    key.len = len;
+    HKey key = hkey_of(name, len);
     HNode *found = hm_pop(&zset->hmap, &key.node, &hcmp);
     if (!found) {
-        return NULL;
+        return false;
     }
 
     ZNode *node = container_of(found, ZNode, hmap);
-    zset->tree = avl_del(&node->tree);
-    return node;
+    index_del(zset, node);
+    free(node);
+    return true;
 }
 
-// find the (score, name) tuple that is greater or equal to the argument.
-ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len) {
-    AVLNode *found = NULL;
+// the number of tuples with a score less than the argument,
+// or less than or equal to it if `inclusive` is set.
+size_t zset_rank_score(ZSet *zset, double score, bool inclusive) {
+    if (inclusive) {
+        if (score == INFINITY) {
+            return zset_size(zset);
+        }
+        score = nextafter(score, INFINITY);
+    }
+    // (score, "") is the least tuple with this score
+    if (zset->enc == ZSET_PACK) {
+        return pack_lower_bound(&zset->pack, score, "", 0);
+    }
+    if (zset->enc == ZSET_BTREE) {
+        HKey key = hkey_of("", 0);
+        size_t rank = 0;
+        (void)bt_lower_bound(&zset->btree, score, &key, &rank);
+        return rank;
+    }
+    size_t rank = 0;
     AVLNode *cur = zset->tree;
     while (cur) {
-        if (zless(cur, score, name, len)) {
+        if (zless(cur, score, "", 0)) {
+            rank += (cur->left ? cur->left->cnt : 0) + 1;
             cur = cur->right;
         } else {
-            found = cur;    // candidate
             cur = cur->left;
         }
     }
-    return found ? container_of(found, ZNode, tree) : NULL;
+    return rank;
 }
 
-// offset into the succeeding or preceding node.
-ZNode *znode_offset(ZNode *node, int64_t offset) {
-    AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
-    return tnode ? container_of(tnode, ZNode, tree) : NULL;
+static bool hsame(HNode *node, HNode *key) {
+    return node == key;
 }
 
-void znode_del(ZNode *node) {
-    free(node);
+static void tree_unlink(ZSet *zset, AVLNode *node) {
+    if (!node) {
+        return;
+    }
+    tree_unlink(zset, node->left);
+    tree_unlink(zset, node->right);
+    ZNode *znode = container_of(node, ZNode, tree);
+    HNode *found = hm_pop(&zset->hmap, &znode->hmap, &hsame);
+    assert(found);
+    (void)found;
 }
 
 static void tree_dispose(AVLNode *node) {
@@ -161,11 +549,435 @@ static void tree_dispose(AVLNode *node) {
     }
     tree_dispose(node->left);
     tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, tree));
+    free(container_of(node, ZNode, tree));
+}
+
+static void cb_tree_dispose(void *arg) {
+    tree_dispose((AVLNode *)arg);
+}
+
+static void cb_nodes_dispose(void *arg) {
+    std::vector<ZNode *> *nodes = (std::vector<ZNode *> *)arg;
+    for (ZNode *node : *nodes) {
+        free(node);
+    }
+    delete nodes;
+}
+
+// removed nodes are freed in the background if there are many of them
+const size_t k_lazy_free_min = 1024;
+
+// B+tree: remove the nodes one by one if there are few of them,
+// otherwise rebuild the tree from the remaining nodes.
+static void btree_del_range(ZSet *zset, size_t start, size_t stop) {
+    size_t size = zset->btree.size;
+    std::vector<ZNode *> *dead = new std::vector<ZNode *>();
+    dead->reserve(stop - start);
+    for (BPos pos = bt_select(&zset->btree, start);
+            dead->size() < stop - start; bt_next(&pos)) {
+        ZNode *node = (ZNode *)pos.leaf->ref[pos.slot];
+        HNode *found = hm_pop(&zset->hmap, &node->hmap, &hsame);
+        assert(found);
+        (void)found;
+        dead->push_back(node);
+    }
+
+    if ((stop - start) * 2 < size) {
+        for (ZNode *node : *dead) {
+            index_del(zset, node);
+        }
+    } else {
+        std::vector<ZNode *> live;
+        live.reserve(size - (stop - start));
+        size_t rank = 0;
+        for (BPos pos = bt_select(&zset->btree, 0); pos.leaf; bt_next(&pos), ++rank) {
+            if (rank < start || rank >= stop) {
+                live.push_back((ZNode *)pos.leaf->ref[pos.slot]);
+            }
+        }
+        bt_dispose(&zset->btree, NULL);
+        index_build(zset, live);
+    }
+
+    if (dead->size() >= k_lazy_free_min) {
+        bg_submit(&cb_nodes_dispose, dead);
+    } else {
+        cb_nodes_dispose(dead);
+    }
+}
+
+// remove the tuples whose ranks are in [start, stop).
+// the AVL tree is split at both ends and joined back in O(log(n)),
+// then the range is unlinked from the hashtable in O(number of removed).
+size_t zset_del_range(ZSet *zset, size_t start, size_t stop) {
+    stop = std::min(stop, zset_size(zset));
+    if (start >= stop) {
+        return 0;
+    }
+    if (zset->enc == ZSET_PACK) {
+        pack_remove_range(&zset->pack, (uint32_t)start, (uint32_t)stop);
+    } else if (zset->enc == ZSET_BTREE) {
+        btree_del_range(zset, start, stop);
+    } else {
+        AVLNode *left = NULL;
+        AVLNode *mid = NULL;
+        AVLNode *right = NULL;
+        avl_split(zset->tree, start, &left, &right);
+        avl_split(right, stop - start, &mid, &right);
+        zset->tree = avl_merge(left, right);
+        tree_unlink(zset, mid);
+        if (stop - start >= k_lazy_free_min) {
+            bg_submit(&cb_tree_dispose, mid);
+        } else {
+            tree_dispose(mid);
+        }
+    }
+    return stop - start;
+}
+
+// fill in the tuple of the current position
+static void ziter_load(ZIter *iter) {
+    ZSet *zset = iter->zset;
+    if (zset->enc == ZSET_PACK) {
+        if (iter->idx < 0 || iter->idx >= (int64_t)zset->pack.n) {
+            iter->name = NULL;
+            return;
+        }
+        iter->name = pack_name(&zset->pack, (size_t)iter->idx);
+        iter->len = pack_len(&zset->pack, (size_t)iter->idx);
+        iter->score = pack_score(&zset->pack, (size_t)iter->idx);
+        return;
+    }
+
+    if (zset->enc == ZSET_BTREE) {
+        iter->node = iter->pos.leaf
+            ? (ZNode *)iter->pos.leaf->ref[iter->pos.slot] : NULL;
+    }
+    if (!iter->node) {
+        iter->name = NULL;
+        return;
+    }
+    iter->name = iter->node->name;
+    iter->len = iter->node->len;
+    iter->score = iter->node->score;
+}
+
+// find the (score, name) tuple that is greater or equal to the argument.
+ZIter zset_query(ZSet *zset, double score, const char *name, size_t len) {
+    ZIter iter;
+    iter.zset = zset;
+    if (zset->enc == ZSET_PACK) {
+        iter.idx = pack_lower_bound(&zset->pack, score, name, len);
+    } else if (zset->enc == ZSET_BTREE) {
+        HKey key = hkey_of(name, len);
+        size_t rank = 0;
+        iter.pos = bt_lower_bound(&zset->btree, score, &key, &rank);
+    } else {
+        AVLNode *found = NULL;
+        AVLNode *cur = zset->tree;
+        while (cur) {
+            if (zless(cur, score, name, len)) {
+                cur = cur->right;
+            } else {
+                found = cur;    // candidate
+                cur = cur->left;
+            }
+        }
+        iter.node = found ? container_of(found, ZNode, tree) : NULL;
+    }
+    ziter_load(&iter);
+    return iter;
+}
+
+// B+tree: step through the leaves, or go through the rank for long offsets
+static void bt_offset(ZIter *iter, int64_t offset) {
+    BPos *pos = &iter->pos;
+    int64_t slot = (int64_t)pos->slot + offset;
+    if (slot >= 0 && slot < (int64_t)pos->leaf->base.n) {
+        pos->slot = (uint32_t)slot;
+        return;
+    }
+    if (offset == 1) {
+        return bt_next(pos);
+    }
+    if (offset == -1) {
+        return bt_prev(pos);
+    }
+    BTree *btree = &iter->zset->btree;
+    HKey key = hkey_of(iter->name, iter->len);
+    size_t rank = 0;
+    (void)bt_lower_bound(btree, iter->score, &key, &rank);
+    int64_t target = (int64_t)rank + offset;
+    *pos = target >= 0 ? bt_select(btree, (size_t)target) : BPos{};
+}
+
+// offset into the succeeding or preceding tuple.
+// note: the worst-case is O(log(n)) regardless of how long the offset is.
+void ziter_offset(ZIter *iter, int64_t offset) {
+    if (!iter->name) {
+        return;
+    }
+    if (iter->zset->enc == ZSET_PACK) {
+        iter->idx += offset;
+    } else if (iter->zset->enc == ZSET_BTREE) {
+        bt_offset(iter, offset);
+    } else {
+        AVLNode *tnode = avl_offset(&iter->node->tree, offset);
+        iter->node = tnode ? container_of(tnode, ZNode, tree) : NULL;
+    }
+    ziter_load(iter);
+}
+
+size_t zset_size(ZSet *zset) {
+    return zset->enc == ZSET_PACK ? zset->pack.n : hm_size(&zset->hmap);
 }
 
 // destroy the zset
 void zset_dispose(ZSet *zset) {
+    pack_dispose(&zset->pack);
     tree_dispose(zset->tree);
+    bt_dispose(&zset->btree, &free);
     hm_destroy(&zset->hmap);
 }
+
+// fill an empty zset with items sorted by (score, name), names must be unique
+void zset_build(ZSet *zset, const ZItem *items, size_t n) {
+    assert(zset->enc == ZSET_PACK && zset->pack.n == 0);
+    bool pack = n <= g_zset_conf.max_pack_len;
+    for (size_t i = 0; pack && i < n; ++i) {
+        pack = items[i].len <= pack_max_name();
+    }
+    if (pack) {
+        for (size_t i = 0; i < n; ++i) {
+            pack_append(&zset->pack, items[i].score, items[i].name, items[i].len);
+        }
+        return;
+    }
+
+    zset_convert(zset, false);
+    hm_reserve(&zset->hmap, n);
+    std::vector<ZNode *> nodes(n);
+    for (size_t i = 0; i < n; ++i) {
+        nodes[i] = znode_new(items[i].name, items[i].len, items[i].score);
+        hm_insert(&zset->hmap, &nodes[i]->hmap);
+    }
+    index_build(zset, nodes);
+}
+
+// set operations.
+// the inputs are flattened into arrays of items that point into the inputs,
+// combined, then sorted by (score, name) for zset_build().
+
+static bool item_less(const ZItem &lhs, const ZItem &rhs) {
+    return zless(lhs.score, lhs.name, lhs.len, rhs.score, rhs.name, rhs.len);
+}
+
+static bool item_name_less(const ZItem &lhs, const ZItem &rhs) {
+    int rv = memcmp(lhs.name, rhs.name, min(lhs.len, rhs.len));
+    return rv != 0 ? rv < 0 : lhs.len < rhs.len;
+}
+
+static bool item_name_eq(const ZItem &lhs, const ZItem &rhs) {
+    return lhs.len == rhs.len && 0 == memcmp(lhs.name, rhs.name, lhs.len);
+}
+
+// inf * 0 and inf - inf are treated as 0
+static double zweight(double score, double weight) {
+    double val = score * weight;
+    return isnan(val) ? 0 : val;
+}
+
+static double zaggregate(double lhs, double rhs, uint32_t agg) {
+    double val = lhs + rhs;
+    if (agg == ZAGG_MIN) {
+        val = lhs < rhs ? lhs : rhs;
+    } else if (agg == ZAGG_MAX) {
+        val = lhs < rhs ? rhs : lhs;
+    }
+    return isnan(val) ? 0 : val;
+}
+
+// all tuples of a zset in order, scores multiplied by the weight
+static void zset_items(ZSet *zset, double weight, std::vector<ZItem> &out) {
+    out.reserve(out.size() + zset_size(zset));
+    ZIter iter = zset_query(zset, -INFINITY, "", 0);
+    for (; iter.name; ziter_offset(&iter, +1)) {
+        ZItem item;
+        item.score = zweight(iter.score, weight);
+        item.name = iter.name;
+        item.len = iter.len;
+        out.push_back(item);
+    }
+}
+
+// below this, sorting is not worth spreading across threads
+const size_t k_par_sort_min = 1 << 16;
+
+// sort chunks on separate threads, then merge the chunks pairwise
+static void par_sort(
+    std::vector<ZItem> &items, bool (*less)(const ZItem &, const ZItem &))
+{
+    size_t nthreads = g_zset_conf.threads;
+    if (nthreads <= 1 || items.size() < k_par_sort_min) {
+        std::sort(items.begin(), items.end(), less);
+        return;
+    }
+
+    std::vector<size_t> bounds(nthreads + 1);
+    for (size_t i = 0; i <= nthreads; ++i) {
+        bounds[i] = items.size() * i / nthreads;
+    }
+    ZItem *data = items.data();
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < nthreads; ++i) {
+        workers.emplace_back([=]() {
+            std::sort(data + bounds[i], data + bounds[i + 1], less);
+        });
+    }
+    for (std::thread &t : workers) {
+        t.join();
+    }
+    for (size_t width = 1; width < nthreads; width *= 2) {
+        workers.clear();
+        for (size_t i = 0; i + width < nthreads; i += 2 * width) {
+            size_t lo = bounds[i];
+            size_t mid = bounds[i + width];
+            size_t hi = bounds[std::min(i + 2 * width, nthreads)];
+            workers.emplace_back([=]() {
+                std::inplace_merge(data + lo, data + mid, data + hi, less);
+            });
+        }
+        for (std::thread &t : workers) {
+            t.join();
+        }
+    }
+}
+
+// sort all items by name and aggregate the runs of the same name
+static void combine_union(
+    ZSet *const *srcs, const double *weights, size_t n, uint32_t agg,
+    std::vector<ZItem> &out)
+{
+    std::vector<ZItem> all;
+    for (size_t i = 0; i < n; ++i) {
+        if (srcs[i]) {
+            zset_items(srcs[i], weights[i], all);
+        }
+    }
+    par_sort(all, &item_name_less);
+    for (size_t i = 0; i < all.size();) {
+        ZItem item = all[i++];
+        while (i < all.size() && item_name_eq(all[i], item)) {
+            item.score = zaggregate(item.score, all[i++].score, agg);
+        }
+        out.push_back(item);
+    }
+}
+
+// the other side of an intersection or a difference
+struct ZProbe {
+    ZSet *zset = NULL;
+    double weight = 1;
+    bool hash = false;          // probe the hashtable, or merge with `items`
+    std::vector<ZItem> items;   // sorted by name
+    size_t pos = 0;
+};
+
+// hash probing is used when the driving input is this much smaller
+const size_t k_probe_ratio = 8;
+
+static bool probe_find(ZProbe &probe, const ZItem &item, double *score) {
+    if (probe.hash) {
+        if (!zset_lookup(probe.zset, item.name, item.len, score)) {
+            return false;
+        }
+        *score = zweight(*score, probe.weight);
+        return true;
+    }
+    std::vector<ZItem> &items = probe.items;
+    while (probe.pos < items.size() && item_name_less(items[probe.pos], item)) {
+        probe.pos++;
+    }
+    if (probe.pos < items.size() && item_name_eq(items[probe.pos], item)) {
+        *score = items[probe.pos].score;
+        return true;
+    }
+    return false;
+}
+
+// keep the items of the driving input that are in all (ZOP_INTER)
+// or none (ZOP_DIFF) of the other inputs.
+static void combine_filter(
+    uint32_t op, ZSet *driver, double weight, std::vector<ZProbe> &probes,
+    uint32_t agg, std::vector<ZItem> &out)
+{
+    std::vector<ZItem> items;
+    zset_items(driver, weight, items);
+    bool merge = false;
+    for (ZProbe &probe : probes) {
+        probe.hash = zset_size(driver) * k_probe_ratio <= zset_size(probe.zset);
+        if (!probe.hash) {
+            zset_items(probe.zset, probe.weight, probe.items);
+            par_sort(probe.items, &item_name_less);
+            merge = true;
+        }
+    }
+    if (merge) {
+        par_sort(items, &item_name_less);
+    }
+
+    for (ZItem item : items) {
+        bool keep = true;
+        for (ZProbe &probe : probes) {
+            double score = 0;
+            bool found = probe_find(probe, item, &score);
+            if (op == ZOP_INTER && found) {
+                item.score = zaggregate(item.score, score, agg);
+            }
+            if (found == (op == ZOP_DIFF)) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep) {
+            out.push_back(item);
+        }
+    }
+}
+
+// combine the inputs into the empty `dst`. NULL inputs are empty sets.
+void zset_combine(
+    ZSet *dst, uint32_t op, ZSet *const *srcs, const double *weights, size_t n,
+    uint32_t agg)
+{
+    std::vector<ZItem> out;
+    if (op == ZOP_UNION) {
+        combine_union(srcs, weights, n, agg, out);
+    } else {
+        // the intersection is driven by the smallest input,
+        // the difference by the first input.
+        size_t drv = 0;
+        for (size_t i = 0; op == ZOP_INTER && i < n; ++i) {
+            size_t size = srcs[i] ? zset_size(srcs[i]) : 0;
+            if (size < (srcs[drv] ? zset_size(srcs[drv]) : 0)) {
+                drv = i;
+            }
+        }
+        std::vector<ZProbe> probes;
+        bool empty = !srcs[drv];
+        for (size_t i = 0; !empty && i < n; ++i) {
+            if (i == drv || !srcs[i]) {
+                continue;   // a missing input is only relevant to ZOP_INTER
+            }
+            ZProbe probe;
+            probe.zset = srcs[i];
+            probe.weight = weights[i];
+            probes.push_back(std::move(probe));
+        }
+        if (!empty) {
+            combine_filter(op, srcs[drv], weights[drv], probes, agg, out);
+        }
+    }
+    par_sort(out, &item_less);
+    zset_build(dst, out.data(), out.size());
+}
@@ -1,11 +1,32 @@
 #pragma once
 
 #include "avl.h"
+#include "btree.h"
 #include "hashtable.h"
 
 
+enum {
+    ZSET_PACK = 0,  // small zsets: a sorted array of packed tuples
+    ZSET_AVL = 1,   // large zsets: AVL tree + hashtable
+    ZSET_BTREE = 2, // large zsets: B+tree + hashtable
+};
+
+// the compact encoding. (score, len, name) tuples are packed back to back
+// in sorted order, `off[i]` is the byte position of the i-th tuple.
+struct ZPack {
+    uint8_t *buf = NULL;
+    uint32_t *off = NULL;
+    uint32_t n = 0;         // number of tuples
+    uint32_t used = 0;      // bytes used in `buf`
+    uint32_t cap = 0;       // capacity of `buf`
+    uint32_t ncap = 0;      // capacity of `off`
+};
+
 struct ZSet {
+    uint32_t enc = ZSET_PACK;
+    ZPack pack;
     AVLNode *tree = NULL;
+    BTree btree;
     HMap hmap;
 };
 
@@ -17,10 +38,80 @@ struct ZNode {
     char name[0];
 };
 
+// a position in the zset, invalidated by any modification of the zset.
+struct ZIter {
+    // the current tuple, `name` is NULL when out of range
+    const char *name = NULL;
+    size_t len = 0;
+    double score = 0;
+    // private
+    ZSet *zset = NULL;
+    ZNode *node = NULL;     // ZSET_AVL
+    BPos pos;               // ZSET_BTREE
+    int64_t idx = 0;        // ZSET_PACK
+};
+
+// a zset is converted to the `large` encoding once it exceeds either limit
+struct ZSetConf {
+    uint32_t max_pack_len = 128;    // number of tuples
+    uint32_t max_pack_name = 64;    // length of a name, 255 at most
+    uint32_t large = ZSET_AVL;      // ZSET_AVL or ZSET_BTREE
+    uint32_t threads = 1;           // for sorting large inputs of zset_combine()
+};
+
+extern ZSetConf g_zset_conf;
+
+// flags for zset_upsert() and zset_add_batch()
+enum {
+    ZADD_NX = 1 << 0,   // only add new tuples
+    ZADD_XX = 1 << 1,   // only update existing tuples
+    ZADD_GT = 1 << 2,   // only update to a greater score
+    ZADD_LT = 1 << 3,   // only update to a lesser score
+    ZADD_INCR = 1 << 4, // add to the existing score
+};
+
+// results of zset_upsert()
+enum {
+    ZADD_NAN = -1,      // INCR resulted in NaN, nothing is done
+    ZADD_SKIPPED = 0,   // prevented by NX, XX, GT or LT
+    ZADD_ADDED = 1,
+    ZADD_UPDATED = 2,   // the score was changed
+    ZADD_UNCHANGED = 3, // the new score is the same
+};
+
+struct ZItem {
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
 bool zset_add(ZSet *zset, const char *name, size_t len, double score);
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
-ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len);
+int zset_upsert(ZSet *zset, const char *name, size_t len, double *score, uint32_t flags);
+size_t zset_add_batch(
+    ZSet *zset, const ZItem *items, size_t n, uint32_t flags, size_t *updated);
+// set operations for zset_combine()
+enum {
+    ZOP_UNION = 0,
+    ZOP_INTER = 1,
+    ZOP_DIFF = 2,
+};
+
+// how scores of the same name are combined
+enum {
+    ZAGG_SUM = 0,
+    ZAGG_MIN = 1,
+    ZAGG_MAX = 2,
+};
+
+void zset_build(ZSet *zset, const ZItem *items, size_t n);
+void zset_combine(
+    ZSet *dst, uint32_t op, ZSet *const *srcs, const double *weights, size_t n,
+    uint32_t agg);
+bool zset_lookup(ZSet *zset, const char *name, size_t len, double *score);
+bool zset_del(ZSet *zset, const char *name, size_t len);
+size_t zset_del_range(ZSet *zset, size_t start, size_t stop);
+size_t zset_rank_score(ZSet *zset, double score, bool inclusive);
+ZIter zset_query(ZSet *zset, double score, const char *name, size_t len);
+size_t zset_size(ZSet *zset);
 void zset_dispose(ZSet *zset);
-ZNode *znode_offset(ZNode *node, int64_t offset);
-void znode_del(ZNode *node);
+void ziter_offset(ZIter *iter, int64_t offset);